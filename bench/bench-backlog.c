@@ -0,0 +1,247 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Builds the backlog of weeks without network in a journal, a track
+ * at a time as the scrobbler writes them, and submits it back in
+ * batches, compacting along the way as the scrobbler does. It runs
+ * twice: first leaving the records uncompressed while offline, as
+ * before the journal had segments, so that they are only sealed by
+ * the first compaction once submitting, and then sealing them while
+ * offline. It reports the size of the backlog on disk and the CPU
+ * time per track, which counts the journal thread too.
+ *
+ * Usage: bench-backlog [TRACKS]
+ */
+
+#include <glib.h>
+#include <glib-object.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mafw-lastfm-journal.h"
+
+#define DEFAULT_TRACKS 5000
+#define BATCH_SIZE 50
+/* As in mafw-lastfm-scrobbler.c. */
+#define COMPACT_THRESHOLD (32 * 1024)
+#define START_TIME 1262304000
+
+typedef struct {
+  goffset records;
+  goffset disk_size;
+  gdouble append_cpu;
+  gdouble submit_cpu;
+} Result;
+
+static const gchar *words[] = {
+  "Love", "Night", "Blue", "Song", "Heart", "Fire", "Dream", "Road",
+  "Rain", "Time", "Light", "Girl", "Moon", "River", "Home", "Gold",
+  "Summer", "Lonely", "Dance", "Black", "Sweet", "Wild", "Angel", "City"
+};
+
+static gboolean done;
+static goffset batch_end;
+static guint n_submitted;
+
+static void
+fill_track (MafwLastfmTrack *track,
+            guint i)
+{
+  static gchar artist[64], title[64], album[64];
+  guint artist_id, word;
+
+  /* Albums are listened to from start to end, a dozen tracks each. */
+  artist_id = (i / 12) * 7919 % 300;
+  g_snprintf (artist, sizeof (artist), "The %s %ss",
+              words[artist_id % G_N_ELEMENTS (words)],
+              words[artist_id / G_N_ELEMENTS (words) % G_N_ELEMENTS (words)]);
+  g_snprintf (album, sizeof (album), "%s of the %s",
+              words[(i / 12) % G_N_ELEMENTS (words)],
+              words[(i / 12 + artist_id) % G_N_ELEMENTS (words)]);
+  word = i * 31 % G_N_ELEMENTS (words);
+  g_snprintf (title, sizeof (title), "%s %s (%u)", words[word],
+              words[(word + i) % G_N_ELEMENTS (words)], i % 12 + 1);
+
+  track->artist = artist;
+  track->title = title;
+  track->album = album;
+  track->timestamp = START_TIME + i * 217;
+  track->source = 'P';
+  track->length = 180 + i % 120;
+  track->number = i % 12 + 1;
+}
+
+static void
+wait_for_journal (void)
+{
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+  done = FALSE;
+}
+
+static void
+journal_cb (MafwLastfmJournal *journal,
+            const GError *error,
+            gpointer user_data)
+{
+  if (error)
+    g_printerr ("%s\n", error->message);
+  done = TRUE;
+}
+
+static void
+read_cb (MafwLastfmJournal *journal,
+         const gchar *contents,
+         gsize length,
+         goffset offset,
+         const GError *error,
+         gpointer user_data)
+{
+  MafwLastfmJournalIter iter;
+  MafwLastfmTrack track;
+
+  if (error)
+    g_printerr ("%s\n", error->message);
+
+  batch_end = contents ? offset + length : -1;
+  if (contents) {
+    mafw_lastfm_journal_iter_init (&iter, contents, length);
+    while (mafw_lastfm_journal_iter_next (&iter, &track, NULL))
+      n_submitted++;
+  }
+  done = TRUE;
+}
+
+static void
+compact (MafwLastfmJournal *journal)
+{
+  if (mafw_lastfm_journal_compact_async (journal, journal_cb, NULL))
+    wait_for_journal ();
+}
+
+static void
+run (const gchar *path,
+     guint n_tracks,
+     gboolean seal,
+     Result *result)
+{
+  MafwLastfmJournal *journal;
+  MafwLastfmTrack track;
+  GString *records;
+  guint cursor;
+  goffset from;
+  clock_t start;
+  guint i;
+
+  journal = mafw_lastfm_journal_new (path);
+  cursor = mafw_lastfm_journal_add_cursor (journal, "bench");
+
+  start = clock ();
+  for (i = 0; i < n_tracks; i++) {
+    fill_track (&track, i);
+    records = g_string_new (NULL);
+    mafw_lastfm_journal_encode_record (records, &track, 0);
+    mafw_lastfm_journal_append_async (journal, records, journal_cb, NULL);
+    wait_for_journal ();
+
+    if (seal && mafw_lastfm_journal_get_unsealed_size (journal) >
+        MAFW_LASTFM_JOURNAL_SEGMENT_SIZE)
+      compact (journal);
+  }
+  result->append_cpu = (gdouble) (clock () - start) / CLOCKS_PER_SEC;
+  result->records = mafw_lastfm_journal_get_pending_size (journal);
+  result->disk_size = mafw_lastfm_journal_get_size (journal);
+
+  n_submitted = 0;
+  start = clock ();
+  for (;;) {
+    from = mafw_lastfm_journal_get_cursor (journal, cursor);
+    mafw_lastfm_journal_read_batch_async (journal, from, BATCH_SIZE,
+                                          read_cb, NULL);
+    wait_for_journal ();
+    if (batch_end < 0)
+      break;
+
+    mafw_lastfm_journal_commit (journal, cursor, batch_end);
+    if (mafw_lastfm_journal_get_acked_offset (journal) > COMPACT_THRESHOLD)
+      compact (journal);
+  }
+  result->submit_cpu = (gdouble) (clock () - start) / CLOCKS_PER_SEC;
+
+  if (n_submitted != n_tracks)
+    g_printerr ("Only %u of the %u tracks were read back\n",
+                n_submitted, n_tracks);
+
+  mafw_lastfm_journal_free (journal);
+}
+
+static void
+report (const gchar *name,
+        guint n_tracks,
+        Result *result)
+{
+  g_print ("%-14s %8" G_GINT64_FORMAT " bytes on disk (%5.2fx) "
+           "%6.2f us/track appending %6.2f us/track submitting\n",
+           name, (gint64) result->disk_size,
+           (gdouble) result->records / result->disk_size,
+           result->append_cpu * G_USEC_PER_SEC / n_tracks,
+           result->submit_cpu * G_USEC_PER_SEC / n_tracks);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  Result raw, sealed;
+  gchar *path, *ack_path;
+  guint n_tracks;
+
+  g_type_init ();
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
+
+  n_tracks = argc > 1 ? atoi (argv[1]) : DEFAULT_TRACKS;
+  if (n_tracks == 0) {
+    g_printerr ("Usage: bench-backlog [TRACKS]\n");
+    return 1;
+  }
+
+  path = g_strdup_printf ("%s/mafw-lastfm-bench-%d.journal",
+                          g_get_tmp_dir (), (gint) getpid ());
+  ack_path = g_strconcat (path, ".ack", NULL);
+
+  run (path, n_tracks, FALSE, &raw);
+  run (path, n_tracks, TRUE, &sealed);
+
+  g_print ("%u tracks, %" G_GINT64_FORMAT " bytes of records\n",
+           n_tracks, (gint64) sealed.records);
+  report ("uncompressed", n_tracks, &raw);
+  report ("sealed", n_tracks, &sealed);
+
+  g_unlink (path);
+  g_unlink (ack_path);
+  g_free (path);
+  g_free (ack_path);
+
+  return 0;
+}
@@ -0,0 +1,228 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Counts the allocations made to build the body of a 50-track
+ * submission and of a now-playing request, with the string splitting
+ * and printf-based code used before the body builder and with
+ * mafw-lastfm-body.c.
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mafw-lastfm-body.h"
+#include "mafw-lastfm-journal.h"
+
+#define N_TRACKS 50
+#define N_ROUNDS 200
+#define SESSION_ID "17E61E13454CDD8B68E8D7DEEEDF6170"
+
+static guint n_allocations = 0;
+
+static gpointer
+counting_malloc (gsize n_bytes)
+{
+  n_allocations++;
+  return malloc (n_bytes);
+}
+
+static gpointer
+counting_realloc (gpointer mem,
+                  gsize n_bytes)
+{
+  n_allocations++;
+  return realloc (mem, n_bytes);
+}
+
+static GMemVTable counting_vtable = {
+  counting_malloc,
+  counting_realloc,
+  free,
+  NULL,
+  NULL,
+  NULL
+};
+
+static void
+fill_track (MafwLastfmTrack *track,
+            gint i)
+{
+  static gchar artist[64], title[64];
+
+  g_snprintf (artist, sizeof (artist), "Sigur%%20R%%C3%%B3s%%20%i", i);
+  g_snprintf (title, sizeof (title), "Hopp%%C3%%ADpolla%%20%i", i);
+  track->artist = artist;
+  track->title = title;
+  track->album = "Takk...";
+  track->timestamp = 1262304000 + i * 300;
+  track->source = 'P';
+  track->length = 270;
+  track->number = i % 12 + 1;
+}
+
+static gchar *
+old_submission (gchar **lines)
+{
+  gchar **track;
+  gchar **entries;
+  gchar *buffer;
+  gchar *post_data;
+  gint i, n;
+
+  n = g_strv_length (lines);
+  entries = g_new0 (gchar *, n + 1);
+  for (i = 0; i < n; i++) {
+    track = g_strsplit (lines[i], "&", 0);
+    entries[i] = g_strdup_printf ("a[%i]=%s&t[%i]=%s&i[%i]=%s&o[%i]=%s&r[%i]=&l[%i]=%s&b[%i]=%s&n[%i]=%s&m[%i]=",
+                                  i, track[0], i, track[1], i, track[2],
+                                  i, track[3], i, i, track[4], i, track[5],
+                                  i, track[6], i);
+    g_strfreev (track);
+  }
+  buffer = g_strjoinv ("&", entries);
+  g_strfreev (entries);
+
+  post_data = g_strdup_printf ("s=%s&%s", SESSION_ID, buffer);
+  g_free (buffer);
+
+  return post_data;
+}
+
+static gchar *
+new_submission (const gchar *records,
+                gsize length)
+{
+  MafwLastfmJournalIter iter;
+  MafwLastfmTrack track;
+  GString *body;
+  gint i = 0;
+
+  body = mafw_lastfm_body_new (SESSION_ID, length + N_TRACKS * 64);
+  mafw_lastfm_journal_iter_init (&iter, records, length);
+  while (mafw_lastfm_journal_iter_next (&iter, &track, NULL))
+    mafw_lastfm_body_append_submission (body, i++, &track, TRUE);
+
+  return g_string_free (body, FALSE);
+}
+
+static gchar *
+old_now_playing (MafwLastfmTrack *track)
+{
+  return g_strdup_printf ("s=%s&a=%s&t=%s&b=%s&l=%lli&n=%i&m=",
+                          SESSION_ID, track->artist, track->title,
+                          track->album, track->length, track->number);
+}
+
+static gchar *
+new_now_playing (MafwLastfmTrack *track)
+{
+  GString *body;
+
+  body = mafw_lastfm_body_new (SESSION_ID,
+                               mafw_lastfm_body_estimate_size (track));
+  mafw_lastfm_body_append_now_playing (body, track);
+
+  return g_string_free (body, FALSE);
+}
+
+static void
+report (const gchar *name,
+        guint allocations,
+        guint n_tracks,
+        gdouble seconds)
+{
+  g_print ("%-24s %8.2f allocations/track %10.2f us/track\n", name,
+           (gdouble) allocations / n_tracks,
+           seconds * G_USEC_PER_SEC / n_tracks);
+}
+
+int
+main (void)
+{
+  MafwLastfmTrack track;
+  GString *text, *records;
+  gchar **lines;
+  GTimer *timer;
+  guint before;
+  gint i;
+
+  g_mem_set_vtable (&counting_vtable);
+
+  text = g_string_new (NULL);
+  records = g_string_new (NULL);
+  for (i = 0; i < N_TRACKS; i++) {
+    fill_track (&track, i);
+    g_string_append_printf (text, "%s&%s&%li&%c&%lli&%s&%i\n",
+                            track.artist, track.title, track.timestamp,
+                            track.source, track.length, track.album,
+                            track.number);
+    mafw_lastfm_journal_encode_record (records, &track,
+                                       MAFW_LASTFM_JOURNAL_RECORD_ENCODED);
+  }
+  /* Drop the trailing newline, as the old code did with the last,
+     empty line. */
+  g_string_truncate (text, text->len - 1);
+  lines = g_strsplit (text->str, "\n", 0);
+
+  timer = g_timer_new ();
+
+  if (n_allocations == 0)
+    g_print ("Warning: this GLib ignores g_mem_set_vtable(), allocations "
+             "will be reported as 0.\n");
+
+  before = n_allocations;
+  g_timer_start (timer);
+  for (i = 0; i < N_ROUNDS; i++)
+    g_free (old_submission (lines));
+  report ("submission (before)", n_allocations - before, N_ROUNDS * N_TRACKS,
+          g_timer_elapsed (timer, NULL));
+
+  before = n_allocations;
+  g_timer_start (timer);
+  for (i = 0; i < N_ROUNDS; i++)
+    g_free (new_submission (records->str, records->len));
+  report ("submission (after)", n_allocations - before, N_ROUNDS * N_TRACKS,
+          g_timer_elapsed (timer, NULL));
+
+  fill_track (&track, 0);
+
+  before = n_allocations;
+  g_timer_start (timer);
+  for (i = 0; i < N_ROUNDS; i++)
+    g_free (old_now_playing (&track));
+  report ("now-playing (before)", n_allocations - before, N_ROUNDS,
+          g_timer_elapsed (timer, NULL));
+
+  before = n_allocations;
+  g_timer_start (timer);
+  for (i = 0; i < N_ROUNDS; i++)
+    g_free (new_now_playing (&track));
+  report ("now-playing (after)", n_allocations - before, N_ROUNDS,
+          g_timer_elapsed (timer, NULL));
+
+  g_timer_destroy (timer);
+  g_strfreev (lines);
+  g_string_free (text, TRUE);
+  g_string_free (records, TRUE);
+
+  return 0;
+}
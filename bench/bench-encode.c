@@ -0,0 +1,148 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Compares mafw_lastfm_body_append_encoded() with soup_uri_encode(),
+ * as used before to encode the tracks, on a set of artists, titles
+ * and albums. The outputs are checked to be the same before timing.
+ */
+
+#include <glib.h>
+#include <libsoup/soup.h>
+#include <string.h>
+
+#include "mafw-lastfm-body.h"
+
+#define N_ROUNDS 20000
+#define EXTRA_URI_ENCODE_CHARS "&+"
+
+static const gchar *metadata[] = {
+  "Björk", "Jóga", "Homogenic",
+  "Sigur Rós", "Hoppípolla", "Takk...",
+  "Мумий Тролль", "Владивосток 2000", "Морская",
+  "坂本龍一", "Merry Christmas Mr. Lawrence", "戦場のメリークリスマス",
+  "AC/DC", "Highway to Hell", "Highway to Hell",
+  "Simon & Garfunkel", "The Sound of Silence", "Sounds of Silence",
+  "Guns N' Roses", "Sweet Child o' Mine", "Appetite for Destruction",
+  "Mötley Crüe", "Kickstart My Heart", "Dr. Feelgood",
+  "Beyoncé", "Crazy in Love (feat. Jay-Z)", "Dangerously in Love",
+  "The Beatles", "Love Me Do", "Please Please Me",
+  "Ólafur Arnalds", "Þú ert sólin", "...And They Have Escaped the Weight of Darkness",
+  "Daft Punk", "Harder, Better, Faster, Stronger", "Discovery",
+  "Wolfgang Amadeus Mozart", "Requiem in D minor, K. 626: Lacrimosa", "Requiem",
+  "Astor Piazzolla", "Libertango", "Libertango",
+  "Amadou & Mariam", "Sabali", "Welcome to Mali",
+  "C++ Rockers", "100% Pure + Simple", "#1s?"
+};
+
+static gsize
+encode_soup (void)
+{
+  gchar *encoded;
+  gsize total = 0;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (metadata); i++) {
+    encoded = soup_uri_encode (metadata[i], EXTRA_URI_ENCODE_CHARS);
+    total += strlen (encoded);
+    g_free (encoded);
+  }
+
+  return total;
+}
+
+static gsize
+encode_body (GString *body)
+{
+  guint i;
+
+  g_string_truncate (body, 0);
+  for (i = 0; i < G_N_ELEMENTS (metadata); i++)
+    mafw_lastfm_body_append_encoded (body, metadata[i]);
+
+  return body->len;
+}
+
+static gboolean
+check (GString *body)
+{
+  gchar *expected;
+  gboolean ok = TRUE;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (metadata); i++) {
+    expected = soup_uri_encode (metadata[i], EXTRA_URI_ENCODE_CHARS);
+    g_string_truncate (body, 0);
+    mafw_lastfm_body_append_encoded (body, metadata[i]);
+    if (strcmp (expected, body->str) != 0) {
+      g_print ("Mismatch for '%s': '%s' != '%s'\n",
+               metadata[i], body->str, expected);
+      ok = FALSE;
+    }
+    g_free (expected);
+  }
+
+  return ok;
+}
+
+static void
+report (const gchar *name,
+        gsize input,
+        gdouble seconds)
+{
+  g_print ("%-24s %10.2f ns/string %8.2f MB/s\n", name,
+           seconds * 1e9 / (N_ROUNDS * G_N_ELEMENTS (metadata)),
+           input * N_ROUNDS / seconds / 1e6);
+}
+
+int
+main (void)
+{
+  GString *body;
+  GTimer *timer;
+  gsize input = 0;
+  gsize output = 0;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (metadata); i++)
+    input += strlen (metadata[i]);
+
+  body = g_string_sized_new (3 * input);
+  if (!check (body))
+    return 1;
+
+  timer = g_timer_new ();
+
+  g_timer_start (timer);
+  for (i = 0; i < N_ROUNDS; i++)
+    output += encode_soup ();
+  report ("soup_uri_encode", input, g_timer_elapsed (timer, NULL));
+
+  g_timer_start (timer);
+  for (i = 0; i < N_ROUNDS; i++)
+    output -= encode_body (body);
+  report ("body_append_encoded", input, g_timer_elapsed (timer, NULL));
+
+  g_timer_destroy (timer);
+  g_string_free (body, TRUE);
+
+  /* Both loops must have produced the same number of bytes. */
+  return output == 0 ? 0 : 1;
+}
@@ -0,0 +1,225 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Fills a history with years of synthetic plays, appended in batches
+ * as the journal archives them, and times the lookups against a scan
+ * of the whole log, which is what answering them without the indexes
+ * would take. Opening the history again is timed too.
+ *
+ * Usage: bench-history [PLAYS]
+ */
+
+#include <glib.h>
+#include <glib-object.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mafw-lastfm-history.h"
+#include "mafw-lastfm-journal.h"
+
+#define DEFAULT_PLAYS 300000
+#define BATCH_SIZE 50
+#define N_ARTISTS 2000
+#define TRACKS_PER_ARTIST 40
+#define N_LOOKUPS 100
+#define START_TIME 1262304000
+#define WEEK (7 * 24 * 3600)
+
+static void
+fill_track (MafwLastfmTrack *track,
+            guint i)
+{
+  static gchar artist[64], title[64];
+  guint artist_id;
+
+  /* Some artists are played much more than others. */
+  artist_id = (i * 7919 % N_ARTISTS) * (i % 3 + 1) % N_ARTISTS;
+  g_snprintf (artist, sizeof (artist), "Artist %u", artist_id);
+  g_snprintf (title, sizeof (title), "Track %u", i % TRACKS_PER_ARTIST);
+  track->artist = artist;
+  track->title = title;
+  track->album = "Album";
+  track->timestamp = START_TIME + i * 240;
+  track->source = 'P';
+  track->length = 230;
+  track->number = i % 12 + 1;
+}
+
+static void
+free_plays (GList *plays)
+{
+  g_list_foreach (plays, (GFunc) mafw_lastfm_track_unref, NULL);
+  g_list_free (plays);
+}
+
+static void
+free_counts (GList *counts)
+{
+  g_list_foreach (counts, (GFunc) mafw_lastfm_history_count_free, NULL);
+  g_list_free (counts);
+}
+
+/* Counts the plays of @artist reading every record of the log. */
+static guint
+scan_log (const gchar *path,
+          const gchar *artist)
+{
+  MafwLastfmJournalIter iter;
+  MafwLastfmTrack track;
+  GMappedFile *map;
+  guint n_plays = 0;
+
+  map = g_mapped_file_new (path, FALSE, NULL);
+  if (!map)
+    return 0;
+
+  /* Past the header of the history. */
+  mafw_lastfm_journal_iter_init (&iter, g_mapped_file_get_contents (map) + 8,
+                                 g_mapped_file_get_length (map) - 8);
+  while (mafw_lastfm_journal_iter_next (&iter, &track, NULL))
+    if (g_ascii_strcasecmp (track.artist, artist) == 0)
+      n_plays++;
+
+#if GLIB_CHECK_VERSION (2, 22, 0)
+  g_mapped_file_unref (map);
+#else
+  g_mapped_file_free (map);
+#endif
+
+  return n_plays;
+}
+
+static void
+report (const gchar *name,
+        guint n_lookups,
+        gdouble seconds)
+{
+  g_print ("%-28s %10.3f ms/lookup\n", name,
+           seconds * 1000 / n_lookups);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  MafwLastfmHistory *history;
+  MafwLastfmTrack track;
+  GString *records;
+  GTimer *timer;
+  GList *result;
+  gchar *path, *artist, *file;
+  const gchar *suffixes[] = { "", ".time", ".artist", ".track" };
+  glong last_week;
+  guint n_plays, n_found = 0;
+  guint i;
+
+  n_plays = argc > 1 ? atoi (argv[1]) : DEFAULT_PLAYS;
+  if (n_plays == 0) {
+    g_printerr ("Usage: bench-history [PLAYS]\n");
+    return 1;
+  }
+
+  g_type_init ();
+
+  path = g_strdup_printf ("%s/mafw-lastfm-bench-%d.history",
+                          g_get_tmp_dir (), (gint) getpid ());
+
+  history = mafw_lastfm_history_new (path);
+  if (!history)
+    return 1;
+
+  timer = g_timer_new ();
+  records = g_string_new (NULL);
+  for (i = 0; i < n_plays; i++) {
+    fill_track (&track, i);
+    mafw_lastfm_journal_encode_record (records, &track, 0);
+    if ((i + 1) % BATCH_SIZE == 0 || i + 1 == n_plays) {
+      mafw_lastfm_history_append (history, records->str, records->len);
+      g_string_truncate (records, 0);
+    }
+  }
+  g_print ("%u plays appended in batches of %u: %.2f us/play\n",
+           mafw_lastfm_history_get_n_plays (history), BATCH_SIZE,
+           g_timer_elapsed (timer, NULL) * G_USEC_PER_SEC / n_plays);
+  g_string_free (records, TRUE);
+
+  g_timer_start (timer);
+  for (i = 0; i < N_LOOKUPS; i++) {
+    artist = g_strdup_printf ("artist %u", i * 13 % N_ARTISTS);
+    result = mafw_lastfm_history_get_plays (history, artist, NULL, 0);
+    n_found += g_list_length (result);
+    free_plays (result);
+    g_free (artist);
+  }
+  report ("plays of an artist", N_LOOKUPS, g_timer_elapsed (timer, NULL));
+  g_print ("  %.1f plays/artist\n", (gdouble) n_found / N_LOOKUPS);
+
+  g_timer_start (timer);
+  for (i = 0; i < N_LOOKUPS; i++) {
+    artist = g_strdup_printf ("Artist %u", i * 13 % N_ARTISTS);
+    result = mafw_lastfm_history_get_plays (history, artist, "track 7", 10);
+    free_plays (result);
+    g_free (artist);
+  }
+  report ("last 10 plays of a track", N_LOOKUPS, g_timer_elapsed (timer, NULL));
+
+  fill_track (&track, n_plays - 1);
+  last_week = track.timestamp - WEEK;
+  g_timer_start (timer);
+  for (i = 0; i < N_LOOKUPS; i++)
+    free_counts (mafw_lastfm_history_get_top_artists (history, last_week, 10));
+  report ("top 10 artists of the week", N_LOOKUPS,
+          g_timer_elapsed (timer, NULL));
+
+  g_timer_start (timer);
+  for (i = 0; i < N_LOOKUPS; i++)
+    free_plays (mafw_lastfm_history_get_recent (history, 50));
+  report ("last 50 plays", N_LOOKUPS, g_timer_elapsed (timer, NULL));
+
+  g_timer_start (timer);
+  for (i = 0; i < 10; i++) {
+    artist = g_strdup_printf ("Artist %u", i * 13 % N_ARTISTS);
+    scan_log (path, artist);
+    g_free (artist);
+  }
+  report ("scan of the log", 10, g_timer_elapsed (timer, NULL));
+
+  mafw_lastfm_history_free (history);
+
+  g_timer_start (timer);
+  history = mafw_lastfm_history_new (path);
+  g_print ("%-28s %10.3f ms\n", "opening the history",
+           g_timer_elapsed (timer, NULL) * 1000);
+  mafw_lastfm_history_free (history);
+
+  g_timer_destroy (timer);
+
+  for (i = 0; i < G_N_ELEMENTS (suffixes); i++) {
+    file = g_strconcat (path, suffixes[i], NULL);
+    g_unlink (file);
+    g_free (file);
+  }
+  g_free (path);
+
+  return 0;
+}
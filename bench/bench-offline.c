@@ -0,0 +1,182 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Simulates eight hours without network, during which the handshake
+ * server can't be reached, and counts the wakeups of the scrobbler
+ * and the handshakes it attempts. It runs twice: first with the
+ * scrobbler unaware of the network being down, retrying with its
+ * backoff, and then told so with mafw_lastfm_scrobbler_set_online(),
+ * which parks its timers. The clock of the timers is virtual, so it
+ * only takes a few seconds.
+ *
+ * Usage: bench-offline [HOURS]
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libsoup/soup.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mafw-lastfm-scrobbler.h"
+#include "mafw-lastfm-scheduler.h"
+#include "mafw-lastfm-metrics.h"
+
+#define DEFAULT_HOURS 8
+/* Granularity of the virtual clock, in milliseconds. */
+#define STEP 1000
+
+typedef struct {
+  guint wakeups;
+  guint handshakes;
+  /* Virtual seconds from the network coming back to a handshake. */
+  gdouble reconnect_delay;
+} Result;
+
+static gint64 virtual_time = 0;
+
+static gint64
+get_virtual_time (void)
+{
+  return virtual_time;
+}
+
+static void
+run_pending (void)
+{
+  while (g_main_context_pending (NULL))
+    g_main_context_iteration (NULL, FALSE);
+}
+
+/* The handshakes fail on their own, in real time. */
+static void
+wait_for_handshakes (void)
+{
+  while (mafw_lastfm_metrics_get (MAFW_LASTFM_METRIC_HANDSHAKES) >
+         mafw_lastfm_metrics_get (MAFW_LASTFM_METRIC_HANDSHAKES_FAILED))
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+advance (gint64 milliseconds)
+{
+  gint64 end = virtual_time + milliseconds;
+
+  while (virtual_time < end) {
+    virtual_time += STEP;
+    run_pending ();
+    wait_for_handshakes ();
+  }
+}
+
+static void
+simulate (const gchar *url,
+          gboolean aware,
+          guint hours,
+          Result *result)
+{
+  MafwLastfmScrobbler *scrobbler;
+  gchar *journal, *ack;
+  guint handshakes;
+  gint64 start;
+
+  journal = g_strdup_printf ("%s/mafw-lastfm-offline-%d.journal",
+                             g_get_tmp_dir (), (gint) getpid ());
+  ack = g_strconcat (journal, ".ack", NULL);
+
+  mafw_lastfm_metrics_reset ();
+  scrobbler = mafw_lastfm_scrobbler_new_with_journal (journal);
+  mafw_lastfm_scrobbler_set_handshake_url (scrobbler, url);
+  mafw_lastfm_scrobbler_set_credentials (scrobbler, "bench",
+                                         "0123456789abcdef0123456789abcdef");
+  if (aware)
+    mafw_lastfm_scrobbler_set_online (scrobbler, FALSE);
+  mafw_lastfm_scrobbler_handshake (scrobbler);
+  wait_for_handshakes ();
+
+  advance ((gint64) hours * 3600 * 1000);
+
+  result->wakeups = mafw_lastfm_scrobbler_get_wakeups (scrobbler);
+  result->handshakes = mafw_lastfm_metrics_get (MAFW_LASTFM_METRIC_HANDSHAKES);
+
+  /* The network is back. The unaware scrobbler only notices on its
+     next retry. */
+  handshakes = result->handshakes;
+  start = virtual_time;
+  if (aware)
+    mafw_lastfm_scrobbler_set_online (scrobbler, TRUE);
+  while (mafw_lastfm_metrics_get (MAFW_LASTFM_METRIC_HANDSHAKES) == handshakes)
+    advance (STEP);
+  result->reconnect_delay = (virtual_time - start) / 1000.0;
+  wait_for_handshakes ();
+
+  g_object_unref (scrobbler);
+
+  g_unlink (journal);
+  g_unlink (ack);
+  g_free (journal);
+  g_free (ack);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  SoupServer *server;
+  Result unaware, aware;
+  gchar *url;
+  guint hours;
+
+  g_type_init ();
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
+
+  hours = argc > 1 ? atoi (argv[1]) : DEFAULT_HOURS;
+  if (hours == 0)
+    hours = DEFAULT_HOURS;
+
+  /* Grab a free port and close it, so that connecting is refused. */
+  server = soup_server_new (SOUP_SERVER_PORT, 0, NULL);
+  url = g_strdup_printf ("http://127.0.0.1:%u/",
+                         soup_server_get_port (server));
+  g_object_unref (server);
+
+  virtual_time = mafw_lastfm_scheduler_get_real_time ();
+  mafw_lastfm_scheduler_set_time_func (get_virtual_time);
+
+  simulate (url, FALSE, hours, &unaware);
+  simulate (url, TRUE, hours, &aware);
+
+  mafw_lastfm_scheduler_set_time_func (NULL);
+
+  g_print ("offline for             %u h\n", hours);
+  g_print ("                        unaware     parked\n");
+  g_print ("wakeups                 %-11u %u\n", unaware.wakeups, aware.wakeups);
+  g_print ("handshakes attempted    %-11u %u\n",
+           unaware.handshakes, aware.handshakes);
+  g_print ("reconnect delay         %-11.0f %.0f s\n",
+           unaware.reconnect_delay, aware.reconnect_delay);
+  g_print ("wakeups saved           %u\n", unaware.wakeups - aware.wakeups);
+
+  g_free (url);
+
+  return 0;
+}
@@ -0,0 +1,710 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Compares the two ways of running the scrobbler: the daemon, which
+ * gets the signals of the renderer from another process over D-Bus,
+ * and the plugin, loaded by the process of the renderer, which gets
+ * them as plain GObject signals. A fake renderer plays a number of
+ * tracks, paced like a fast skipping through a playlist, and its
+ * signals are handled by the same service code in both modes. The
+ * latency of each event is measured from its emission to the return
+ * of the handlers of the tracker, and the CPU time of both processes
+ * is added up.
+ *
+ * In the daemon mode the renderer runs in a child process with a
+ * peer-to-peer D-Bus connection to the scrobbler, so the additional
+ * hop through the bus daemon made by mafw-shared isn't counted and
+ * the figures of the daemon are a lower bound.
+ *
+ * Usage: bench-plugin [TRACKS]
+ */
+
+#include <glib.h>
+#include <glib-object.h>
+#include <glib/gstdio.h>
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib-lowlevel.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "mafw-lastfm-scrobbler.h"
+#include "mafw-lastfm-service.h"
+#include "mafw-lastfm-tracker.h"
+#include "mafw-lastfm-metrics.h"
+
+#define DEFAULT_TRACKS 1000
+/* Milliseconds between the tracks. */
+#define INTERVAL 2
+/* Signals emitted for each track. */
+#define EVENTS_PER_TRACK 8
+
+#define BENCH_PATH "/org/maemo/MafwLastfm/Bench"
+#define BENCH_INTERFACE "org.maemo.MafwLastfm.Bench"
+
+/* A renderer emitting the signals of MafwRenderer the service
+   listens to, with the same signatures. */
+typedef struct {
+  GObject parent;
+} BenchRenderer;
+
+typedef struct {
+  GObjectClass parent_class;
+} BenchRendererClass;
+
+enum {
+  STATE_CHANGED,
+  MEDIA_CHANGED,
+  METADATA_CHANGED,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL];
+
+typedef struct {
+  gdouble mean;
+  gint64 median;
+  gint64 p99;
+  /* CPU time of the process of the renderer and of the daemon, in
+     milliseconds. */
+  gdouble renderer_cpu;
+  gdouble daemon_cpu;
+  guint misses;
+} Result;
+
+typedef struct {
+  BenchRenderer *renderer;
+  GMainLoop *loop;
+  guint tracks;
+  guint played;
+  /* The connection from the renderer of the child. */
+  DBusConnection *connection;
+  guint child_id;
+} Driver;
+
+/* When the event being handled was emitted, in microseconds. */
+static gint64 sent_at = 0;
+static GArray *latencies = NULL;
+
+GType
+bench_renderer_get_type (void);
+
+G_DEFINE_TYPE (BenchRenderer, bench_renderer, G_TYPE_OBJECT)
+
+typedef void (*MarshalFunc_VOID__INT_STRING) (gpointer data1,
+                                              gint arg1,
+                                              const gchar *arg2,
+                                              gpointer data2);
+
+typedef void (*MarshalFunc_VOID__STRING_BOXED) (gpointer data1,
+                                                const gchar *arg1,
+                                                gpointer arg2,
+                                                gpointer data2);
+
+static void
+marshal_VOID__INT_STRING (GClosure *closure,
+                          GValue *return_value,
+                          guint n_param_values,
+                          const GValue *param_values,
+                          gpointer invocation_hint,
+                          gpointer marshal_data)
+{
+  GCClosure *cc = (GCClosure *) closure;
+  MarshalFunc_VOID__INT_STRING callback;
+  gpointer data1, data2;
+
+  if (G_CCLOSURE_SWAP_DATA (closure)) {
+    data1 = closure->data;
+    data2 = g_value_peek_pointer (param_values);
+  } else {
+    data1 = g_value_peek_pointer (param_values);
+    data2 = closure->data;
+  }
+  callback = (MarshalFunc_VOID__INT_STRING) (marshal_data ?
+                                             marshal_data : cc->callback);
+  callback (data1,
+            g_value_get_int (param_values + 1),
+            g_value_get_string (param_values + 2),
+            data2);
+}
+
+static void
+marshal_VOID__STRING_BOXED (GClosure *closure,
+                            GValue *return_value,
+                            guint n_param_values,
+                            const GValue *param_values,
+                            gpointer invocation_hint,
+                            gpointer marshal_data)
+{
+  GCClosure *cc = (GCClosure *) closure;
+  MarshalFunc_VOID__STRING_BOXED callback;
+  gpointer data1, data2;
+
+  if (G_CCLOSURE_SWAP_DATA (closure)) {
+    data1 = closure->data;
+    data2 = g_value_peek_pointer (param_values);
+  } else {
+    data1 = g_value_peek_pointer (param_values);
+    data2 = closure->data;
+  }
+  callback = (MarshalFunc_VOID__STRING_BOXED) (marshal_data ?
+                                               marshal_data : cc->callback);
+  callback (data1,
+            g_value_get_string (param_values + 1),
+            g_value_get_boxed (param_values + 2),
+            data2);
+}
+
+static void
+bench_renderer_class_init (BenchRendererClass *klass)
+{
+  signals[STATE_CHANGED] =
+    g_signal_new ("state-changed", G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_FIRST, 0, NULL, NULL,
+                  g_cclosure_marshal_VOID__INT,
+                  G_TYPE_NONE, 1, G_TYPE_INT);
+  signals[MEDIA_CHANGED] =
+    g_signal_new ("media-changed", G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_FIRST, 0, NULL, NULL,
+                  marshal_VOID__INT_STRING,
+                  G_TYPE_NONE, 2, G_TYPE_INT, G_TYPE_STRING);
+  signals[METADATA_CHANGED] =
+    g_signal_new ("metadata-changed", G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_FIRST, 0, NULL, NULL,
+                  marshal_VOID__STRING_BOXED,
+                  G_TYPE_NONE, 2, G_TYPE_STRING, G_TYPE_VALUE_ARRAY);
+}
+
+static void
+bench_renderer_init (BenchRenderer *renderer)
+{
+}
+
+static gint64
+get_time (void)
+{
+  GTimeVal time_val;
+
+  g_get_current_time (&time_val);
+  return (gint64) time_val.tv_sec * G_USEC_PER_SEC + time_val.tv_usec;
+}
+
+static gdouble
+get_cpu_time (int who)
+{
+  struct rusage usage;
+
+  getrusage (who, &usage);
+  return usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0 +
+    usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+}
+
+static void
+begin_event (void)
+{
+  sent_at = get_time ();
+}
+
+static void
+end_event (void)
+{
+  gint64 latency;
+
+  latency = get_time () - sent_at;
+  g_array_append_val (latencies, latency);
+}
+
+static void
+emit_metadata (BenchRenderer *renderer,
+               const gchar *key,
+               const GValue *value)
+{
+  GValueArray *varray;
+
+  varray = g_value_array_new (1);
+  g_value_array_append (varray, value);
+  g_signal_emit (renderer, signals[METADATA_CHANGED], 0, key, varray);
+  g_value_array_free (varray);
+}
+
+static void
+emit_string (BenchRenderer *renderer,
+             const gchar *key,
+             const gchar *string)
+{
+  GValue value = { 0 };
+
+  g_value_init (&value, G_TYPE_STRING);
+  g_value_set_string (&value, string);
+  begin_event ();
+  emit_metadata (renderer, key, &value);
+  end_event ();
+  g_value_unset (&value);
+}
+
+static void
+emit_state (BenchRenderer *renderer,
+            gint state)
+{
+  begin_event ();
+  g_signal_emit (renderer, signals[STATE_CHANGED], 0, state);
+  end_event ();
+}
+
+/* The signals of the renderer when it moves to the next track, which
+   give the service all it needs without asking. */
+static void
+play_track (BenchRenderer *renderer,
+            guint i)
+{
+  GValue value = { 0 };
+  gchar *object_id, *title;
+
+  object_id = g_strdup_printf ("localtagfs::music/bench-%u", i);
+  title = g_strdup_printf ("Track %u", i);
+
+  begin_event ();
+  g_signal_emit (renderer, signals[MEDIA_CHANGED], 0, (gint) i, object_id);
+  end_event ();
+
+  emit_string (renderer, "artist", "Bench Artist");
+  emit_string (renderer, "title", title);
+  emit_string (renderer, "album", "Bench Album");
+
+  g_value_init (&value, G_TYPE_INT);
+  g_value_set_int (&value, i % 20 + 1);
+  begin_event ();
+  emit_metadata (renderer, "track", &value);
+  end_event ();
+  g_value_unset (&value);
+
+  g_value_init (&value, G_TYPE_INT64);
+  g_value_set_int64 (&value, 240);
+  begin_event ();
+  emit_metadata (renderer, "duration", &value);
+  end_event ();
+  g_value_unset (&value);
+
+  emit_state (renderer, MAFW_LASTFM_TRACKER_PLAYING);
+  emit_state (renderer, MAFW_LASTFM_TRACKER_PAUSED);
+
+  g_free (title);
+  g_free (object_id);
+}
+
+static gboolean
+drive_cb (Driver *driver)
+{
+  play_track (driver->renderer, driver->played++);
+  if (driver->played < driver->tracks)
+    return TRUE;
+
+  g_main_loop_quit (driver->loop);
+
+  return FALSE;
+}
+
+static void
+drive (BenchRenderer *renderer,
+       guint tracks)
+{
+  Driver driver = { 0 };
+
+  driver.renderer = renderer;
+  driver.loop = g_main_loop_new (NULL, FALSE);
+  driver.tracks = tracks;
+
+  g_timeout_add (INTERVAL, (GSourceFunc) drive_cb, &driver);
+  g_main_loop_run (driver.loop);
+  g_main_loop_unref (driver.loop);
+}
+
+/* What mafw-shared does in the process of the renderer: each signal
+   is sent as soon as it is emitted. */
+static void
+send_message (DBusConnection *connection,
+              DBusMessage *message)
+{
+  dbus_connection_send (connection, message, NULL);
+  dbus_connection_flush (connection);
+  dbus_message_unref (message);
+}
+
+static void
+forward_state_changed (BenchRenderer *renderer,
+                       gint state,
+                       DBusConnection *connection)
+{
+  DBusMessage *message;
+  dbus_int64_t stamp = sent_at;
+  dbus_int32_t dstate = state;
+
+  message = dbus_message_new_signal (BENCH_PATH, BENCH_INTERFACE,
+                                     "StateChanged");
+  dbus_message_append_args (message,
+                            DBUS_TYPE_INT64, &stamp,
+                            DBUS_TYPE_INT32, &dstate,
+                            DBUS_TYPE_INVALID);
+  send_message (connection, message);
+}
+
+static void
+forward_media_changed (BenchRenderer *renderer,
+                       gint index,
+                       const gchar *object_id,
+                       DBusConnection *connection)
+{
+  DBusMessage *message;
+  dbus_int64_t stamp = sent_at;
+  dbus_int32_t dindex = index;
+
+  message = dbus_message_new_signal (BENCH_PATH, BENCH_INTERFACE,
+                                     "MediaChanged");
+  dbus_message_append_args (message,
+                            DBUS_TYPE_INT64, &stamp,
+                            DBUS_TYPE_INT32, &dindex,
+                            DBUS_TYPE_STRING, &object_id,
+                            DBUS_TYPE_INVALID);
+  send_message (connection, message);
+}
+
+static void
+forward_metadata_changed (BenchRenderer *renderer,
+                          const gchar *key,
+                          GValueArray *varray,
+                          DBusConnection *connection)
+{
+  DBusMessage *message;
+  GValue *value;
+  dbus_int64_t stamp = sent_at;
+  dbus_int32_t number;
+  dbus_int64_t number64;
+  const gchar *string;
+
+  value = g_value_array_get_nth (varray, 0);
+  message = dbus_message_new_signal (BENCH_PATH, BENCH_INTERFACE,
+                                     "MetadataChanged");
+  dbus_message_append_args (message,
+                            DBUS_TYPE_INT64, &stamp,
+                            DBUS_TYPE_STRING, &key,
+                            DBUS_TYPE_INVALID);
+  if (G_VALUE_HOLDS_INT (value)) {
+    number = g_value_get_int (value);
+    dbus_message_append_args (message, DBUS_TYPE_INT32, &number,
+                              DBUS_TYPE_INVALID);
+  } else if (G_VALUE_HOLDS_INT64 (value)) {
+    number64 = g_value_get_int64 (value);
+    dbus_message_append_args (message, DBUS_TYPE_INT64, &number64,
+                              DBUS_TYPE_INVALID);
+  } else {
+    string = g_value_get_string (value);
+    dbus_message_append_args (message, DBUS_TYPE_STRING, &string,
+                              DBUS_TYPE_INVALID);
+  }
+  send_message (connection, message);
+}
+
+static void
+run_renderer (const gchar *address,
+              guint tracks)
+{
+  BenchRenderer *renderer;
+  DBusConnection *connection;
+  DBusError error;
+
+  dbus_error_init (&error);
+  connection = dbus_connection_open_private (address, &error);
+  if (!connection) {
+    g_warning ("Couldn't connect to %s: %s", address, error.message);
+    dbus_error_free (&error);
+    _exit (1);
+  }
+
+  renderer = g_object_new (bench_renderer_get_type (), NULL);
+  g_signal_connect (renderer, "state-changed",
+                    G_CALLBACK (forward_state_changed), connection);
+  g_signal_connect (renderer, "media-changed",
+                    G_CALLBACK (forward_media_changed), connection);
+  g_signal_connect (renderer, "metadata-changed",
+                    G_CALLBACK (forward_metadata_changed), connection);
+
+  drive (renderer, tracks);
+
+  /* The daemon stops receiving once disconnected. */
+  g_object_unref (renderer);
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+}
+
+/* What mafw-shared does in the daemon: the proxy of the renderer
+   emits the signals received from it. */
+static DBusHandlerResult
+receive_filter (DBusConnection *connection,
+                DBusMessage *message,
+                void *user_data)
+{
+  Driver *driver = user_data;
+  DBusMessageIter iter;
+  GValue value = { 0 };
+  dbus_int64_t stamp, number64;
+  dbus_int32_t number;
+  const gchar *string, *key;
+
+  if (dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL, "Disconnected")) {
+    g_main_loop_quit (driver->loop);
+    return DBUS_HANDLER_RESULT_HANDLED;
+  }
+  if (!dbus_message_has_interface (message, BENCH_INTERFACE))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_get_basic (&iter, &stamp);
+  dbus_message_iter_next (&iter);
+  sent_at = stamp;
+
+  if (dbus_message_is_signal (message, BENCH_INTERFACE, "StateChanged")) {
+    dbus_message_iter_get_basic (&iter, &number);
+    g_signal_emit (driver->renderer, signals[STATE_CHANGED], 0,
+                   (gint) number);
+  } else if (dbus_message_is_signal (message, BENCH_INTERFACE,
+                                     "MediaChanged")) {
+    dbus_message_iter_get_basic (&iter, &number);
+    dbus_message_iter_next (&iter);
+    dbus_message_iter_get_basic (&iter, &string);
+    g_signal_emit (driver->renderer, signals[MEDIA_CHANGED], 0,
+                   (gint) number, string);
+  } else {
+    dbus_message_iter_get_basic (&iter, &key);
+    dbus_message_iter_next (&iter);
+    switch (dbus_message_iter_get_arg_type (&iter)) {
+    case DBUS_TYPE_INT32:
+      dbus_message_iter_get_basic (&iter, &number);
+      g_value_init (&value, G_TYPE_INT);
+      g_value_set_int (&value, number);
+      break;
+    case DBUS_TYPE_INT64:
+      dbus_message_iter_get_basic (&iter, &number64);
+      g_value_init (&value, G_TYPE_INT64);
+      g_value_set_int64 (&value, number64);
+      break;
+    default:
+      dbus_message_iter_get_basic (&iter, &string);
+      g_value_init (&value, G_TYPE_STRING);
+      g_value_set_string (&value, string);
+      break;
+    }
+    emit_metadata (driver->renderer, key, &value);
+    g_value_unset (&value);
+  }
+  end_event ();
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void
+new_connection_cb (DBusServer *server,
+                   DBusConnection *connection,
+                   void *user_data)
+{
+  Driver *driver = user_data;
+
+  if (driver->connection)
+    return;
+
+  driver->connection = dbus_connection_ref (connection);
+  dbus_connection_setup_with_g_main (connection, NULL);
+  dbus_connection_add_filter (connection, receive_filter, driver, NULL);
+}
+
+/* The renderer couldn't connect, otherwise it is the disconnection
+   which ends the run. */
+static void
+renderer_exited_cb (GPid pid,
+                    gint status,
+                    Driver *driver)
+{
+  driver->child_id = 0;
+  if (!driver->connection)
+    g_main_loop_quit (driver->loop);
+}
+
+static gint
+compare_latencies (gconstpointer a,
+                   gconstpointer b)
+{
+  gint64 la = *(const gint64 *) a, lb = *(const gint64 *) b;
+
+  return la < lb ? -1 : la > lb;
+}
+
+static void
+simulate (gboolean plugin,
+          guint tracks,
+          Result *result)
+{
+  MafwLastfmScrobbler *scrobbler;
+  MafwLastfmService *service;
+  BenchRenderer *renderer;
+  DBusServer *server = NULL;
+  DBusError error;
+  Driver driver = { 0 };
+  gchar *journal, *ack, *address;
+  gdouble cpu_start;
+  gint64 total = 0;
+  pid_t pid = 0;
+  guint i;
+
+  latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+  /* The renderer is forked before the scrobbler starts its threads,
+     and only the daemon accepts connections. */
+  if (!plugin) {
+    dbus_error_init (&error);
+    server = dbus_server_listen ("unix:tmpdir=/tmp", &error);
+    if (!server)
+      g_error ("Couldn't listen: %s", error.message);
+
+    address = dbus_server_get_address (server);
+    pid = fork ();
+    if (pid == 0) {
+      run_renderer (address, tracks);
+      _exit (0);
+    }
+    dbus_free (address);
+
+    dbus_server_set_new_connection_function (server, new_connection_cb,
+                                             &driver, NULL);
+    dbus_server_setup_with_g_main (server, NULL);
+    driver.loop = g_main_loop_new (NULL, FALSE);
+    driver.child_id = g_child_watch_add (pid,
+                                         (GChildWatchFunc) renderer_exited_cb,
+                                         &driver);
+  }
+
+  journal = g_strdup_printf ("%s/mafw-lastfm-plugin-%d.journal",
+                             g_get_tmp_dir (), (gint) getpid ());
+  ack = g_strconcat (journal, ".ack", NULL);
+
+  mafw_lastfm_metrics_reset ();
+
+  scrobbler = mafw_lastfm_scrobbler_new_with_journal (journal);
+  service = mafw_lastfm_service_new (scrobbler);
+  renderer = g_object_new (bench_renderer_get_type (), NULL);
+  mafw_lastfm_service_attach_renderer (service, G_OBJECT (renderer));
+
+  cpu_start = get_cpu_time (RUSAGE_SELF);
+  if (plugin) {
+    drive (renderer, tracks);
+  } else {
+    driver.renderer = renderer;
+    g_main_loop_run (driver.loop);
+    g_main_loop_unref (driver.loop);
+
+    if (driver.child_id)
+      g_source_remove (driver.child_id);
+    waitpid (pid, NULL, 0);
+    if (driver.connection) {
+      dbus_connection_remove_filter (driver.connection, receive_filter,
+                                     &driver);
+      dbus_connection_unref (driver.connection);
+    }
+    dbus_server_disconnect (server);
+    dbus_server_unref (server);
+  }
+  result->daemon_cpu = get_cpu_time (RUSAGE_SELF) - cpu_start;
+  result->renderer_cpu = get_cpu_time (RUSAGE_CHILDREN);
+
+  if (latencies->len != tracks * EVENTS_PER_TRACK)
+    g_warning ("Received %u events out of %u", latencies->len,
+               tracks * EVENTS_PER_TRACK);
+  g_array_sort (latencies, compare_latencies);
+  for (i = 0; i < latencies->len; i++)
+    total += g_array_index (latencies, gint64, i);
+  result->mean = latencies->len ? (gdouble) total / latencies->len : 0;
+  result->median = latencies->len ?
+    g_array_index (latencies, gint64, latencies->len / 2) : 0;
+  result->p99 = latencies->len ?
+    g_array_index (latencies, gint64, latencies->len * 99 / 100) : 0;
+  result->misses =
+    mafw_lastfm_metrics_get (MAFW_LASTFM_METRIC_METADATA_CACHE_MISSES) +
+    mafw_lastfm_metrics_get (MAFW_LASTFM_METRIC_POSITION_CACHE_MISSES);
+
+  /* Both processes are the renderer's when it loads the plugin. */
+  if (plugin) {
+    result->renderer_cpu = result->daemon_cpu;
+    result->daemon_cpu = 0;
+  }
+
+  g_array_free (latencies, TRUE);
+  latencies = NULL;
+  mafw_lastfm_service_free (service);
+  g_object_unref (renderer);
+  g_object_unref (scrobbler);
+
+  g_unlink (journal);
+  g_unlink (ack);
+  g_free (journal);
+  g_free (ack);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  Result daemon, plugin;
+  guint tracks, events;
+
+  g_type_init ();
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
+
+  tracks = argc > 1 ? atoi (argv[1]) : DEFAULT_TRACKS;
+  if (tracks == 0)
+    tracks = DEFAULT_TRACKS;
+  events = tracks * EVENTS_PER_TRACK;
+
+  simulate (FALSE, tracks, &daemon);
+  simulate (TRUE, tracks, &plugin);
+
+  if (daemon.misses || plugin.misses)
+    g_warning ("The tracker asked the renderer %u times",
+               daemon.misses + plugin.misses);
+
+  g_print ("tracks                  %u (%u events)\n", tracks, events);
+  g_print ("                        daemon      plugin\n");
+  g_print ("latency mean            %-11.1f %.1f us\n",
+           daemon.mean, plugin.mean);
+  g_print ("latency median          %-11" G_GINT64_FORMAT " %" G_GINT64_FORMAT " us\n",
+           daemon.median, plugin.median);
+  g_print ("latency 99th            %-11" G_GINT64_FORMAT " %" G_GINT64_FORMAT " us\n",
+           daemon.p99, plugin.p99);
+  g_print ("renderer cpu            %-11.1f %.1f ms\n",
+           daemon.renderer_cpu, plugin.renderer_cpu);
+  g_print ("daemon cpu              %-11.1f %.1f ms\n",
+           daemon.daemon_cpu, plugin.daemon_cpu);
+  g_print ("cpu per event           %-11.2f %.2f us\n",
+           (daemon.renderer_cpu + daemon.daemon_cpu) * 1000 / events,
+           (plugin.renderer_cpu + plugin.daemon_cpu) * 1000 / events);
+
+  return 0;
+}
@@ -0,0 +1,194 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Times the scheduler on many timers spread over an hour, and reports
+ * how many wakeups the slack saves. Before timing, it checks that
+ * timers removed while a dispatch is going on, by their own function
+ * or by the one of another timer due at the same time, are neither run
+ * again nor put back. The clock is virtual.
+ *
+ * Usage: bench-scheduler [N]
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+
+#include "mafw-lastfm-scheduler.h"
+
+#define DEFAULT_N_TIMERS 100000
+#define SLACK 1000
+#define PERIOD (3600 * 1000)
+
+static gint64 virtual_time = 0;
+
+static gint64
+get_virtual_time (void)
+{
+  return virtual_time;
+}
+
+static void
+run_pending (void)
+{
+  while (g_main_context_pending (NULL))
+    g_main_context_iteration (NULL, FALSE);
+}
+
+typedef struct {
+  MafwLastfmScheduler *scheduler;
+  guint id;
+  guint runs;
+  /* A timer to remove from this one, and whether to remove itself. */
+  guint remove_id;
+  gboolean remove_self;
+} Check;
+
+static gboolean
+check_cb (gpointer data)
+{
+  Check *check = data;
+
+  check->runs++;
+  if (check->remove_id)
+    mafw_lastfm_scheduler_remove (check->scheduler, check->remove_id);
+  if (check->remove_self)
+    mafw_lastfm_scheduler_remove (check->scheduler, check->id);
+
+  return TRUE;
+}
+
+static gboolean
+check_removal (void)
+{
+  MafwLastfmScheduler *scheduler;
+  Check checks[4] = { { NULL } };
+  gboolean ok = TRUE;
+  guint i;
+
+  scheduler = mafw_lastfm_scheduler_new (SLACK);
+  for (i = 0; i < G_N_ELEMENTS (checks); i++) {
+    checks[i].scheduler = scheduler;
+    checks[i].id = mafw_lastfm_scheduler_add (scheduler, 100 * (i + 1),
+                                              check_cb, &checks[i]);
+  }
+  /* All four share a wakeup. The second one removes the first, which
+     has run and is waiting to be put back, and the third one removes
+     itself. */
+  checks[1].remove_id = checks[0].id;
+  checks[2].remove_self = TRUE;
+
+  virtual_time += 1000;
+  run_pending ();
+  if (checks[0].runs != 1 || checks[1].runs != 1 ||
+      checks[2].runs != 1 || checks[3].runs != 1) {
+    g_print ("Timers ran %u, %u, %u and %u times, not once each\n",
+             checks[0].runs, checks[1].runs, checks[2].runs, checks[3].runs);
+    ok = FALSE;
+  }
+  if (mafw_lastfm_scheduler_get_n_timers (scheduler) != 2) {
+    g_print ("%u timers left instead of 2\n",
+             mafw_lastfm_scheduler_get_n_timers (scheduler));
+    ok = FALSE;
+  }
+
+  /* The second one now removes the last one before it runs. */
+  checks[1].remove_id = checks[3].id;
+  virtual_time += 1000;
+  run_pending ();
+  if (checks[0].runs != 1 || checks[1].runs != 2 ||
+      checks[2].runs != 1 || checks[3].runs != 1) {
+    g_print ("Timers ran %u, %u, %u and %u times, not 1, 2, 1 and 1\n",
+             checks[0].runs, checks[1].runs, checks[2].runs, checks[3].runs);
+    ok = FALSE;
+  }
+  if (mafw_lastfm_scheduler_get_n_timers (scheduler) != 1) {
+    g_print ("%u timers left instead of 1\n",
+             mafw_lastfm_scheduler_get_n_timers (scheduler));
+    ok = FALSE;
+  }
+
+  mafw_lastfm_scheduler_free (scheduler);
+
+  return ok;
+}
+
+static gboolean
+count_cb (gpointer data)
+{
+  (*(guint *) data)++;
+
+  return FALSE;
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  MafwLastfmScheduler *scheduler;
+  GTimer *timer;
+  GRand *rand;
+  gdouble add, dispatch;
+  guint n_timers, runs = 0;
+  guint i;
+
+  n_timers = argc > 1 ? atoi (argv[1]) : DEFAULT_N_TIMERS;
+  if (n_timers == 0)
+    n_timers = DEFAULT_N_TIMERS;
+
+  mafw_lastfm_scheduler_set_time_func (get_virtual_time);
+
+  if (!check_removal ())
+    return 1;
+
+  scheduler = mafw_lastfm_scheduler_new (SLACK);
+  rand = g_rand_new_with_seed (0);
+  timer = g_timer_new ();
+
+  g_timer_start (timer);
+  for (i = 0; i < n_timers; i++)
+    mafw_lastfm_scheduler_add (scheduler, g_rand_int_range (rand, 0, PERIOD),
+                               count_cb, &runs);
+  add = g_timer_elapsed (timer, NULL);
+
+  g_timer_start (timer);
+  while (mafw_lastfm_scheduler_get_n_timers (scheduler) > 0) {
+    virtual_time += 100;
+    run_pending ();
+  }
+  dispatch = g_timer_elapsed (timer, NULL);
+
+  g_print ("timers                  %u over %u s\n", n_timers, PERIOD / 1000);
+  g_print ("add                     %.2f us/timer\n", add * 1e6 / n_timers);
+  g_print ("dispatch                %.2f us/timer\n",
+           dispatch * 1e6 / n_timers);
+  g_print ("wakeups                 %u\n",
+           mafw_lastfm_scheduler_get_wakeups (scheduler));
+  g_print ("wakeups avoided         %u\n",
+           mafw_lastfm_scheduler_get_wakeups_avoided (scheduler));
+
+  g_timer_destroy (timer);
+  g_rand_free (rand);
+  mafw_lastfm_scheduler_free (scheduler);
+  mafw_lastfm_scheduler_set_time_func (NULL);
+
+  /* Every timer must have run exactly once. */
+  return runs == n_timers ? 0 : 1;
+}
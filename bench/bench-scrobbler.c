@@ -0,0 +1,746 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * End-to-end benchmark of the scrobbler against an in-process
+ * Audioscrobbler server, speaking either 1.2.1 or the 2.0 web
+ * services, or ListenBrainz server. N synthetic tracks, each played long enough to be
+ * scrobbled, are pushed through
+ * mafw_lastfm_scrobbler_enqueue_scrobble(), and the time until the
+ * server acknowledges each of them is measured. The 2.0 server checks
+ * the signature of every call, the ListenBrainz one the token.
+ *
+ * With REJECT, the 2.0 and ListenBrainz servers refuse every
+ * REJECT-th track for good, along with the batch it comes in. The
+ * tracks are then cached offline and sent in full batches, one at a
+ * time, once back online. The scrobbler must halve every refused batch
+ * until the track is alone, drop it and never send it again, and still
+ * get all the others acknowledged. Afterwards, nothing may be left
+ * pending in the journal and the history must hold every track but the
+ * rejected ones, or this fails.
+ *
+ * Usage: bench-scrobbler [N] [PROTOCOL] [REJECT]
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libsoup/soup.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mafw-lastfm-scrobbler.h"
+#include "mafw-lastfm-history.h"
+#include "mafw-lastfm-journal.h"
+#include "mafw-lastfm-metrics.h"
+
+#define DEFAULT_N_TRACKS 1000
+#define SESSION_ID "17E61E13454CDD8B68E8D7DEEEDF6170"
+#define API_KEY "b25b959554ed76058ac220b7b2e0a026"
+#define API_SECRET "425b55975eed76058ac220b7b2e0a026"
+#define PASSWORD "0123456789abcdef0123456789abcdef"
+#define BASE_TIMESTAMP 1262304000
+#define TRACK_LENGTH 200
+/* Half the length, so that the tracks can be cached right away. */
+#define TRACK_POSITION 100
+#define TIMEOUT 120
+
+/* The indexes the history keeps next to it. */
+static const gchar *history_suffixes[] = { ".time", ".artist", ".track" };
+
+typedef struct {
+  SoupServer *server;
+  GMainLoop *loop;
+  GTimer *timer;
+
+  guint n_tracks;
+  /* Every reject_every-th track is refused, n_rejected of them. */
+  guint reject_every;
+  guint n_rejected;
+  /* The size of the last batch if it was refused, 0 otherwise. */
+  guint refused_size;
+  /* Per track, whether it was refused alone. */
+  gboolean *dropped;
+  gboolean sequence_ok;
+  /* The sizes of the batches refused until the first track dropped. */
+  GString *first_refusals;
+  /* Seconds since the start, per track. */
+  gdouble *enqueued;
+  gdouble *acked;
+  guint n_acked;
+  gdouble last_ack;
+
+  const MafwLastfmProtocol *protocol;
+  gboolean handshaken;
+  guint n_handshakes;
+  guint n_now_playing;
+  guint n_submissions;
+  guint64 bytes;
+} Bench;
+
+static void
+respond (SoupMessage *msg,
+         const gchar *response)
+{
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+  soup_message_set_response (msg, "text/plain", SOUP_MEMORY_COPY,
+                             response, strlen (response));
+}
+
+static void
+handle_handshake (Bench *bench,
+                  SoupMessage *msg,
+                  GHashTable *query)
+{
+  gchar *response;
+  guint port;
+
+  if (!query || !g_hash_table_lookup (query, "u") ||
+      !g_hash_table_lookup (query, "t") || !g_hash_table_lookup (query, "a")) {
+    respond (msg, "FAILED Missing parameters\n");
+    return;
+  }
+
+  port = soup_server_get_port (bench->server);
+  response = g_strdup_printf ("OK\n%s\n"
+                              "http://127.0.0.1:%u/np\n"
+                              "http://127.0.0.1:%u/sub\n",
+                              SESSION_ID, port, port);
+  respond (msg, response);
+  g_free (response);
+
+  bench->n_handshakes++;
+  bench->handshaken = TRUE;
+}
+
+static void
+ack_track (Bench *bench,
+           glong timestamp)
+{
+  guint index;
+
+  index = timestamp - BASE_TIMESTAMP;
+  if (index < bench->n_tracks && bench->acked[index] < 0) {
+    bench->acked[index] = g_timer_elapsed (bench->timer, NULL);
+    bench->n_acked++;
+  }
+}
+
+static gboolean
+is_rejected (Bench *bench,
+             glong timestamp)
+{
+  return bench->reject_every > 0 &&
+    (timestamp - BASE_TIMESTAMP) % bench->reject_every ==
+    bench->reject_every - 1;
+}
+
+static void
+check_done (Bench *bench)
+{
+  if (bench->n_acked == bench->n_tracks - bench->n_rejected) {
+    bench->last_ack = g_timer_elapsed (bench->timer, NULL);
+    g_main_loop_quit (bench->loop);
+  }
+}
+
+/* Reads the timestamps given by @format and the index in the batch. */
+static GArray *
+collect_timestamps (GHashTable *form,
+                    const gchar *format)
+{
+  GArray *timestamps;
+  gchar key[32];
+  const gchar *timestamp;
+  glong value;
+  guint i;
+
+  timestamps = g_array_new (FALSE, FALSE, sizeof (glong));
+  for (i = 0; i < 50; i++) {
+    g_snprintf (key, sizeof (key), format, i);
+    timestamp = g_hash_table_lookup (form, key);
+    if (!timestamp)
+      break;
+
+    value = strtol (timestamp, NULL, 10);
+    g_array_append_val (timestamps, value);
+  }
+
+  return timestamps;
+}
+
+/* Takes a batch in, checking it against the ones refused before, and
+   returns whether it is accepted. The batches come one at a time when
+   tracks are rejected, so each one follows from the response to the
+   previous one. */
+static gboolean
+receive_batch (Bench *bench,
+               GArray *timestamps)
+{
+  gboolean refused = FALSE;
+  glong timestamp;
+  guint index;
+  guint i;
+
+  bench->n_submissions++;
+
+  for (i = 0; i < timestamps->len; i++) {
+    timestamp = g_array_index (timestamps, glong, i);
+    index = timestamp - BASE_TIMESTAMP;
+    if (index < bench->n_tracks && bench->dropped[index]) {
+      g_print ("Track %u sent again after being dropped\n", index);
+      bench->sequence_ok = FALSE;
+    }
+    if (is_rejected (bench, timestamp))
+      refused = TRUE;
+  }
+
+  if (bench->refused_size > 1 &&
+      timestamps->len > bench->refused_size / 2) {
+    g_print ("Batch of %u sent after one of %u was refused\n",
+             timestamps->len, bench->refused_size);
+    bench->sequence_ok = FALSE;
+  }
+  bench->refused_size = refused ? timestamps->len : 0;
+
+  if (refused) {
+    if (timestamps->len == 1)
+      bench->dropped[g_array_index (timestamps, glong, 0) -
+                     BASE_TIMESTAMP] = TRUE;
+    if (bench->first_refusals) {
+      g_string_append_printf (bench->first_refusals, "%s%u",
+                              bench->first_refusals->len ? ", " : "",
+                              timestamps->len);
+      if (timestamps->len == 1) {
+        g_print ("first refused batches   %s\n", bench->first_refusals->str);
+        g_string_free (bench->first_refusals, TRUE);
+        bench->first_refusals = NULL;
+      }
+    }
+    return FALSE;
+  }
+
+  for (i = 0; i < timestamps->len; i++)
+    ack_track (bench, g_array_index (timestamps, glong, i));
+
+  return TRUE;
+}
+
+static void
+respond_as20 (SoupMessage *msg,
+              guint status,
+              const gchar *response)
+{
+  gchar *body;
+
+  body = g_strdup_printf ("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+                          "%s\n", response);
+  soup_message_set_status (msg, status);
+  soup_message_set_response (msg, "text/xml", SOUP_MEMORY_TAKE,
+                             body, strlen (body));
+}
+
+static void
+collect_param (gpointer key,
+               gpointer value,
+               gpointer user_data)
+{
+  if (strcmp (key, "api_sig") != 0 && strcmp (key, "format") != 0)
+    g_ptr_array_add (user_data, key);
+}
+
+static gint
+compare_names (gconstpointer a,
+               gconstpointer b)
+{
+  return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+/* Checks api_sig as the web services do it. */
+static gboolean
+check_signature (GHashTable *form)
+{
+  GPtrArray *names;
+  GString *data;
+  gchar *signature;
+  gboolean valid;
+  guint i;
+
+  names = g_ptr_array_new ();
+  g_hash_table_foreach (form, collect_param, names);
+  g_ptr_array_sort (names, compare_names);
+
+  data = g_string_new (NULL);
+  for (i = 0; i < names->len; i++) {
+    g_string_append (data, g_ptr_array_index (names, i));
+    g_string_append (data, g_hash_table_lookup (form,
+                                                g_ptr_array_index (names, i)));
+  }
+  g_string_append (data, API_SECRET);
+
+  signature = g_compute_checksum_for_string (G_CHECKSUM_MD5, data->str, -1);
+  valid = g_strcmp0 (signature, g_hash_table_lookup (form, "api_sig")) == 0;
+
+  g_free (signature);
+  g_string_free (data, TRUE);
+  g_ptr_array_free (names, TRUE);
+
+  return valid;
+}
+
+static void
+handle_as20 (Bench *bench,
+             SoupMessage *msg,
+             GHashTable *form)
+{
+  const gchar *method;
+  GArray *timestamps;
+
+  method = g_hash_table_lookup (form, "method");
+
+  if (g_strcmp0 (g_hash_table_lookup (form, "api_key"), API_KEY) != 0 ||
+      !check_signature (form)) {
+    respond_as20 (msg, SOUP_STATUS_FORBIDDEN,
+                  "<lfm status=\"failed\"><error code=\"13\">"
+                  "Invalid method signature supplied</error></lfm>");
+  } else if (g_strcmp0 (method, "auth.getMobileSession") == 0) {
+    respond_as20 (msg, SOUP_STATUS_OK,
+                  "<lfm status=\"ok\"><session><name>bench</name>"
+                  "<key>" SESSION_ID "</key><subscriber>0</subscriber>"
+                  "</session></lfm>");
+    bench->n_handshakes++;
+    bench->handshaken = TRUE;
+  } else if (g_strcmp0 (g_hash_table_lookup (form, "sk"), SESSION_ID) != 0) {
+    respond_as20 (msg, SOUP_STATUS_FORBIDDEN,
+                  "<lfm status=\"failed\"><error code=\"9\">"
+                  "Invalid session key - Please re-authenticate</error></lfm>");
+  } else if (g_strcmp0 (method, "track.updateNowPlaying") == 0) {
+    bench->n_now_playing++;
+    respond_as20 (msg, SOUP_STATUS_OK,
+                  "<lfm status=\"ok\"><nowplaying/></lfm>");
+  } else if (g_strcmp0 (method, "track.scrobble") == 0) {
+    timestamps = collect_timestamps (form, "timestamp[%u]");
+    if (receive_batch (bench, timestamps)) {
+      respond_as20 (msg, SOUP_STATUS_OK,
+                    "<lfm status=\"ok\"><scrobbles/></lfm>");
+      check_done (bench);
+    } else {
+      respond_as20 (msg, SOUP_STATUS_BAD_REQUEST,
+                    "<lfm status=\"failed\"><error code=\"6\">"
+                    "Invalid parameters</error></lfm>");
+    }
+    g_array_free (timestamps, TRUE);
+  } else {
+    respond_as20 (msg, SOUP_STATUS_BAD_REQUEST,
+                  "<lfm status=\"failed\"><error code=\"3\">"
+                  "Invalid Method</error></lfm>");
+  }
+}
+
+static void
+respond_json (SoupMessage *msg,
+              guint status,
+              const gchar *response)
+{
+  soup_message_set_status (msg, status);
+  soup_message_set_response (msg, "application/json", SOUP_MEMORY_COPY,
+                             response, strlen (response));
+}
+
+/* Only looks at what the listens need to be acknowledged, the JSON
+   isn't parsed. */
+static void
+handle_listenbrainz (Bench *bench,
+                     SoupMessage *msg,
+                     const char *path)
+{
+  const gchar *authorization;
+  const gchar *data;
+  const gchar *p;
+  GArray *timestamps;
+  glong timestamp;
+  gboolean accepted;
+
+  authorization = soup_message_headers_get (msg->request_headers,
+                                            "Authorization");
+  if (g_strcmp0 (authorization, "Token " PASSWORD) != 0) {
+    respond_json (msg, SOUP_STATUS_UNAUTHORIZED,
+                  "{\"code\": 401, \"error\": \"Invalid authorization token.\"}");
+    return;
+  }
+
+  if (strcmp (path, "/1/validate-token") == 0) {
+    respond_json (msg, SOUP_STATUS_OK,
+                  "{\"code\": 200, \"message\": \"Token valid.\", "
+                  "\"valid\": true, \"user_name\": \"bench\"}");
+    bench->n_handshakes++;
+    bench->handshaken = TRUE;
+    return;
+  }
+
+  data = msg->request_body->data;
+  if (g_str_has_prefix (data, "{\"listen_type\":\"playing_now\"")) {
+    bench->n_now_playing++;
+  } else if (g_str_has_prefix (data, "{\"listen_type\":\"import\"")) {
+    timestamps = g_array_new (FALSE, FALSE, sizeof (glong));
+    for (p = strstr (data, "\"listened_at\":"); p;
+         p = strstr (p, "\"listened_at\":")) {
+      p += strlen ("\"listened_at\":");
+      timestamp = strtol (p, NULL, 10);
+      g_array_append_val (timestamps, timestamp);
+    }
+    accepted = receive_batch (bench, timestamps);
+    g_array_free (timestamps, TRUE);
+    if (!accepted) {
+      respond_json (msg, SOUP_STATUS_BAD_REQUEST,
+                    "{\"code\": 400, \"error\": \"Invalid listen.\"}");
+      return;
+    }
+  } else {
+    respond_json (msg, SOUP_STATUS_BAD_REQUEST,
+                  "{\"code\": 400, \"error\": \"Invalid listen_type.\"}");
+    return;
+  }
+
+  respond_json (msg, SOUP_STATUS_OK, "{\"status\": \"ok\"}");
+  check_done (bench);
+}
+
+static void
+server_cb (SoupServer *server,
+           SoupMessage *msg,
+           const char *path,
+           GHashTable *query,
+           SoupClientContext *client,
+           gpointer user_data)
+{
+  Bench *bench = user_data;
+  GHashTable *form;
+  GArray *timestamps;
+
+  if (strcmp (path, "/1/validate-token") == 0 ||
+      (strcmp (path, "/1/submit-listens") == 0 &&
+       strcmp (msg->method, "POST") == 0)) {
+    handle_listenbrainz (bench, msg, path);
+    return;
+  }
+
+  if (strcmp (path, "/2.0/") == 0 && strcmp (msg->method, "POST") == 0) {
+    form = soup_form_decode (msg->request_body->data);
+    handle_as20 (bench, msg, form);
+    g_hash_table_destroy (form);
+    return;
+  }
+
+  if (strcmp (path, "/") == 0) {
+    handle_handshake (bench, msg, query);
+    return;
+  }
+
+  if (strcmp (msg->method, "POST") != 0 ||
+      (strcmp (path, "/np") != 0 && strcmp (path, "/sub") != 0)) {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+    return;
+  }
+
+  form = soup_form_decode (msg->request_body->data);
+  if (g_strcmp0 (g_hash_table_lookup (form, "s"), SESSION_ID) != 0) {
+    respond (msg, "BADSESSION\n");
+  } else if (strcmp (path, "/np") == 0) {
+    bench->n_now_playing++;
+    respond (msg, "OK\n");
+  } else {
+    respond (msg, "OK\n");
+    timestamps = collect_timestamps (form, "i[%u]");
+    receive_batch (bench, timestamps);
+    g_array_free (timestamps, TRUE);
+    check_done (bench);
+  }
+  g_hash_table_destroy (form);
+}
+
+static void
+count_header (const char *name,
+              const char *value,
+              gpointer user_data)
+{
+  /* "name: value\r\n" */
+  *(guint64 *) user_data += strlen (name) + strlen (value) + 4;
+}
+
+/* Counts the headers and bodies of both the request and the response,
+   leaving out the request and status lines. */
+static void
+request_finished_cb (SoupServer *server,
+                     SoupMessage *msg,
+                     SoupClientContext *client,
+                     gpointer user_data)
+{
+  Bench *bench = user_data;
+
+  soup_message_headers_foreach (msg->request_headers, count_header,
+                                &bench->bytes);
+  soup_message_headers_foreach (msg->response_headers, count_header,
+                                &bench->bytes);
+  bench->bytes += msg->request_body->length + msg->response_body->length;
+}
+
+static void
+run_pending (void)
+{
+  while (g_main_context_pending (NULL))
+    g_main_context_iteration (NULL, FALSE);
+}
+
+static gboolean
+timeout_cb (gpointer user_data)
+{
+  Bench *bench = user_data;
+
+  g_warning ("Timed out with %u of %u tracks acknowledged",
+             bench->n_acked, bench->n_tracks);
+  g_main_loop_quit (bench->loop);
+
+  return FALSE;
+}
+
+static int
+compare_doubles (gconstpointer a,
+                 gconstpointer b)
+{
+  gdouble x = *(const gdouble *) a;
+  gdouble y = *(const gdouble *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void
+report (Bench *bench)
+{
+  gdouble *latencies;
+  guint i, n = 0;
+
+  latencies = g_new (gdouble, bench->n_tracks);
+  for (i = 0; i < bench->n_tracks; i++) {
+    if (bench->acked[i] >= 0)
+      latencies[n++] = bench->acked[i] - bench->enqueued[i];
+  }
+  qsort (latencies, n, sizeof (gdouble), compare_doubles);
+
+  g_print ("tracks acknowledged     %u/%u\n", n, bench->n_tracks);
+  if (bench->reject_every > 0)
+    g_print ("tracks rejected         %u, %u dropped\n", bench->n_rejected,
+             mafw_lastfm_metrics_get (MAFW_LASTFM_METRIC_SCROBBLES_REJECTED));
+  if (n > 0) {
+    g_print ("throughput              %.1f tracks/s\n",
+             n / bench->last_ack);
+    g_print ("latency p50             %.2f ms\n",
+             latencies[n / 2] * 1000);
+    g_print ("latency p99             %.2f ms\n",
+             latencies[MIN (n - 1, n * 99 / 100)] * 1000);
+  }
+  g_print ("protocol                %s\n", bench->protocol->name);
+  g_print ("requests                %u (%u handshake, %u now-playing, "
+           "%u submission)\n",
+           bench->n_handshakes + bench->n_now_playing + bench->n_submissions,
+           bench->n_handshakes, bench->n_now_playing, bench->n_submissions);
+  g_print ("bytes on the wire       %" G_GUINT64_FORMAT " (%.1f per track)\n",
+           bench->bytes, (gdouble) bench->bytes / MAX (n, 1));
+
+  g_free (latencies);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  Bench bench = { 0 };
+  const MafwLastfmProtocol *protocol;
+  MafwLastfmScrobbler *scrobbler;
+  MafwLastfmTrack *track;
+  MafwLastfmJournal *left;
+  MafwLastfmHistory *history;
+  gchar *journal, *ack, *history_path, *path, *url;
+  gchar artist[32], title[32];
+  guint timeout_id;
+  guint n_pending = 0, n_plays = 0;
+  gboolean ok;
+  guint i;
+
+  g_type_init ();
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
+
+  bench.n_tracks = argc > 1 ? atoi (argv[1]) : DEFAULT_N_TRACKS;
+  if (bench.n_tracks == 0)
+    bench.n_tracks = DEFAULT_N_TRACKS;
+  protocol = mafw_lastfm_protocol_lookup (argc > 2 ? argv[2] : NULL);
+  if (!protocol) {
+    g_printerr ("Unknown protocol %s\n", argv[2]);
+    return 1;
+  }
+  bench.protocol = protocol;
+  bench.reject_every = argc > 3 ? atoi (argv[3]) : 0;
+  if (bench.reject_every > 0 && protocol == &mafw_lastfm_protocol_as12) {
+    g_printerr ("1.2.1 can't reject tracks\n");
+    return 1;
+  }
+  for (i = 0; i < bench.n_tracks; i++) {
+    if (is_rejected (&bench, BASE_TIMESTAMP + i))
+      bench.n_rejected++;
+  }
+  bench.enqueued = g_new (gdouble, bench.n_tracks);
+  bench.acked = g_new (gdouble, bench.n_tracks);
+  for (i = 0; i < bench.n_tracks; i++)
+    bench.acked[i] = -1;
+  bench.dropped = g_new0 (gboolean, bench.n_tracks);
+  bench.sequence_ok = TRUE;
+  if (bench.n_rejected > 0)
+    bench.first_refusals = g_string_new (NULL);
+
+  bench.loop = g_main_loop_new (NULL, FALSE);
+  bench.server = soup_server_new (SOUP_SERVER_PORT, 0, NULL);
+  soup_server_add_handler (bench.server, NULL, server_cb, &bench, NULL);
+  g_signal_connect (bench.server, "request-finished",
+                    G_CALLBACK (request_finished_cb), &bench);
+  soup_server_run_async (bench.server);
+
+  /* Keep away from the real queue in the home directory. */
+  journal = g_strdup_printf ("%s/mafw-lastfm-bench-%d.journal",
+                             g_get_tmp_dir (), (gint) getpid ());
+  ack = g_strconcat (journal, ".ack", NULL);
+  history_path = g_strdup_printf ("%s/mafw-lastfm-bench-%d.history",
+                                  g_get_tmp_dir (), (gint) getpid ());
+  g_unlink (journal);
+  g_unlink (ack);
+
+  scrobbler = mafw_lastfm_scrobbler_new_with_journal (journal);
+  if (bench.reject_every > 0) {
+    mafw_lastfm_scrobbler_set_history_file (scrobbler, history_path);
+    mafw_lastfm_scrobbler_set_max_batches_in_flight (scrobbler, 1);
+  }
+  mafw_lastfm_endpoint_set_protocol (mafw_lastfm_scrobbler_get_endpoint (scrobbler, NULL),
+                                     protocol, API_KEY, API_SECRET);
+  url = g_strdup_printf ("http://127.0.0.1:%u/%s",
+                         soup_server_get_port (bench.server),
+                         protocol == &mafw_lastfm_protocol_as20 ? "2.0/" : "");
+  mafw_lastfm_scrobbler_set_handshake_url (scrobbler, url);
+  g_free (url);
+  mafw_lastfm_scrobbler_set_credentials (scrobbler, "bench", PASSWORD);
+  mafw_lastfm_scrobbler_handshake (scrobbler);
+
+  while (!bench.handshaken)
+    g_main_context_iteration (NULL, TRUE);
+  run_pending ();
+
+  bench.timer = g_timer_new ();
+
+  /* Cache the tracks, so that they are sent in full batches. */
+  if (bench.reject_every > 0)
+    mafw_lastfm_scrobbler_set_online (scrobbler, FALSE);
+
+  for (i = 0; i < bench.n_tracks; i++) {
+    g_snprintf (artist, sizeof (artist), "Artist %u", i % 97);
+    g_snprintf (title, sizeof (title), "Title %u", i);
+    track = mafw_lastfm_track_new_full (artist, title, "Album",
+                                        BASE_TIMESTAMP + i, 'P',
+                                        TRACK_LENGTH, i % 12 + 1);
+
+    bench.enqueued[i] = g_timer_elapsed (bench.timer, NULL);
+    mafw_lastfm_scrobbler_enqueue_scrobble (scrobbler, track,
+                                            TRACK_POSITION);
+    mafw_lastfm_track_unref (track);
+
+    /* Let the track be cached, and the responses come in. */
+    run_pending ();
+  }
+  mafw_lastfm_scrobbler_flush_queue (scrobbler);
+  if (bench.reject_every > 0)
+    mafw_lastfm_scrobbler_set_online (scrobbler, TRUE);
+
+  if (bench.n_acked < bench.n_tracks - bench.n_rejected) {
+    timeout_id = g_timeout_add_seconds (TIMEOUT, timeout_cb, &bench);
+    g_main_loop_run (bench.loop);
+    g_source_remove (timeout_id);
+  }
+  if (bench.n_acked < bench.n_tracks - bench.n_rejected)
+    bench.last_ack = g_timer_elapsed (bench.timer, NULL);
+
+  report (&bench);
+
+  g_object_unref (scrobbler);
+  soup_server_quit (bench.server);
+  g_object_unref (bench.server);
+  g_main_loop_unref (bench.loop);
+  g_timer_destroy (bench.timer);
+
+  ok = bench.n_acked == bench.n_tracks - bench.n_rejected &&
+    mafw_lastfm_metrics_get (MAFW_LASTFM_METRIC_SCROBBLES_REJECTED) ==
+    bench.n_rejected;
+
+  /* The journal and the history are written by now, look at them as
+     the next run would. */
+  if (bench.reject_every > 0) {
+    for (i = 0; i < bench.n_tracks; i++) {
+      if (is_rejected (&bench, BASE_TIMESTAMP + i) && !bench.dropped[i]) {
+        g_print ("Track %u never refused alone\n", i);
+        bench.sequence_ok = FALSE;
+      }
+    }
+
+    left = mafw_lastfm_journal_new (journal);
+    if (left) {
+      n_pending = mafw_lastfm_journal_get_n_pending (left);
+      mafw_lastfm_journal_free (left);
+    }
+    history = mafw_lastfm_history_new (history_path);
+    if (history) {
+      n_plays = mafw_lastfm_history_get_n_plays (history);
+      mafw_lastfm_history_free (history);
+    }
+
+    g_print ("batch sequence          %s\n",
+             bench.sequence_ok ? "ok" : "wrong");
+    g_print ("journal left            %u pending\n", n_pending);
+    g_print ("history                 %u plays\n", n_plays);
+
+    ok = ok && bench.sequence_ok && n_pending == 0 &&
+      n_plays == bench.n_tracks - bench.n_rejected;
+  }
+
+  g_unlink (journal);
+  g_unlink (ack);
+  g_unlink (history_path);
+  for (i = 0; i < G_N_ELEMENTS (history_suffixes); i++) {
+    path = g_strconcat (history_path, history_suffixes[i], NULL);
+    g_unlink (path);
+    g_free (path);
+  }
+  g_free (journal);
+  g_free (ack);
+  g_free (history_path);
+  g_free (bench.enqueued);
+  g_free (bench.acked);
+  g_free (bench.dropped);
+  if (bench.first_refusals)
+    g_string_free (bench.first_refusals, TRUE);
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,270 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Replays an event log recorded by running mafw-lastfm with
+ * MAFW_LASTFM_RECORD=<file> into a scrobbler, without MAFW, and
+ * reports the CPU time, allocations and wakeups per hour of
+ * listening.
+ *
+ * The events are replayed with their recorded timing, or as fast as
+ * possible with --fast, in which case the clock of the scrobbler
+ * timeouts jumps from one event to the next. The scrobbler caches the
+ * tracks in a temporary journal, and only submits them if a server
+ * is given with --server, such as the one of bench-scrobbler.
+ *
+ * Usage: replay [--fast] [--server URL] LOG
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mafw-lastfm-scrobbler.h"
+#include "mafw-lastfm-scheduler.h"
+#include "mafw-lastfm-tracker.h"
+#include "mafw-lastfm-metrics.h"
+
+typedef struct {
+  MafwLastfmTracker *tracker;
+  MafwLastfmEventIter iter;
+  MafwLastfmEvent event;
+  GMainLoop *loop;
+  guint n_events;
+} Replay;
+
+static guint n_allocations = 0;
+static gint64 virtual_time = 0;
+
+static gpointer
+counting_malloc (gsize n_bytes)
+{
+  n_allocations++;
+  return malloc (n_bytes);
+}
+
+static gpointer
+counting_realloc (gpointer mem,
+                  gsize n_bytes)
+{
+  n_allocations++;
+  return realloc (mem, n_bytes);
+}
+
+static GMemVTable counting_vtable = {
+  counting_malloc,
+  counting_realloc,
+  free,
+  NULL,
+  NULL,
+  NULL
+};
+
+static gint64
+get_virtual_time (void)
+{
+  return virtual_time;
+}
+
+static void
+run_pending (void)
+{
+  while (g_main_context_pending (NULL))
+    g_main_context_iteration (NULL, FALSE);
+}
+
+static void
+replay_fast (Replay *replay)
+{
+  gint64 start = virtual_time;
+
+  while (mafw_lastfm_event_iter_next (&replay->iter, &replay->event)) {
+    /* Let the timeouts due before the event run first. */
+    virtual_time = start + replay->event.time;
+    run_pending ();
+
+    mafw_lastfm_tracker_feed (replay->tracker, &replay->event);
+    replay->n_events++;
+    run_pending ();
+  }
+
+  /* And the ones still pending after the last event, such as the
+     caching of the last track. */
+  virtual_time += 3600 * 1000;
+  run_pending ();
+}
+
+static gboolean
+replay_next_cb (gpointer user_data)
+{
+  Replay *replay = user_data;
+  gint64 time;
+
+  mafw_lastfm_tracker_feed (replay->tracker, &replay->event);
+  replay->n_events++;
+
+  time = replay->event.time;
+  if (!mafw_lastfm_event_iter_next (&replay->iter, &replay->event)) {
+    g_main_loop_quit (replay->loop);
+    return FALSE;
+  }
+
+  g_timeout_add (replay->event.time - time, replay_next_cb, replay);
+
+  return FALSE;
+}
+
+static void
+replay_real_time (Replay *replay)
+{
+  if (!mafw_lastfm_event_iter_next (&replay->iter, &replay->event))
+    return;
+
+  replay->loop = g_main_loop_new (NULL, FALSE);
+  g_timeout_add (0, replay_next_cb, replay);
+  g_main_loop_run (replay->loop);
+  g_main_loop_unref (replay->loop);
+}
+
+static void
+usage (void)
+{
+  g_printerr ("Usage: replay [--fast] [--server URL] LOG\n");
+  exit (2);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  Replay replay = { 0 };
+  MafwLastfmScrobbler *scrobbler;
+  MafwLastfmEvent event;
+  GError *error = NULL;
+  gboolean fast = FALSE;
+  const gchar *server = NULL;
+  const gchar *path = NULL;
+  gchar *contents;
+  gsize length;
+  gchar *journal, *ack;
+  gdouble hours;
+  gint64 duration = 0;
+  clock_t cpu;
+  guint allocations;
+  gint i;
+
+  g_mem_set_vtable (&counting_vtable);
+  g_type_init ();
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp (argv[i], "--fast") == 0)
+      fast = TRUE;
+    else if (strcmp (argv[i], "--server") == 0 && i + 1 < argc)
+      server = argv[++i];
+    else if (argv[i][0] != '-' && !path)
+      path = argv[i];
+    else
+      usage ();
+  }
+  if (!path)
+    usage ();
+
+  if (!g_file_get_contents (path, &contents, &length, &error)) {
+    g_printerr ("Couldn't read %s: %s\n", path, error->message);
+    g_error_free (error);
+    return 1;
+  }
+
+  /* The last event gives the length of the session. */
+  mafw_lastfm_event_iter_init (&replay.iter, contents, length);
+  while (mafw_lastfm_event_iter_next (&replay.iter, &event))
+    duration = event.time;
+  hours = duration / 3600000.0;
+
+  if (fast) {
+    virtual_time = mafw_lastfm_scheduler_get_real_time ();
+    mafw_lastfm_scheduler_set_time_func (get_virtual_time);
+  }
+
+  journal = g_strdup_printf ("%s/mafw-lastfm-replay-%d.journal",
+                             g_get_tmp_dir (), (gint) getpid ());
+  ack = g_strconcat (journal, ".ack", NULL);
+
+  scrobbler = mafw_lastfm_scrobbler_new_with_journal (journal);
+  if (server) {
+    mafw_lastfm_scrobbler_set_handshake_url (scrobbler, server);
+    mafw_lastfm_scrobbler_set_credentials (scrobbler, "replay",
+                                           "0123456789abcdef0123456789abcdef");
+    mafw_lastfm_scrobbler_handshake (scrobbler);
+  }
+  replay.tracker = mafw_lastfm_tracker_new (scrobbler);
+
+  mafw_lastfm_event_iter_init (&replay.iter, contents, length);
+  allocations = n_allocations;
+  cpu = clock ();
+
+  if (fast)
+    replay_fast (&replay);
+  else
+    replay_real_time (&replay);
+
+  cpu = clock () - cpu;
+  allocations = n_allocations - allocations;
+
+  g_print ("events                  %u\n", replay.n_events);
+  g_print ("listening time          %.2f h\n", hours);
+  g_print ("cpu time                %.3f s\n", (gdouble) cpu / CLOCKS_PER_SEC);
+  g_print ("allocations             %u\n", allocations);
+  g_print ("wakeups                 %u (%u avoided)\n",
+           mafw_lastfm_scrobbler_get_wakeups (scrobbler),
+           mafw_lastfm_scrobbler_get_wakeups_avoided (scrobbler));
+  g_print ("metadata cache          %u hits, %u misses\n",
+           mafw_lastfm_metrics_get (MAFW_LASTFM_METRIC_METADATA_CACHE_HITS),
+           mafw_lastfm_metrics_get (MAFW_LASTFM_METRIC_METADATA_CACHE_MISSES));
+  g_print ("position cache          %u hits, %u misses\n",
+           mafw_lastfm_metrics_get (MAFW_LASTFM_METRIC_POSITION_CACHE_HITS),
+           mafw_lastfm_metrics_get (MAFW_LASTFM_METRIC_POSITION_CACHE_MISSES));
+  g_print ("duplicates dropped      %u\n",
+           mafw_lastfm_metrics_get (MAFW_LASTFM_METRIC_DUPLICATES_DROPPED));
+  if (hours > 0) {
+    g_print ("per hour of listening   %.3f s cpu, %.0f allocations, "
+             "%.1f wakeups\n",
+             (gdouble) cpu / CLOCKS_PER_SEC / hours,
+             allocations / hours,
+             mafw_lastfm_scrobbler_get_wakeups (scrobbler) / hours);
+  }
+
+  mafw_lastfm_tracker_free (replay.tracker);
+  g_object_unref (scrobbler);
+  mafw_lastfm_scheduler_set_time_func (NULL);
+
+  g_unlink (journal);
+  g_unlink (ack);
+  g_free (journal);
+  g_free (ack);
+  g_free (contents);
+
+  return 0;
+}
@@ -58,7 +58,9 @@ save_credentials (const gchar *file,
 	gchar *md5passwd;
 	GKeyFile *keyfile;
 
+	/* Keep the other endpoints configured in the file. */
 	keyfile = g_key_file_new ();
+	g_key_file_load_from_file (keyfile, file, G_KEY_FILE_KEEP_COMMENTS, NULL);
 	md5passwd = g_compute_checksum_for_string (G_CHECKSUM_MD5,
 						   password, -1);
 
@@ -0,0 +1,217 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The Audioscrobbler 1.2.1 protocol: a handshake authenticated with
+ * the md5sum of the password and the current time, which returns a
+ * session id and the urls for the now-playing and submission
+ * requests, and plain text responses.
+ */
+
+#include <glib.h>
+#include <libsoup/soup.h>
+#include <string.h>
+
+#include "mafw-lastfm-protocol.h"
+#include "mafw-lastfm-body.h"
+
+#define CLIENT_ID "maf"
+#define CLIENT_VERSION "0.0.1"
+#define HANDSHAKE_URL "http://post.audioscrobbler.com/"
+
+/**
+ * get_auth_string:
+ * @md5password: the md5sum of the password to build the authorization string from
+ * @timestamp: a pointer to store the used timestamp.
+ *
+ * Builds an authorization string based on the password
+ * and the current epoch time. The Last.fm authorization string
+ * is of the form md5 (md5 (password) + @timestamp).
+ *
+ * Returns: a newly allocated string with the authorization md5sum,
+ * to be used together with @timestamp.
+ **/
+static gchar *
+get_auth_string (const gchar *md5passwd,
+                 glong *timestamp)
+{
+  GTimeVal time_val;
+  gchar *auth;
+  gchar *md5;
+
+  g_return_val_if_fail (timestamp, NULL);
+
+  g_get_current_time (&time_val);
+
+  auth = g_strdup_printf ("%s%li", md5passwd, time_val.tv_sec);
+
+  *timestamp = time_val.tv_sec;
+
+  md5 = g_compute_checksum_for_string (G_CHECKSUM_MD5, auth, -1);
+  g_free (auth);
+
+  return md5;
+}
+
+static SoupMessage *
+as12_new_handshake (const MafwLastfmAccount *account)
+{
+  gchar *auth;
+  glong timestamp;
+  gchar *handshake_url;
+  SoupMessage *message;
+
+  auth = get_auth_string (account->md5password, &timestamp);
+
+  handshake_url = g_strdup_printf ("%s?hs=true&p=1.2.1&c=%s&v=%s&u=%s&t=%li&a=%s",
+                                   account->url,
+                                   CLIENT_ID, CLIENT_VERSION,
+                                   account->username,
+                                   timestamp,
+                                   auth);
+
+  message = soup_message_new ("GET", handshake_url);
+  g_free (handshake_url);
+  g_free (auth);
+
+  return message;
+}
+
+static MafwLastfmHandshakeResponse
+as12_parse_handshake (SoupMessage *message,
+                      MafwLastfmAccount *account)
+{
+  gchar **response;
+  MafwLastfmHandshakeResponse retval;
+
+  if (!SOUP_STATUS_IS_SUCCESSFUL (message->status_code) ||
+      !message->response_body->data)
+    return MAFW_LASTFM_HANDSHAKE_FAILED;
+
+  response = g_strsplit (message->response_body->data, "\n", 5);
+
+  if (g_str_has_prefix (response [0], "OK") &&
+      response[1] && response[2] && response[3]) {
+    g_free (account->session_id);
+    g_free (account->np_url);
+    g_free (account->sub_url);
+
+    account->session_id = response[1];
+    account->np_url = response[2];
+    account->sub_url = response[3];
+
+    /* We take ownership on the relevant parsed data, free the
+       array and response code. */
+    g_free (response[0]);
+    g_free (response[4]);
+    g_free (response);
+
+    retval = MAFW_LASTFM_HANDSHAKE_OK;
+  } else if (g_str_has_prefix (response [0], "BADTIME")) {
+    retval = MAFW_LASTFM_HANDSHAKE_BADTIME;
+  } else {
+    retval = MAFW_LASTFM_HANDSHAKE_FAILED;
+  }
+
+  if (retval != MAFW_LASTFM_HANDSHAKE_OK) {
+    g_warning ("Couldn't handshake: %s", response[0]);
+    g_strfreev (response);
+  }
+
+  return retval;
+}
+
+static void
+as12_append (MafwLastfmPayload *payload,
+             MafwLastfmTrack *track,
+             gboolean encoded)
+{
+  if (payload->request == MAFW_LASTFM_REQUEST_NOW_PLAYING)
+    mafw_lastfm_body_append_now_playing (payload->data, track);
+  else
+    mafw_lastfm_body_append_submission (payload->data, payload->n_tracks,
+                                        track, encoded);
+}
+
+static SoupMessage *
+as12_new_request (const MafwLastfmAccount *account,
+                  MafwLastfmPayload *payload)
+{
+  const gchar *url;
+
+  url = payload->request == MAFW_LASTFM_REQUEST_NOW_PLAYING ?
+    account->np_url : account->sub_url;
+
+  /* Only the session id is ours, the tracks follow. */
+  return mafw_lastfm_protocol_new_post (url,
+                                        "application/x-www-form-urlencoded",
+                                        mafw_lastfm_body_new (account->session_id, 0),
+                                        payload);
+}
+
+/**
+ * as12_parse_response:
+ * @message: a finished now-playing or submission request
+ *
+ * Returns: the outcome of @message. FAILED responses, and the ones
+ * that can't be understood, are hard failures.
+ **/
+static MafwLastfmResponse
+as12_parse_response (SoupMessage *message)
+{
+  MafwLastfmResponse response;
+  const gchar *data;
+
+  response = mafw_lastfm_protocol_check_status (message);
+  if (response != MAFW_LASTFM_RESPONSE_OK)
+    return response;
+
+  if (!SOUP_STATUS_IS_SUCCESSFUL (message->status_code)) {
+    g_warning ("Request failed: %u %s", message->status_code,
+               message->reason_phrase);
+    return MAFW_LASTFM_RESPONSE_HTTP_ERROR;
+  }
+
+  data = message->response_body->data;
+  if (!data)
+    data = "";
+
+  if (g_str_has_prefix (data, "OK"))
+    return MAFW_LASTFM_RESPONSE_OK;
+  if (g_str_has_prefix (data, "BADSESSION"))
+    return MAFW_LASTFM_RESPONSE_BADSESSION;
+
+  g_warning ("Request failed: %.*s", (gint) strcspn (data, "\n"), data);
+
+  return MAFW_LASTFM_RESPONSE_FAILED;
+}
+
+const MafwLastfmProtocol mafw_lastfm_protocol_as12 = {
+  "1.2.1",
+  HANDSHAKE_URL,
+  TRUE,
+  as12_new_handshake,
+  as12_parse_handshake,
+  NULL,
+  as12_append,
+  NULL,
+  as12_new_request,
+  as12_parse_response
+};
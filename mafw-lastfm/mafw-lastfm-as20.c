@@ -0,0 +1,418 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The Audioscrobbler 2.0 web services: track.updateNowPlaying and
+ * track.scrobble, with up to 50 tracks per call. The handshake
+ * (auth.getMobileSession) returns a session key that doesn't expire,
+ * so once saved it is only done again if the server revokes it.
+ *
+ * Every call is signed with the md5sum of its fields, sorted by name,
+ * and the secret of the API account. The fields of the tracks are
+ * sorted once per payload; the api key and the session key of each
+ * endpoint are merged into them while hashing.
+ */
+
+#include <glib.h>
+#include <libsoup/soup.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mafw-lastfm-protocol.h"
+#include "mafw-lastfm-body.h"
+
+#define API_URL "http://ws.audioscrobbler.com/2.0/"
+
+/* Error codes of the web services. */
+#define AS20_ERROR_INVALID_PARAMETERS 6
+#define AS20_ERROR_INVALID_RESOURCE 7
+#define AS20_ERROR_INVALID_SESSION 9
+#define AS20_ERROR_SERVICE_OFFLINE 11
+#define AS20_ERROR_UNAVAILABLE 16
+#define AS20_ERROR_RATE_LIMIT 29
+
+/**
+ * as20_sign:
+ * @params: fields of a payload sorted by name, or %NULL
+ * @extra: %NULL-terminated pairs of names and values of other fields,
+ * sorted by name
+ * @secret: the secret of the API account
+ *
+ * Returns: the signature of the fields, the md5sum of their names and
+ * values one after the other in order, followed by @secret.
+ **/
+static gchar *
+as20_sign (GPtrArray *params,
+           const gchar * const *extra,
+           const gchar *secret)
+{
+  GChecksum *checksum;
+  const gchar *param;
+  const gchar *name, *value;
+  gchar *signature;
+  guint i = 0;
+
+  checksum = g_checksum_new (G_CHECKSUM_MD5);
+
+  for (;;) {
+    param = params && i < params->len ? g_ptr_array_index (params, i) : NULL;
+    if (param && (!*extra || strcmp (param, *extra) < 0)) {
+      name = param;
+      value = param + strlen (param) + 1;
+      i++;
+    } else if (*extra) {
+      name = extra[0];
+      value = extra[1];
+      extra += 2;
+    } else {
+      break;
+    }
+
+    g_checksum_update (checksum, (const guchar *) name, -1);
+    g_checksum_update (checksum, (const guchar *) value, -1);
+  }
+  g_checksum_update (checksum, (const guchar *) secret, -1);
+
+  signature = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+
+  return signature;
+}
+
+/* Appends "&name=value", or "name=value" to an empty @body. */
+static void
+append_field (GString *body,
+              const gchar *name,
+              const gchar *value)
+{
+  if (body->len > 0)
+    g_string_append_c (body, '&');
+  g_string_append (body, name);
+  g_string_append_c (body, '=');
+  mafw_lastfm_body_append_encoded (body, value);
+}
+
+/**
+ * as20_get_error:
+ * @message: a request that got a response
+ *
+ * Returns: 0 if the response says the call succeeded, the error code
+ * it gives otherwise, or -1 if it can't be understood.
+ **/
+static gint
+as20_get_error (SoupMessage *message)
+{
+  const gchar *data;
+  const gchar *lfm, *end, *status, *error;
+
+  data = message->response_body->data;
+  if (!data || !(lfm = strstr (data, "<lfm")))
+    return -1;
+
+  end = strchr (lfm, '>');
+  status = strstr (lfm, "status=\"ok\"");
+  if (end && status && status < end)
+    return 0;
+
+  error = strstr (lfm, "<error code=\"");
+  if (!error)
+    return -1;
+
+  return atoi (error + strlen ("<error code=\""));
+}
+
+/* Warns about the message of a failed response, if any. */
+static void
+as20_warn (SoupMessage *message,
+           gint code)
+{
+  const gchar *data;
+  const gchar *text;
+
+  data = message->response_body->data;
+  text = data ? strstr (data, "<error code=\"") : NULL;
+  if (text)
+    text = strchr (text, '>');
+
+  if (text)
+    g_warning ("Request failed: %d %.*s", code,
+               (gint) strcspn (text + 1, "<"), text + 1);
+  else
+    g_warning ("Request failed: %u %s", message->status_code,
+               message->reason_phrase);
+}
+
+static SoupMessage *
+as20_new_handshake (const MafwLastfmAccount *account)
+{
+  SoupMessage *message;
+  GString *body;
+  gchar *data;
+  gchar *token;
+  gchar *signature;
+  gsize length;
+
+  if (!account->api_key || !account->api_secret) {
+    g_warning ("An api key and secret are needed for the 2.0 protocol");
+    return NULL;
+  }
+
+  /* The same token as the md5sum of the password would give with
+     the password itself, which isn't kept. */
+  data = g_strconcat (account->username, account->md5password, NULL);
+  token = g_compute_checksum_for_string (G_CHECKSUM_MD5, data, -1);
+  g_free (data);
+
+  {
+    const gchar * const fields[] = {
+      "api_key", account->api_key,
+      "authToken", token,
+      "method", "auth.getMobileSession",
+      "username", account->username,
+      NULL
+    };
+    gint i;
+
+    signature = as20_sign (NULL, fields, account->api_secret);
+
+    body = g_string_sized_new (256);
+    for (i = 0; fields[i]; i += 2)
+      append_field (body, fields[i], fields[i + 1]);
+    append_field (body, "api_sig", signature);
+  }
+
+  message = soup_message_new ("POST", account->url);
+  if (message) {
+    length = body->len;
+    soup_message_set_request (message, "application/x-www-form-urlencoded",
+                              SOUP_MEMORY_TAKE,
+                              g_string_free (body, FALSE), length);
+  } else {
+    g_string_free (body, TRUE);
+  }
+
+  g_free (signature);
+  g_free (token);
+
+  return message;
+}
+
+static MafwLastfmHandshakeResponse
+as20_parse_handshake (SoupMessage *message,
+                      MafwLastfmAccount *account)
+{
+  const gchar *key, *end;
+  gint error;
+
+  if (mafw_lastfm_protocol_check_status (message) != MAFW_LASTFM_RESPONSE_OK)
+    return MAFW_LASTFM_HANDSHAKE_FAILED;
+
+  error = as20_get_error (message);
+  key = error == 0 ? strstr (message->response_body->data, "<key>") : NULL;
+  end = key ? strstr (key, "</key>") : NULL;
+
+  if (!end) {
+    g_warning ("Couldn't get a session key");
+    as20_warn (message, error);
+    return MAFW_LASTFM_HANDSHAKE_FAILED;
+  }
+
+  key += strlen ("<key>");
+
+  g_free (account->session_id);
+  g_free (account->np_url);
+  g_free (account->sub_url);
+  account->session_id = g_strndup (key, end - key);
+  /* Every call goes to the same place. */
+  account->np_url = g_strdup (account->url);
+  account->sub_url = g_strdup (account->url);
+
+  return MAFW_LASTFM_HANDSHAKE_OK;
+}
+
+/**
+ * add_field:
+ * @payload: an unfinished #MafwLastfmPayload
+ * @name: the name of the field
+ * @index: the position of the track in a scrobble, or -1
+ * @value: the value of the field, unencoded
+ *
+ * Appends "&name[index]=value" to @payload, and keeps it to be signed.
+ **/
+static void
+add_field (MafwLastfmPayload *payload,
+           const gchar *name,
+           gint index,
+           const gchar *value)
+{
+  gchar key[32];
+
+  if (index >= 0)
+    g_snprintf (key, sizeof (key), "%s[%d]", name, index);
+  else
+    g_strlcpy (key, name, sizeof (key));
+
+  g_string_append_c (payload->data, '&');
+  g_string_append (payload->data, key);
+  g_string_append_c (payload->data, '=');
+  mafw_lastfm_body_append_encoded (payload->data, value);
+
+  mafw_lastfm_payload_add_param (payload, key, value);
+}
+
+static void
+add_int_field (MafwLastfmPayload *payload,
+               const gchar *name,
+               gint index,
+               gint64 value)
+{
+  gchar buffer[24];
+
+  g_snprintf (buffer, sizeof (buffer), "%" G_GINT64_FORMAT, value);
+  add_field (payload, name, index, buffer);
+}
+
+static void
+as20_begin (MafwLastfmPayload *payload)
+{
+  add_field (payload, "method", -1,
+             payload->request == MAFW_LASTFM_REQUEST_NOW_PLAYING ?
+             "track.updateNowPlaying" : "track.scrobble");
+}
+
+static void
+as20_append (MafwLastfmPayload *payload,
+             MafwLastfmTrack *track,
+             gboolean encoded)
+{
+  gint index;
+
+  index = payload->request == MAFW_LASTFM_REQUEST_NOW_PLAYING ?
+    -1 : (gint) payload->n_tracks;
+
+  add_field (payload, "artist", index, track->artist);
+  add_field (payload, "track", index, track->title);
+  if (track->album && *track->album)
+    add_field (payload, "album", index, track->album);
+  if (track->number > 0)
+    add_int_field (payload, "trackNumber", index, track->number);
+  if (track->length > 0)
+    add_int_field (payload, "duration", index, track->length);
+
+  if (index < 0)
+    return;
+
+  add_int_field (payload, "timestamp", index, track->timestamp);
+  /* Chosen by the user unless told otherwise. */
+  if (track->source != 'P')
+    add_field (payload, "chosenByUser", index, "0");
+}
+
+static SoupMessage *
+as20_new_request (const MafwLastfmAccount *account,
+                  MafwLastfmPayload *payload)
+{
+  GString *prefix;
+  gchar *signature;
+  const gchar * const fields[] = {
+    "api_key", account->api_key,
+    "sk", account->session_id,
+    NULL
+  };
+
+  g_return_val_if_fail (account->api_key && account->api_secret, NULL);
+
+  signature = as20_sign (payload->params, fields, account->api_secret);
+
+  /* The fields of the payload start with '&'. */
+  prefix = g_string_sized_new (128);
+  append_field (prefix, "api_key", account->api_key);
+  append_field (prefix, "sk", account->session_id);
+  append_field (prefix, "api_sig", signature);
+  g_free (signature);
+
+  return mafw_lastfm_protocol_new_post (account->sub_url,
+                                        "application/x-www-form-urlencoded",
+                                        prefix, payload);
+}
+
+/**
+ * as20_parse_response:
+ * @message: a finished now-playing or submission request
+ *
+ * Returns: the outcome of @message. Errors reported as temporary by
+ * the server are retried as HTTP errors, with the longer backoff.
+ * Scrobbles the server ignores are acknowledged nonetheless, they
+ * would be ignored again, and the ones with parameters it refuses are
+ * rejected. The other errors, about the account or the api key, are
+ * hard failures until fixed.
+ **/
+static MafwLastfmResponse
+as20_parse_response (SoupMessage *message)
+{
+  MafwLastfmResponse response;
+  gint error;
+
+  response = mafw_lastfm_protocol_check_status (message);
+  if (response != MAFW_LASTFM_RESPONSE_OK)
+    return response;
+
+  /* Failed calls come with an error status and body. */
+  error = as20_get_error (message);
+  switch (error) {
+  case 0:
+    return MAFW_LASTFM_RESPONSE_OK;
+  case AS20_ERROR_INVALID_SESSION:
+    return MAFW_LASTFM_RESPONSE_BADSESSION;
+  case AS20_ERROR_INVALID_PARAMETERS:
+  case AS20_ERROR_INVALID_RESOURCE:
+    response = MAFW_LASTFM_RESPONSE_REJECTED;
+    break;
+  case AS20_ERROR_SERVICE_OFFLINE:
+  case AS20_ERROR_UNAVAILABLE:
+  case AS20_ERROR_RATE_LIMIT:
+    response = MAFW_LASTFM_RESPONSE_HTTP_ERROR;
+    break;
+  case -1:
+    response = SOUP_STATUS_IS_SUCCESSFUL (message->status_code) ?
+      MAFW_LASTFM_RESPONSE_FAILED : MAFW_LASTFM_RESPONSE_HTTP_ERROR;
+    break;
+  default:
+    response = MAFW_LASTFM_RESPONSE_FAILED;
+    break;
+  }
+
+  as20_warn (message, error);
+
+  return response;
+}
+
+const MafwLastfmProtocol mafw_lastfm_protocol_as20 = {
+  "2.0",
+  API_URL,
+  FALSE,
+  as20_new_handshake,
+  as20_parse_handshake,
+  as20_begin,
+  as20_append,
+  NULL,
+  as20_new_request,
+  as20_parse_response
+};
@@ -0,0 +1,152 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Exponential backoff with jitter, and a circuit breaker on top of
+ * it. Delays are in milliseconds, to be passed to the scheduler.
+ *
+ * The jitter draws each delay between half and all of its base, so
+ * that clients failing at the same time, such as after an outage of
+ * the server, don't retry in lockstep.
+ *
+ * The breaker opens after a number of consecutive failures, for a
+ * cooldown that grows like a backoff while the server keeps failing.
+ * Once the cooldown is over, the owner half-opens it to let a single
+ * request probe the server: a success closes it, a failure opens it
+ * again.
+ */
+
+#include <glib.h>
+
+#include "mafw-lastfm-backoff.h"
+
+void
+mafw_lastfm_backoff_init (MafwLastfmBackoff *backoff,
+                          guint initial,
+                          guint max)
+{
+  g_return_if_fail (initial > 0 && initial <= max);
+
+  backoff->initial = initial;
+  backoff->max = max;
+  backoff->current = 0;
+}
+
+/**
+ * mafw_lastfm_backoff_next:
+ * @backoff: a #MafwLastfmBackoff
+ *
+ * Accounts for a failure.
+ *
+ * Returns: how long to wait before trying again, in milliseconds.
+ * The base of the delay doubles on every call, up to the maximum.
+ **/
+guint
+mafw_lastfm_backoff_next (MafwLastfmBackoff *backoff)
+{
+  guint half;
+
+  if (backoff->current == 0)
+    backoff->current = backoff->initial;
+  else
+    backoff->current = MIN (backoff->max, backoff->current * 2);
+
+  half = backoff->current / 2;
+
+  return half + g_random_int_range (0, backoff->current - half + 1);
+}
+
+void
+mafw_lastfm_backoff_reset (MafwLastfmBackoff *backoff)
+{
+  backoff->current = 0;
+}
+
+/**
+ * mafw_lastfm_breaker_init:
+ * @breaker: a #MafwLastfmBreaker
+ * @threshold: the consecutive failures that open the breaker
+ * @cooldown: how long it stays open the first time, in milliseconds
+ * @max_cooldown: how long it stays open at most
+ **/
+void
+mafw_lastfm_breaker_init (MafwLastfmBreaker *breaker,
+                          guint threshold,
+                          guint cooldown,
+                          guint max_cooldown)
+{
+  breaker->state = MAFW_LASTFM_BREAKER_CLOSED;
+  breaker->failures = 0;
+  breaker->threshold = threshold;
+  mafw_lastfm_backoff_init (&breaker->cooldown, cooldown, max_cooldown);
+}
+
+/**
+ * mafw_lastfm_breaker_allows:
+ * @breaker: a #MafwLastfmBreaker
+ *
+ * Returns: whether requests may be sent, which is only one at a time
+ * while half-open.
+ **/
+gboolean
+mafw_lastfm_breaker_allows (MafwLastfmBreaker *breaker)
+{
+  return breaker->state != MAFW_LASTFM_BREAKER_OPEN;
+}
+
+/**
+ * mafw_lastfm_breaker_failure:
+ * @breaker: a #MafwLastfmBreaker
+ *
+ * Accounts for a failed request.
+ *
+ * Returns: 0, or the cooldown in milliseconds if the breaker opened,
+ * after which mafw_lastfm_breaker_half_open() should be called.
+ **/
+guint
+mafw_lastfm_breaker_failure (MafwLastfmBreaker *breaker)
+{
+  if (breaker->state == MAFW_LASTFM_BREAKER_OPEN)
+    return 0;
+
+  breaker->failures++;
+  if (breaker->state == MAFW_LASTFM_BREAKER_CLOSED &&
+      breaker->failures < breaker->threshold)
+    return 0;
+
+  breaker->state = MAFW_LASTFM_BREAKER_OPEN;
+
+  return mafw_lastfm_backoff_next (&breaker->cooldown);
+}
+
+void
+mafw_lastfm_breaker_success (MafwLastfmBreaker *breaker)
+{
+  breaker->state = MAFW_LASTFM_BREAKER_CLOSED;
+  breaker->failures = 0;
+  mafw_lastfm_backoff_reset (&breaker->cooldown);
+}
+
+void
+mafw_lastfm_breaker_half_open (MafwLastfmBreaker *breaker)
+{
+  if (breaker->state == MAFW_LASTFM_BREAKER_OPEN)
+    breaker->state = MAFW_LASTFM_BREAKER_HALF_OPEN;
+}
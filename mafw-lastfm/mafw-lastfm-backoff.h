@@ -0,0 +1,79 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef MAFW_LASTFM_BACKOFF_H
+#define MAFW_LASTFM_BACKOFF_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct {
+  guint initial;
+  guint max;
+  /* The base of the next delay, 0 until the first failure. */
+  guint current;
+} MafwLastfmBackoff;
+
+typedef enum {
+  MAFW_LASTFM_BREAKER_CLOSED,
+  MAFW_LASTFM_BREAKER_OPEN,
+  MAFW_LASTFM_BREAKER_HALF_OPEN
+} MafwLastfmBreakerState;
+
+typedef struct {
+  MafwLastfmBreakerState state;
+  guint failures;
+  guint threshold;
+  MafwLastfmBackoff cooldown;
+} MafwLastfmBreaker;
+
+void
+mafw_lastfm_backoff_init (MafwLastfmBackoff *backoff,
+                          guint initial,
+                          guint max);
+
+guint
+mafw_lastfm_backoff_next (MafwLastfmBackoff *backoff);
+
+void
+mafw_lastfm_backoff_reset (MafwLastfmBackoff *backoff);
+
+void
+mafw_lastfm_breaker_init (MafwLastfmBreaker *breaker,
+                          guint threshold,
+                          guint cooldown,
+                          guint max_cooldown);
+
+gboolean
+mafw_lastfm_breaker_allows (MafwLastfmBreaker *breaker);
+
+guint
+mafw_lastfm_breaker_failure (MafwLastfmBreaker *breaker);
+
+void
+mafw_lastfm_breaker_success (MafwLastfmBreaker *breaker);
+
+void
+mafw_lastfm_breaker_half_open (MafwLastfmBreaker *breaker);
+
+G_END_DECLS
+
+#endif /* MAFW_LASTFM_BACKOFF_H */
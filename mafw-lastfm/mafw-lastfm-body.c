@@ -0,0 +1,248 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Builders for the application/x-www-form-urlencoded bodies of the
+ * submission and now-playing requests. The whole body is written into
+ * a single GString, sized up front, that can be handed over to
+ * libsoup as is. Nothing is allocated per track or per field.
+ *
+ * Tracks are kept unencoded until they get here, the strings are
+ * encoded as they are appended, with the same output as
+ * soup_uri_encode (value, "&+").
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "mafw-lastfm-body.h"
+
+/* Length of the keys and separators of a submission entry with a
+   two-digit index, plus room for the numeric values. */
+#define SUBMISSION_OVERHEAD 96
+
+/* Characters that are left as they are by the encoder: the unreserved
+   ones and the sub-delimiters, but '&' and '+'. */
+static const guint8 safe_chars[256] = {
+  /* 0x20 - 0x2f:  !"#$%&'()*+,-./ */
+  [0x21] = 1, [0x24] = 1, [0x27] = 1, [0x28] = 1, [0x29] = 1,
+  [0x2a] = 1, [0x2c] = 1, [0x2d] = 1, [0x2e] = 1,
+  /* 0x30 - 0x3f: 0123456789:;<=>? */
+  [0x30] = 1, [0x31] = 1, [0x32] = 1, [0x33] = 1, [0x34] = 1,
+  [0x35] = 1, [0x36] = 1, [0x37] = 1, [0x38] = 1, [0x39] = 1,
+  [0x3b] = 1, [0x3d] = 1,
+  /* 0x40 - 0x5f: @A-Z[\]^_ */
+  [0x41] = 1, [0x42] = 1, [0x43] = 1, [0x44] = 1, [0x45] = 1,
+  [0x46] = 1, [0x47] = 1, [0x48] = 1, [0x49] = 1, [0x4a] = 1,
+  [0x4b] = 1, [0x4c] = 1, [0x4d] = 1, [0x4e] = 1, [0x4f] = 1,
+  [0x50] = 1, [0x51] = 1, [0x52] = 1, [0x53] = 1, [0x54] = 1,
+  [0x55] = 1, [0x56] = 1, [0x57] = 1, [0x58] = 1, [0x59] = 1,
+  [0x5a] = 1, [0x5f] = 1,
+  /* 0x60 - 0x7f: `a-z{|}~ */
+  [0x61] = 1, [0x62] = 1, [0x63] = 1, [0x64] = 1, [0x65] = 1,
+  [0x66] = 1, [0x67] = 1, [0x68] = 1, [0x69] = 1, [0x6a] = 1,
+  [0x6b] = 1, [0x6c] = 1, [0x6d] = 1, [0x6e] = 1, [0x6f] = 1,
+  [0x70] = 1, [0x71] = 1, [0x72] = 1, [0x73] = 1, [0x74] = 1,
+  [0x75] = 1, [0x76] = 1, [0x77] = 1, [0x78] = 1, [0x79] = 1,
+  [0x7a] = 1, [0x7e] = 1
+};
+
+static void
+append_int (GString *body,
+            gint64 value)
+{
+  gchar buffer[24];
+  gchar *p = buffer + sizeof (buffer);
+  guint64 v = value < 0 ? -(guint64) value : (guint64) value;
+
+  do {
+    *--p = '0' + v % 10;
+    v /= 10;
+  } while (v);
+
+  if (value < 0)
+    *--p = '-';
+
+  g_string_append_len (body, p, buffer + sizeof (buffer) - p);
+}
+
+/* Appends "&key[index]=" */
+static void
+append_key (GString *body,
+            gchar key,
+            guint index)
+{
+  g_string_append_c (body, '&');
+  g_string_append_c (body, key);
+  g_string_append_c (body, '[');
+  append_int (body, index);
+  g_string_append_len (body, "]=", 2);
+}
+
+static void
+append_string (GString *body,
+               const gchar *value)
+{
+  if (value)
+    g_string_append (body, value);
+}
+
+/**
+ * mafw_lastfm_body_new:
+ * @session_id: the session id returned by the handshake
+ * @size_hint: the expected size of the body, without the session id
+ *
+ * Creates the buffer for a new request body, starting with the
+ * session id.
+ *
+ * Returns: a new #GString. Its contents can be passed to libsoup with
+ * %SOUP_MEMORY_TAKE after freeing it with g_string_free (body, FALSE).
+ **/
+GString *
+mafw_lastfm_body_new (const gchar *session_id,
+                      gsize size_hint)
+{
+  GString *body;
+
+  body = g_string_sized_new (2 + (session_id ? strlen (session_id) : 0) +
+                             size_hint);
+  g_string_append_len (body, "s=", 2);
+  append_string (body, session_id);
+
+  return body;
+}
+
+/**
+ * mafw_lastfm_body_estimate_size:
+ * @track: a #MafwLastfmTrack
+ *
+ * Returns: an upper bound of the number of bytes that @track takes
+ * in a request body, once encoded.
+ **/
+gsize
+mafw_lastfm_body_estimate_size (MafwLastfmTrack *track)
+{
+  return SUBMISSION_OVERHEAD + 3 *
+    ((track->artist ? strlen (track->artist) : 0) +
+     (track->title ? strlen (track->title) : 0) +
+     (track->album ? strlen (track->album) : 0));
+}
+
+/**
+ * mafw_lastfm_body_append_encoded:
+ * @body: a #GString
+ * @value: a nul-terminated string, or %NULL
+ *
+ * Appends @value to @body encoded for a form body, as
+ * soup_uri_encode (@value, "&+") would do it. Runs of characters that
+ * need no escaping are appended in one go.
+ **/
+void
+mafw_lastfm_body_append_encoded (GString *body,
+                                 const gchar *value)
+{
+  static const gchar hex[] = "0123456789ABCDEF";
+  const guchar *p = (const guchar *) value;
+  const guchar *start;
+  gchar escape[3];
+
+  if (!value)
+    return;
+
+  escape[0] = '%';
+  while (*p) {
+    start = p;
+    while (safe_chars[*p])
+      p++;
+    if (p > start)
+      g_string_append_len (body, (const gchar *) start, p - start);
+
+    while (*p && !safe_chars[*p]) {
+      escape[1] = hex[*p >> 4];
+      escape[2] = hex[*p & 0xf];
+      g_string_append_len (body, escape, 3);
+      p++;
+    }
+  }
+}
+
+/**
+ * mafw_lastfm_body_append_submission:
+ * @body: a body created with mafw_lastfm_body_new()
+ * @index: the position of @track in the submission
+ * @track: the track to submit
+ * @encoded: whether the strings of @track are already encoded
+ *
+ * Appends the fields of @track for a submission request. @encoded is
+ * only set for the tracks queued by older versions.
+ **/
+void
+mafw_lastfm_body_append_submission (GString *body,
+                                    guint index,
+                                    MafwLastfmTrack *track,
+                                    gboolean encoded)
+{
+  void (*append) (GString *, const gchar *);
+
+  append = encoded ? append_string : mafw_lastfm_body_append_encoded;
+
+  append_key (body, 'a', index);
+  append (body, track->artist);
+  append_key (body, 't', index);
+  append (body, track->title);
+  append_key (body, 'i', index);
+  append_int (body, track->timestamp);
+  append_key (body, 'o', index);
+  g_string_append_c (body, track->source);
+  /* ratio skipped */
+  append_key (body, 'r', index);
+  append_key (body, 'l', index);
+  append_int (body, track->length);
+  append_key (body, 'b', index);
+  append (body, track->album);
+  append_key (body, 'n', index);
+  append_int (body, track->number);
+  /* musicbrainz id skipped */
+  append_key (body, 'm', index);
+}
+
+/**
+ * mafw_lastfm_body_append_now_playing:
+ * @body: a body created with mafw_lastfm_body_new()
+ * @track: the track being played
+ *
+ * Appends the fields of @track for a now-playing request.
+ **/
+void
+mafw_lastfm_body_append_now_playing (GString *body,
+                                     MafwLastfmTrack *track)
+{
+  g_string_append_len (body, "&a=", 3);
+  mafw_lastfm_body_append_encoded (body, track->artist);
+  g_string_append_len (body, "&t=", 3);
+  mafw_lastfm_body_append_encoded (body, track->title);
+  g_string_append_len (body, "&b=", 3);
+  mafw_lastfm_body_append_encoded (body, track->album);
+  g_string_append_len (body, "&l=", 3);
+  append_int (body, track->length);
+  g_string_append_len (body, "&n=", 3);
+  append_int (body, track->number);
+  g_string_append_len (body, "&m=", 3);
+}
@@ -0,0 +1,53 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef MAFW_LASTFM_BODY_H
+#define MAFW_LASTFM_BODY_H
+
+#include <glib.h>
+
+#include "mafw-lastfm-scrobbler.h"
+
+G_BEGIN_DECLS
+
+GString *
+mafw_lastfm_body_new (const gchar *session_id,
+                      gsize size_hint);
+
+gsize
+mafw_lastfm_body_estimate_size (MafwLastfmTrack *track);
+
+void
+mafw_lastfm_body_append_encoded (GString *body,
+                                 const gchar *value);
+
+void
+mafw_lastfm_body_append_submission (GString *body,
+                                    guint index,
+                                    MafwLastfmTrack *track,
+                                    gboolean encoded);
+
+void
+mafw_lastfm_body_append_now_playing (GString *body,
+                                     MafwLastfmTrack *track);
+
+G_END_DECLS
+
+#endif /* MAFW_LASTFM_BODY_H */
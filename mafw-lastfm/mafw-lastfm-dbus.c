@@ -0,0 +1,167 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Exports the metrics on the session bus, so that they can be read
+ * from a running device:
+ *
+ *   dbus-send --session --print-reply --dest=org.maemo.MafwLastfm \
+ *     /org/maemo/MafwLastfm org.maemo.MafwLastfm.Stats.GetStats
+ *
+ * GetStats takes no arguments and returns an a{su} dictionary with
+ * the values listed by mafw_lastfm_metrics_foreach().
+ */
+
+#include <glib.h>
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib.h>
+#include <dbus/dbus-glib-lowlevel.h>
+
+#include "mafw-lastfm-dbus.h"
+#include "mafw-lastfm-metrics.h"
+
+static DBusConnection *exported_connection = NULL;
+
+static void
+append_entry (const gchar *name,
+              guint value,
+              gpointer user_data)
+{
+  DBusMessageIter *dict = user_data;
+  DBusMessageIter entry;
+  dbus_uint32_t uvalue = value;
+
+  dbus_message_iter_open_container (dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+  dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &name);
+  dbus_message_iter_append_basic (&entry, DBUS_TYPE_UINT32, &uvalue);
+  dbus_message_iter_close_container (dict, &entry);
+}
+
+static DBusHandlerResult
+stats_message_cb (DBusConnection *connection,
+                  DBusMessage *message,
+                  void *user_data)
+{
+  DBusMessage *reply;
+  DBusMessageIter iter, dict;
+
+  if (!dbus_message_is_method_call (message,
+                                    MAFW_LASTFM_DBUS_STATS_INTERFACE,
+                                    "GetStats"))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  reply = dbus_message_new_method_return (message);
+  dbus_message_iter_init_append (reply, &iter);
+  dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                    DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                                    DBUS_TYPE_STRING_AS_STRING
+                                    DBUS_TYPE_UINT32_AS_STRING
+                                    DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+                                    &dict);
+  mafw_lastfm_metrics_foreach (append_entry, &dict);
+  dbus_message_iter_close_container (&iter, &dict);
+
+  dbus_connection_send (connection, reply, NULL);
+  dbus_message_unref (reply);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static const DBusObjectPathVTable stats_vtable = {
+  NULL,
+  stats_message_cb
+};
+
+/**
+ * mafw_lastfm_dbus_export_stats:
+ * @error: return location for a #GError, or %NULL
+ *
+ * Owns MAFW_LASTFM_DBUS_SERVICE on the session bus and answers the
+ * GetStats calls made to MAFW_LASTFM_DBUS_PATH from the default main
+ * context.
+ *
+ * Returns: %TRUE on success.
+ **/
+gboolean
+mafw_lastfm_dbus_export_stats (GError **error)
+{
+  DBusConnection *connection;
+  DBusError derror;
+  gint result;
+
+  dbus_error_init (&derror);
+
+  connection = dbus_bus_get (DBUS_BUS_SESSION, &derror);
+  if (!connection) {
+    dbus_set_g_error (error, &derror);
+    dbus_error_free (&derror);
+    return FALSE;
+  }
+  dbus_connection_setup_with_g_main (connection, NULL);
+
+  result = dbus_bus_request_name (connection, MAFW_LASTFM_DBUS_SERVICE,
+                                  DBUS_NAME_FLAG_DO_NOT_QUEUE, &derror);
+  if (result == -1) {
+    dbus_set_g_error (error, &derror);
+    dbus_error_free (&derror);
+    dbus_connection_unref (connection);
+    return FALSE;
+  }
+  if (result != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+    g_set_error (error, DBUS_GERROR, DBUS_GERROR_FAILED,
+                 "%s is already owned", MAFW_LASTFM_DBUS_SERVICE);
+    dbus_connection_unref (connection);
+    return FALSE;
+  }
+
+  if (!dbus_connection_register_object_path (connection,
+                                             MAFW_LASTFM_DBUS_PATH,
+                                             &stats_vtable, NULL)) {
+    g_set_error (error, DBUS_GERROR, DBUS_GERROR_NO_MEMORY,
+                 "Couldn't register %s", MAFW_LASTFM_DBUS_PATH);
+    dbus_connection_unref (connection);
+    return FALSE;
+  }
+
+  /* The connection is kept until the metrics are unexported. */
+  exported_connection = connection;
+
+  return TRUE;
+}
+
+/**
+ * mafw_lastfm_dbus_unexport_stats:
+ *
+ * Undoes mafw_lastfm_dbus_export_stats(), for when the code answering
+ * the calls is about to be unloaded.
+ **/
+void
+mafw_lastfm_dbus_unexport_stats (void)
+{
+  if (!exported_connection)
+    return;
+
+  dbus_connection_unregister_object_path (exported_connection,
+                                          MAFW_LASTFM_DBUS_PATH);
+  dbus_bus_release_name (exported_connection, MAFW_LASTFM_DBUS_SERVICE,
+                         NULL);
+  dbus_connection_unref (exported_connection);
+  exported_connection = NULL;
+}
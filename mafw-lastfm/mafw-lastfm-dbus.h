@@ -0,0 +1,40 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef MAFW_LASTFM_DBUS_H
+#define MAFW_LASTFM_DBUS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define MAFW_LASTFM_DBUS_SERVICE "org.maemo.MafwLastfm"
+#define MAFW_LASTFM_DBUS_PATH "/org/maemo/MafwLastfm"
+#define MAFW_LASTFM_DBUS_STATS_INTERFACE "org.maemo.MafwLastfm.Stats"
+
+gboolean
+mafw_lastfm_dbus_export_stats (GError **error);
+
+void
+mafw_lastfm_dbus_unexport_stats (void);
+
+G_END_DECLS
+
+#endif /* MAFW_LASTFM_DBUS_H */
@@ -0,0 +1,405 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * A bounded set of the fingerprints of the last tracks acknowledged
+ * by the servers, so that a play is never submitted twice to the
+ * same one: whether it was written to the journal twice, imported
+ * again, or sent again after a failure or a restart.
+ *
+ * A fingerprint is the 64-bit FNV-1a hash of a scope, the name of the
+ * endpoint, and of the artist, the title and the timestamp of the
+ * track, 0 being kept for the empty slots of the ring. Two different
+ * plays only share one by accident, and then the later one is
+ * dropped, which is far less likely than the duplicates it prevents.
+ *
+ * The fingerprints are kept in a ring, in the order they were added,
+ * and the oldest one makes room for the next once the ring is full.
+ * A hash table with linear probing, twice the size of the ring, maps
+ * them to their position in it.
+ *
+ * The set is saved to a file starting with DEDUP_MAGIC and the
+ * version, followed by the fingerprints, oldest first. Those added
+ * since the last save are appended, and the file is rewritten with
+ * the ones in the ring once it holds twice as many, or if it couldn't
+ * be read or written whole. The file is written by the worker of the
+ * journal, in order with its cursors.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "mafw-lastfm-dedup.h"
+
+#define DEDUP_MAGIC "MLFD"
+#define DEDUP_HEADER_SIZE 8
+#define FINGERPRINT_SIZE 8
+
+#define FNV_BASIS G_GUINT64_CONSTANT (14695981039346656037)
+#define FNV_PRIME G_GUINT64_CONSTANT (1099511628211)
+
+#define EMPTY 0
+
+struct MafwLastfmDedup {
+  /* The fingerprints, oldest first from head. */
+  guint64 *ring;
+  guint capacity;
+  guint head;
+  guint length;
+
+  /* The position in the ring plus one of each fingerprint, or 0. */
+  guint32 *slots;
+  guint mask;
+
+  gchar *path;
+  /* The fingerprints in the file, 0 if it must be written again from
+     scratch, and the newest ones of the ring not in it yet. */
+  guint n_saved;
+  guint n_unsaved;
+};
+
+static guint64
+fnv1a (guint64 hash,
+       const gchar *data,
+       gsize length)
+{
+  gsize i;
+
+  for (i = 0; i < length; i++) {
+    hash ^= (guchar) data[i];
+    hash *= FNV_PRIME;
+  }
+
+  return hash;
+}
+
+/**
+ * mafw_lastfm_dedup_new:
+ * @capacity: the number of fingerprints to keep
+ *
+ * Creates an empty set, keeping the last @capacity fingerprints
+ * added.
+ *
+ * Returns: a new #MafwLastfmDedup, to be freed with
+ * mafw_lastfm_dedup_free().
+ **/
+MafwLastfmDedup *
+mafw_lastfm_dedup_new (guint capacity)
+{
+  MafwLastfmDedup *dedup;
+  guint n_slots;
+
+  g_return_val_if_fail (capacity > 0, NULL);
+
+  dedup = g_new0 (MafwLastfmDedup, 1);
+  dedup->capacity = capacity;
+  dedup->ring = g_new0 (guint64, capacity);
+
+  /* At most half full, so that probes stay short. */
+  n_slots = 1;
+  while (n_slots < 2 * capacity)
+    n_slots <<= 1;
+  dedup->slots = g_new0 (guint32, n_slots);
+  dedup->mask = n_slots - 1;
+
+  return dedup;
+}
+
+void
+mafw_lastfm_dedup_free (MafwLastfmDedup *dedup)
+{
+  g_free (dedup->ring);
+  g_free (dedup->slots);
+  g_free (dedup->path);
+  g_free (dedup);
+}
+
+/**
+ * mafw_lastfm_dedup_fingerprint:
+ * @track: a #MafwLastfmTrack, with its strings decoded
+ * @scope: the name of the endpoint @track is submitted to
+ *
+ * Returns: the fingerprint of @track for @scope, never 0.
+ **/
+guint64
+mafw_lastfm_dedup_fingerprint (const MafwLastfmTrack *track,
+                               const gchar *scope)
+{
+  guint64 hash;
+  gint64 timestamp;
+
+  /* The strings with their NUL, so that "ab" "c" and "a" "bc"
+     differ. */
+  hash = fnv1a (FNV_BASIS, scope, strlen (scope) + 1);
+  if (track->artist)
+    hash = fnv1a (hash, track->artist, strlen (track->artist) + 1);
+  else
+    hash = fnv1a (hash, "", 1);
+  if (track->title)
+    hash = fnv1a (hash, track->title, strlen (track->title) + 1);
+  else
+    hash = fnv1a (hash, "", 1);
+
+  timestamp = GINT64_TO_LE (track->timestamp);
+  hash = fnv1a (hash, (const gchar *) &timestamp, 8);
+
+  return hash != EMPTY ? hash : 1;
+}
+
+/* Returns the slot holding @fingerprint, or the empty one ending its
+   probe. */
+static guint
+find_slot (MafwLastfmDedup *dedup,
+           guint64 fingerprint)
+{
+  guint i;
+
+  i = fingerprint & dedup->mask;
+  while (dedup->slots[i] &&
+         dedup->ring[dedup->slots[i] - 1] != fingerprint)
+    i = (i + 1) & dedup->mask;
+
+  return i;
+}
+
+/* Empties slot @i, moving back the entries after it that would no
+   longer be found otherwise. */
+static void
+delete_slot (MafwLastfmDedup *dedup,
+             guint i)
+{
+  guint j, home;
+
+  j = i;
+  for (;;) {
+    j = (j + 1) & dedup->mask;
+    if (!dedup->slots[j])
+      break;
+
+    home = dedup->ring[dedup->slots[j] - 1] & dedup->mask;
+    /* It can move unless its home is cyclically in (i, j]. */
+    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+      dedup->slots[i] = dedup->slots[j];
+      i = j;
+    }
+  }
+
+  dedup->slots[i] = 0;
+}
+
+/**
+ * mafw_lastfm_dedup_add:
+ * @dedup: a #MafwLastfmDedup
+ * @fingerprint: a fingerprint from mafw_lastfm_dedup_fingerprint()
+ *
+ * Adds @fingerprint to the set, dropping the oldest one if full.
+ *
+ * Returns: %FALSE if @fingerprint was in the set already.
+ **/
+gboolean
+mafw_lastfm_dedup_add (MafwLastfmDedup *dedup,
+                       guint64 fingerprint)
+{
+  guint64 oldest;
+  guint position;
+
+  g_return_val_if_fail (fingerprint != EMPTY, FALSE);
+
+  if (dedup->slots[find_slot (dedup, fingerprint)])
+    return FALSE;
+
+  if (dedup->length == dedup->capacity) {
+    oldest = dedup->ring[dedup->head];
+    delete_slot (dedup, find_slot (dedup, oldest));
+    dedup->head = (dedup->head + 1) % dedup->capacity;
+    dedup->length--;
+  }
+
+  position = (dedup->head + dedup->length) % dedup->capacity;
+  dedup->ring[position] = fingerprint;
+  dedup->length++;
+  dedup->slots[find_slot (dedup, fingerprint)] = position + 1;
+
+  dedup->n_unsaved = MIN (dedup->n_unsaved + 1, dedup->length);
+
+  return TRUE;
+}
+
+gboolean
+mafw_lastfm_dedup_contains (MafwLastfmDedup *dedup,
+                            guint64 fingerprint)
+{
+  return fingerprint != EMPTY &&
+    dedup->slots[find_slot (dedup, fingerprint)] != 0;
+}
+
+/**
+ * mafw_lastfm_dedup_load:
+ * @dedup: a #MafwLastfmDedup
+ * @path: the file to keep the set in
+ * @error: return location for a #GError, or %NULL
+ *
+ * Adds the fingerprints saved in @path, if any, and saves the set
+ * there from now on. Meant to be called before adding any.
+ *
+ * Returns: %FALSE if @path exists but couldn't be read.
+ **/
+gboolean
+mafw_lastfm_dedup_load (MafwLastfmDedup *dedup,
+                        const gchar *path,
+                        GError **error)
+{
+  GError *read_error = NULL;
+  gchar *contents;
+  gsize length;
+  guint64 fingerprint;
+  guint32 version;
+  guint n_fingerprints, i;
+
+  g_free (dedup->path);
+  dedup->path = g_strdup (path);
+  dedup->n_saved = 0;
+
+  if (!g_file_get_contents (path, &contents, &length, &read_error)) {
+    if (g_error_matches (read_error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+      g_error_free (read_error);
+      return TRUE;
+    }
+    g_propagate_error (error, read_error);
+    return FALSE;
+  }
+
+  if (length < DEDUP_HEADER_SIZE ||
+      memcmp (contents, DEDUP_MAGIC, 4) != 0) {
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                 "%s is not a fingerprint file", path);
+    g_free (contents);
+    return FALSE;
+  }
+
+  memcpy (&version, contents + 4, 4);
+  version = GUINT32_FROM_LE (version);
+  if (version > MAFW_LASTFM_DEDUP_VERSION) {
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                 "Unsupported fingerprint file version %u", version);
+    g_free (contents);
+    return FALSE;
+  }
+
+  /* Version 1 kept the tracks written to the journal, not the ones
+     acknowledged, and without their endpoint. */
+  if (version < MAFW_LASTFM_DEDUP_VERSION) {
+    g_free (contents);
+    return TRUE;
+  }
+
+  n_fingerprints = (length - DEDUP_HEADER_SIZE) / FINGERPRINT_SIZE;
+  i = n_fingerprints > dedup->capacity ? n_fingerprints - dedup->capacity : 0;
+  for (; i < n_fingerprints; i++) {
+    memcpy (&fingerprint,
+            contents + DEDUP_HEADER_SIZE + (gsize) i * FINGERPRINT_SIZE,
+            FINGERPRINT_SIZE);
+    fingerprint = GUINT64_FROM_LE (fingerprint);
+    if (fingerprint != EMPTY)
+      mafw_lastfm_dedup_add (dedup, fingerprint);
+  }
+
+  /* Keep appending to it, unless a write was torn. */
+  if ((length - DEDUP_HEADER_SIZE) % FINGERPRINT_SIZE == 0)
+    dedup->n_saved = n_fingerprints;
+  dedup->n_unsaved = 0;
+
+  g_free (contents);
+
+  return TRUE;
+}
+
+static void
+append_fingerprints (MafwLastfmDedup *dedup,
+                     GString *buffer,
+                     guint n_fingerprints)
+{
+  guint64 fingerprint;
+  guint i;
+
+  for (i = dedup->length - n_fingerprints; i < dedup->length; i++) {
+    fingerprint = dedup->ring[(dedup->head + i) % dedup->capacity];
+    fingerprint = GUINT64_TO_LE (fingerprint);
+    g_string_append_len (buffer, (const gchar *) &fingerprint,
+                         FINGERPRINT_SIZE);
+  }
+}
+
+static void
+save_cb (MafwLastfmJournal *journal,
+         const GError *error,
+         gpointer user_data)
+{
+  MafwLastfmDedup *dedup = user_data;
+
+  if (error) {
+    g_warning ("Couldn't save the fingerprints of the tracks: %s",
+               error->message);
+    /* Whatever was written may end with part of a fingerprint. */
+    dedup->n_saved = 0;
+  }
+}
+
+/**
+ * mafw_lastfm_dedup_save_async:
+ * @dedup: a #MafwLastfmDedup
+ * @journal: the #MafwLastfmJournal to write the file with
+ *
+ * Saves the fingerprints added since the last call to the file given
+ * to mafw_lastfm_dedup_load(), if any, from the worker of @journal.
+ * @dedup must outlive @journal.
+ **/
+void
+mafw_lastfm_dedup_save_async (MafwLastfmDedup *dedup,
+                              MafwLastfmJournal *journal)
+{
+  GString *buffer;
+  guint32 version;
+  gboolean append;
+
+  if (!dedup->path || dedup->n_unsaved == 0)
+    return;
+
+  buffer = g_string_new (NULL);
+
+  append = dedup->n_saved > 0 &&
+    dedup->n_saved + dedup->n_unsaved <= 2 * dedup->capacity;
+  if (append) {
+    append_fingerprints (dedup, buffer, dedup->n_unsaved);
+    dedup->n_saved += dedup->n_unsaved;
+  } else {
+    g_string_append_len (buffer, DEDUP_MAGIC, 4);
+    version = GUINT32_TO_LE (MAFW_LASTFM_DEDUP_VERSION);
+    g_string_append_len (buffer, (const gchar *) &version, 4);
+    append_fingerprints (dedup, buffer, dedup->length);
+    dedup->n_saved = (buffer->len - DEDUP_HEADER_SIZE) / FINGERPRINT_SIZE;
+  }
+
+  /* Unless save_cb says otherwise. */
+  dedup->n_unsaved = 0;
+
+  mafw_lastfm_journal_write_file_async (journal, dedup->path, buffer,
+                                        append, save_cb, dedup);
+}
@@ -0,0 +1,1430 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * An endpoint is one of the servers the tracks are scrobbled to, with
+ * its own credentials, session and cursor in the journal, which is
+ * shared by all of them. It handshakes, submits the batches handed
+ * over by the scrobbler and announces the track being played, and it
+ * recovers from its failures on its own: an endpoint that is down
+ * doesn't hold back the others, it only lags behind in the journal.
+ *
+ * What goes on the wire depends on the protocol of the endpoint. The
+ * tracks of the requests are encoded by the scrobbler, once for all
+ * the endpoints speaking the same protocol, and shared as a payload.
+ * Each endpoint only writes its own session in front of them.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libsoup/soup.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "mafw-lastfm-endpoint.h"
+#include "mafw-lastfm-metrics.h"
+#include "mafw-lastfm-backoff.h"
+
+#define MAFW_LASTFM_SESSION_GROUP "Session"
+
+#define MAFW_LASTFM_DEFAULT_BATCHES_IN_FLIGHT 2
+/* Handshake retries, in milliseconds. */
+#define MAFW_LASTFM_HANDSHAKE_BACKOFF 5000
+#define MAFW_LASTFM_HANDSHAKE_MAX_BACKOFF (320 * 1000)
+/* Hard failures in a row before handshaking again, as mandated by
+   the 1.2.1 protocol. */
+#define MAFW_LASTFM_MAX_HARD_FAILURES 3
+/* Failed requests in a row that stop the submissions for a while. */
+#define MAFW_LASTFM_BREAKER_THRESHOLD 5
+#define MAFW_LASTFM_BREAKER_COOLDOWN (5 * 60 * 1000)
+#define MAFW_LASTFM_BREAKER_MAX_COOLDOWN (60 * 60 * 1000)
+
+typedef enum {
+  MAFW_LASTFM_ENDPOINT_NEED_HANDSHAKE,
+  MAFW_LASTFM_ENDPOINT_HANDSHAKING,
+  MAFW_LASTFM_ENDPOINT_READY
+} MafwLastfmEndpointStatus;
+
+/* Backoff of the submissions per kind of failure, in milliseconds:
+   the network may be back soon, an overloaded server needs longer. */
+static const struct {
+  guint initial;
+  guint max;
+} submission_backoffs[MAFW_LASTFM_RESPONSE_N_BACKOFFS] = {
+  { 5 * 1000, 5 * 60 * 1000 },
+  { 30 * 1000, 30 * 60 * 1000 },
+  { 60 * 1000, 60 * 60 * 1000 }
+};
+
+struct MafwLastfmEndpoint {
+  gchar *name;
+
+  /* Shared with the scrobbler and the other endpoints. */
+  SoupSession *session;
+  MafwLastfmScheduler *scheduler;
+  MafwLastfmJournal *journal;
+  guint cursor;
+  /* The fingerprints of the tracks acknowledged, or NULL. */
+  MafwLastfmDedup *dedup;
+
+  MafwLastfmEndpointFunc changed;
+  gpointer user_data;
+
+  const MafwLastfmProtocol *protocol;
+  /* The url of the handshake, or NULL for the default of the
+     protocol. */
+  gchar *handshake_url;
+  MafwLastfmAccount account;
+  /* Where the session is saved, or NULL. */
+  gchar *session_path;
+
+  MafwLastfmEndpointStatus status;
+  /* While offline, the handshake and the submissions are parked. */
+  gboolean online;
+  guint handshake_id;
+  guint retry_id;
+  SoupMessage *retry_message;
+  MafwLastfmBackoff handshake_backoff;
+  /* The delay before the next handshake, in seconds, 0 if none. */
+  guint retry_backoff;
+  /* When the current handshake request was sent, in milliseconds. */
+  gint64 handshake_started;
+
+  /* The now-playing request in flight, and the track to announce
+     once it and the submissions in flight are done. */
+  SoupMessage *playing_now_message;
+  MafwLastfmPayload *next_playing_now;
+
+  /* Offset in the journal up to which records have been sent. */
+  goffset submitted_end;
+  /* Batches in the order they were sent, until they are committed. */
+  GQueue *batches;
+  guint batches_in_flight;
+  guint max_batches_in_flight;
+  gboolean batch_failed;
+  /* The most records per batch, lowered to find the track the server
+     rejects in a batch that ends at rejected_end. */
+  guint batch_limit;
+  goffset rejected_end;
+
+  /* Submissions wait for submit_retry_id after a failure, and for
+     breaker_id while the breaker is open. */
+  MafwLastfmBackoff submission_backoffs[MAFW_LASTFM_RESPONSE_N_BACKOFFS];
+  MafwLastfmBreaker breaker;
+  guint hard_failures;
+  guint submit_retry_id;
+  guint breaker_id;
+};
+
+/* The endpoints alive, whose worst state the gauges show. */
+static GSList *all_endpoints = NULL;
+
+typedef struct {
+  MafwLastfmEndpoint *endpoint;
+  guint n_tracks;
+  /* The fingerprints of its tracks. */
+  GArray *fingerprints;
+  goffset start;
+  goffset end;
+  /* Acknowledged, or rejected, so that the cursor can move past. */
+  gboolean acked;
+  gint64 sent;
+} MafwLastfmBatch;
+
+#ifndef MAFW_LASTFM_ENABLE_DEBUG
+ #undef g_print
+ #define g_print(...)
+#endif
+
+
+static void
+mafw_lastfm_endpoint_send_next_playing_now (MafwLastfmEndpoint *endpoint);
+
+static void
+batch_free (MafwLastfmBatch *batch)
+{
+  g_array_free (batch->fingerprints, TRUE);
+  g_free (batch);
+}
+
+static void handshake_cb (SoupSession *session,
+                          SoupMessage *message,
+                          gpointer user_data);
+
+/**
+ * mafw_lastfm_endpoint_new:
+ * @name: the name of the endpoint, which is also the one of its
+ * cursor in @journal
+ * @handshake_url: the url of the handshake, without the query, or
+ * %NULL for the default of the protocol
+ * @session: the session to send the requests with
+ * @scheduler: the scheduler to run the timeouts with
+ * @journal: the journal the tracks are cached in
+ * @changed: called when the endpoint committed records or may submit
+ * again
+ * @user_data: data to pass to @changed
+ *
+ * Returns: a new #MafwLastfmEndpoint speaking Audioscrobbler 1.2.1,
+ * which needs credentials and a handshake before it can submit
+ * anything.
+ **/
+MafwLastfmEndpoint *
+mafw_lastfm_endpoint_new (const gchar *name,
+                          const gchar *handshake_url,
+                          SoupSession *session,
+                          MafwLastfmScheduler *scheduler,
+                          MafwLastfmJournal *journal,
+                          MafwLastfmEndpointFunc changed,
+                          gpointer user_data)
+{
+  MafwLastfmEndpoint *endpoint;
+  gint i;
+
+  endpoint = g_new0 (MafwLastfmEndpoint, 1);
+  endpoint->name = g_strdup (name);
+  endpoint->session = g_object_ref (session);
+  endpoint->scheduler = scheduler;
+  endpoint->journal = journal;
+  endpoint->cursor = mafw_lastfm_journal_add_cursor (journal, name);
+  endpoint->changed = changed;
+  endpoint->user_data = user_data;
+
+  endpoint->protocol = mafw_lastfm_protocol_lookup (NULL);
+  endpoint->handshake_url = g_strdup (handshake_url);
+  mafw_lastfm_backoff_init (&endpoint->handshake_backoff,
+                            MAFW_LASTFM_HANDSHAKE_BACKOFF,
+                            MAFW_LASTFM_HANDSHAKE_MAX_BACKOFF);
+
+  endpoint->submitted_end = mafw_lastfm_journal_get_cursor (journal,
+                                                           endpoint->cursor);
+  endpoint->batches = g_queue_new ();
+  endpoint->max_batches_in_flight = MAFW_LASTFM_DEFAULT_BATCHES_IN_FLIGHT;
+  endpoint->batch_limit = G_MAXUINT;
+
+  for (i = 0; i < MAFW_LASTFM_RESPONSE_N_BACKOFFS; i++)
+    mafw_lastfm_backoff_init (&endpoint->submission_backoffs[i],
+                              submission_backoffs[i].initial,
+                              submission_backoffs[i].max);
+  mafw_lastfm_breaker_init (&endpoint->breaker, MAFW_LASTFM_BREAKER_THRESHOLD,
+                            MAFW_LASTFM_BREAKER_COOLDOWN,
+                            MAFW_LASTFM_BREAKER_MAX_COOLDOWN);
+
+  endpoint->status = MAFW_LASTFM_ENDPOINT_NEED_HANDSHAKE;
+  endpoint->online = TRUE;
+
+  all_endpoints = g_slist_prepend (all_endpoints, endpoint);
+
+  return endpoint;
+}
+
+/**
+ * update_gauges:
+ *
+ * Sets the breaker and backoff gauges to the worst of the endpoints,
+ * rather than to the last one that changed: an open breaker, or else
+ * a half-open one, and the longest backoff.
+ **/
+static void
+update_gauges (void)
+{
+  MafwLastfmEndpoint *endpoint;
+  MafwLastfmBreakerState state = MAFW_LASTFM_BREAKER_CLOSED;
+  guint backoff = 0;
+  GSList *l;
+
+  for (l = all_endpoints; l; l = l->next) {
+    endpoint = l->data;
+    if (endpoint->breaker.state == MAFW_LASTFM_BREAKER_OPEN ||
+        (endpoint->breaker.state == MAFW_LASTFM_BREAKER_HALF_OPEN &&
+         state == MAFW_LASTFM_BREAKER_CLOSED))
+      state = endpoint->breaker.state;
+    backoff = MAX (backoff, endpoint->retry_backoff);
+  }
+
+  mafw_lastfm_metrics_set (MAFW_LASTFM_METRIC_BREAKER_STATE, state);
+  mafw_lastfm_metrics_set (MAFW_LASTFM_METRIC_RETRY_BACKOFF, backoff);
+}
+
+static void
+mafw_lastfm_endpoint_cancel_handshake (MafwLastfmEndpoint *endpoint)
+{
+  if (endpoint->retry_id) {
+    mafw_lastfm_scheduler_remove (endpoint->scheduler, endpoint->retry_id);
+    endpoint->retry_id = 0;
+    if (endpoint->retry_message) {
+      g_object_unref (endpoint->retry_message);
+      endpoint->retry_message = NULL;
+    }
+  }
+  if (endpoint->handshake_id) {
+    mafw_lastfm_scheduler_remove (endpoint->scheduler, endpoint->handshake_id);
+    endpoint->handshake_id = 0;
+  }
+}
+
+/**
+ * mafw_lastfm_endpoint_free:
+ * @endpoint: a #MafwLastfmEndpoint
+ *
+ * Frees @endpoint, which must not have requests in flight: the owner
+ * of the session aborts it first.
+ **/
+void
+mafw_lastfm_endpoint_free (MafwLastfmEndpoint *endpoint)
+{
+  if (!endpoint)
+    return;
+
+  all_endpoints = g_slist_remove (all_endpoints, endpoint);
+  update_gauges ();
+
+  mafw_lastfm_endpoint_cancel_handshake (endpoint);
+  if (endpoint->submit_retry_id)
+    mafw_lastfm_scheduler_remove (endpoint->scheduler,
+                                  endpoint->submit_retry_id);
+  if (endpoint->breaker_id)
+    mafw_lastfm_scheduler_remove (endpoint->scheduler, endpoint->breaker_id);
+  if (endpoint->next_playing_now)
+    mafw_lastfm_payload_unref (endpoint->next_playing_now);
+
+  g_queue_foreach (endpoint->batches, (GFunc) batch_free, NULL);
+  g_queue_free (endpoint->batches);
+  g_object_unref (endpoint->session);
+
+  g_free (endpoint->name);
+  g_free (endpoint->handshake_url);
+  g_free (endpoint->account.url);
+  g_free (endpoint->account.username);
+  g_free (endpoint->account.md5password);
+  g_free (endpoint->account.api_key);
+  g_free (endpoint->account.api_secret);
+  g_free (endpoint->account.session_id);
+  g_free (endpoint->account.np_url);
+  g_free (endpoint->account.sub_url);
+  g_free (endpoint->session_path);
+  g_free (endpoint);
+}
+
+const gchar *
+mafw_lastfm_endpoint_get_name (MafwLastfmEndpoint *endpoint)
+{
+  return endpoint->name;
+}
+
+void
+mafw_lastfm_endpoint_set_credentials (MafwLastfmEndpoint *endpoint,
+                                      const gchar *username,
+                                      const gchar *md5password)
+{
+  g_free (endpoint->account.username);
+  endpoint->account.username = g_strdup (username);
+
+  g_free (endpoint->account.md5password);
+  endpoint->account.md5password = g_strdup (md5password);
+
+  endpoint->status = MAFW_LASTFM_ENDPOINT_NEED_HANDSHAKE;
+}
+
+/**
+ * mafw_lastfm_endpoint_get_protocol:
+ * @endpoint: a #MafwLastfmEndpoint
+ *
+ * Returns: the protocol spoken by @endpoint, which its payloads must
+ * be encoded for.
+ **/
+const MafwLastfmProtocol *
+mafw_lastfm_endpoint_get_protocol (MafwLastfmEndpoint *endpoint)
+{
+  return endpoint->protocol;
+}
+
+/**
+ * mafw_lastfm_endpoint_set_protocol:
+ * @endpoint: a #MafwLastfmEndpoint
+ * @protocol: the protocol to speak
+ * @api_key: the api key to sign the requests with, or %NULL
+ * @api_secret: the secret of @api_key, or %NULL
+ *
+ * Switches @endpoint to @protocol, whose default url is used unless
+ * one was set with mafw_lastfm_endpoint_set_handshake_url(). The
+ * api key is only needed by the protocols that sign their requests.
+ * Unless nothing changes, a new handshake is needed, with no requests
+ * in flight.
+ **/
+void
+mafw_lastfm_endpoint_set_protocol (MafwLastfmEndpoint *endpoint,
+                                   const MafwLastfmProtocol *protocol,
+                                   const gchar *api_key,
+                                   const gchar *api_secret)
+{
+  g_return_if_fail (protocol);
+
+  if (endpoint->protocol == protocol &&
+      g_strcmp0 (endpoint->account.api_key, api_key) == 0 &&
+      g_strcmp0 (endpoint->account.api_secret, api_secret) == 0)
+    return;
+
+  g_return_if_fail (endpoint->status != MAFW_LASTFM_ENDPOINT_HANDSHAKING);
+
+  endpoint->protocol = protocol;
+
+  g_free (endpoint->account.api_key);
+  endpoint->account.api_key = g_strdup (api_key);
+
+  g_free (endpoint->account.api_secret);
+  endpoint->account.api_secret = g_strdup (api_secret);
+
+  /* A track waiting is encoded for the former one. */
+  if (endpoint->next_playing_now) {
+    mafw_lastfm_payload_unref (endpoint->next_playing_now);
+    endpoint->next_playing_now = NULL;
+  }
+
+  endpoint->status = MAFW_LASTFM_ENDPOINT_NEED_HANDSHAKE;
+}
+
+/**
+ * mafw_lastfm_endpoint_set_handshake_url:
+ * @endpoint: a #MafwLastfmEndpoint
+ * @url: the url of the handshake, without the query, or %NULL for
+ * the default of the protocol
+ *
+ * Sets the server to handshake with. The urls for the now-playing and
+ * submission requests come from its response. This takes effect on
+ * the next handshake.
+ **/
+void
+mafw_lastfm_endpoint_set_handshake_url (MafwLastfmEndpoint *endpoint,
+                                        const gchar *url)
+{
+  g_free (endpoint->handshake_url);
+  endpoint->handshake_url = g_strdup (url);
+}
+
+/**
+ * mafw_lastfm_endpoint_set_session_file:
+ * @endpoint: a #MafwLastfmEndpoint
+ * @path: the file to save the session in, or %NULL
+ *
+ * Sets where the session obtained in the handshake is saved, for
+ * mafw_lastfm_endpoint_restore_session() to reuse it. It isn't saved
+ * unless this is called.
+ **/
+void
+mafw_lastfm_endpoint_set_session_file (MafwLastfmEndpoint *endpoint,
+                                       const gchar *path)
+{
+  g_free (endpoint->session_path);
+  endpoint->session_path = g_strdup (path);
+}
+
+/**
+ * mafw_lastfm_endpoint_set_dedup:
+ * @endpoint: a #MafwLastfmEndpoint
+ * @dedup: the set to keep the fingerprints of the acknowledged tracks
+ * in, shared with the other endpoints
+ *
+ * Makes @endpoint add the fingerprints of its tracks to @dedup once
+ * the server acknowledged them, and save it before committing them,
+ * so that mafw_lastfm_endpoint_has_sent() knows about them even if
+ * they are sent again.
+ **/
+void
+mafw_lastfm_endpoint_set_dedup (MafwLastfmEndpoint *endpoint,
+                                MafwLastfmDedup *dedup)
+{
+  endpoint->dedup = dedup;
+}
+
+/**
+ * mafw_lastfm_endpoint_set_max_batches_in_flight:
+ * @endpoint: a #MafwLastfmEndpoint
+ * @max_batches: the maximum number of submissions to have in flight
+ *
+ * Sets how many batches of cached tracks can be submitted to
+ * @endpoint at the same time while draining the queue. A new batch is
+ * sent as soon as one of the pending ones is acknowledged.
+ **/
+void
+mafw_lastfm_endpoint_set_max_batches_in_flight (MafwLastfmEndpoint *endpoint,
+                                                guint max_batches)
+{
+  g_return_if_fail (max_batches > 0);
+
+  endpoint->max_batches_in_flight = max_batches;
+  endpoint->changed (endpoint, endpoint->user_data);
+}
+
+static gboolean
+on_deferred_handshake_timeout_cb (gpointer user_data)
+{
+  MafwLastfmEndpoint *endpoint = user_data;
+  endpoint->handshake_id = 0;
+
+  mafw_lastfm_endpoint_handshake (endpoint);
+
+  return FALSE;
+}
+
+/* The url to handshake with, for the protocol in use. */
+static void
+mafw_lastfm_endpoint_update_url (MafwLastfmEndpoint *endpoint)
+{
+  g_free (endpoint->account.url);
+  endpoint->account.url = g_strdup (endpoint->handshake_url ?
+                                    endpoint->handshake_url :
+                                    endpoint->protocol->default_url);
+}
+
+/**
+ * mafw_lastfm_endpoint_session_key:
+ * @endpoint: a #MafwLastfmEndpoint
+ *
+ * Returns: a digest of the credentials and the server, which a saved
+ * session must match to be reused.
+ **/
+static gchar *
+mafw_lastfm_endpoint_session_key (MafwLastfmEndpoint *endpoint)
+{
+  gchar *data;
+  gchar *key;
+
+  /* The api key, if any, is last so that 1.2.1 sessions keep their
+     key. */
+  data = g_strconcat (endpoint->account.username, "\n",
+                      endpoint->account.md5password, "\n",
+                      endpoint->account.url,
+                      endpoint->account.api_key ? "\n" : NULL,
+                      endpoint->account.api_key, NULL);
+  key = g_compute_checksum_for_string (G_CHECKSUM_MD5, data, -1);
+  g_free (data);
+
+  return key;
+}
+
+static void
+mafw_lastfm_endpoint_save_session (MafwLastfmEndpoint *endpoint)
+{
+  GKeyFile *keyfile;
+  GError *error = NULL;
+  gchar *key;
+  gchar *data;
+  gsize length;
+  mode_t mask;
+
+  if (!endpoint->session_path || !endpoint->account.session_id ||
+      !endpoint->account.np_url || !endpoint->account.sub_url)
+    return;
+
+  keyfile = g_key_file_new ();
+  key = mafw_lastfm_endpoint_session_key (endpoint);
+  g_key_file_set_string (keyfile, MAFW_LASTFM_SESSION_GROUP, "key", key);
+  g_key_file_set_string (keyfile, MAFW_LASTFM_SESSION_GROUP, "protocol",
+                         endpoint->protocol->name);
+  g_key_file_set_string (keyfile, MAFW_LASTFM_SESSION_GROUP, "id",
+                         endpoint->account.session_id);
+  g_key_file_set_string (keyfile, MAFW_LASTFM_SESSION_GROUP, "np_url",
+                         endpoint->account.np_url);
+  g_key_file_set_string (keyfile, MAFW_LASTFM_SESSION_GROUP, "sub_url",
+                         endpoint->account.sub_url);
+  data = g_key_file_to_data (keyfile, &length, NULL);
+
+  /* The session id is as good as the password until it expires, if
+     ever, so keep it private. */
+  mask = umask (077);
+  if (!g_file_set_contents (endpoint->session_path, data, length, &error)) {
+    g_warning ("Couldn't save the session: %s", error->message);
+    g_error_free (error);
+  }
+  umask (mask);
+
+  g_free (data);
+  g_free (key);
+  g_key_file_free (keyfile);
+}
+
+static void
+mafw_lastfm_endpoint_forget_session (MafwLastfmEndpoint *endpoint)
+{
+  if (endpoint->session_path)
+    g_unlink (endpoint->session_path);
+}
+
+static void
+mafw_lastfm_endpoint_defer_handshake (MafwLastfmEndpoint *endpoint)
+{
+  if (endpoint->handshake_id != 0)
+    return;
+
+  /* The server rejected the session, don't reuse it on restart. */
+  mafw_lastfm_endpoint_forget_session (endpoint);
+
+  endpoint->status = MAFW_LASTFM_ENDPOINT_NEED_HANDSHAKE;
+  /* Done as soon as the network is back. */
+  if (!endpoint->online)
+    return;
+
+  endpoint->handshake_id =
+    mafw_lastfm_scheduler_add_seconds (endpoint->scheduler, 5,
+                                       (GSourceFunc) on_deferred_handshake_timeout_cb,
+                                       endpoint);
+}
+
+/**
+ * endpoint_send_message:
+ * @endpoint: a #MafwLastfmEndpoint
+ * @payload: the tracks of the request, encoded for the protocol of
+ * @endpoint
+ * @callback: the callback for the response
+ * @user_data: data to pass to @callback
+ *
+ * Now-playing requests let the others go first, when the session
+ * supports it.
+ *
+ * Returns: the message, owned by the session until @callback runs,
+ * or %NULL if it couldn't be built. A new handshake is deferred then,
+ * the urls of the session may be to blame.
+ **/
+static SoupMessage *
+endpoint_send_message (MafwLastfmEndpoint *endpoint,
+                       MafwLastfmPayload *payload,
+                       SoupSessionCallback callback,
+                       gpointer user_data)
+{
+  SoupMessage *message;
+
+  g_return_val_if_fail (payload->protocol == endpoint->protocol, NULL);
+
+  /* The tracks are not copied, the other endpoints send them too. */
+  message = endpoint->protocol->new_request (&endpoint->account, payload);
+  if (!message) {
+    g_warning ("Couldn't build a request for %s", endpoint->name);
+    mafw_lastfm_endpoint_defer_handshake (endpoint);
+    return NULL;
+  }
+
+  mafw_lastfm_metrics_add (MAFW_LASTFM_METRIC_BYTES_SENT,
+                           message->request_body->length);
+#ifdef SOUP_CHECK_VERSION
+#if SOUP_CHECK_VERSION (2, 44, 0)
+  if (payload->request == MAFW_LASTFM_REQUEST_NOW_PLAYING)
+    soup_message_set_priority (message, SOUP_MESSAGE_PRIORITY_LOW);
+#endif
+#endif
+  soup_session_queue_message (endpoint->session,
+                              message,
+                              callback,
+                              user_data);
+
+  return message;
+}
+
+static gboolean
+breaker_cooldown_cb (MafwLastfmEndpoint *endpoint)
+{
+  endpoint->breaker_id = 0;
+
+  mafw_lastfm_breaker_half_open (&endpoint->breaker);
+  update_gauges ();
+  /* Probe the server with a single batch. */
+  endpoint->changed (endpoint, endpoint->user_data);
+
+  return FALSE;
+}
+
+static void
+mafw_lastfm_endpoint_request_succeeded (MafwLastfmEndpoint *endpoint)
+{
+  gint i;
+
+  mafw_lastfm_breaker_success (&endpoint->breaker);
+  update_gauges ();
+  endpoint->hard_failures = 0;
+  for (i = 0; i < MAFW_LASTFM_RESPONSE_N_BACKOFFS; i++)
+    mafw_lastfm_backoff_reset (&endpoint->submission_backoffs[i]);
+}
+
+/**
+ * mafw_lastfm_endpoint_request_failed:
+ * @endpoint: a #MafwLastfmEndpoint
+ *
+ * Accounts for a now-playing or submission request that failed for
+ * another reason than the session. After too many of them in a row,
+ * the breaker opens and the submissions stop until its cooldown is
+ * over.
+ *
+ * Returns: %TRUE if the breaker is open.
+ **/
+static gboolean
+mafw_lastfm_endpoint_request_failed (MafwLastfmEndpoint *endpoint)
+{
+  guint cooldown;
+
+  cooldown = mafw_lastfm_breaker_failure (&endpoint->breaker);
+  if (cooldown == 0)
+    return !mafw_lastfm_breaker_allows (&endpoint->breaker);
+
+  g_warning ("%s failing, pausing the submissions for %u seconds",
+             endpoint->name, cooldown / 1000);
+  mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_BREAKER_TRIPS);
+  update_gauges ();
+  endpoint->breaker_id =
+    mafw_lastfm_scheduler_add (endpoint->scheduler, cooldown,
+                               (GSourceFunc) breaker_cooldown_cb,
+                               endpoint);
+
+  return TRUE;
+}
+
+static gboolean
+submit_retry_cb (MafwLastfmEndpoint *endpoint)
+{
+  endpoint->submit_retry_id = 0;
+
+  endpoint->changed (endpoint, endpoint->user_data);
+
+  return FALSE;
+}
+
+/**
+ * mafw_lastfm_endpoint_submission_failed:
+ * @endpoint: a #MafwLastfmEndpoint
+ * @response: why the submission failed
+ *
+ * Schedules the next submission after a failure: a new handshake
+ * for BADSESSION or after too many hard failures in a row, none for
+ * REJECTED, the backoff of the kind of failure otherwise, unless the
+ * breaker opens.
+ **/
+static void
+mafw_lastfm_endpoint_submission_failed (MafwLastfmEndpoint *endpoint,
+                                        MafwLastfmResponse response)
+{
+  guint delay;
+
+  if (response == MAFW_LASTFM_RESPONSE_BADSESSION) {
+    mafw_lastfm_endpoint_defer_handshake (endpoint);
+    return;
+  }
+  /* Sent again right away, in smaller batches. */
+  if (response == MAFW_LASTFM_RESPONSE_REJECTED)
+    return;
+
+  if (++endpoint->hard_failures >= MAFW_LASTFM_MAX_HARD_FAILURES) {
+    endpoint->hard_failures = 0;
+    mafw_lastfm_endpoint_defer_handshake (endpoint);
+  }
+
+  if (mafw_lastfm_endpoint_request_failed (endpoint) ||
+      endpoint->submit_retry_id != 0)
+    return;
+
+  delay = mafw_lastfm_backoff_next (&endpoint->submission_backoffs[response]);
+  g_print ("Submission to %s failed, retrying in %u ms\n",
+           endpoint->name, delay);
+  endpoint->submit_retry_id =
+    mafw_lastfm_scheduler_add (endpoint->scheduler, delay,
+                               (GSourceFunc) submit_retry_cb, endpoint);
+}
+
+static void
+set_playing_now_cb (SoupSession *session,
+                    SoupMessage *message,
+                    gpointer user_data)
+{
+  MafwLastfmEndpoint *endpoint = user_data;
+
+  endpoint->playing_now_message = NULL;
+
+  if (SOUP_STATUS_IS_SUCCESSFUL (message->status_code))
+    g_print ("Playing-now: %s", message->response_body->data);
+
+  /* Stale by now, so failures aren't retried. */
+  switch (endpoint->protocol->parse_response (message)) {
+  case MAFW_LASTFM_RESPONSE_CANCELLED:
+    return;
+  case MAFW_LASTFM_RESPONSE_OK:
+  case MAFW_LASTFM_RESPONSE_REJECTED:
+    mafw_lastfm_endpoint_request_succeeded (endpoint);
+    break;
+  case MAFW_LASTFM_RESPONSE_BADSESSION:
+    mafw_lastfm_endpoint_defer_handshake (endpoint);
+    break;
+  default:
+    mafw_lastfm_endpoint_request_failed (endpoint);
+    break;
+  }
+
+  mafw_lastfm_endpoint_send_next_playing_now (endpoint);
+}
+
+static void
+mafw_lastfm_endpoint_send_playing_now (MafwLastfmEndpoint *endpoint,
+                                       MafwLastfmPayload *payload)
+{
+  endpoint->playing_now_message =
+    endpoint_send_message (endpoint, payload, set_playing_now_cb, endpoint);
+  if (endpoint->playing_now_message)
+    mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_NOW_PLAYING_SENT);
+}
+
+/**
+ * mafw_lastfm_endpoint_drop_playing_now:
+ * @endpoint: a #MafwLastfmEndpoint
+ *
+ * Forgets about the track waiting to be announced, if any.
+ **/
+void
+mafw_lastfm_endpoint_drop_playing_now (MafwLastfmEndpoint *endpoint)
+{
+  if (!endpoint->next_playing_now)
+    return;
+
+  mafw_lastfm_payload_unref (endpoint->next_playing_now);
+  endpoint->next_playing_now = NULL;
+  mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_NOW_PLAYING_CANCELLED);
+}
+
+/**
+ * mafw_lastfm_endpoint_send_next_playing_now:
+ * @endpoint: a #MafwLastfmEndpoint
+ *
+ * Announces the track left waiting by
+ * mafw_lastfm_endpoint_set_playing_now(), once nothing else is in
+ * flight. It is dropped if the session was lost in the meantime.
+ **/
+static void
+mafw_lastfm_endpoint_send_next_playing_now (MafwLastfmEndpoint *endpoint)
+{
+  MafwLastfmPayload *payload;
+
+  if (!endpoint->next_playing_now || endpoint->playing_now_message ||
+      endpoint->batches_in_flight > 0)
+    return;
+
+  if (!endpoint->online || endpoint->status != MAFW_LASTFM_ENDPOINT_READY ||
+      !mafw_lastfm_breaker_allows (&endpoint->breaker)) {
+    mafw_lastfm_endpoint_drop_playing_now (endpoint);
+    return;
+  }
+
+  payload = endpoint->next_playing_now;
+  endpoint->next_playing_now = NULL;
+  mafw_lastfm_endpoint_send_playing_now (endpoint, payload);
+  mafw_lastfm_payload_unref (payload);
+}
+
+/**
+ * mafw_lastfm_endpoint_set_playing_now:
+ * @endpoint: a #MafwLastfmEndpoint
+ * @payload: the track being played, encoded for the protocol of
+ * @endpoint
+ *
+ * Announces the track being played, if @endpoint has a session. There
+ * is at most one now-playing request in flight, and none while
+ * submitting: @payload waits for them otherwise, and it is
+ * superseded if another track is announced before it could be sent.
+ **/
+void
+mafw_lastfm_endpoint_set_playing_now (MafwLastfmEndpoint *endpoint,
+                                      MafwLastfmPayload *payload)
+{
+  g_return_if_fail (payload);
+
+  if (endpoint->status != MAFW_LASTFM_ENDPOINT_READY)
+    return;
+
+  /* Stale by the time the network or the server is back. */
+  if (!endpoint->online || !mafw_lastfm_breaker_allows (&endpoint->breaker)) {
+    mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_NOW_PLAYING_CANCELLED);
+    return;
+  }
+
+  if (endpoint->playing_now_message || endpoint->batches_in_flight > 0) {
+    if (endpoint->next_playing_now) {
+      mafw_lastfm_payload_unref (endpoint->next_playing_now);
+      mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_NOW_PLAYING_SUPERSEDED);
+    }
+    endpoint->next_playing_now = mafw_lastfm_payload_ref (payload);
+    return;
+  }
+
+  mafw_lastfm_endpoint_send_playing_now (endpoint, payload);
+}
+
+static gboolean
+retry_queue_message (gpointer userdata)
+{
+  MafwLastfmEndpoint *endpoint = userdata;
+
+  endpoint->retry_id = 0;
+  g_print ("retrying to queue message\n");
+  endpoint->handshake_started = mafw_lastfm_scheduler_get_real_time ();
+  mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_HANDSHAKES);
+  soup_session_queue_message (endpoint->session,
+                              endpoint->retry_message,
+                              handshake_cb,
+                              endpoint);
+  endpoint->retry_message = NULL;
+
+  return FALSE;
+}
+
+static void
+handshake_cb (SoupSession *session,
+              SoupMessage *message,
+              gpointer user_data)
+{
+  MafwLastfmEndpoint *endpoint = user_data;
+  guint delay;
+
+  /* The endpoint is going away. */
+  if (message->status_code == SOUP_STATUS_CANCELLED)
+    return;
+
+  mafw_lastfm_metrics_observe (MAFW_LASTFM_HISTOGRAM_HANDSHAKE_LATENCY,
+                               mafw_lastfm_scheduler_get_real_time () -
+                               endpoint->handshake_started);
+
+  if (SOUP_STATUS_IS_SUCCESSFUL (message->status_code))
+    g_print ("%s", message->response_body->data);
+
+  switch (endpoint->protocol->parse_handshake (message, &endpoint->account)) {
+  case MAFW_LASTFM_HANDSHAKE_OK:
+    endpoint->status = MAFW_LASTFM_ENDPOINT_READY;
+    mafw_lastfm_backoff_reset (&endpoint->handshake_backoff);
+    endpoint->retry_backoff = 0;
+    update_gauges ();
+    mafw_lastfm_endpoint_save_session (endpoint);
+    endpoint->changed (endpoint, endpoint->user_data);
+    return;
+  case MAFW_LASTFM_HANDSHAKE_BADTIME:
+    mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_HANDSHAKES_FAILED);
+    endpoint->status = MAFW_LASTFM_ENDPOINT_NEED_HANDSHAKE;
+    mafw_lastfm_backoff_reset (&endpoint->handshake_backoff);
+    mafw_lastfm_endpoint_handshake (endpoint);
+    return;
+  case MAFW_LASTFM_HANDSHAKE_FAILED:
+    break;
+  }
+
+  /* If something went wrong, try to recover. */
+  mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_HANDSHAKES_FAILED);
+  endpoint->status = MAFW_LASTFM_ENDPOINT_NEED_HANDSHAKE;
+  /* No point in retrying until the network is back. */
+  if (!endpoint->online)
+    return;
+
+  delay = mafw_lastfm_backoff_next (&endpoint->handshake_backoff);
+  endpoint->retry_backoff = delay / 1000;
+  update_gauges ();
+  g_print ("message failed, trying to send in %u ms.\n", delay);
+  endpoint->retry_message = g_object_ref (message);
+  endpoint->retry_id =
+    mafw_lastfm_scheduler_add (endpoint->scheduler, delay,
+                               retry_queue_message, endpoint);
+}
+
+void
+mafw_lastfm_endpoint_handshake (MafwLastfmEndpoint *endpoint)
+{
+  SoupMessage *message;
+  gchar *uri;
+
+  g_return_if_fail (endpoint->status != MAFW_LASTFM_ENDPOINT_HANDSHAKING);
+  g_return_if_fail (endpoint->account.username ||
+                    endpoint->account.md5password);
+
+  mafw_lastfm_endpoint_cancel_handshake (endpoint);
+  if (!endpoint->online) {
+    /* Parked until mafw_lastfm_endpoint_set_online(). */
+    endpoint->status = MAFW_LASTFM_ENDPOINT_NEED_HANDSHAKE;
+    return;
+  }
+
+  mafw_lastfm_endpoint_update_url (endpoint);
+  message = endpoint->protocol->new_handshake (&endpoint->account);
+  if (!message) {
+    g_warning ("Couldn't handshake with %s", endpoint->name);
+    endpoint->status = MAFW_LASTFM_ENDPOINT_NEED_HANDSHAKE;
+    return;
+  }
+  endpoint->status = MAFW_LASTFM_ENDPOINT_HANDSHAKING;
+
+  endpoint->handshake_started = mafw_lastfm_scheduler_get_real_time ();
+  mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_HANDSHAKES);
+  uri = soup_uri_to_string (soup_message_get_uri (message), TRUE);
+  mafw_lastfm_metrics_add (MAFW_LASTFM_METRIC_BYTES_SENT,
+                           strlen (uri) + message->request_body->length);
+  g_free (uri);
+
+  soup_session_queue_message (endpoint->session,
+                              message,
+                              handshake_cb,
+                              endpoint);
+}
+
+/**
+ * mafw_lastfm_endpoint_restore_session:
+ * @endpoint: a #MafwLastfmEndpoint
+ *
+ * Reuses the session saved after the last handshake with the same
+ * credentials and server, if any, so that tracks can be submitted
+ * without handshaking first. Should the server have expired it, the
+ * endpoint handshakes again on the first BADSESSION response.
+ *
+ * Returns: %TRUE if a session was restored, %FALSE if
+ * mafw_lastfm_endpoint_handshake() is needed.
+ **/
+gboolean
+mafw_lastfm_endpoint_restore_session (MafwLastfmEndpoint *endpoint)
+{
+  GKeyFile *keyfile;
+  gchar *key, *saved_key;
+  gchar *protocol;
+  gchar *session_id, *np_url, *sub_url;
+  gboolean restored = FALSE;
+
+  if (!endpoint->session_path || !endpoint->account.username ||
+      !endpoint->account.md5password ||
+      endpoint->status == MAFW_LASTFM_ENDPOINT_HANDSHAKING)
+    return FALSE;
+
+  keyfile = g_key_file_new ();
+  if (!g_key_file_load_from_file (keyfile, endpoint->session_path,
+                                  G_KEY_FILE_NONE, NULL)) {
+    g_key_file_free (keyfile);
+    return FALSE;
+  }
+
+  mafw_lastfm_endpoint_update_url (endpoint);
+  key = mafw_lastfm_endpoint_session_key (endpoint);
+  saved_key = g_key_file_get_string (keyfile, MAFW_LASTFM_SESSION_GROUP,
+                                     "key", NULL);
+  /* Sessions saved before there was a choice are 1.2.1 ones. */
+  protocol = g_key_file_get_string (keyfile, MAFW_LASTFM_SESSION_GROUP,
+                                    "protocol", NULL);
+  session_id = g_key_file_get_string (keyfile, MAFW_LASTFM_SESSION_GROUP,
+                                      "id", NULL);
+  np_url = g_key_file_get_string (keyfile, MAFW_LASTFM_SESSION_GROUP,
+                                  "np_url", NULL);
+  sub_url = g_key_file_get_string (keyfile, MAFW_LASTFM_SESSION_GROUP,
+                                   "sub_url", NULL);
+
+  if (g_strcmp0 (key, saved_key) == 0 &&
+      mafw_lastfm_protocol_lookup (protocol) == endpoint->protocol &&
+      session_id && np_url && sub_url) {
+    mafw_lastfm_endpoint_cancel_handshake (endpoint);
+
+    g_free (endpoint->account.session_id);
+    g_free (endpoint->account.np_url);
+    g_free (endpoint->account.sub_url);
+    endpoint->account.session_id = session_id;
+    endpoint->account.np_url = np_url;
+    endpoint->account.sub_url = sub_url;
+    session_id = np_url = sub_url = NULL;
+
+    endpoint->status = MAFW_LASTFM_ENDPOINT_READY;
+    mafw_lastfm_backoff_reset (&endpoint->handshake_backoff);
+    restored = TRUE;
+  }
+
+  g_free (session_id);
+  g_free (np_url);
+  g_free (sub_url);
+  g_free (protocol);
+  g_free (saved_key);
+  g_free (key);
+  g_key_file_free (keyfile);
+
+  if (restored)
+    endpoint->changed (endpoint, endpoint->user_data);
+
+  return restored;
+}
+
+/**
+ * mafw_lastfm_endpoint_is_ready:
+ * @endpoint: a #MafwLastfmEndpoint
+ *
+ * Returns: whether @endpoint has a session and the network is
+ * available, so that it can be sent requests.
+ **/
+gboolean
+mafw_lastfm_endpoint_is_ready (MafwLastfmEndpoint *endpoint)
+{
+  return endpoint->online && endpoint->status == MAFW_LASTFM_ENDPOINT_READY;
+}
+
+/**
+ * mafw_lastfm_endpoint_set_online:
+ * @endpoint: a #MafwLastfmEndpoint
+ * @online: whether the network is available
+ *
+ * While offline, the handshake retries and the submissions are
+ * parked instead of waking up to fail. Once back online, the endpoint
+ * handshakes right away if needed, or asks for the cached tracks.
+ **/
+void
+mafw_lastfm_endpoint_set_online (MafwLastfmEndpoint *endpoint,
+                                 gboolean online)
+{
+  online = online != FALSE;
+  if (endpoint->online == online)
+    return;
+
+  endpoint->online = online;
+
+  if (!online) {
+    /* A handshake in flight will fail and stay parked too. */
+    mafw_lastfm_endpoint_cancel_handshake (endpoint);
+    if (endpoint->submit_retry_id) {
+      mafw_lastfm_scheduler_remove (endpoint->scheduler,
+                                    endpoint->submit_retry_id);
+      endpoint->submit_retry_id = 0;
+    }
+    /* Probe the server once back, rather than waiting any longer. */
+    if (endpoint->breaker_id) {
+      mafw_lastfm_scheduler_remove (endpoint->scheduler, endpoint->breaker_id);
+      endpoint->breaker_id = 0;
+      mafw_lastfm_breaker_half_open (&endpoint->breaker);
+      update_gauges ();
+    }
+    return;
+  }
+
+  mafw_lastfm_backoff_reset (&endpoint->handshake_backoff);
+  if (endpoint->status == MAFW_LASTFM_ENDPOINT_NEED_HANDSHAKE &&
+      endpoint->account.username && endpoint->account.md5password)
+    mafw_lastfm_endpoint_handshake (endpoint);
+  else
+    endpoint->changed (endpoint, endpoint->user_data);
+}
+
+/**
+ * mafw_lastfm_endpoint_reset_batches:
+ * @endpoint: a #MafwLastfmEndpoint
+ *
+ * Forgets about the batches that were sent but not committed, so
+ * that they are sent again, starting from the cursor of @endpoint.
+ * There must be none in flight.
+ **/
+void
+mafw_lastfm_endpoint_reset_batches (MafwLastfmEndpoint *endpoint)
+{
+  g_return_if_fail (endpoint->batches_in_flight == 0);
+
+  g_queue_foreach (endpoint->batches, (GFunc) batch_free, NULL);
+  g_queue_clear (endpoint->batches);
+
+  endpoint->submitted_end =
+    mafw_lastfm_journal_get_cursor (endpoint->journal, endpoint->cursor);
+  endpoint->batch_failed = FALSE;
+}
+
+/**
+ * mafw_lastfm_endpoint_get_batch_limit:
+ * @endpoint: a #MafwLastfmEndpoint
+ *
+ * Returns: the most records to send @endpoint in its next batch,
+ * %G_MAXUINT unless it is looking for a track the server rejects.
+ **/
+guint
+mafw_lastfm_endpoint_get_batch_limit (MafwLastfmEndpoint *endpoint)
+{
+  return endpoint->batch_limit;
+}
+
+/**
+ * mafw_lastfm_endpoint_get_submitted_end:
+ * @endpoint: a #MafwLastfmEndpoint
+ *
+ * Returns: the offset in the journal to read the next batch for
+ * @endpoint from.
+ **/
+goffset
+mafw_lastfm_endpoint_get_submitted_end (MafwLastfmEndpoint *endpoint)
+{
+  /* With every batch committed, this is the cursor, which moves when
+     the journal is compacted or cleared. */
+  if (g_queue_is_empty (endpoint->batches))
+    endpoint->submitted_end =
+      mafw_lastfm_journal_get_cursor (endpoint->journal, endpoint->cursor);
+
+  return endpoint->submitted_end;
+}
+
+/**
+ * mafw_lastfm_endpoint_can_submit:
+ * @endpoint: a #MafwLastfmEndpoint
+ *
+ * Checks, without any disk access, whether @endpoint can be sent a
+ * batch of the records after mafw_lastfm_endpoint_get_submitted_end().
+ *
+ * Returns: %TRUE if there are records to submit, and neither a
+ * failure nor the maximum number of batches in flight holds them.
+ **/
+gboolean
+mafw_lastfm_endpoint_can_submit (MafwLastfmEndpoint *endpoint)
+{
+  guint max_batches;
+
+  if (!endpoint->online || endpoint->status != MAFW_LASTFM_ENDPOINT_READY ||
+      endpoint->batch_failed || endpoint->submit_retry_id != 0 ||
+      !mafw_lastfm_breaker_allows (&endpoint->breaker))
+    return FALSE;
+
+  /* A half-open breaker lets a single batch probe the server. */
+  max_batches = endpoint->breaker.state == MAFW_LASTFM_BREAKER_HALF_OPEN ?
+    1 : endpoint->max_batches_in_flight;
+
+  return endpoint->batches_in_flight < max_batches &&
+    mafw_lastfm_journal_has_pending (endpoint->journal,
+                                     mafw_lastfm_endpoint_get_submitted_end (endpoint));
+}
+
+gboolean
+mafw_lastfm_endpoint_is_idle (MafwLastfmEndpoint *endpoint)
+{
+  return endpoint->batches_in_flight == 0;
+}
+
+/**
+ * mafw_lastfm_endpoint_commit_batches:
+ * @endpoint: a #MafwLastfmEndpoint
+ *
+ * Moves the cursor of @endpoint past the batches that have been
+ * acknowledged, as long as all the batches sent before them were
+ * acknowledged too.
+ **/
+static void
+mafw_lastfm_endpoint_commit_batches (MafwLastfmEndpoint *endpoint)
+{
+  MafwLastfmBatch *batch;
+  goffset end = 0;
+
+  while ((batch = g_queue_peek_head (endpoint->batches)) &&
+         batch->acked) {
+    end = batch->end;
+    batch_free (g_queue_pop_head (endpoint->batches));
+  }
+
+  if (end > 0)
+    mafw_lastfm_journal_commit (endpoint->journal, endpoint->cursor, end);
+
+  /* Past the batch the rejected track was in. */
+  if (end >= endpoint->rejected_end)
+    endpoint->batch_limit = G_MAXUINT;
+}
+
+/**
+ * mafw_lastfm_endpoint_remember_batch:
+ * @endpoint: a #MafwLastfmEndpoint
+ * @batch: a batch just acknowledged
+ *
+ * Adds the fingerprints of @batch to the set of @endpoint, and saves
+ * it before the cursor is, so that its tracks are dropped if they
+ * are read again: after a restart, or because a batch sent before
+ * them failed.
+ **/
+static void
+mafw_lastfm_endpoint_remember_batch (MafwLastfmEndpoint *endpoint,
+                                     MafwLastfmBatch *batch)
+{
+  guint i;
+
+  if (!endpoint->dedup)
+    return;
+
+  for (i = 0; i < batch->fingerprints->len; i++)
+    mafw_lastfm_dedup_add (endpoint->dedup,
+                           g_array_index (batch->fingerprints, guint64, i));
+  mafw_lastfm_dedup_save_async (endpoint->dedup, endpoint->journal);
+}
+
+/**
+ * mafw_lastfm_endpoint_has_sent:
+ * @endpoint: a #MafwLastfmEndpoint
+ * @fingerprint: the fingerprint of a track for @endpoint, from
+ * mafw_lastfm_dedup_fingerprint()
+ *
+ * Returns: %TRUE if the track has been acknowledged by @endpoint, or
+ * is in a batch still in flight.
+ **/
+gboolean
+mafw_lastfm_endpoint_has_sent (MafwLastfmEndpoint *endpoint,
+                               guint64 fingerprint)
+{
+  MafwLastfmBatch *batch;
+  GList *l;
+  guint i;
+
+  if (endpoint->dedup &&
+      mafw_lastfm_dedup_contains (endpoint->dedup, fingerprint))
+    return TRUE;
+
+  for (l = endpoint->batches->head; l; l = l->next) {
+    batch = l->data;
+    for (i = 0; i < batch->fingerprints->len; i++) {
+      if (g_array_index (batch->fingerprints, guint64, i) == fingerprint)
+        return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+ * mafw_lastfm_endpoint_batch_rejected:
+ * @endpoint: a #MafwLastfmEndpoint
+ * @batch: a batch the server refused for good
+ *
+ * Drops the track of @batch if it is the only one, since it would be
+ * refused every time and hold the ones after it back. It is neither
+ * archived nor remembered as sent. Otherwise the batch is sent again
+ * in halves, until the track to blame is alone.
+ **/
+static void
+mafw_lastfm_endpoint_batch_rejected (MafwLastfmEndpoint *endpoint,
+                                     MafwLastfmBatch *batch)
+{
+  if (batch->n_tracks > 1) {
+    endpoint->batch_limit = batch->n_tracks / 2;
+    endpoint->rejected_end = batch->end;
+    return;
+  }
+
+  g_warning ("%s rejected a track, dropping it", endpoint->name);
+  mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_SCROBBLES_REJECTED);
+  endpoint->batch_limit = G_MAXUINT;
+  mafw_lastfm_journal_reject (endpoint->journal, batch->start, batch->end);
+  batch->acked = TRUE;
+  mafw_lastfm_endpoint_commit_batches (endpoint);
+}
+
+static void
+cached_scrobble_cb (SoupSession *session,
+                    SoupMessage *message,
+                    gpointer user_data)
+{
+  MafwLastfmBatch *batch = user_data;
+  MafwLastfmEndpoint *endpoint = batch->endpoint;
+  MafwLastfmResponse response;
+
+  endpoint->batches_in_flight--;
+  mafw_lastfm_metrics_observe (MAFW_LASTFM_HISTOGRAM_SUBMISSION_LATENCY,
+                               mafw_lastfm_scheduler_get_real_time () - batch->sent);
+
+  response = endpoint->protocol->parse_response (message);
+  /* The endpoint is going away. */
+  if (response == MAFW_LASTFM_RESPONSE_CANCELLED)
+    return;
+
+  if (response == MAFW_LASTFM_RESPONSE_OK) {
+    g_print ("Scrobble to %s: %s", endpoint->name,
+             message->response_body->data);
+    batch->acked = TRUE;
+    mafw_lastfm_endpoint_remember_batch (endpoint, batch);
+    mafw_lastfm_endpoint_request_succeeded (endpoint);
+    mafw_lastfm_endpoint_commit_batches (endpoint);
+  } else if (response == MAFW_LASTFM_RESPONSE_REJECTED) {
+    /* The server is fine, the tracks are not. */
+    mafw_lastfm_endpoint_request_succeeded (endpoint);
+    mafw_lastfm_endpoint_batch_rejected (endpoint, batch);
+  } else {
+    mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_SUBMISSIONS_FAILED);
+  }
+
+  if (!batch->acked && !endpoint->batch_failed) {
+    /* If we are here, we failed to submit. Stop sending batches
+       and recover once all the pending ones have returned. */
+    endpoint->batch_failed = TRUE;
+    mafw_lastfm_endpoint_submission_failed (endpoint, response);
+  }
+
+  if (endpoint->batches_in_flight > 0 && endpoint->batch_failed)
+    return;
+
+  /* Batches acknowledged after a failed one are not committed, and
+     will be sent again. */
+  if (endpoint->batches_in_flight == 0 && endpoint->batch_failed)
+    mafw_lastfm_endpoint_reset_batches (endpoint);
+
+  /* Keep draining, including the tracks cached in the meantime. */
+  endpoint->changed (endpoint, endpoint->user_data);
+  /* And announce the current track once done. */
+  mafw_lastfm_endpoint_send_next_playing_now (endpoint);
+}
+
+/**
+ * mafw_lastfm_endpoint_submit:
+ * @endpoint: a #MafwLastfmEndpoint
+ * @payload: the tracks of the batch, encoded for the protocol of
+ * @endpoint
+ * @end: the offset in the journal where the batch ends
+ * @fingerprints: the fingerprints of the tracks in @payload, which
+ * @endpoint takes ownership of
+ *
+ * Submits the batch of the records after
+ * mafw_lastfm_endpoint_get_submitted_end() up to @end, which are
+ * committed to the cursor of @endpoint once acknowledged. Only to be
+ * called if mafw_lastfm_endpoint_can_submit().
+ **/
+void
+mafw_lastfm_endpoint_submit (MafwLastfmEndpoint *endpoint,
+                             MafwLastfmPayload *payload,
+                             goffset end,
+                             GArray *fingerprints)
+{
+  MafwLastfmBatch *batch;
+  goffset start;
+
+  start = endpoint->submitted_end;
+
+  batch = g_new0 (MafwLastfmBatch, 1);
+  batch->endpoint = endpoint;
+  batch->n_tracks = payload->n_tracks;
+  batch->fingerprints = fingerprints;
+  batch->start = start;
+  batch->end = end;
+  batch->acked = FALSE;
+  g_queue_push_tail (endpoint->batches, batch);
+  endpoint->submitted_end = end;
+
+  /* The records changed under our feet, nothing to send. */
+  if (payload->n_tracks == 0) {
+    batch->acked = TRUE;
+    mafw_lastfm_endpoint_commit_batches (endpoint);
+    return;
+  }
+
+  g_print ("Submitting batch of %u track(s) to %s\n", payload->n_tracks,
+           endpoint->name);
+  if (!endpoint_send_message (endpoint, payload, cached_scrobble_cb, batch)) {
+    /* Sent again after the handshake. */
+    batch_free (g_queue_pop_tail (endpoint->batches));
+    endpoint->submitted_end = start;
+    return;
+  }
+
+  endpoint->batches_in_flight++;
+  batch->sent = mafw_lastfm_scheduler_get_real_time ();
+  mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_SUBMISSIONS);
+}
@@ -0,0 +1,133 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef MAFW_LASTFM_ENDPOINT_H
+#define MAFW_LASTFM_ENDPOINT_H
+
+#include <glib.h>
+#include <libsoup/soup.h>
+
+#include "mafw-lastfm-dedup.h"
+#include "mafw-lastfm-journal.h"
+#include "mafw-lastfm-protocol.h"
+#include "mafw-lastfm-scheduler.h"
+
+G_BEGIN_DECLS
+
+typedef struct MafwLastfmEndpoint MafwLastfmEndpoint;
+
+/* Called when @endpoint committed records to the journal, or may
+   submit again. */
+typedef void (*MafwLastfmEndpointFunc) (MafwLastfmEndpoint *endpoint,
+                                        gpointer user_data);
+
+MafwLastfmEndpoint *
+mafw_lastfm_endpoint_new (const gchar *name,
+                          const gchar *handshake_url,
+                          SoupSession *session,
+                          MafwLastfmScheduler *scheduler,
+                          MafwLastfmJournal *journal,
+                          MafwLastfmEndpointFunc changed,
+                          gpointer user_data);
+
+void
+mafw_lastfm_endpoint_free (MafwLastfmEndpoint *endpoint);
+
+const gchar *
+mafw_lastfm_endpoint_get_name (MafwLastfmEndpoint *endpoint);
+
+void
+mafw_lastfm_endpoint_set_credentials (MafwLastfmEndpoint *endpoint,
+                                      const gchar *username,
+                                      const gchar *md5password);
+
+const MafwLastfmProtocol *
+mafw_lastfm_endpoint_get_protocol (MafwLastfmEndpoint *endpoint);
+
+void
+mafw_lastfm_endpoint_set_protocol (MafwLastfmEndpoint *endpoint,
+                                   const MafwLastfmProtocol *protocol,
+                                   const gchar *api_key,
+                                   const gchar *api_secret);
+
+void
+mafw_lastfm_endpoint_set_handshake_url (MafwLastfmEndpoint *endpoint,
+                                        const gchar *url);
+
+void
+mafw_lastfm_endpoint_set_session_file (MafwLastfmEndpoint *endpoint,
+                                       const gchar *path);
+
+void
+mafw_lastfm_endpoint_set_dedup (MafwLastfmEndpoint *endpoint,
+                                MafwLastfmDedup *dedup);
+
+void
+mafw_lastfm_endpoint_set_max_batches_in_flight (MafwLastfmEndpoint *endpoint,
+                                                guint max_batches);
+
+void
+mafw_lastfm_endpoint_handshake (MafwLastfmEndpoint *endpoint);
+
+gboolean
+mafw_lastfm_endpoint_restore_session (MafwLastfmEndpoint *endpoint);
+
+gboolean
+mafw_lastfm_endpoint_is_ready (MafwLastfmEndpoint *endpoint);
+
+void
+mafw_lastfm_endpoint_set_online (MafwLastfmEndpoint *endpoint,
+                                 gboolean online);
+
+void
+mafw_lastfm_endpoint_set_playing_now (MafwLastfmEndpoint *endpoint,
+                                      MafwLastfmPayload *payload);
+
+void
+mafw_lastfm_endpoint_drop_playing_now (MafwLastfmEndpoint *endpoint);
+
+gboolean
+mafw_lastfm_endpoint_can_submit (MafwLastfmEndpoint *endpoint);
+
+guint
+mafw_lastfm_endpoint_get_batch_limit (MafwLastfmEndpoint *endpoint);
+
+goffset
+mafw_lastfm_endpoint_get_submitted_end (MafwLastfmEndpoint *endpoint);
+
+void
+mafw_lastfm_endpoint_submit (MafwLastfmEndpoint *endpoint,
+                             MafwLastfmPayload *payload,
+                             goffset end,
+                             GArray *fingerprints);
+
+gboolean
+mafw_lastfm_endpoint_has_sent (MafwLastfmEndpoint *endpoint,
+                               guint64 fingerprint);
+
+gboolean
+mafw_lastfm_endpoint_is_idle (MafwLastfmEndpoint *endpoint);
+
+void
+mafw_lastfm_endpoint_reset_batches (MafwLastfmEndpoint *endpoint);
+
+G_END_DECLS
+
+#endif /* MAFW_LASTFM_ENDPOINT_H */
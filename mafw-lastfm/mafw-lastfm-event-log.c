@@ -0,0 +1,394 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * A compact binary log of the events coming from the renderer, so
+ * that a listening session can be replayed without MAFW.
+ *
+ * The log starts with "MLFE" and a little-endian uint32 version, and
+ * is followed by the events. Each event is a byte with its type, a
+ * uint32 with the milliseconds since the previous event, taken from a
+ * monotonic clock, and its payload:
+ *
+ *   state changed:    uint8 state, int64 wall time
+ *   duration changed: int64 duration
+ *   position:         int32 position
+ *   metadata:         int32 track number, then the artist, title and
+ *                     album, each as a uint16 length followed by the
+ *                     bytes and a nul, or 0xffff for a missing string
+ *   media changed:    nothing
+ *   metadata changed: uint8 key, int32 track number, then the value
+ *                     as a string like the ones above
+ *
+ * The last two were added in version 2, older logs are still read.
+ *
+ * A truncated event at the end, as left by a crash, ends the log.
+ */
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <string.h>
+
+#include "mafw-lastfm-event-log.h"
+#include "mafw-lastfm-scheduler.h"
+
+#define EVENT_LOG_MAGIC "MLFE"
+#define EVENT_LOG_HEADER_SIZE 8
+/* Type and time delta. */
+#define EVENT_HEADER_SIZE 5
+#define NO_STRING 0xffff
+
+struct MafwLastfmEventLog {
+  GOutputStream *stream;
+  gint64 last_time;
+  gboolean started;
+};
+
+static void
+append_uint16 (GString *buffer,
+               guint16 value)
+{
+  value = GUINT16_TO_LE (value);
+  g_string_append_len (buffer, (const gchar *) &value, 2);
+}
+
+static void
+append_uint32 (GString *buffer,
+               guint32 value)
+{
+  value = GUINT32_TO_LE (value);
+  g_string_append_len (buffer, (const gchar *) &value, 4);
+}
+
+static void
+append_int64 (GString *buffer,
+              gint64 value)
+{
+  value = GINT64_TO_LE (value);
+  g_string_append_len (buffer, (const gchar *) &value, 8);
+}
+
+static void
+append_string (GString *buffer,
+               const gchar *value)
+{
+  gsize length;
+
+  if (!value) {
+    append_uint16 (buffer, NO_STRING);
+    return;
+  }
+
+  /* Longer strings are truncated, this is only test data. */
+  length = MIN (strlen (value), NO_STRING - 1);
+  append_uint16 (buffer, length);
+  g_string_append_len (buffer, value, length);
+  g_string_append_c (buffer, '\0');
+}
+
+static guint16
+read_uint16 (const gchar *data)
+{
+  guint16 value;
+
+  memcpy (&value, data, 2);
+  return GUINT16_FROM_LE (value);
+}
+
+static guint32
+read_uint32 (const gchar *data)
+{
+  guint32 value;
+
+  memcpy (&value, data, 4);
+  return GUINT32_FROM_LE (value);
+}
+
+static gint64
+read_int64 (const gchar *data)
+{
+  gint64 value;
+
+  memcpy (&value, data, 8);
+  return GINT64_FROM_LE (value);
+}
+
+/**
+ * mafw_lastfm_event_log_new:
+ * @path: the file to record the events to
+ * @error: return location for a #GError, or %NULL
+ *
+ * Creates a new event log at @path, replacing any existing file.
+ *
+ * Returns: a new #MafwLastfmEventLog, or %NULL on error.
+ **/
+MafwLastfmEventLog *
+mafw_lastfm_event_log_new (const gchar *path,
+                           GError **error)
+{
+  MafwLastfmEventLog *log;
+  GFileOutputStream *stream;
+  GFile *file;
+  GString *header;
+  gboolean success;
+
+  file = g_file_new_for_path (path);
+  stream = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_PRIVATE,
+                           NULL, error);
+  g_object_unref (file);
+
+  if (!stream)
+    return NULL;
+
+  header = g_string_new (EVENT_LOG_MAGIC);
+  append_uint32 (header, MAFW_LASTFM_EVENT_LOG_VERSION);
+  success = g_output_stream_write_all (G_OUTPUT_STREAM (stream),
+                                       header->str, header->len,
+                                       NULL, NULL, error);
+  g_string_free (header, TRUE);
+
+  if (!success) {
+    g_object_unref (stream);
+    return NULL;
+  }
+
+  log = g_new0 (MafwLastfmEventLog, 1);
+  log->stream = G_OUTPUT_STREAM (stream);
+
+  return log;
+}
+
+/**
+ * mafw_lastfm_event_log_free:
+ * @log: a #MafwLastfmEventLog
+ *
+ * Closes and frees @log.
+ **/
+void
+mafw_lastfm_event_log_free (MafwLastfmEventLog *log)
+{
+  if (!log)
+    return;
+
+  g_output_stream_close (log->stream, NULL, NULL);
+  g_object_unref (log->stream);
+  g_free (log);
+}
+
+/**
+ * mafw_lastfm_event_log_write:
+ * @log: a #MafwLastfmEventLog
+ * @event: the event to record, its time is ignored
+ * @error: return location for a #GError, or %NULL
+ *
+ * Appends @event to @log, stamped with the current time, and flushes
+ * it so that it survives a crash.
+ *
+ * Returns: %TRUE on success.
+ **/
+gboolean
+mafw_lastfm_event_log_write (MafwLastfmEventLog *log,
+                             MafwLastfmEvent *event,
+                             GError **error)
+{
+  GString *buffer;
+  gint64 now;
+  gint64 delta;
+  gboolean success;
+
+  now = mafw_lastfm_scheduler_get_real_time ();
+  delta = log->started ? CLAMP (now - log->last_time, 0, G_MAXUINT32) : 0;
+  log->last_time = now;
+  log->started = TRUE;
+
+  buffer = g_string_sized_new (32);
+  g_string_append_c (buffer, event->type);
+  append_uint32 (buffer, delta);
+
+  switch (event->type) {
+  case MAFW_LASTFM_EVENT_STATE_CHANGED:
+    g_string_append_c (buffer, event->state);
+    append_int64 (buffer, event->wall_time);
+    break;
+  case MAFW_LASTFM_EVENT_DURATION_CHANGED:
+    append_int64 (buffer, event->duration);
+    break;
+  case MAFW_LASTFM_EVENT_POSITION:
+    append_uint32 (buffer, event->position);
+    break;
+  case MAFW_LASTFM_EVENT_METADATA:
+    append_uint32 (buffer, event->number);
+    append_string (buffer, event->artist);
+    append_string (buffer, event->title);
+    append_string (buffer, event->album);
+    break;
+  case MAFW_LASTFM_EVENT_MEDIA_CHANGED:
+    break;
+  case MAFW_LASTFM_EVENT_METADATA_CHANGED:
+    g_string_append_c (buffer, event->key);
+    append_uint32 (buffer, event->number);
+    append_string (buffer, event->value);
+    break;
+  }
+
+  success = (g_output_stream_write_all (log->stream, buffer->str,
+                                        buffer->len, NULL, NULL, error) &&
+             g_output_stream_flush (log->stream, NULL, error));
+  g_string_free (buffer, TRUE);
+
+  return success;
+}
+
+/**
+ * mafw_lastfm_event_iter_init:
+ * @iter: a #MafwLastfmEventIter
+ * @data: the contents of an event log
+ * @length: the length of @data
+ *
+ * Prepares @iter to go through the events in @data.
+ **/
+void
+mafw_lastfm_event_iter_init (MafwLastfmEventIter *iter,
+                             const gchar *data,
+                             gsize length)
+{
+  iter->data = data;
+  iter->length = length;
+  iter->offset = length;
+  iter->time = 0;
+
+  if (length < EVENT_LOG_HEADER_SIZE ||
+      memcmp (data, EVENT_LOG_MAGIC, 4) != 0) {
+    g_warning ("Not an event log");
+  } else if (read_uint32 (data + 4) > MAFW_LASTFM_EVENT_LOG_VERSION) {
+    g_warning ("Unsupported event log version %u", read_uint32 (data + 4));
+  } else {
+    iter->offset = EVENT_LOG_HEADER_SIZE;
+  }
+}
+
+/* Reads a string at *offset, which is moved past it. */
+static gboolean
+read_string (MafwLastfmEventIter *iter,
+             gsize *offset,
+             const gchar **value)
+{
+  guint16 length;
+
+  if (*offset + 2 > iter->length)
+    return FALSE;
+
+  length = read_uint16 (iter->data + *offset);
+  *offset += 2;
+
+  if (length == NO_STRING) {
+    *value = NULL;
+    return TRUE;
+  }
+
+  if (*offset + length + 1 > iter->length ||
+      iter->data[*offset + length] != '\0')
+    return FALSE;
+
+  *value = iter->data + *offset;
+  *offset += length + 1;
+
+  return TRUE;
+}
+
+/**
+ * mafw_lastfm_event_iter_next:
+ * @iter: a #MafwLastfmEventIter
+ * @event: the #MafwLastfmEvent to fill
+ *
+ * Reads the next event. The strings of the metadata events point into
+ * the data being iterated, and must not be freed.
+ *
+ * Returns: %FALSE at the end of the log.
+ **/
+gboolean
+mafw_lastfm_event_iter_next (MafwLastfmEventIter *iter,
+                             MafwLastfmEvent *event)
+{
+  const gchar *data;
+  gsize offset;
+
+  if (iter->offset + EVENT_HEADER_SIZE > iter->length)
+    return FALSE;
+
+  data = iter->data + iter->offset;
+  offset = iter->offset + EVENT_HEADER_SIZE;
+  memset (event, 0, sizeof (MafwLastfmEvent));
+  event->type = (guchar) data[0];
+
+  switch (event->type) {
+  case MAFW_LASTFM_EVENT_STATE_CHANGED:
+    if (offset + 9 > iter->length)
+      return FALSE;
+    event->state = (guchar) iter->data[offset];
+    event->wall_time = read_int64 (iter->data + offset + 1);
+    offset += 9;
+    break;
+  case MAFW_LASTFM_EVENT_DURATION_CHANGED:
+    if (offset + 8 > iter->length)
+      return FALSE;
+    event->duration = read_int64 (iter->data + offset);
+    offset += 8;
+    break;
+  case MAFW_LASTFM_EVENT_POSITION:
+    if (offset + 4 > iter->length)
+      return FALSE;
+    event->position = (gint32) read_uint32 (iter->data + offset);
+    offset += 4;
+    break;
+  case MAFW_LASTFM_EVENT_METADATA:
+    if (offset + 4 > iter->length)
+      return FALSE;
+    event->number = (gint32) read_uint32 (iter->data + offset);
+    offset += 4;
+
+    if (!read_string (iter, &offset, &event->artist) ||
+        !read_string (iter, &offset, &event->title) ||
+        !read_string (iter, &offset, &event->album))
+      return FALSE;
+    break;
+  case MAFW_LASTFM_EVENT_MEDIA_CHANGED:
+    break;
+  case MAFW_LASTFM_EVENT_METADATA_CHANGED:
+    if (offset + 5 > iter->length)
+      return FALSE;
+    event->key = (guchar) iter->data[offset];
+    event->number = (gint32) read_uint32 (iter->data + offset + 1);
+    offset += 5;
+
+    if (!read_string (iter, &offset, &event->value))
+      return FALSE;
+    break;
+  default:
+    g_warning ("Unknown event type %d in the event log", event->type);
+    return FALSE;
+  }
+
+  iter->time += read_uint32 (data + 1);
+  event->time = iter->time;
+  iter->offset = offset;
+
+  return TRUE;
+}
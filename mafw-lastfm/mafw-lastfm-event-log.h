@@ -0,0 +1,96 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef MAFW_LASTFM_EVENT_LOG_H
+#define MAFW_LASTFM_EVENT_LOG_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define MAFW_LASTFM_EVENT_LOG_VERSION 2
+
+typedef enum {
+  MAFW_LASTFM_EVENT_STATE_CHANGED,
+  MAFW_LASTFM_EVENT_DURATION_CHANGED,
+  MAFW_LASTFM_EVENT_POSITION,
+  MAFW_LASTFM_EVENT_METADATA,
+  /* Since version 2. */
+  MAFW_LASTFM_EVENT_MEDIA_CHANGED,
+  MAFW_LASTFM_EVENT_METADATA_CHANGED
+} MafwLastfmEventType;
+
+typedef struct {
+  MafwLastfmEventType type;
+  /* Milliseconds since the first event. */
+  gint64 time;
+
+  /* MAFW_LASTFM_EVENT_STATE_CHANGED */
+  gint state;
+  /* Seconds since the epoch, when the state changed. */
+  glong wall_time;
+  /* MAFW_LASTFM_EVENT_DURATION_CHANGED */
+  gint64 duration;
+  /* MAFW_LASTFM_EVENT_POSITION */
+  gint position;
+  /* MAFW_LASTFM_EVENT_METADATA, the number is also used by
+     MAFW_LASTFM_EVENT_METADATA_CHANGED */
+  const gchar *artist;
+  const gchar *title;
+  const gchar *album;
+  gint number;
+  /* MAFW_LASTFM_EVENT_METADATA_CHANGED, a MafwLastfmTrackerKey */
+  gint key;
+  const gchar *value;
+} MafwLastfmEvent;
+
+typedef struct MafwLastfmEventLog MafwLastfmEventLog;
+
+typedef struct {
+  const gchar *data;
+  gsize length;
+  gsize offset;
+  gint64 time;
+} MafwLastfmEventIter;
+
+MafwLastfmEventLog *
+mafw_lastfm_event_log_new (const gchar *path,
+                           GError **error);
+
+void
+mafw_lastfm_event_log_free (MafwLastfmEventLog *log);
+
+gboolean
+mafw_lastfm_event_log_write (MafwLastfmEventLog *log,
+                             MafwLastfmEvent *event,
+                             GError **error);
+
+void
+mafw_lastfm_event_iter_init (MafwLastfmEventIter *iter,
+                             const gchar *data,
+                             gsize length);
+
+gboolean
+mafw_lastfm_event_iter_next (MafwLastfmEventIter *iter,
+                             MafwLastfmEvent *event);
+
+G_END_DECLS
+
+#endif /* MAFW_LASTFM_EVENT_LOG_H */
@@ -0,0 +1,1179 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The history keeps the plays that every server has acknowledged,
+ * once the journal drops them, so that they can be looked up without
+ * a network. The log is an append-only file starting with
+ * HISTORY_MAGIC and the format version, followed by the records of
+ * the plays in the format of the journal.
+ *
+ * Three index files sit next to it, with a fixed-size entry per play
+ * pointing at its record:
+ *
+ *   TIME_SUFFIX     timestamp | offset | artist hash | track hash
+ *   ARTIST_SUFFIX   artist hash | offset
+ *   TRACK_SUFFIX    track hash | offset
+ *
+ * The hashes are FNV-1a of the case-folded artist, and of the artist
+ * and the title, so that a lookup is a binary search that only reads
+ * back the records that match. An index starts with INDEX_MAGIC, the
+ * version, the number of sorted entries and the end of the log they
+ * cover. The entries of the plays appended since follow them in the
+ * order of the log, and are merged into the sorted ones once they are
+ * too many. An index missing the last plays, after a crash for
+ * instance, catches up with the log when opened.
+ *
+ * Plays are appended from the worker thread of the journal, and
+ * looked up from the main loop. The files are mapped in memory, and
+ * the maps are only replaced with the lock held, which the lookups
+ * hold too.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mafw-lastfm-history.h"
+#include "mafw-lastfm-journal.h"
+
+#define HISTORY_MAGIC "MLFH"
+#define HISTORY_HEADER_SIZE 8
+#define INDEX_MAGIC "MLFI"
+/* magic, version, sorted entries and end of the log covered. */
+#define INDEX_HEADER_SIZE (4 + 4 + 8 + 8)
+#define TIME_ENTRY_SIZE (8 + 8 + 4 + 4)
+#define KEY_ENTRY_SIZE (4 + 8)
+#define TIME_SUFFIX ".time"
+#define ARTIST_SUFFIX ".artist"
+#define TRACK_SUFFIX ".track"
+/* The unsorted entries of an index are merged once there are more
+   than TAIL_MIN of them and one for every TAIL_RATIO sorted ones. */
+#define TAIL_MIN 1024
+#define TAIL_RATIO 8
+
+#define FNV_BASIS 2166136261U
+#define FNV_PRIME 16777619U
+
+#if !GLIB_CHECK_VERSION (2, 22, 0)
+#define g_mapped_file_unref g_mapped_file_free
+#endif
+
+#ifndef MAFW_LASTFM_ENABLE_DEBUG
+ #undef g_print
+ #define g_print(...)
+#endif
+
+typedef enum {
+  INDEX_TIME,
+  INDEX_ARTIST,
+  INDEX_TRACK,
+  N_INDEXES
+} IndexType;
+
+typedef struct {
+  gchar *path;
+  gsize entry_size;
+  /* Where the offset of the record is in an entry. */
+  gsize offset_pos;
+  int (*compare) (const void *a, const void *b);
+
+  GMappedFile *map;
+  /* The sorted entries, followed by the ones appended since. */
+  const gchar *entries;
+  guint n_sorted;
+  guint n_entries;
+  goffset covered;
+  /* An append failed, it is left behind until opened again. */
+  gboolean broken;
+} HistoryIndex;
+
+struct MafwLastfmHistory {
+  gchar *path;
+  GMappedFile *map;
+  const gchar *data;
+  gsize size;
+  HistoryIndex indexes[N_INDEXES];
+#if GLIB_CHECK_VERSION (2, 32, 0)
+  GMutex lock;
+#else
+  GMutex *lock;
+#endif
+};
+
+typedef struct {
+  gint64 timestamp;
+  goffset offset;
+} TimeKey;
+
+typedef struct {
+  guint32 hash;
+  guint plays;
+  /* The last play, to read the name of the artist from. */
+  goffset offset;
+} ArtistCount;
+
+static void
+append_uint32 (GString *buffer,
+               guint32 value)
+{
+  value = GUINT32_TO_LE (value);
+  g_string_append_len (buffer, (const gchar *) &value, 4);
+}
+
+static void
+append_int64 (GString *buffer,
+              gint64 value)
+{
+  value = GINT64_TO_LE (value);
+  g_string_append_len (buffer, (const gchar *) &value, 8);
+}
+
+static guint32
+read_uint32 (const gchar *data)
+{
+  guint32 value;
+
+  memcpy (&value, data, 4);
+  return GUINT32_FROM_LE (value);
+}
+
+static gint64
+read_int64 (const gchar *data)
+{
+  gint64 value;
+
+  memcpy (&value, data, 8);
+  return GINT64_FROM_LE (value);
+}
+
+static void
+lock_history (MafwLastfmHistory *history)
+{
+#if GLIB_CHECK_VERSION (2, 32, 0)
+  g_mutex_lock (&history->lock);
+#else
+  g_mutex_lock (history->lock);
+#endif
+}
+
+static void
+unlock_history (MafwLastfmHistory *history)
+{
+#if GLIB_CHECK_VERSION (2, 32, 0)
+  g_mutex_unlock (&history->lock);
+#else
+  g_mutex_unlock (history->lock);
+#endif
+}
+
+static gchar *
+fold (const gchar *string)
+{
+  if (!string)
+    return g_strdup ("");
+
+  if (g_utf8_validate (string, -1, NULL))
+    return g_utf8_casefold (string, -1);
+  else
+    return g_ascii_strdown (string, -1);
+}
+
+static guint32
+fnv1a (guint32 hash,
+       const gchar *string)
+{
+  for (; *string; string++) {
+    hash ^= (guchar) *string;
+    hash *= FNV_PRIME;
+  }
+
+  return hash;
+}
+
+static guint32
+hash_artist (const gchar *folded_artist)
+{
+  return fnv1a (FNV_BASIS, folded_artist);
+}
+
+static guint32
+hash_track (const gchar *folded_artist,
+            const gchar *folded_title)
+{
+  guint32 hash;
+
+  /* The NUL separating both strings, so that "ab" "c" and "a" "bc"
+     don't collide. */
+  hash = fnv1a (FNV_BASIS, folded_artist) * FNV_PRIME;
+
+  return fnv1a (hash, folded_title);
+}
+
+static int
+compare_time_entries (const void *a,
+                      const void *b)
+{
+  gint64 timestamp_a, timestamp_b;
+  gint64 offset_a, offset_b;
+
+  timestamp_a = read_int64 (a);
+  timestamp_b = read_int64 (b);
+  if (timestamp_a != timestamp_b)
+    return timestamp_a < timestamp_b ? -1 : 1;
+
+  offset_a = read_int64 ((const gchar *) a + 8);
+  offset_b = read_int64 ((const gchar *) b + 8);
+
+  return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+static int
+compare_key_entries (const void *a,
+                     const void *b)
+{
+  guint32 hash_a, hash_b;
+  gint64 offset_a, offset_b;
+
+  hash_a = read_uint32 (a);
+  hash_b = read_uint32 (b);
+  if (hash_a != hash_b)
+    return hash_a < hash_b ? -1 : 1;
+
+  offset_a = read_int64 ((const gchar *) a + 4);
+  offset_b = read_int64 ((const gchar *) b + 4);
+
+  return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+static const gchar *
+index_get_entry (HistoryIndex *index,
+                 guint i)
+{
+  return index->entries + (gsize) i * index->entry_size;
+}
+
+static goffset
+index_get_offset (HistoryIndex *index,
+                  guint i)
+{
+  return read_int64 (index_get_entry (index, i) + index->offset_pos);
+}
+
+static gboolean
+append_to_file (const gchar *path,
+                const gchar *data,
+                gsize length,
+                GError **error)
+{
+  GFile *file;
+  GFileOutputStream *outstream;
+  gboolean success;
+
+  file = g_file_new_for_path (path);
+  outstream = g_file_append_to (file, G_FILE_CREATE_PRIVATE, NULL, error);
+  g_object_unref (file);
+
+  if (!outstream)
+    return FALSE;
+
+  success = g_output_stream_write_all (G_OUTPUT_STREAM (outstream),
+                                       data, length, NULL, NULL, error);
+
+  if (!g_output_stream_close (G_OUTPUT_STREAM (outstream), NULL,
+                              success ? error : NULL))
+    success = FALSE;
+  g_object_unref (outstream);
+
+  return success;
+}
+
+static gboolean
+remap_log (MafwLastfmHistory *history,
+           GError **error)
+{
+  GMappedFile *map, *old_map;
+
+  map = g_mapped_file_new (history->path, FALSE, error);
+  if (!map)
+    return FALSE;
+
+  lock_history (history);
+  old_map = history->map;
+  history->map = map;
+  history->data = g_mapped_file_get_contents (map);
+  history->size = g_mapped_file_get_length (map);
+  unlock_history (history);
+
+  if (old_map)
+    g_mapped_file_unref (old_map);
+
+  return TRUE;
+}
+
+/* Points @index to the entries in @map, if it holds a valid index
+   of the log as mapped. Called with the lock held. */
+static gboolean
+index_set_map (MafwLastfmHistory *history,
+               HistoryIndex *index,
+               GMappedFile *map)
+{
+  const gchar *contents;
+  gsize length;
+  guint64 n_sorted, n_entries;
+  goffset covered;
+
+  contents = g_mapped_file_get_contents (map);
+  length = g_mapped_file_get_length (map);
+
+  if (length < INDEX_HEADER_SIZE ||
+      memcmp (contents, INDEX_MAGIC, 4) != 0 ||
+      read_uint32 (contents + 4) != MAFW_LASTFM_HISTORY_VERSION ||
+      (length - INDEX_HEADER_SIZE) % index->entry_size != 0)
+    return FALSE;
+
+  n_entries = (length - INDEX_HEADER_SIZE) / index->entry_size;
+  n_sorted = read_int64 (contents + 8);
+  covered = read_int64 (contents + 16);
+
+  if (n_sorted > n_entries || n_entries > G_MAXUINT ||
+      covered < HISTORY_HEADER_SIZE || covered > history->size)
+    return FALSE;
+
+  if (index->map)
+    g_mapped_file_unref (index->map);
+  index->map = map;
+  index->entries = contents + INDEX_HEADER_SIZE;
+  index->n_sorted = n_sorted;
+  index->n_entries = n_entries;
+  index->covered = covered;
+
+  return TRUE;
+}
+
+static void
+index_reset (HistoryIndex *index)
+{
+  if (index->map)
+    g_mapped_file_unref (index->map);
+  index->map = NULL;
+  index->entries = NULL;
+  index->n_sorted = 0;
+  index->n_entries = 0;
+  index->covered = HISTORY_HEADER_SIZE;
+}
+
+static gboolean
+remap_index (MafwLastfmHistory *history,
+             HistoryIndex *index,
+             GError **error)
+{
+  GMappedFile *map;
+  gboolean valid;
+
+  map = g_mapped_file_new (index->path, FALSE, error);
+  if (!map)
+    return FALSE;
+
+  lock_history (history);
+  valid = index_set_map (history, index, map);
+  unlock_history (history);
+
+  if (!valid) {
+    g_mapped_file_unref (map);
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                 "Invalid index %s", index->path);
+  }
+
+  return valid;
+}
+
+/* Returns the end of the log covered by @index, or -1 if its last
+   entry doesn't point at a record. */
+static goffset
+index_get_end (MafwLastfmHistory *history,
+               HistoryIndex *index)
+{
+  MafwLastfmJournalIter iter;
+  MafwLastfmTrack track;
+  goffset offset;
+
+  if (index->n_entries == index->n_sorted)
+    return index->covered;
+
+  offset = index_get_offset (index, index->n_entries - 1);
+  if (offset < index->covered || offset >= history->size)
+    return -1;
+
+  mafw_lastfm_journal_iter_init (&iter, history->data + offset,
+                                 history->size - offset);
+  if (!mafw_lastfm_journal_iter_next (&iter, &track, NULL) ||
+      iter.record_offset != 0)
+    return -1;
+
+  return offset + iter.offset;
+}
+
+static void
+add_entries (GString *entries[N_INDEXES],
+             const MafwLastfmTrack *track,
+             goffset offset)
+{
+  gchar *artist, *title;
+  guint32 artist_hash, track_hash;
+
+  artist = fold (track->artist);
+  title = fold (track->title);
+  artist_hash = hash_artist (artist);
+  track_hash = hash_track (artist, title);
+  g_free (artist);
+  g_free (title);
+
+  if (entries[INDEX_TIME]) {
+    append_int64 (entries[INDEX_TIME], track->timestamp);
+    append_int64 (entries[INDEX_TIME], offset);
+    append_uint32 (entries[INDEX_TIME], artist_hash);
+    append_uint32 (entries[INDEX_TIME], track_hash);
+  }
+
+  if (entries[INDEX_ARTIST]) {
+    append_uint32 (entries[INDEX_ARTIST], artist_hash);
+    append_int64 (entries[INDEX_ARTIST], offset);
+  }
+
+  if (entries[INDEX_TRACK]) {
+    append_uint32 (entries[INDEX_TRACK], track_hash);
+    append_int64 (entries[INDEX_TRACK], offset);
+  }
+}
+
+/* Builds the entries of @type for the records of the log in
+   [@from, @to). */
+static GString *
+index_log (MafwLastfmHistory *history,
+           IndexType type,
+           goffset from,
+           goffset to)
+{
+  GString *entries[N_INDEXES] = { NULL };
+  MafwLastfmJournalIter iter;
+  MafwLastfmTrack track;
+
+  entries[type] = g_string_new (NULL);
+
+  mafw_lastfm_journal_iter_init (&iter, history->data + from, to - from);
+  while (mafw_lastfm_journal_iter_next (&iter, &track, NULL))
+    add_entries (entries, &track, from + iter.record_offset);
+
+  return entries[type];
+}
+
+/* Rewrites @index with its entries and @extra, all of them sorted,
+   covering the log up to @covered. */
+static gboolean
+compact_index (MafwLastfmHistory *history,
+               HistoryIndex *index,
+               const GString *extra,
+               goffset covered,
+               GError **error)
+{
+  GString *contents;
+  gchar *tail;
+  gsize size;
+  guint n_tail, n_extra, n_new;
+  guint i, j;
+  gboolean success;
+
+  size = index->entry_size;
+  n_tail = index->n_entries - index->n_sorted;
+  n_extra = extra ? extra->len / size : 0;
+  n_new = n_tail + n_extra;
+
+  tail = g_malloc (n_new * size);
+  if (n_tail)
+    memcpy (tail, index_get_entry (index, index->n_sorted), n_tail * size);
+  if (n_extra)
+    memcpy (tail + n_tail * size, extra->str, n_extra * size);
+  qsort (tail, n_new, size, index->compare);
+
+  contents = g_string_sized_new (INDEX_HEADER_SIZE +
+                                 (index->n_sorted + n_new) * size);
+  g_string_append_len (contents, INDEX_MAGIC, 4);
+  append_uint32 (contents, MAFW_LASTFM_HISTORY_VERSION);
+  append_int64 (contents, index->n_sorted + n_new);
+  append_int64 (contents, covered);
+
+  i = j = 0;
+  while (i < index->n_sorted || j < n_new) {
+    if (j == n_new ||
+        (i < index->n_sorted &&
+         index->compare (index_get_entry (index, i), tail + j * size) <= 0)) {
+      g_string_append_len (contents, index_get_entry (index, i), size);
+      i++;
+    } else {
+      g_string_append_len (contents, tail + j * size, size);
+      j++;
+    }
+  }
+  g_free (tail);
+
+  g_print ("Compacting %s: %u entries\n", index->path, index->n_sorted + n_new);
+
+  success = g_file_set_contents (index->path, contents->str, contents->len,
+                                 error);
+  g_string_free (contents, TRUE);
+
+  if (success)
+    success = remap_index (history, index, error);
+
+  return success;
+}
+
+static void
+load_index (MafwLastfmHistory *history,
+            IndexType type)
+{
+  HistoryIndex *index;
+  GMappedFile *map;
+  GString *extra = NULL;
+  GError *error = NULL;
+  goffset end = -1;
+  gboolean rewrite;
+
+  index = &history->indexes[type];
+
+  map = g_mapped_file_new (index->path, FALSE, NULL);
+  if (map) {
+    if (index_set_map (history, index, map))
+      end = index_get_end (history, index);
+    else
+      g_mapped_file_unref (map);
+  }
+
+  rewrite = end < 0;
+  if (rewrite) {
+    g_print ("Rebuilding %s\n", index->path);
+    index_reset (index);
+    end = HISTORY_HEADER_SIZE;
+  }
+
+  if (end < history->size) {
+    extra = index_log (history, type, end, history->size);
+    rewrite = TRUE;
+  }
+
+  if (rewrite &&
+      !compact_index (history, index, extra, history->size, &error)) {
+    g_warning ("Couldn't write the history index: %s", error->message);
+    g_error_free (error);
+    index_reset (index);
+    index->broken = TRUE;
+  }
+
+  if (extra)
+    g_string_free (extra, TRUE);
+}
+
+static gboolean
+open_log (MafwLastfmHistory *history,
+          GError **error)
+{
+  gchar header[HISTORY_HEADER_SIZE];
+  guint32 version;
+  struct stat st;
+
+  if (g_stat (history->path, &st) != 0 || st.st_size == 0) {
+    memcpy (header, HISTORY_MAGIC, 4);
+    version = GUINT32_TO_LE (MAFW_LASTFM_HISTORY_VERSION);
+    memcpy (header + 4, &version, 4);
+
+    if (!append_to_file (history->path, header, HISTORY_HEADER_SIZE, error))
+      return FALSE;
+  }
+
+  if (!remap_log (history, error))
+    return FALSE;
+
+  if (history->size < HISTORY_HEADER_SIZE ||
+      memcmp (history->data, HISTORY_MAGIC, 4) != 0) {
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                 "%s is not a history", history->path);
+    return FALSE;
+  }
+
+  version = read_uint32 (history->data + 4);
+  if (version > MAFW_LASTFM_HISTORY_VERSION) {
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                 "Unsupported history version %u", version);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * mafw_lastfm_history_new:
+ * @path: the path of the history
+ *
+ * Opens the history at @path, creating it if needed, and brings its
+ * indexes up to date.
+ *
+ * Returns: a new #MafwLastfmHistory, or %NULL if @path can't be used.
+ **/
+MafwLastfmHistory *
+mafw_lastfm_history_new (const gchar *path)
+{
+  MafwLastfmHistory *history;
+  HistoryIndex *index;
+  GError *error = NULL;
+  const gchar *suffixes[N_INDEXES] = { TIME_SUFFIX, ARTIST_SUFFIX,
+                                       TRACK_SUFFIX };
+  guint i;
+
+  g_return_val_if_fail (path != NULL, NULL);
+
+  history = g_new0 (MafwLastfmHistory, 1);
+  history->path = g_strdup (path);
+#if GLIB_CHECK_VERSION (2, 32, 0)
+  g_mutex_init (&history->lock);
+#else
+  history->lock = g_mutex_new ();
+#endif
+
+  for (i = 0; i < N_INDEXES; i++) {
+    index = &history->indexes[i];
+    index->path = g_strconcat (path, suffixes[i], NULL);
+    if (i == INDEX_TIME) {
+      index->entry_size = TIME_ENTRY_SIZE;
+      index->offset_pos = 8;
+      index->compare = compare_time_entries;
+    } else {
+      index->entry_size = KEY_ENTRY_SIZE;
+      index->offset_pos = 4;
+      index->compare = compare_key_entries;
+    }
+    index_reset (index);
+  }
+
+  if (!open_log (history, &error)) {
+    g_warning ("Couldn't open the history: %s", error->message);
+    g_error_free (error);
+    mafw_lastfm_history_free (history);
+    return NULL;
+  }
+
+  for (i = 0; i < N_INDEXES; i++)
+    load_index (history, i);
+
+  return history;
+}
+
+/**
+ * mafw_lastfm_history_free:
+ * @history: a #MafwLastfmHistory
+ *
+ * Closes @history. No append can be running.
+ **/
+void
+mafw_lastfm_history_free (MafwLastfmHistory *history)
+{
+  guint i;
+
+  g_return_if_fail (history != NULL);
+
+  for (i = 0; i < N_INDEXES; i++) {
+    index_reset (&history->indexes[i]);
+    g_free (history->indexes[i].path);
+  }
+
+  if (history->map)
+    g_mapped_file_unref (history->map);
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+  g_mutex_clear (&history->lock);
+#else
+  g_mutex_free (history->lock);
+#endif
+
+  g_free (history->path);
+  g_free (history);
+}
+
+static gchar *
+unescape (const gchar *string)
+{
+  gchar *unescaped;
+
+  unescaped = g_uri_unescape_string (string, NULL);
+
+  return unescaped ? unescaped : g_strdup (string);
+}
+
+/**
+ * mafw_lastfm_history_append:
+ * @history: a #MafwLastfmHistory
+ * @records: records in the format of the journal
+ * @length: the length of @records
+ *
+ * Appends the plays in @records to the history and its indexes. Meant
+ * to be the archive function of the journal, it can run in any
+ * thread, but only one append can run at a time.
+ **/
+void
+mafw_lastfm_history_append (MafwLastfmHistory *history,
+                            const gchar *records,
+                            gsize length)
+{
+  MafwLastfmJournalIter iter;
+  MafwLastfmTrack track, unescaped;
+  HistoryIndex *index;
+  gchar *artist, *title, *album;
+  GString *buffer;
+  GString *entries[N_INDEXES];
+  GError *error = NULL;
+  goffset base;
+  guint flags;
+  guint i;
+  struct stat st;
+
+  g_return_if_fail (history != NULL);
+
+  /* After a failed append the file may be longer than mapped. */
+  base = g_stat (history->path, &st) == 0 ? st.st_size : history->size;
+
+  buffer = g_string_new (NULL);
+  for (i = 0; i < N_INDEXES; i++)
+    entries[i] = g_string_new (NULL);
+
+  mafw_lastfm_journal_iter_init (&iter, records, length);
+  while (mafw_lastfm_journal_iter_next (&iter, &track, &flags)) {
+    if (flags & MAFW_LASTFM_JOURNAL_RECORD_ENCODED) {
+      artist = unescape (track.artist);
+      title = unescape (track.title);
+      album = unescape (track.album);
+      unescaped = track;
+      unescaped.artist = artist;
+      unescaped.title = title;
+      unescaped.album = album;
+      add_entries (entries, &unescaped, base + buffer->len);
+      mafw_lastfm_journal_encode_record (buffer, &unescaped, 0);
+      g_free (artist);
+      g_free (title);
+      g_free (album);
+    } else {
+      add_entries (entries, &track, base + buffer->len);
+      mafw_lastfm_journal_encode_record (buffer, &track, 0);
+    }
+  }
+
+  if (buffer->len == 0)
+    goto out;
+
+  if (!append_to_file (history->path, buffer->str, buffer->len, &error) ||
+      !remap_log (history, &error)) {
+    g_warning ("Couldn't append to the history: %s", error->message);
+    g_error_free (error);
+    goto out;
+  }
+
+  for (i = 0; i < N_INDEXES; i++) {
+    index = &history->indexes[i];
+    if (index->broken)
+      continue;
+
+    if (!append_to_file (index->path, entries[i]->str, entries[i]->len,
+                         &error) ||
+        !remap_index (history, index, &error) ||
+        (index->n_entries - index->n_sorted >
+         MAX (TAIL_MIN, index->n_sorted / TAIL_RATIO) &&
+         !compact_index (history, index, NULL, history->size, &error))) {
+      g_warning ("Couldn't update the history index: %s", error->message);
+      g_error_free (error);
+      error = NULL;
+      index->broken = TRUE;
+    }
+  }
+
+out:
+  g_string_free (buffer, TRUE);
+  for (i = 0; i < N_INDEXES; i++)
+    g_string_free (entries[i], TRUE);
+}
+
+/**
+ * mafw_lastfm_history_get_n_plays:
+ * @history: a #MafwLastfmHistory
+ *
+ * Returns: the number of plays in @history.
+ **/
+guint
+mafw_lastfm_history_get_n_plays (MafwLastfmHistory *history)
+{
+  guint n_plays;
+
+  g_return_val_if_fail (history != NULL, 0);
+
+  lock_history (history);
+  n_plays = history->indexes[INDEX_TIME].n_entries;
+  unlock_history (history);
+
+  return n_plays;
+}
+
+/* Reads the play at @offset, if it is by @folded_artist and, unless
+   %NULL, named @folded_title. Called with the lock held. */
+static MafwLastfmTrack *
+read_play (MafwLastfmHistory *history,
+           goffset offset,
+           const gchar *folded_artist,
+           const gchar *folded_title)
+{
+  MafwLastfmJournalIter iter;
+  MafwLastfmTrack track;
+  gchar *folded;
+  gboolean matches;
+
+  if (offset < HISTORY_HEADER_SIZE || offset >= history->size)
+    return NULL;
+
+  mafw_lastfm_journal_iter_init (&iter, history->data + offset,
+                                 history->size - offset);
+  if (!mafw_lastfm_journal_iter_next (&iter, &track, NULL) ||
+      iter.record_offset != 0)
+    return NULL;
+
+  /* Tell apart the names with the same hash. */
+  if (folded_artist) {
+    folded = fold (track.artist);
+    matches = strcmp (folded, folded_artist) == 0;
+    g_free (folded);
+    if (!matches)
+      return NULL;
+  }
+
+  if (folded_title) {
+    folded = fold (track.title);
+    matches = strcmp (folded, folded_title) == 0;
+    g_free (folded);
+    if (!matches)
+      return NULL;
+  }
+
+  return mafw_lastfm_track_new_full (track.artist, track.title, track.album,
+                                     track.timestamp, track.source,
+                                     track.length, track.number);
+}
+
+static gint
+compare_newest_first (gconstpointer a,
+                      gconstpointer b)
+{
+  const MafwLastfmTrack *track_a = a;
+  const MafwLastfmTrack *track_b = b;
+
+  if (track_a->timestamp != track_b->timestamp)
+    return track_a->timestamp > track_b->timestamp ? -1 : 1;
+
+  return 0;
+}
+
+static GList *
+truncate_plays (GList *plays,
+                guint max_plays)
+{
+  GList *rest;
+
+  if (max_plays == 0)
+    return plays;
+
+  rest = g_list_nth (plays, max_plays);
+  if (!rest)
+    return plays;
+
+  rest->prev->next = NULL;
+  rest->prev = NULL;
+  g_list_foreach (rest, (GFunc) mafw_lastfm_track_unref, NULL);
+  g_list_free (rest);
+
+  return plays;
+}
+
+/**
+ * mafw_lastfm_history_get_plays:
+ * @history: a #MafwLastfmHistory
+ * @artist: the artist
+ * @title: the title of the track, or %NULL for every track of @artist
+ * @max_plays: the maximum number of plays to return, or 0 for all
+ *
+ * Looks up the plays of a track, or of an artist. Names are compared
+ * regardless of case.
+ *
+ * Returns: a list of #MafwLastfmTrack, newest first, to be released
+ * with mafw_lastfm_track_unref() and g_list_free().
+ **/
+GList *
+mafw_lastfm_history_get_plays (MafwLastfmHistory *history,
+                               const gchar *artist,
+                               const gchar *title,
+                               guint max_plays)
+{
+  HistoryIndex *index;
+  MafwLastfmTrack *track;
+  GList *plays = NULL;
+  gchar *folded_artist, *folded_title = NULL;
+  guint32 hash;
+  guint low, high, middle, i;
+
+  g_return_val_if_fail (history != NULL, NULL);
+  g_return_val_if_fail (artist != NULL, NULL);
+
+  folded_artist = fold (artist);
+  if (title) {
+    folded_title = fold (title);
+    hash = hash_track (folded_artist, folded_title);
+    index = &history->indexes[INDEX_TRACK];
+  } else {
+    hash = hash_artist (folded_artist);
+    index = &history->indexes[INDEX_ARTIST];
+  }
+
+  lock_history (history);
+
+  low = 0;
+  high = index->n_sorted;
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    if (read_uint32 (index_get_entry (index, middle)) < hash)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  /* The matching sorted entries, then all of the unsorted ones. */
+  for (i = low; i < index->n_entries; i++) {
+    if (read_uint32 (index_get_entry (index, i)) != hash) {
+      if (i < index->n_sorted)
+        i = index->n_sorted - 1;
+      continue;
+    }
+
+    track = read_play (history, index_get_offset (index, i),
+                       folded_artist, folded_title);
+    if (track)
+      plays = g_list_prepend (plays, track);
+  }
+
+  unlock_history (history);
+
+  g_free (folded_artist);
+  g_free (folded_title);
+
+  plays = g_list_sort (plays, compare_newest_first);
+
+  return truncate_plays (plays, max_plays);
+}
+
+static gint
+compare_time_keys (gconstpointer a,
+                   gconstpointer b)
+{
+  const TimeKey *key_a = a;
+  const TimeKey *key_b = b;
+
+  if (key_a->timestamp != key_b->timestamp)
+    return key_a->timestamp > key_b->timestamp ? -1 : 1;
+
+  return key_a->offset > key_b->offset ? -1 : key_a->offset < key_b->offset;
+}
+
+/**
+ * mafw_lastfm_history_get_recent:
+ * @history: a #MafwLastfmHistory
+ * @n_plays: the number of plays to return
+ *
+ * Returns: a list of the last @n_plays #MafwLastfmTrack played,
+ * newest first, to be released with mafw_lastfm_track_unref() and
+ * g_list_free().
+ **/
+GList *
+mafw_lastfm_history_get_recent (MafwLastfmHistory *history,
+                                guint n_plays)
+{
+  HistoryIndex *index;
+  GArray *keys;
+  TimeKey key;
+  MafwLastfmTrack *track;
+  GList *plays = NULL;
+  const gchar *entry;
+  guint i;
+
+  g_return_val_if_fail (history != NULL, NULL);
+
+  index = &history->indexes[INDEX_TIME];
+  keys = g_array_new (FALSE, FALSE, sizeof (TimeKey));
+
+  lock_history (history);
+
+  /* The newest plays are the last sorted ones, unless they are among
+     the ones appended since. */
+  i = index->n_sorted > n_plays ? index->n_sorted - n_plays : 0;
+  for (; i < index->n_entries; i++) {
+    entry = index_get_entry (index, i);
+    key.timestamp = read_int64 (entry);
+    key.offset = read_int64 (entry + 8);
+    g_array_append_val (keys, key);
+  }
+
+  g_array_sort (keys, compare_time_keys);
+
+  for (i = MIN (keys->len, n_plays); i > 0; i--) {
+    track = read_play (history, g_array_index (keys, TimeKey, i - 1).offset,
+                       NULL, NULL);
+    if (track)
+      plays = g_list_prepend (plays, track);
+  }
+
+  unlock_history (history);
+
+  g_array_free (keys, TRUE);
+
+  return plays;
+}
+
+static gint
+compare_counts (gconstpointer a,
+                gconstpointer b)
+{
+  const ArtistCount *count_a = *(ArtistCount * const *) a;
+  const ArtistCount *count_b = *(ArtistCount * const *) b;
+
+  if (count_a->plays != count_b->plays)
+    return count_a->plays > count_b->plays ? -1 : 1;
+
+  return count_a->offset > count_b->offset ? -1 :
+    count_a->offset < count_b->offset;
+}
+
+/**
+ * mafw_lastfm_history_get_top_artists:
+ * @history: a #MafwLastfmHistory
+ * @since: the time to count the plays from, in seconds since the
+ * epoch, or 0 for all of them
+ * @n_artists: the number of artists to return
+ *
+ * Counts the plays of each artist, by the hash of its name, so two
+ * artists whose names collide are counted as one, with the name of
+ * the one played last.
+ *
+ * Returns: a list of the @n_artists #MafwLastfmHistoryCount with the
+ * most plays, to be released with mafw_lastfm_history_count_free()
+ * and g_list_free().
+ **/
+GList *
+mafw_lastfm_history_get_top_artists (MafwLastfmHistory *history,
+                                     glong since,
+                                     guint n_artists)
+{
+  HistoryIndex *index;
+  GHashTable *counts;
+  GHashTableIter hash_iter;
+  GPtrArray *sorted;
+  ArtistCount *count;
+  MafwLastfmHistoryCount *top;
+  MafwLastfmTrack *track;
+  GList *artists = NULL;
+  const gchar *entry;
+  guint32 hash;
+  guint low, high, middle, i;
+
+  g_return_val_if_fail (history != NULL, NULL);
+
+  index = &history->indexes[INDEX_TIME];
+  counts = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+
+  lock_history (history);
+
+  low = 0;
+  high = index->n_sorted;
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    if (read_int64 (index_get_entry (index, middle)) < since)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  for (i = low; i < index->n_entries; i++) {
+    entry = index_get_entry (index, i);
+    if (i >= index->n_sorted && read_int64 (entry) < since)
+      continue;
+
+    hash = read_uint32 (entry + 16);
+    count = g_hash_table_lookup (counts, GUINT_TO_POINTER (hash));
+    if (!count) {
+      count = g_new0 (ArtistCount, 1);
+      count->hash = hash;
+      g_hash_table_insert (counts, GUINT_TO_POINTER (hash), count);
+    }
+    count->plays++;
+    count->offset = MAX (count->offset, read_int64 (entry + 8));
+  }
+
+  sorted = g_ptr_array_sized_new (g_hash_table_size (counts));
+  g_hash_table_iter_init (&hash_iter, counts);
+  while (g_hash_table_iter_next (&hash_iter, NULL, (gpointer *) &count))
+    g_ptr_array_add (sorted, count);
+  g_ptr_array_sort (sorted, compare_counts);
+
+  for (i = MIN (sorted->len, n_artists); i > 0; i--) {
+    count = g_ptr_array_index (sorted, i - 1);
+    track = read_play (history, count->offset, NULL, NULL);
+    if (!track)
+      continue;
+
+    top = g_new (MafwLastfmHistoryCount, 1);
+    top->artist = g_strdup (track->artist);
+    top->plays = count->plays;
+    artists = g_list_prepend (artists, top);
+    mafw_lastfm_track_unref (track);
+  }
+
+  unlock_history (history);
+
+  g_ptr_array_free (sorted, TRUE);
+  g_hash_table_destroy (counts);
+
+  return artists;
+}
+
+/**
+ * mafw_lastfm_history_count_free:
+ * @count: a #MafwLastfmHistoryCount
+ *
+ * Frees @count.
+ **/
+void
+mafw_lastfm_history_count_free (MafwLastfmHistoryCount *count)
+{
+  g_free (count->artist);
+  g_free (count);
+}
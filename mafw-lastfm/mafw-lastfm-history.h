@@ -0,0 +1,73 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2009-2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef MAFW_LASTFM_HISTORY_H
+#define MAFW_LASTFM_HISTORY_H
+
+#include <glib.h>
+
+#include "mafw-lastfm-track.h"
+
+G_BEGIN_DECLS
+
+#define MAFW_LASTFM_HISTORY_VERSION 1
+
+typedef struct MafwLastfmHistory MafwLastfmHistory;
+
+typedef struct {
+  gchar *artist;
+  guint plays;
+} MafwLastfmHistoryCount;
+
+MafwLastfmHistory *
+mafw_lastfm_history_new (const gchar *path);
+
+void
+mafw_lastfm_history_free (MafwLastfmHistory *history);
+
+void
+mafw_lastfm_history_append (MafwLastfmHistory *history,
+                            const gchar *records,
+                            gsize length);
+
+guint
+mafw_lastfm_history_get_n_plays (MafwLastfmHistory *history);
+
+GList *
+mafw_lastfm_history_get_plays (MafwLastfmHistory *history,
+                               const gchar *artist,
+                               const gchar *title,
+                               guint max_plays);
+
+GList *
+mafw_lastfm_history_get_recent (MafwLastfmHistory *history,
+                                guint n_plays);
+
+GList *
+mafw_lastfm_history_get_top_artists (MafwLastfmHistory *history,
+                                     glong since,
+                                     guint n_artists);
+
+void
+mafw_lastfm_history_count_free (MafwLastfmHistoryCount *count);
+
+G_END_DECLS
+
+#endif /* MAFW_LASTFM_HISTORY_H */
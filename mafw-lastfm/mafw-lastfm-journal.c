@@ -0,0 +1,2118 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The journal is an append-only file of binary records. It starts
+ * with a header holding JOURNAL_MAGIC and the format version, followed
+ * by any number of records of the form:
+ *
+ *   RECORD_MARKER | payload length | payload | crc32
+ *
+ * All integers are little endian, and the crc32 covers the payload
+ * length and the payload. The payload holds the fixed-size fields of
+ * the track followed by the artist, title and album strings, each of
+ * them NUL-terminated so that they can be used in place.
+ *
+ * A record that fails validation (for instance, because of a torn
+ * write) is skipped by looking for the next RECORD_MARKER, so the
+ * records after it are not lost.
+ *
+ * Records are never rewritten in place. Instead, the offset up to
+ * which the records have been acknowledged by the server is kept in a
+ * separate cursor file (the journal path plus ACK_SUFFIX), and the
+ * acknowledged records are dropped when the journal is compacted.
+ *
+ * Compacting also seals the pending records, so that a long offline
+ * backlog takes little flash: right after the header, they are
+ * rewritten as segments of at least MAFW_LASTFM_JOURNAL_SEGMENT_SIZE
+ * bytes of records, compressed with zlib:
+ *
+ *   SEGMENT_MARKER | length of the records | compressed length | data
+ *
+ * The records left after the last segment, the active tail, stay
+ * uncompressed, and records are still appended to it as they are.
+ * Offsets everywhere are those of the records uncompressed, as if
+ * there were no segments, and only the worker maps them to the file.
+ * A batch read in a segment inflates it from where the previous batch
+ * stopped, so submitting a backlog inflates each segment once.
+ *
+ * Each server the records are submitted to has a named cursor of its
+ * own. The cursor file starts with the lowest of them, which is all
+ * that older versions wrote, followed by a "name offset" line per
+ * cursor. Records are only dropped once behind every cursor, and are
+ * handed to the archive function, if any, just before. The ones a
+ * server rejected are left out of it, and listed after an empty line
+ * of the cursor file, one "start end" line per run of records, until
+ * every cursor is past them.
+ *
+ * The offsets of the records after the cursor are kept in memory, so
+ * that the number of pending records is known without reading the
+ * file, and a batch of records can be read with a single seek.
+ *
+ * The file is only touched by a worker thread, which runs the requests
+ * queued from the main loop one after the other. It hands them back
+ * to the main loop in the same order, to update the index and run
+ * their callbacks there, so that the index and the cursors need no
+ * locking. Only mafw_lastfm_journal_new() reads the journal right
+ * away, before the main loop runs.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "mafw-lastfm-journal.h"
+
+#define JOURNAL_MAGIC "MLFJ"
+#define JOURNAL_HEADER_SIZE 8
+#define RECORD_MARKER "MLFR"
+#define RECORD_MARKER_SIZE 4
+/* marker + payload length + crc32 */
+#define RECORD_OVERHEAD (RECORD_MARKER_SIZE + 4 + 4)
+/* timestamp, length, number, source, flags and the string lengths. */
+#define PAYLOAD_FIXED_SIZE (8 + 8 + 4 + 1 + 1 + 3 * 4)
+#define PAYLOAD_MAX_SIZE (1024 * 1024)
+#define ACK_SUFFIX ".ack"
+#define SEGMENT_MARKER "MLFZ"
+/* marker + length of the records + compressed length */
+#define SEGMENT_OVERHEAD (RECORD_MARKER_SIZE + 4 + 4)
+/* How much of a segment is read or inflated at a time. */
+#define SEGMENT_CHUNK_SIZE 8192
+
+#ifndef MAFW_LASTFM_ENABLE_DEBUG
+ #undef g_print
+ #define g_print(...)
+#endif
+
+typedef struct {
+  goffset offset;
+  guint32 size;
+} JournalEntry;
+
+/* A compressed run of records: where they are in the journal, and
+   where the segment, marker included, is in the file. */
+typedef struct {
+  goffset offset;
+  guint32 length;
+  goffset position;
+  guint32 compressed_size;
+} JournalSegment;
+
+typedef struct {
+  gchar *name;
+  goffset offset;
+  /* Loaded cursors are ignored until they are added back. */
+  gboolean added;
+} JournalCursor;
+
+typedef struct {
+  goffset start;
+  goffset end;
+} JournalRange;
+
+struct MafwLastfmJournal {
+  gchar *path;
+  gchar *ack_path;
+  /* The offset of the end, and the size of the file. */
+  goffset size;
+  goffset disk_size;
+  /* The end of the last segment, if any. */
+  goffset sealed;
+  /* The lowest of the cursors that have been added. */
+  goffset acked;
+  GArray *cursors;
+  /* JournalEntry for each record after the lowest cursor. */
+  GArray *index;
+
+  GThread *worker;
+  /* The requests for the worker, and the ones it is done with. */
+  GAsyncQueue *requests;
+  GAsyncQueue *done;
+  /* The idle handing the done requests back, under the lock of
+     done. */
+  guint dispatch_id;
+  guint n_appending;
+  /* Bumped when the journal is cleared, to drop the records appended
+     before. */
+  guint generation;
+  gboolean compacting;
+  /* The cursors moved while compacting, and must be saved once
+     done. */
+  gboolean cursors_dirty;
+
+  MafwLastfmJournalArchiveFunc archive_func;
+  gpointer archive_data;
+  /* The end of the acknowledged records handed to archive_func, and
+     the JournalRange of records after it not to hand, in order. */
+  goffset archived;
+  GArray *rejected;
+
+  /* Only touched by the worker, once started. The segments, in order,
+     and how much longer the records before the tail are than in the
+     file. */
+  GArray *segments;
+  goffset shift;
+  /* The segment being inflated, if any, and where it is at in the
+     records and in the file. */
+  z_stream inflater;
+  gboolean inflating;
+  guint inflating_segment;
+  gsize inflated;
+  goffset inflate_position;
+};
+
+typedef enum {
+  JOURNAL_APPEND,
+  JOURNAL_READ,
+  JOURNAL_SAVE_CURSORS,
+  JOURNAL_ARCHIVE,
+  JOURNAL_COMPACT,
+  JOURNAL_CLEAR,
+  JOURNAL_WRITE_FILE,
+  JOURNAL_QUIT
+} JournalOp;
+
+typedef struct {
+  JournalOp op;
+  /* The records to append, or the cursor file to save. For
+     JOURNAL_COMPACT, the cursor file saved before replacing the
+     journal, and cursors the one saved after. */
+  GString *data;
+  GString *cursors;
+  /* A file to remove once the records are appended. */
+  gchar *remove_path;
+  /* For JOURNAL_WRITE_FILE, the file to write data to, and whether
+     to append it. */
+  gchar *path;
+  gboolean append;
+  /* Where to read or compact from, or where the records were
+     appended. */
+  goffset offset;
+  gsize length;
+  gchar *contents;
+  /* The size of the journal once done, the size of the file, and
+     the end of the last segment. */
+  goffset size;
+  goffset disk_size;
+  goffset sealed;
+  guint generation;
+  GError *error;
+  GCallback callback;
+  gpointer user_data;
+} JournalRequest;
+
+static void
+append_uint32 (GString *buffer,
+               guint32 value)
+{
+  value = GUINT32_TO_LE (value);
+  g_string_append_len (buffer, (const gchar *) &value, 4);
+}
+
+static void
+append_int64 (GString *buffer,
+              gint64 value)
+{
+  value = GINT64_TO_LE (value);
+  g_string_append_len (buffer, (const gchar *) &value, 8);
+}
+
+static guint32
+read_uint32 (const gchar *data)
+{
+  guint32 value;
+
+  memcpy (&value, data, 4);
+  return GUINT32_FROM_LE (value);
+}
+
+static gint64
+read_int64 (const gchar *data)
+{
+  gint64 value;
+
+  memcpy (&value, data, 8);
+  return GINT64_FROM_LE (value);
+}
+
+static void
+load_ack_cursor (MafwLastfmJournal *journal)
+{
+  JournalCursor cursor;
+  JournalRange range;
+  gboolean ranges = FALSE;
+  gchar *contents;
+  gchar **lines;
+  gchar *separator;
+  gint i;
+
+  journal->acked = 0;
+
+  if (journal->size == 0)
+    return;
+
+  if (!g_file_get_contents (journal->ack_path, &contents, NULL, NULL))
+    return;
+
+  lines = g_strsplit (contents, "\n", 0);
+  g_free (contents);
+
+  journal->acked = g_ascii_strtoll (lines[0], NULL, 10);
+  /* A cursor beyond the end doesn't belong to this journal. */
+  if (journal->acked > journal->size) {
+    g_warning ("Ignoring invalid acknowledgement cursor");
+    journal->acked = 0;
+  }
+
+  for (i = 1; lines[i] != NULL; i++) {
+    /* The rejected records follow the cursors. */
+    if (lines[i][0] == '\0') {
+      ranges = TRUE;
+      continue;
+    }
+
+    separator = strrchr (lines[i], ' ');
+    if (!separator)
+      continue;
+
+    if (ranges) {
+      range.start = g_ascii_strtoll (lines[i], NULL, 10);
+      range.end = g_ascii_strtoll (separator + 1, NULL, 10);
+      if (range.start >= journal->acked && range.start < range.end &&
+          range.end <= journal->size)
+        g_array_append_val (journal->rejected, range);
+      continue;
+    }
+
+    cursor.offset = g_ascii_strtoll (separator + 1, NULL, 10);
+    if (cursor.offset < journal->acked || cursor.offset > journal->size)
+      cursor.offset = journal->acked;
+    cursor.name = g_strndup (lines[i], separator - lines[i]);
+    cursor.added = FALSE;
+    g_array_append_val (journal->cursors, cursor);
+  }
+
+  g_strfreev (lines);
+}
+
+/**
+ * format_cursors:
+ * @journal: a #MafwLastfmJournal
+ * @delta: how much to move the cursors back, or %G_MAXINT64 to save
+ * them all at the start of the journal
+ *
+ * Formats the cursor file, with the cursors that have been added
+ * after the lowest of them, and then the rejected records.
+ *
+ * Returns: the contents of the cursor file.
+ **/
+static GString *
+format_cursors (MafwLastfmJournal *journal,
+                goffset delta)
+{
+  JournalCursor *cursor;
+  JournalRange *range;
+  GString *contents;
+  guint i;
+
+  contents = g_string_new (NULL);
+  g_string_append_printf (contents, "%" G_GINT64_FORMAT "\n",
+                          journal->acked > delta ?
+                          (gint64) (journal->acked - delta) : (gint64) 0);
+  for (i = 0; i < journal->cursors->len; i++) {
+    cursor = &g_array_index (journal->cursors, JournalCursor, i);
+    if (cursor->added)
+      g_string_append_printf (contents, "%s %" G_GINT64_FORMAT "\n",
+                              cursor->name,
+                              cursor->offset > delta ?
+                              (gint64) (cursor->offset - delta) : (gint64) 0);
+  }
+
+  /* Those moved to the start are sent again, and rejected again. */
+  if (journal->rejected->len > 0)
+    g_string_append_c (contents, '\n');
+  for (i = 0; i < journal->rejected->len; i++) {
+    range = &g_array_index (journal->rejected, JournalRange, i);
+    if (range->start - delta >= JOURNAL_HEADER_SIZE)
+      g_string_append_printf (contents, "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT "\n",
+                              (gint64) (range->start - delta),
+                              (gint64) (range->end - delta));
+  }
+
+  return contents;
+}
+
+static void
+index_records (MafwLastfmJournal *journal,
+               const gchar *data,
+               gsize length,
+               goffset offset)
+{
+  MafwLastfmJournalIter iter;
+  MafwLastfmTrack track;
+  JournalEntry entry;
+
+  mafw_lastfm_journal_iter_init (&iter, data, length);
+  while (mafw_lastfm_journal_iter_next (&iter, &track, NULL)) {
+    entry.offset = offset + iter.record_offset;
+    entry.size = iter.offset - iter.record_offset;
+    g_array_append_val (journal->index, entry);
+  }
+
+  if (iter.n_corrupted > 0)
+    g_warning ("Skipped %u corrupted record(s) in the journal",
+               iter.n_corrupted);
+}
+
+static void
+free_request (JournalRequest *request)
+{
+  if (request->data)
+    g_string_free (request->data, TRUE);
+  if (request->cursors)
+    g_string_free (request->cursors, TRUE);
+  g_free (request->remove_path);
+  g_free (request->path);
+  g_free (request->contents);
+  if (request->error)
+    g_error_free (request->error);
+  g_slice_free (JournalRequest, request);
+}
+
+static JournalRequest *
+new_request (MafwLastfmJournal *journal,
+             JournalOp op,
+             GCallback callback,
+             gpointer user_data)
+{
+  JournalRequest *request;
+
+  request = g_slice_new0 (JournalRequest);
+  request->op = op;
+  request->generation = journal->generation;
+  request->callback = callback;
+  request->user_data = user_data;
+
+  return request;
+}
+
+static GInputStream *
+open_journal (const gchar *path,
+              GError **error)
+{
+  GFile *file;
+  GFileInputStream *instream;
+
+  file = g_file_new_for_path (path);
+  instream = g_file_read (file, NULL, error);
+  g_object_unref (file);
+
+  return instream ? G_INPUT_STREAM (instream) : NULL;
+}
+
+static void
+close_journal (GInputStream *instream)
+{
+  g_input_stream_close (instream, NULL, NULL);
+  g_object_unref (instream);
+}
+
+/* Runs in the worker thread, like the other functions that touch the
+   file or the segments, down to run_request(). */
+static gboolean
+read_raw (GInputStream *instream,
+          goffset position,
+          gchar *buffer,
+          gsize length,
+          GError **error)
+{
+  gsize bytes_read = 0;
+
+  if (!g_seekable_seek (G_SEEKABLE (instream), position, G_SEEK_SET,
+                        NULL, error) ||
+      !g_input_stream_read_all (instream, buffer, length, &bytes_read,
+                                NULL, error))
+    return FALSE;
+
+  if (bytes_read != length) {
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                 "Journal is shorter than expected");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+read_file_range (const gchar *path,
+                 goffset position,
+                 gchar *buffer,
+                 gsize length,
+                 GError **error)
+{
+  GInputStream *instream;
+  gboolean success;
+
+  instream = open_journal (path, error);
+  if (!instream)
+    return FALSE;
+
+  success = read_raw (instream, position, buffer, length, error);
+  close_journal (instream);
+
+  return success;
+}
+
+static void
+stop_inflating (MafwLastfmJournal *journal)
+{
+  if (journal->inflating) {
+    inflateEnd (&journal->inflater);
+    journal->inflating = FALSE;
+  }
+}
+
+static void
+reset_segments (MafwLastfmJournal *journal)
+{
+  stop_inflating (journal);
+  g_array_set_size (journal->segments, 0);
+  journal->shift = 0;
+}
+
+/* Finds the segments after the header, before the worker starts. */
+static void
+load_segments (MafwLastfmJournal *journal)
+{
+  JournalSegment segment;
+  GInputStream *instream;
+  gchar header[SEGMENT_OVERHEAD];
+  goffset offset = JOURNAL_HEADER_SIZE;
+  goffset position = JOURNAL_HEADER_SIZE;
+
+  instream = open_journal (journal->path, NULL);
+  if (!instream)
+    return;
+
+  while (position + SEGMENT_OVERHEAD <= journal->disk_size &&
+         read_raw (instream, position, header, SEGMENT_OVERHEAD, NULL) &&
+         memcmp (header, SEGMENT_MARKER, RECORD_MARKER_SIZE) == 0) {
+    segment.offset = offset;
+    segment.length = read_uint32 (header + RECORD_MARKER_SIZE);
+    segment.position = position;
+    segment.compressed_size = read_uint32 (header + RECORD_MARKER_SIZE + 4);
+    if (position + SEGMENT_OVERHEAD + segment.compressed_size >
+        journal->disk_size) {
+      g_warning ("Ignoring truncated segment in the journal");
+      break;
+    }
+
+    g_array_append_val (journal->segments, segment);
+    offset += segment.length;
+    position += SEGMENT_OVERHEAD + segment.compressed_size;
+  }
+
+  close_journal (instream);
+
+  journal->shift = offset - position;
+}
+
+/**
+ * inflate_segment:
+ * @journal: a #MafwLastfmJournal
+ * @instream: the journal file
+ * @index: the segment to read
+ * @from: where to start, in the records of the segment
+ * @buffer: where to store the records
+ * @length: how much to read
+ * @error: return location for a #GError
+ *
+ * Inflates part of a segment, going on from where the previous call
+ * stopped if it was reading the same segment before @from. Corrupted
+ * data reads as zeroes, which the iterator skips as corrupted records.
+ *
+ * Returns: %FALSE if the file couldn't be read.
+ **/
+static gboolean
+inflate_segment (MafwLastfmJournal *journal,
+                 GInputStream *instream,
+                 guint index,
+                 gsize from,
+                 gchar *buffer,
+                 gsize length,
+                 GError **error)
+{
+  JournalSegment *segment;
+  z_stream *stream = &journal->inflater;
+  guchar input[SEGMENT_CHUNK_SIZE];
+  guchar skipped[SEGMENT_CHUNK_SIZE];
+  goffset position, end;
+  gsize bytes_read, produced;
+  gsize copied = 0;
+  gint status = Z_OK;
+
+  segment = &g_array_index (journal->segments, JournalSegment, index);
+  end = segment->position + SEGMENT_OVERHEAD + segment->compressed_size;
+
+  if (journal->inflating &&
+      (journal->inflating_segment != index || journal->inflated > from))
+    stop_inflating (journal);
+
+  if (!journal->inflating) {
+    memset (stream, 0, sizeof (z_stream));
+    if (inflateInit (stream) != Z_OK) {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOMEM,
+                   "Couldn't inflate the journal");
+      return FALSE;
+    }
+    journal->inflating = TRUE;
+    journal->inflating_segment = index;
+    journal->inflated = 0;
+    journal->inflate_position = segment->position + SEGMENT_OVERHEAD;
+  }
+
+  position = journal->inflate_position;
+  stream->avail_in = 0;
+  if (!g_seekable_seek (G_SEEKABLE (instream), position, G_SEEK_SET,
+                        NULL, error)) {
+    stop_inflating (journal);
+    return FALSE;
+  }
+
+  while (copied < length) {
+    if (stream->avail_in == 0) {
+      if (!g_input_stream_read_all (instream, input,
+                                    MIN (sizeof (input), end - position),
+                                    &bytes_read, NULL, error)) {
+        stop_inflating (journal);
+        return FALSE;
+      }
+      if (bytes_read == 0)
+        break;
+      position += bytes_read;
+      stream->next_in = input;
+      stream->avail_in = bytes_read;
+    }
+
+    /* The records before @from are inflated aside, the others right
+       into @buffer. */
+    if (journal->inflated < from) {
+      stream->next_out = skipped;
+      stream->avail_out = MIN (sizeof (skipped), from - journal->inflated);
+    } else {
+      stream->next_out = (Bytef *) buffer + copied;
+      stream->avail_out = length - copied;
+    }
+
+    produced = stream->avail_out;
+    status = inflate (stream, Z_NO_FLUSH);
+    produced -= stream->avail_out;
+    if (journal->inflated >= from)
+      copied += produced;
+    journal->inflated += produced;
+
+    if (status == Z_STREAM_END ||
+        (status != Z_OK && status != Z_BUF_ERROR) ||
+        (status == Z_BUF_ERROR && stream->avail_in > 0))
+      break;
+  }
+
+  if (copied < length) {
+    g_warning ("Corrupted segment in the journal at %" G_GINT64_FORMAT,
+               (gint64) segment->position);
+    memset (buffer + copied, 0, length - copied);
+    stop_inflating (journal);
+    return TRUE;
+  }
+
+  if (status == Z_STREAM_END) {
+    stop_inflating (journal);
+  } else {
+    /* The input read ahead is read again by the next batch. */
+    journal->inflate_position = position - stream->avail_in;
+    stream->avail_in = 0;
+  }
+
+  return TRUE;
+}
+
+/**
+ * read_range:
+ * @journal: a #MafwLastfmJournal
+ * @offset: where to start
+ * @length: how much to read
+ * @error: return location for a #GError
+ *
+ * Reads the records in a range of offsets, inflating the parts of it
+ * that are in segments.
+ *
+ * Returns: the records, or %NULL on error.
+ **/
+static gchar *
+read_range (MafwLastfmJournal *journal,
+            goffset offset,
+            gsize length,
+            GError **error)
+{
+  JournalSegment *segment;
+  GInputStream *instream;
+  gchar *buffer;
+  goffset position, end;
+  /* How much longer the segments skipped are once inflated. */
+  goffset shift = 0;
+  gsize n;
+  guint i = 0;
+  gboolean success = TRUE;
+
+  instream = open_journal (journal->path, error);
+  if (!instream)
+    return NULL;
+
+  buffer = g_malloc (length);
+  end = offset + length;
+  for (position = offset; success && position < end; position += n) {
+    segment = NULL;
+    for (; i < journal->segments->len; i++) {
+      segment = &g_array_index (journal->segments, JournalSegment, i);
+      if (segment->offset + segment->length > position)
+        break;
+      shift += (goffset) segment->length -
+        SEGMENT_OVERHEAD - segment->compressed_size;
+      segment = NULL;
+    }
+
+    if (segment && segment->offset <= position) {
+      n = MIN (end, segment->offset + segment->length) - position;
+      success = inflate_segment (journal, instream, i,
+                                 position - segment->offset,
+                                 buffer + (position - offset), n, error);
+    } else {
+      n = (segment ? MIN (end, segment->offset) : end) - position;
+      success = read_raw (instream, position - shift,
+                          buffer + (position - offset), n, error);
+    }
+  }
+
+  close_journal (instream);
+
+  if (!success) {
+    g_free (buffer);
+    return NULL;
+  }
+
+  return buffer;
+}
+
+static void
+write_records (MafwLastfmJournal *journal,
+               JournalRequest *request)
+{
+  GFile *file;
+  GFileOutputStream *outstream;
+  gchar header[JOURNAL_HEADER_SIZE];
+  guint32 version;
+  gboolean success;
+  struct stat st;
+
+  request->disk_size = g_stat (journal->path, &st) == 0 ? st.st_size : 0;
+  /* A new journal, so whatever we knew about the old one is stale. */
+  if (request->disk_size == 0)
+    reset_segments (journal);
+
+  file = g_file_new_for_path (journal->path);
+  outstream = g_file_append_to (file, G_FILE_CREATE_PRIVATE, NULL,
+                                &request->error);
+  g_object_unref (file);
+
+  if (!outstream) {
+    request->size = request->disk_size + journal->shift;
+    return;
+  }
+
+  success = TRUE;
+  if (request->disk_size == 0) {
+    memcpy (header, JOURNAL_MAGIC, 4);
+    version = GUINT32_TO_LE (MAFW_LASTFM_JOURNAL_VERSION);
+    memcpy (header + 4, &version, 4);
+    success = g_output_stream_write_all (G_OUTPUT_STREAM (outstream),
+                                         header, JOURNAL_HEADER_SIZE,
+                                         NULL, NULL, &request->error);
+  }
+
+  if (success)
+    success = g_output_stream_write_all (G_OUTPUT_STREAM (outstream),
+                                         request->data->str,
+                                         request->data->len,
+                                         NULL, NULL, &request->error);
+
+  if (!g_output_stream_close (G_OUTPUT_STREAM (outstream), NULL,
+                              success ? &request->error : NULL))
+    success = FALSE;
+  g_object_unref (outstream);
+
+  /* After a failure we don't know how much was written. */
+  if (success) {
+    request->disk_size = MAX (request->disk_size, JOURNAL_HEADER_SIZE) +
+      request->data->len;
+    request->offset = request->disk_size - request->data->len +
+      journal->shift;
+    if (request->remove_path)
+      g_unlink (request->remove_path);
+  } else if (g_stat (journal->path, &st) == 0) {
+    request->disk_size = st.st_size;
+  }
+  request->size = request->disk_size + journal->shift;
+}
+
+static void
+write_file (JournalRequest *request)
+{
+  GFile *file;
+  GFileOutputStream *outstream;
+  gboolean success;
+
+  if (!request->append) {
+    g_file_set_contents (request->path, request->data->str,
+                         request->data->len, &request->error);
+    return;
+  }
+
+  file = g_file_new_for_path (request->path);
+  outstream = g_file_append_to (file, G_FILE_CREATE_PRIVATE, NULL,
+                                &request->error);
+  g_object_unref (file);
+
+  if (!outstream)
+    return;
+
+  success = g_output_stream_write_all (G_OUTPUT_STREAM (outstream),
+                                       request->data->str,
+                                       request->data->len,
+                                       NULL, NULL, &request->error);
+  g_output_stream_close (G_OUTPUT_STREAM (outstream), NULL,
+                         success ? &request->error : NULL);
+  g_object_unref (outstream);
+}
+
+/* Compresses @length bytes of @records as a segment at the end of
+   @contents, where the compacted journal has them at @offset. */
+static gboolean
+append_segment (GString *contents,
+                GArray *segments,
+                goffset offset,
+                const gchar *records,
+                gsize length,
+                GError **error)
+{
+  JournalSegment segment;
+  Bytef *compressed;
+  uLongf compressed_size;
+
+  compressed_size = compressBound (length);
+  compressed = g_malloc (compressed_size);
+  if (compress2 (compressed, &compressed_size, (const Bytef *) records,
+                 length, Z_DEFAULT_COMPRESSION) != Z_OK) {
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOMEM,
+                 "Couldn't compress the journal");
+    g_free (compressed);
+    return FALSE;
+  }
+
+  segment.offset = offset;
+  segment.length = length;
+  segment.position = contents->len;
+  segment.compressed_size = compressed_size;
+  g_array_append_val (segments, segment);
+
+  g_string_append_len (contents, SEGMENT_MARKER, RECORD_MARKER_SIZE);
+  append_uint32 (contents, length);
+  append_uint32 (contents, compressed_size);
+  g_string_append_len (contents, (const gchar *) compressed,
+                       compressed_size);
+  g_free (compressed);
+
+  return TRUE;
+}
+
+/**
+ * write_segments:
+ * @journal: a #MafwLastfmJournal
+ * @contents: the compacted journal, with its header
+ * @segments: the segments of @contents
+ * @from: the offset of the first record to keep
+ * @end: the end of the journal
+ * @error: return location for a #GError
+ *
+ * Writes the records from @from to @end to @contents. The segments
+ * after @from are copied as they are, and the one @from is in is
+ * compressed again without the records before. The records after the
+ * segments are sealed in new ones of at least
+ * MAFW_LASTFM_JOURNAL_SEGMENT_SIZE bytes, and the few left stay
+ * uncompressed.
+ *
+ * Returns: %FALSE on error.
+ **/
+static gboolean
+write_segments (MafwLastfmJournal *journal,
+                GString *contents,
+                GArray *segments,
+                goffset from,
+                goffset end,
+                GError **error)
+{
+  MafwLastfmJournalIter iter;
+  MafwLastfmTrack track;
+  JournalSegment *segment = NULL, *last;
+  JournalSegment copy;
+  gchar *records;
+  goffset delta, position;
+  gsize length, start;
+  guint i;
+
+  /* What the offsets are moved back by. */
+  delta = from - JOURNAL_HEADER_SIZE;
+
+  for (i = 0; i < journal->segments->len; i++) {
+    segment = &g_array_index (journal->segments, JournalSegment, i);
+    if (segment->offset + segment->length > from)
+      break;
+  }
+
+  if (i < journal->segments->len && segment->offset < from) {
+    length = segment->offset + segment->length - from;
+    records = read_range (journal, from, length, error);
+    if (!records ||
+        !append_segment (contents, segments, from - delta, records, length,
+                         error)) {
+      g_free (records);
+      return FALSE;
+    }
+    g_free (records);
+    from += length;
+    i++;
+  }
+
+  if (i < journal->segments->len) {
+    segment = &g_array_index (journal->segments, JournalSegment, i);
+    last = &g_array_index (journal->segments, JournalSegment,
+                           journal->segments->len - 1);
+    position = segment->position;
+    length = last->position + SEGMENT_OVERHEAD + last->compressed_size -
+      position;
+    records = g_malloc (length);
+    if (!read_file_range (journal->path, position, records, length, error)) {
+      g_free (records);
+      return FALSE;
+    }
+
+    for (; i < journal->segments->len; i++) {
+      copy = g_array_index (journal->segments, JournalSegment, i);
+      copy.offset -= delta;
+      copy.position += contents->len - position;
+      g_array_append_val (segments, copy);
+    }
+    g_string_append_len (contents, records, length);
+    g_free (records);
+    from = last->offset + last->length;
+  }
+
+  if (end == from)
+    return TRUE;
+
+  length = end - from;
+  records = read_range (journal, from, length, error);
+  if (!records)
+    return FALSE;
+
+  start = 0;
+  mafw_lastfm_journal_iter_init (&iter, records, length);
+  while (mafw_lastfm_journal_iter_next (&iter, &track, NULL)) {
+    if (iter.offset - start < MAFW_LASTFM_JOURNAL_SEGMENT_SIZE)
+      continue;
+    if (!append_segment (contents, segments, from + start - delta,
+                         records + start, iter.offset - start, error)) {
+      g_free (records);
+      return FALSE;
+    }
+    start = iter.offset;
+  }
+  g_string_append_len (contents, records + start, length - start);
+  g_free (records);
+
+  return TRUE;
+}
+
+static void
+compact_file (MafwLastfmJournal *journal,
+              JournalRequest *request)
+{
+  JournalSegment *last;
+  GArray *segments;
+  GString *contents;
+  gchar *tmp_path;
+  guint32 version;
+  goffset end;
+  struct stat st;
+
+  /* The records appended since the compaction was requested are
+     kept too. */
+  if (g_stat (journal->path, &st) != 0 ||
+      st.st_size + journal->shift < request->offset) {
+    g_set_error (&request->error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                 "Journal is shorter than expected");
+    return;
+  }
+  end = st.st_size + journal->shift;
+
+  contents = g_string_sized_new (JOURNAL_HEADER_SIZE +
+                                 MIN (st.st_size, end - request->offset));
+  g_string_append_len (contents, JOURNAL_MAGIC, 4);
+  version = GUINT32_TO_LE (MAFW_LASTFM_JOURNAL_VERSION);
+  g_string_append_len (contents, (const gchar *) &version, 4);
+
+  segments = g_array_new (FALSE, FALSE, sizeof (JournalSegment));
+  if (!write_segments (journal, contents, segments, request->offset, end,
+                       &request->error)) {
+    g_array_free (segments, TRUE);
+    g_string_free (contents, TRUE);
+    return;
+  }
+
+  tmp_path = g_strconcat (journal->path, ".tmp", NULL);
+  if (!g_file_set_contents (tmp_path, contents->str, contents->len,
+                            &request->error)) {
+    g_free (tmp_path);
+    g_array_free (segments, TRUE);
+    g_string_free (contents, TRUE);
+    return;
+  }
+
+  /* Rewind the cursors before replacing the journal: if we crash in
+     between, the acknowledged records are sent again, but none is
+     lost. */
+  g_file_set_contents (journal->ack_path, request->data->str,
+                       request->data->len, NULL);
+
+  if (g_rename (tmp_path, journal->path) != 0) {
+    g_set_error (&request->error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                 "Couldn't replace the journal");
+    g_unlink (tmp_path);
+    g_free (tmp_path);
+    g_array_free (segments, TRUE);
+    g_string_free (contents, TRUE);
+    return;
+  }
+  g_free (tmp_path);
+
+  g_file_set_contents (journal->ack_path, request->cursors->str,
+                       request->cursors->len, NULL);
+
+  request->length = end - request->offset;
+  request->size = JOURNAL_HEADER_SIZE + request->length;
+  request->disk_size = contents->len;
+  g_string_free (contents, TRUE);
+
+  stop_inflating (journal);
+  g_array_free (journal->segments, TRUE);
+  journal->segments = segments;
+  journal->shift = request->size - request->disk_size;
+  if (segments->len > 0) {
+    last = &g_array_index (segments, JournalSegment, segments->len - 1);
+    request->sealed = last->offset + last->length;
+  }
+}
+
+static void
+run_request (MafwLastfmJournal *journal,
+             JournalRequest *request)
+{
+  switch (request->op) {
+  case JOURNAL_APPEND:
+    write_records (journal, request);
+    break;
+  case JOURNAL_READ:
+    if (request->length > 0)
+      request->contents = read_range (journal, request->offset,
+                                      request->length, &request->error);
+    break;
+  case JOURNAL_SAVE_CURSORS:
+    g_file_set_contents (journal->ack_path, request->data->str,
+                         request->data->len, &request->error);
+    break;
+  case JOURNAL_ARCHIVE:
+    request->contents = read_range (journal, request->offset,
+                                    request->length, &request->error);
+    if (request->contents)
+      ((MafwLastfmJournalArchiveFunc) request->callback) (request->contents,
+                                                          request->length,
+                                                          request->user_data);
+    break;
+  case JOURNAL_COMPACT:
+    compact_file (journal, request);
+    break;
+  case JOURNAL_CLEAR:
+    g_unlink (journal->path);
+    g_unlink (journal->ack_path);
+    reset_segments (journal);
+    break;
+  case JOURNAL_WRITE_FILE:
+    write_file (request);
+    break;
+  case JOURNAL_QUIT:
+    break;
+  }
+}
+
+static void complete_request (MafwLastfmJournal *journal,
+                              JournalRequest *request);
+
+static gboolean
+dispatch_cb (gpointer user_data)
+{
+  MafwLastfmJournal *journal = user_data;
+  JournalRequest *request;
+
+  g_async_queue_lock (journal->done);
+  journal->dispatch_id = 0;
+  g_async_queue_unlock (journal->done);
+
+  while ((request = g_async_queue_try_pop (journal->done)))
+    complete_request (journal, request);
+
+  return FALSE;
+}
+
+static void
+hand_back (MafwLastfmJournal *journal,
+           JournalRequest *request)
+{
+  g_async_queue_lock (journal->done);
+  g_async_queue_push_unlocked (journal->done, request);
+  if (journal->dispatch_id == 0)
+    journal->dispatch_id = g_idle_add (dispatch_cb, journal);
+  g_async_queue_unlock (journal->done);
+}
+
+static gpointer
+journal_worker (gpointer user_data)
+{
+  MafwLastfmJournal *journal = user_data;
+  JournalRequest *request;
+
+  for (;;) {
+    request = g_async_queue_pop (journal->requests);
+    if (request->op == JOURNAL_QUIT) {
+      free_request (request);
+      return NULL;
+    }
+    run_request (journal, request);
+    hand_back (journal, request);
+  }
+}
+
+static void
+push_request (MafwLastfmJournal *journal,
+              JournalRequest *request)
+{
+  /* Without threads, the callbacks still run from the main loop. */
+  if (journal->worker) {
+    g_async_queue_push (journal->requests, request);
+  } else {
+    run_request (journal, request);
+    hand_back (journal, request);
+  }
+}
+
+static void
+archive_range (MafwLastfmJournal *journal,
+               goffset start,
+               goffset end)
+{
+  JournalRequest *request;
+
+  if (!journal->archive_func || end <= start)
+    return;
+
+  request = new_request (journal, JOURNAL_ARCHIVE,
+                         (GCallback) journal->archive_func,
+                         journal->archive_data);
+  request->offset = start;
+  request->length = end - start;
+  push_request (journal, request);
+}
+
+/**
+ * archive_acked:
+ * @journal: a #MafwLastfmJournal
+ *
+ * Queues the records acknowledged since the last call for the archive
+ * function, before they can be dropped by the requests queued after
+ * them, and forgets about the rejected ones among them. While
+ * compacting, the offsets are about to change and this waits until
+ * done.
+ **/
+static void
+archive_acked (MafwLastfmJournal *journal)
+{
+  JournalRange *range;
+  goffset offset;
+
+  if (journal->compacting || journal->archived >= journal->acked)
+    return;
+
+  offset = MAX (journal->archived, JOURNAL_HEADER_SIZE);
+  while (journal->rejected->len > 0) {
+    range = &g_array_index (journal->rejected, JournalRange, 0);
+    if (range->start >= journal->acked)
+      break;
+
+    archive_range (journal, offset, range->start);
+    offset = MAX (offset, range->end);
+    g_array_remove_index (journal->rejected, 0);
+  }
+  archive_range (journal, offset, journal->acked);
+  journal->archived = journal->acked;
+}
+
+/**
+ * save_cursors:
+ * @journal: a #MafwLastfmJournal
+ *
+ * Saves the cursors, unless the journal is being compacted, in which
+ * case they are saved once done. If there are no records left, the
+ * journal is removed instead.
+ **/
+static void
+save_cursors (MafwLastfmJournal *journal)
+{
+  JournalRequest *request;
+
+  if (journal->compacting) {
+    journal->cursors_dirty = TRUE;
+    return;
+  }
+
+  /* Whatever is left after the last record is garbage. */
+  if (journal->index->len == 0 && journal->n_appending == 0) {
+    mafw_lastfm_journal_clear (journal);
+    return;
+  }
+
+  request = new_request (journal, JOURNAL_SAVE_CURSORS, NULL, NULL);
+  request->data = format_cursors (journal, 0);
+  push_request (journal, request);
+}
+
+static void
+finish_compact (MafwLastfmJournal *journal,
+                JournalRequest *request)
+{
+  JournalCursor *cursor;
+  JournalRange *range;
+  goffset delta;
+  guint i;
+
+  journal->compacting = FALSE;
+
+  if (request->error) {
+    g_warning ("Couldn't compact the journal: %s\n", request->error->message);
+    /* They may have been rewound already. */
+    journal->cursors_dirty = TRUE;
+  } else {
+    g_print ("Compacted journal from %" G_GINT64_FORMAT " to %" G_GINT64_FORMAT " bytes, %" G_GINT64_FORMAT " of records\n",
+             (gint64) journal->disk_size, (gint64) request->disk_size,
+             (gint64) request->length);
+
+    /* The records appended before the compaction was done were
+       indexed with the old offsets. */
+    delta = request->offset - JOURNAL_HEADER_SIZE;
+    journal->size = request->size;
+    journal->disk_size = request->disk_size;
+    journal->sealed = request->sealed;
+    for (i = 0; i < journal->index->len; i++)
+      g_array_index (journal->index, JournalEntry, i).offset -= delta;
+
+    journal->acked -= delta;
+    journal->archived = journal->archived > delta ?
+      journal->archived - delta : 0;
+    for (i = 0; i < journal->cursors->len; i++) {
+      cursor = &g_array_index (journal->cursors, JournalCursor, i);
+      cursor->offset = cursor->offset > delta ? cursor->offset - delta : 0;
+    }
+    /* All after the lowest cursor, so after the records dropped. */
+    for (i = 0; i < journal->rejected->len; i++) {
+      range = &g_array_index (journal->rejected, JournalRange, i);
+      range->start -= delta;
+      range->end -= delta;
+    }
+  }
+
+  if (journal->cursors_dirty) {
+    journal->cursors_dirty = FALSE;
+    archive_acked (journal);
+    save_cursors (journal);
+  }
+}
+
+/* Runs in the main loop. */
+static void
+complete_request (MafwLastfmJournal *journal,
+                  JournalRequest *request)
+{
+  switch (request->op) {
+  case JOURNAL_APPEND:
+    journal->n_appending--;
+    if (request->generation == journal->generation) {
+      if (!request->error)
+        index_records (journal, request->data->str, request->data->len,
+                       request->offset);
+      journal->size = request->size;
+      journal->disk_size = request->disk_size;
+    }
+    if (request->callback)
+      ((MafwLastfmJournalFunc) request->callback) (journal, request->error,
+                                                   request->user_data);
+    break;
+  case JOURNAL_READ:
+    ((MafwLastfmJournalReadFunc) request->callback) (journal,
+                                                     request->contents,
+                                                     request->length,
+                                                     request->offset,
+                                                     request->error,
+                                                     request->user_data);
+    break;
+  case JOURNAL_SAVE_CURSORS:
+    if (request->error)
+      g_warning ("Couldn't save acknowledgement cursor: %s\n",
+                 request->error->message);
+    break;
+  case JOURNAL_ARCHIVE:
+    if (request->error)
+      g_warning ("Couldn't archive acknowledged records: %s\n",
+                 request->error->message);
+    break;
+  case JOURNAL_COMPACT:
+    finish_compact (journal, request);
+    if (request->callback)
+      ((MafwLastfmJournalFunc) request->callback) (journal, request->error,
+                                                   request->user_data);
+    break;
+  case JOURNAL_WRITE_FILE:
+    if (request->callback)
+      ((MafwLastfmJournalFunc) request->callback) (journal, request->error,
+                                                   request->user_data);
+    break;
+  case JOURNAL_CLEAR:
+  case JOURNAL_QUIT:
+    break;
+  }
+
+  free_request (request);
+}
+
+MafwLastfmJournal *
+mafw_lastfm_journal_new (const gchar *path)
+{
+  MafwLastfmJournal *journal;
+  JournalSegment *last;
+  gchar *contents;
+  GError *error = NULL;
+  struct stat st;
+
+  journal = g_new0 (MafwLastfmJournal, 1);
+  journal->path = g_strdup (path);
+  journal->ack_path = g_strconcat (path, ACK_SUFFIX, NULL);
+  journal->index = g_array_new (FALSE, FALSE, sizeof (JournalEntry));
+  journal->cursors = g_array_new (FALSE, FALSE, sizeof (JournalCursor));
+  journal->rejected = g_array_new (FALSE, FALSE, sizeof (JournalRange));
+  journal->requests = g_async_queue_new ();
+  journal->done = g_async_queue_new ();
+  journal->segments = g_array_new (FALSE, FALSE, sizeof (JournalSegment));
+
+  if (g_stat (path, &st) == 0 && st.st_size > 0) {
+    journal->disk_size = st.st_size;
+    load_segments (journal);
+    journal->size = journal->disk_size + journal->shift;
+    if (journal->segments->len > 0) {
+      last = &g_array_index (journal->segments, JournalSegment,
+                             journal->segments->len - 1);
+      journal->sealed = last->offset + last->length;
+    }
+  }
+
+  load_ack_cursor (journal);
+  /* Whatever was acknowledged before was archived then. */
+  journal->archived = journal->acked;
+
+  /* This is the only time the whole journal is read. */
+  if (journal->size > journal->acked) {
+    contents = read_range (journal, journal->acked,
+                           journal->size - journal->acked, &error);
+    if (contents) {
+      index_records (journal, contents, journal->size - journal->acked,
+                     journal->acked);
+      g_free (contents);
+    } else {
+      g_warning ("Couldn't read the journal: %s\n", error->message);
+      g_clear_error (&error);
+    }
+  }
+
+  if (g_thread_supported ()) {
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    journal->worker = g_thread_try_new ("journal", journal_worker, journal,
+                                        &error);
+#else
+    journal->worker = g_thread_create (journal_worker, journal, TRUE,
+                                       &error);
+#endif
+    if (!journal->worker) {
+      g_warning ("Couldn't start the journal thread: %s\n", error->message);
+      g_error_free (error);
+    }
+  }
+
+  return journal;
+}
+
+/**
+ * mafw_lastfm_journal_free:
+ * @journal: a #MafwLastfmJournal
+ *
+ * Waits for the requests made so far to be done, and frees @journal.
+ * The callbacks of the ones that haven't been handed back to the main
+ * loop yet are not run.
+ **/
+void
+mafw_lastfm_journal_free (MafwLastfmJournal *journal)
+{
+  JournalRequest *request;
+  guint i;
+
+  if (!journal)
+    return;
+
+  if (journal->worker) {
+    g_async_queue_push (journal->requests,
+                        new_request (journal, JOURNAL_QUIT, NULL, NULL));
+    g_thread_join (journal->worker);
+  }
+
+  if (journal->dispatch_id)
+    g_source_remove (journal->dispatch_id);
+  while ((request = g_async_queue_try_pop (journal->done)))
+    free_request (request);
+  g_async_queue_unref (journal->requests);
+  g_async_queue_unref (journal->done);
+
+  g_free (journal->path);
+  g_free (journal->ack_path);
+  for (i = 0; i < journal->cursors->len; i++)
+    g_free (g_array_index (journal->cursors, JournalCursor, i).name);
+  g_array_free (journal->cursors, TRUE);
+  g_array_free (journal->rejected, TRUE);
+  g_array_free (journal->index, TRUE);
+  stop_inflating (journal);
+  g_array_free (journal->segments, TRUE);
+  g_free (journal);
+}
+
+/**
+ * mafw_lastfm_journal_encode_record:
+ * @buffer: a #GString to append the record to
+ * @track: the track to encode
+ * @flags: a combination of #MafwLastfmJournalRecordFlags
+ *
+ * Appends the binary record for @track to @buffer, ready to be
+ * written with mafw_lastfm_journal_append_async().
+ **/
+void
+mafw_lastfm_journal_encode_record (GString *buffer,
+                                   MafwLastfmTrack *track,
+                                   guint flags)
+{
+  gsize start;
+  guint32 artist_len, title_len, album_len;
+
+  artist_len = track->artist ? strlen (track->artist) : 0;
+  title_len = track->title ? strlen (track->title) : 0;
+  album_len = track->album ? strlen (track->album) : 0;
+
+  g_string_append_len (buffer, RECORD_MARKER, RECORD_MARKER_SIZE);
+  start = buffer->len;
+  append_uint32 (buffer, PAYLOAD_FIXED_SIZE +
+                 artist_len + title_len + album_len + 3);
+
+  append_int64 (buffer, track->timestamp);
+  append_int64 (buffer, track->length);
+  append_uint32 (buffer, track->number);
+  g_string_append_c (buffer, track->source);
+  g_string_append_c (buffer, flags);
+  append_uint32 (buffer, artist_len);
+  append_uint32 (buffer, title_len);
+  append_uint32 (buffer, album_len);
+
+  g_string_append_len (buffer, track->artist, artist_len);
+  g_string_append_c (buffer, '\0');
+  g_string_append_len (buffer, track->title, title_len);
+  g_string_append_c (buffer, '\0');
+  g_string_append_len (buffer, track->album, album_len);
+  g_string_append_c (buffer, '\0');
+
+  append_uint32 (buffer, crc32 (0, (const Bytef *) buffer->str + start,
+                                 buffer->len - start));
+}
+
+/**
+ * mafw_lastfm_journal_append_async:
+ * @journal: a #MafwLastfmJournal
+ * @records: records encoded with mafw_lastfm_journal_encode_record(),
+ * which @journal takes ownership of
+ * @callback: a function to call once they are written, or %NULL
+ * @user_data: data to pass to @callback
+ *
+ * Appends @records at the end of the journal, creating it if needed.
+ * They are counted as pending once written, before @callback runs.
+ **/
+void
+mafw_lastfm_journal_append_async (MafwLastfmJournal *journal,
+                                  GString *records,
+                                  MafwLastfmJournalFunc callback,
+                                  gpointer user_data)
+{
+  JournalRequest *request;
+
+  request = new_request (journal, JOURNAL_APPEND,
+                         (GCallback) callback, user_data);
+  request->data = records;
+  journal->n_appending++;
+  push_request (journal, request);
+}
+
+static guint
+find_entry (MafwLastfmJournal *journal,
+            goffset offset)
+{
+  guint low = 0, high = journal->index->len, mid;
+
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (g_array_index (journal->index, JournalEntry, mid).offset < offset)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+/**
+ * mafw_lastfm_journal_has_pending:
+ * @journal: a #MafwLastfmJournal
+ * @from: an offset in the journal
+ *
+ * Checks, without any disk access, if there are unacknowledged
+ * records at or after @from.
+ *
+ * Returns: %TRUE if there are records to read from @from.
+ **/
+gboolean
+mafw_lastfm_journal_has_pending (MafwLastfmJournal *journal,
+                                 goffset from)
+{
+  return journal->index->len > 0 &&
+    g_array_index (journal->index, JournalEntry,
+                   journal->index->len - 1).offset >= from;
+}
+
+/**
+ * mafw_lastfm_journal_read_batch_async:
+ * @journal: a #MafwLastfmJournal
+ * @from: the offset to read from
+ * @max_records: the maximum number of records to read
+ * @callback: a function to call with the records read
+ * @user_data: data to pass to @callback
+ *
+ * Reads up to @max_records unacknowledged records, starting with the
+ * first one at or after @from. @callback gets %NULL contents if there
+ * were no records to read, and otherwise uses #MafwLastfmJournalIter
+ * to walk through them. The batch ends at its offset plus its length,
+ * which is the offset to read the next batch from.
+ *
+ * The offsets change when the journal is compacted, so this must not
+ * be called while it is.
+ **/
+void
+mafw_lastfm_journal_read_batch_async (MafwLastfmJournal *journal,
+                                      goffset from,
+                                      guint max_records,
+                                      MafwLastfmJournalReadFunc callback,
+                                      gpointer user_data)
+{
+  JournalRequest *request;
+  JournalEntry *first, *last;
+  guint i;
+
+  g_return_if_fail (callback);
+  g_return_if_fail (!journal->compacting);
+
+  request = new_request (journal, JOURNAL_READ,
+                         (GCallback) callback, user_data);
+  request->offset = from;
+
+  i = find_entry (journal, from);
+  if (i < journal->index->len && max_records > 0) {
+    first = &g_array_index (journal->index, JournalEntry, i);
+    last = &g_array_index (journal->index, JournalEntry,
+                           MIN (i + max_records, journal->index->len) - 1);
+    request->offset = first->offset;
+    request->length = last->offset + last->size - first->offset;
+  }
+
+  push_request (journal, request);
+}
+
+guint
+mafw_lastfm_journal_get_n_pending (MafwLastfmJournal *journal)
+{
+  return journal->index->len;
+}
+
+goffset
+mafw_lastfm_journal_get_pending_size (MafwLastfmJournal *journal)
+{
+  return journal->index->len > 0 ? journal->size - journal->acked : 0;
+}
+
+/**
+ * mafw_lastfm_journal_get_size:
+ * @journal: a #MafwLastfmJournal
+ *
+ * Returns: the size of the journal on disk, including the records
+ * acknowledged but not compacted away yet.
+ **/
+goffset
+mafw_lastfm_journal_get_size (MafwLastfmJournal *journal)
+{
+  return journal->disk_size;
+}
+
+/**
+ * mafw_lastfm_journal_get_unsealed_size:
+ * @journal: a #MafwLastfmJournal
+ *
+ * Returns: the size of the pending records that are not compressed
+ * yet. Once it goes past %MAFW_LASTFM_JOURNAL_SEGMENT_SIZE,
+ * mafw_lastfm_journal_compact_async() seals them.
+ **/
+goffset
+mafw_lastfm_journal_get_unsealed_size (MafwLastfmJournal *journal)
+{
+  goffset start;
+
+  if (journal->index->len == 0)
+    return 0;
+
+  start = MAX (MAX (journal->sealed, journal->acked), JOURNAL_HEADER_SIZE);
+  return journal->size > start ? journal->size - start : 0;
+}
+
+/**
+ * mafw_lastfm_journal_add_cursor:
+ * @journal: a #MafwLastfmJournal
+ * @name: a name that identifies the cursor across restarts
+ *
+ * Adds an acknowledgement cursor, for instance for one of the servers
+ * the records are submitted to. It starts where the cursor of the same
+ * name was saved, or at the lowest of the cursors for a new one.
+ *
+ * Returns: the cursor, to pass to mafw_lastfm_journal_commit().
+ **/
+guint
+mafw_lastfm_journal_add_cursor (MafwLastfmJournal *journal,
+                                const gchar *name)
+{
+  JournalCursor *cursor;
+  JournalCursor new_cursor;
+  guint i;
+
+  g_return_val_if_fail (name && !strchr (name, '\n'), 0);
+
+  for (i = 0; i < journal->cursors->len; i++) {
+    cursor = &g_array_index (journal->cursors, JournalCursor, i);
+    if (strcmp (cursor->name, name) == 0) {
+      g_return_val_if_fail (!cursor->added, i);
+      cursor->added = TRUE;
+      cursor->offset = MAX (cursor->offset, journal->acked);
+      return i;
+    }
+  }
+
+  new_cursor.name = g_strdup (name);
+  new_cursor.offset = journal->acked;
+  new_cursor.added = TRUE;
+  g_array_append_val (journal->cursors, new_cursor);
+
+  return journal->cursors->len - 1;
+}
+
+goffset
+mafw_lastfm_journal_get_cursor (MafwLastfmJournal *journal,
+                                guint cursor)
+{
+  g_return_val_if_fail (cursor < journal->cursors->len, 0);
+
+  return g_array_index (journal->cursors, JournalCursor, cursor).offset;
+}
+
+/**
+ * mafw_lastfm_journal_commit:
+ * @journal: a #MafwLastfmJournal
+ * @cursor: a cursor added with mafw_lastfm_journal_add_cursor()
+ * @offset: the end of the last acknowledged record
+ *
+ * Durably moves @cursor to @offset, so that the records before it are
+ * not read again for it. The records behind every cursor are dropped,
+ * and if there are none left, the journal is removed.
+ **/
+void
+mafw_lastfm_journal_commit (MafwLastfmJournal *journal,
+                            guint cursor,
+                            goffset offset)
+{
+  JournalCursor *c;
+  goffset lowest = G_MAXINT64;
+  guint i;
+
+  g_return_if_fail (cursor < journal->cursors->len);
+
+  c = &g_array_index (journal->cursors, JournalCursor, cursor);
+  if (offset <= c->offset)
+    return;
+  c->offset = MIN (offset, journal->size);
+
+  for (i = 0; i < journal->cursors->len; i++) {
+    c = &g_array_index (journal->cursors, JournalCursor, i);
+    if (c->added)
+      lowest = MIN (lowest, c->offset);
+  }
+
+  if (lowest > journal->acked) {
+    journal->acked = lowest;
+    g_array_remove_range (journal->index, 0,
+                          find_entry (journal, journal->acked));
+    archive_acked (journal);
+  }
+
+  save_cursors (journal);
+}
+
+goffset
+mafw_lastfm_journal_get_acked_offset (MafwLastfmJournal *journal)
+{
+  return journal->acked;
+}
+
+/**
+ * mafw_lastfm_journal_reject:
+ * @journal: a #MafwLastfmJournal
+ * @start: the offset of the first record refused
+ * @end: the end of the last one
+ *
+ * Leaves the records from @start to @end out of the archive, for a
+ * cursor to be committed past them although they were refused instead
+ * of acknowledged. They are saved along with the cursors.
+ **/
+void
+mafw_lastfm_journal_reject (MafwLastfmJournal *journal,
+                            goffset start,
+                            goffset end)
+{
+  JournalRange *range;
+  JournalRange new_range;
+  guint i;
+
+  g_return_if_fail (start < end);
+
+  if (start < journal->archived)
+    return;
+
+  /* Kept in order, the servers may refuse the same records. */
+  for (i = 0; i < journal->rejected->len; i++) {
+    range = &g_array_index (journal->rejected, JournalRange, i);
+    if (range->start == start && range->end == end)
+      return;
+    if (range->start > start)
+      break;
+  }
+
+  new_range.start = start;
+  new_range.end = end;
+  g_array_insert_val (journal->rejected, i, new_range);
+}
+
+/**
+ * mafw_lastfm_journal_compact_async:
+ * @journal: a #MafwLastfmJournal
+ * @callback: a function to call once done, or %NULL
+ * @user_data: data to pass to @callback
+ *
+ * Rewrites the journal without the acknowledged records, sealing the
+ * pending ones in compressed segments. No batch can be read until
+ * @callback runs.
+ *
+ * Returns: %TRUE if there was anything to compact or to seal.
+ **/
+gboolean
+mafw_lastfm_journal_compact_async (MafwLastfmJournal *journal,
+                                   MafwLastfmJournalFunc callback,
+                                   gpointer user_data)
+{
+  JournalRequest *request;
+  goffset from;
+
+  if (journal->compacting ||
+      (journal->acked <= JOURNAL_HEADER_SIZE &&
+       mafw_lastfm_journal_get_unsealed_size (journal) <
+       MAFW_LASTFM_JOURNAL_SEGMENT_SIZE))
+    return FALSE;
+
+  from = MAX (journal->acked, JOURNAL_HEADER_SIZE);
+  request = new_request (journal, JOURNAL_COMPACT,
+                         (GCallback) callback, user_data);
+  request->offset = from;
+  request->data = format_cursors (journal, G_MAXINT64);
+  request->cursors = format_cursors (journal, from - JOURNAL_HEADER_SIZE);
+  journal->compacting = TRUE;
+  push_request (journal, request);
+
+  return TRUE;
+}
+
+gboolean
+mafw_lastfm_journal_is_compacting (MafwLastfmJournal *journal)
+{
+  return journal->compacting;
+}
+
+/**
+ * mafw_lastfm_journal_clear:
+ * @journal: a #MafwLastfmJournal
+ *
+ * Removes the journal, along with the records being appended.
+ **/
+void
+mafw_lastfm_journal_clear (MafwLastfmJournal *journal)
+{
+  guint i;
+
+  g_return_if_fail (!journal->compacting);
+
+  push_request (journal, new_request (journal, JOURNAL_CLEAR, NULL, NULL));
+  journal->generation++;
+  journal->size = 0;
+  journal->disk_size = 0;
+  journal->sealed = 0;
+  journal->acked = 0;
+  journal->archived = 0;
+  for (i = 0; i < journal->cursors->len; i++)
+    g_array_index (journal->cursors, JournalCursor, i).offset = 0;
+  g_array_set_size (journal->rejected, 0);
+  g_array_set_size (journal->index, 0);
+}
+
+/**
+ * mafw_lastfm_journal_write_file_async:
+ * @journal: a #MafwLastfmJournal
+ * @path: the file to write
+ * @data: what to write, which @journal takes ownership of
+ * @append: whether to append @data to @path instead of replacing it
+ * @callback: a function to call once written, or %NULL
+ * @user_data: data to pass to @callback
+ *
+ * Writes a file kept along with the journal from the worker, so that
+ * the main loop doesn't wait for the disk. It is written after the
+ * requests made before, and before the ones made after, such as the
+ * cursors saved by the next mafw_lastfm_journal_commit().
+ **/
+void
+mafw_lastfm_journal_write_file_async (MafwLastfmJournal *journal,
+                                      const gchar *path,
+                                      GString *data,
+                                      gboolean append,
+                                      MafwLastfmJournalFunc callback,
+                                      gpointer user_data)
+{
+  JournalRequest *request;
+
+  request = new_request (journal, JOURNAL_WRITE_FILE,
+                         (GCallback) callback, user_data);
+  request->path = g_strdup (path);
+  request->data = data;
+  request->append = append;
+  push_request (journal, request);
+}
+
+/**
+ * mafw_lastfm_journal_set_archive_func:
+ * @journal: a #MafwLastfmJournal
+ * @func: a function to hand the acknowledged records to, or %NULL
+ * @user_data: data to pass to @func
+ *
+ * Sets a function to keep the records acknowledged from now on,
+ * before they are dropped. It is run from the worker thread, with
+ * the records in the same format as the batches, in the order they
+ * were acknowledged.
+ **/
+void
+mafw_lastfm_journal_set_archive_func (MafwLastfmJournal *journal,
+                                      MafwLastfmJournalArchiveFunc func,
+                                      gpointer user_data)
+{
+  journal->archive_func = func;
+  journal->archive_data = user_data;
+  journal->archived = journal->acked;
+}
+
+static void
+import_legacy_cb (MafwLastfmJournal *journal,
+                  const GError *error,
+                  gpointer user_data)
+{
+  if (error)
+    g_warning ("Couldn't import cached tracks: %s\n", error->message);
+  else
+    g_print ("Imported %i cached track(s)\n", GPOINTER_TO_INT (user_data));
+}
+
+/**
+ * mafw_lastfm_journal_import_legacy:
+ * @journal: a #MafwLastfmJournal
+ * @legacy_path: the path of a queue file in the old text format
+ *
+ * Moves the tracks in the text queue used by older versions into
+ * @journal, and removes the old file once they are written. Like
+ * mafw_lastfm_journal_new(), this reads the file right away.
+ *
+ * Returns: %TRUE if there were tracks to import.
+ **/
+gboolean
+mafw_lastfm_journal_import_legacy (MafwLastfmJournal *journal,
+                                   const gchar *legacy_path)
+{
+  gchar *contents;
+  gchar **lines;
+  gchar **fields;
+  GString *records;
+  MafwLastfmTrack track;
+  JournalRequest *request;
+  gint i, n = 0;
+
+  if (!g_file_get_contents (legacy_path, &contents, NULL, NULL))
+    return FALSE;
+
+  lines = g_strsplit (contents, "\n", 0);
+  g_free (contents);
+
+  records = g_string_new (NULL);
+  for (i = 0; lines[i] != NULL; i++) {
+    /* artist&title&timestamp&source&length&album&number */
+    fields = g_strsplit (lines[i], "&", 0);
+    if (g_strv_length (fields) >= 7) {
+      track.artist = fields[0];
+      track.title = fields[1];
+      track.timestamp = strtol (fields[2], NULL, 10);
+      track.source = fields[3][0];
+      track.length = g_ascii_strtoll (fields[4], NULL, 10);
+      track.album = fields[5];
+      track.number = atoi (fields[6]);
+      mafw_lastfm_journal_encode_record (records, &track,
+                                         MAFW_LASTFM_JOURNAL_RECORD_ENCODED);
+      n++;
+    }
+    g_strfreev (fields);
+  }
+  g_strfreev (lines);
+
+  if (n == 0) {
+    g_string_free (records, TRUE);
+    g_unlink (legacy_path);
+    return FALSE;
+  }
+
+  /* The old file is only removed once the tracks are in the
+     journal. */
+  request = new_request (journal, JOURNAL_APPEND,
+                         (GCallback) import_legacy_cb, GINT_TO_POINTER (n));
+  request->data = records;
+  request->remove_path = g_strdup (legacy_path);
+  journal->n_appending++;
+  push_request (journal, request);
+
+  return TRUE;
+}
+
+void
+mafw_lastfm_journal_iter_init (MafwLastfmJournalIter *iter,
+                               const gchar *data,
+                               gsize length)
+{
+  guint32 version;
+
+  iter->data = data;
+  iter->length = length;
+  iter->offset = 0;
+  iter->record_offset = 0;
+  iter->n_corrupted = 0;
+
+  if (length >= JOURNAL_HEADER_SIZE &&
+      memcmp (data, JOURNAL_MAGIC, 4) == 0) {
+    version = read_uint32 (data + 4);
+    if (version > MAFW_LASTFM_JOURNAL_VERSION) {
+      g_warning ("Unsupported journal version %u", version);
+      iter->offset = length;
+    } else {
+      iter->offset = JOURNAL_HEADER_SIZE;
+    }
+  }
+}
+
+static void
+iter_resync (MafwLastfmJournalIter *iter)
+{
+  const gchar *p;
+
+  iter->n_corrupted++;
+
+  for (iter->offset++;
+       iter->offset + RECORD_MARKER_SIZE <= iter->length;
+       iter->offset = p - iter->data + 1) {
+    p = memchr (iter->data + iter->offset, RECORD_MARKER[0],
+                iter->length - iter->offset);
+    if (!p || p + RECORD_MARKER_SIZE > iter->data + iter->length)
+      break;
+    if (memcmp (p, RECORD_MARKER, RECORD_MARKER_SIZE) == 0) {
+      iter->offset = p - iter->data;
+      return;
+    }
+  }
+
+  iter->offset = iter->length;
+}
+
+static gboolean
+parse_payload (const gchar *payload,
+               guint32 payload_len,
+               MafwLastfmTrack *track,
+               guint *flags)
+{
+  guint32 artist_len, title_len, album_len;
+  const gchar *strings;
+
+  artist_len = read_uint32 (payload + 22);
+  title_len = read_uint32 (payload + 26);
+  album_len = read_uint32 (payload + 30);
+
+  /* Compare in 64 bits so that bogus lengths can't overflow. */
+  if ((guint64) PAYLOAD_FIXED_SIZE + artist_len + title_len + album_len + 3 !=
+      payload_len)
+    return FALSE;
+
+  strings = payload + PAYLOAD_FIXED_SIZE;
+  if (strings[artist_len] != '\0' ||
+      strings[artist_len + 1 + title_len] != '\0' ||
+      strings[artist_len + 1 + title_len + 1 + album_len] != '\0')
+    return FALSE;
+
+  track->timestamp = read_int64 (payload);
+  track->length = read_int64 (payload + 8);
+  track->number = (gint32) read_uint32 (payload + 16);
+  track->source = payload[20];
+  if (flags)
+    *flags = (guchar) payload[21];
+
+  /* The strings point into the journal data, so the caller must not
+     free them. */
+  track->artist = strings;
+  track->title = strings + artist_len + 1;
+  track->album = strings + artist_len + 1 + title_len + 1;
+  track->ref_count = 0;
+
+  return TRUE;
+}
+
+/**
+ * mafw_lastfm_journal_iter_next:
+ * @iter: a #MafwLastfmJournalIter
+ * @track: a #MafwLastfmTrack to fill with the next record
+ * @flags: location to store the record flags, or %NULL
+ *
+ * Moves to the next valid record, skipping corrupted ones. The strings
+ * in @track point into the data being iterated, and must not be
+ * freed.
+ *
+ * Returns: %FALSE when there are no more records.
+ **/
+gboolean
+mafw_lastfm_journal_iter_next (MafwLastfmJournalIter *iter,
+                               MafwLastfmTrack *track,
+                               guint *flags)
+{
+  const gchar *record;
+  guint32 payload_len;
+
+  while (iter->offset + RECORD_OVERHEAD + PAYLOAD_FIXED_SIZE <= iter->length) {
+    record = iter->data + iter->offset;
+
+    if (memcmp (record, RECORD_MARKER, RECORD_MARKER_SIZE) != 0) {
+      iter_resync (iter);
+      continue;
+    }
+
+    payload_len = read_uint32 (record + RECORD_MARKER_SIZE);
+    if (payload_len < PAYLOAD_FIXED_SIZE ||
+        payload_len > PAYLOAD_MAX_SIZE ||
+        iter->offset + RECORD_OVERHEAD + payload_len > iter->length ||
+        crc32 (0, (const Bytef *) record + RECORD_MARKER_SIZE,
+               4 + payload_len) !=
+        read_uint32 (record + RECORD_MARKER_SIZE + 4 + payload_len) ||
+        !parse_payload (record + RECORD_MARKER_SIZE + 4, payload_len,
+                        track, flags)) {
+      iter_resync (iter);
+      continue;
+    }
+
+    iter->record_offset = iter->offset;
+    iter->offset += RECORD_OVERHEAD + payload_len;
+
+    return TRUE;
+  }
+
+  /* Trailing bytes that can't hold a record, probably a torn write. */
+  if (iter->offset < iter->length) {
+    iter->n_corrupted++;
+    iter->offset = iter->length;
+  }
+
+  return FALSE;
+}
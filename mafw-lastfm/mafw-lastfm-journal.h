@@ -0,0 +1,171 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef MAFW_LASTFM_JOURNAL_H
+#define MAFW_LASTFM_JOURNAL_H
+
+#include <glib.h>
+
+#include "mafw-lastfm-track.h"
+
+G_BEGIN_DECLS
+
+#define MAFW_LASTFM_JOURNAL_VERSION 2
+/* The pending records are compressed in segments of at least this
+   many bytes. */
+#define MAFW_LASTFM_JOURNAL_SEGMENT_SIZE (64 * 1024)
+
+typedef enum {
+  /* The strings of the record are already URI-encoded, as in the
+     queue of older versions. */
+  MAFW_LASTFM_JOURNAL_RECORD_ENCODED = 1 << 0
+} MafwLastfmJournalRecordFlags;
+
+typedef struct MafwLastfmJournal MafwLastfmJournal;
+
+typedef struct {
+  const gchar *data;
+  gsize length;
+  gsize offset;
+  gsize record_offset;
+  guint n_corrupted;
+} MafwLastfmJournalIter;
+
+/* Completion callbacks, run from the main loop in the order the
+   requests were made. */
+typedef void (*MafwLastfmJournalFunc) (MafwLastfmJournal *journal,
+                                       const GError *error,
+                                       gpointer user_data);
+
+typedef void (*MafwLastfmJournalReadFunc) (MafwLastfmJournal *journal,
+                                           const gchar *contents,
+                                           gsize length,
+                                           goffset offset,
+                                           const GError *error,
+                                           gpointer user_data);
+
+/* Run from the worker thread, see
+   mafw_lastfm_journal_set_archive_func(). */
+typedef void (*MafwLastfmJournalArchiveFunc) (const gchar *records,
+                                              gsize length,
+                                              gpointer user_data);
+
+MafwLastfmJournal *
+mafw_lastfm_journal_new (const gchar *path);
+
+void
+mafw_lastfm_journal_free (MafwLastfmJournal *journal);
+
+void
+mafw_lastfm_journal_encode_record (GString *buffer,
+                                   MafwLastfmTrack *track,
+                                   guint flags);
+
+void
+mafw_lastfm_journal_append_async (MafwLastfmJournal *journal,
+                                  GString *records,
+                                  MafwLastfmJournalFunc callback,
+                                  gpointer user_data);
+
+gboolean
+mafw_lastfm_journal_has_pending (MafwLastfmJournal *journal,
+                                 goffset from);
+
+void
+mafw_lastfm_journal_read_batch_async (MafwLastfmJournal *journal,
+                                      goffset from,
+                                      guint max_records,
+                                      MafwLastfmJournalReadFunc callback,
+                                      gpointer user_data);
+
+guint
+mafw_lastfm_journal_get_n_pending (MafwLastfmJournal *journal);
+
+goffset
+mafw_lastfm_journal_get_pending_size (MafwLastfmJournal *journal);
+
+goffset
+mafw_lastfm_journal_get_size (MafwLastfmJournal *journal);
+
+goffset
+mafw_lastfm_journal_get_unsealed_size (MafwLastfmJournal *journal);
+
+guint
+mafw_lastfm_journal_add_cursor (MafwLastfmJournal *journal,
+                                const gchar *name);
+
+goffset
+mafw_lastfm_journal_get_cursor (MafwLastfmJournal *journal,
+                                guint cursor);
+
+void
+mafw_lastfm_journal_commit (MafwLastfmJournal *journal,
+                            guint cursor,
+                            goffset offset);
+
+goffset
+mafw_lastfm_journal_get_acked_offset (MafwLastfmJournal *journal);
+
+void
+mafw_lastfm_journal_reject (MafwLastfmJournal *journal,
+                            goffset start,
+                            goffset end);
+
+gboolean
+mafw_lastfm_journal_compact_async (MafwLastfmJournal *journal,
+                                   MafwLastfmJournalFunc callback,
+                                   gpointer user_data);
+
+gboolean
+mafw_lastfm_journal_is_compacting (MafwLastfmJournal *journal);
+
+void
+mafw_lastfm_journal_clear (MafwLastfmJournal *journal);
+
+void
+mafw_lastfm_journal_write_file_async (MafwLastfmJournal *journal,
+                                      const gchar *path,
+                                      GString *data,
+                                      gboolean append,
+                                      MafwLastfmJournalFunc callback,
+                                      gpointer user_data);
+
+void
+mafw_lastfm_journal_set_archive_func (MafwLastfmJournal *journal,
+                                      MafwLastfmJournalArchiveFunc func,
+                                      gpointer user_data);
+
+gboolean
+mafw_lastfm_journal_import_legacy (MafwLastfmJournal *journal,
+                                   const gchar *legacy_path);
+
+void
+mafw_lastfm_journal_iter_init (MafwLastfmJournalIter *iter,
+                               const gchar *data,
+                               gsize length);
+
+gboolean
+mafw_lastfm_journal_iter_next (MafwLastfmJournalIter *iter,
+                               MafwLastfmTrack *track,
+                               guint *flags);
+
+G_END_DECLS
+
+#endif /* MAFW_LASTFM_JOURNAL_H */
@@ -0,0 +1,291 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The ListenBrainz API: listens are sent as JSON to submit-listens,
+ * with the "import" type for the cached tracks and "playing_now" for
+ * the track being played, authenticated with the user token in a
+ * header. The "handshake" only validates the token.
+ *
+ * The JSON is written straight into the buffer of the payload as the
+ * tracks are appended, with nothing built in between.
+ */
+
+#include <glib.h>
+#include <libsoup/soup.h>
+#include <string.h>
+
+#include "mafw-lastfm-protocol.h"
+
+#define API_URL "https://api.listenbrainz.org/"
+#define VALIDATE_TOKEN "1/validate-token"
+#define SUBMIT_LISTENS "1/submit-listens"
+#define CLIENT_NAME "mafw-lastfm"
+
+/* Appends @value as a JSON string, quotes included. Runs of
+   characters that need no escaping are appended in one go. */
+static void
+append_json_string (GString *json,
+                    const gchar *value)
+{
+  static const gchar hex[] = "0123456789abcdef";
+  const guchar *p = (const guchar *) (value ? value : "");
+  const guchar *start;
+  gchar escape[6] = { '\\', 'u', '0', '0' };
+
+  g_string_append_c (json, '"');
+  while (*p) {
+    start = p;
+    while (*p >= 0x20 && *p != '"' && *p != '\\')
+      p++;
+    if (p > start)
+      g_string_append_len (json, (const gchar *) start, p - start);
+
+    if (*p == '"' || *p == '\\') {
+      g_string_append_c (json, '\\');
+      g_string_append_c (json, *p++);
+    } else if (*p) {
+      escape[4] = hex[*p >> 4];
+      escape[5] = hex[*p & 0xf];
+      g_string_append_len (json, escape, 6);
+      p++;
+    }
+  }
+  g_string_append_c (json, '"');
+}
+
+/* Appends "key":value to an object, after a comma unless first. */
+static void
+append_member (GString *json,
+               const gchar *key,
+               gboolean first)
+{
+  if (!first)
+    g_string_append_c (json, ',');
+  g_string_append_c (json, '"');
+  g_string_append (json, key);
+  g_string_append_len (json, "\":", 2);
+}
+
+static void
+append_int_member (GString *json,
+                   const gchar *key,
+                   gint64 value,
+                   gboolean first)
+{
+  append_member (json, key, first);
+  g_string_append_printf (json, "%" G_GINT64_FORMAT, value);
+}
+
+/* Builds the url of @method under the root of the API. */
+static gchar *
+lb_build_url (const gchar *url,
+              const gchar *method)
+{
+  return g_strconcat (url, g_str_has_suffix (url, "/") ? "" : "/",
+                      method, NULL);
+}
+
+static void
+lb_authorize (SoupMessage *message,
+              const gchar *token)
+{
+  gchar *authorization;
+
+  authorization = g_strconcat ("Token ", token, NULL);
+  soup_message_headers_replace (message->request_headers, "Authorization",
+                                authorization);
+  g_free (authorization);
+}
+
+static SoupMessage *
+lb_new_handshake (const MafwLastfmAccount *account)
+{
+  SoupMessage *message;
+  gchar *url;
+
+  url = lb_build_url (account->url, VALIDATE_TOKEN);
+  message = soup_message_new ("GET", url);
+  g_free (url);
+
+  if (message)
+    lb_authorize (message, account->md5password);
+
+  return message;
+}
+
+static MafwLastfmHandshakeResponse
+lb_parse_handshake (SoupMessage *message,
+                    MafwLastfmAccount *account)
+{
+  const gchar *valid;
+
+  if (!SOUP_STATUS_IS_SUCCESSFUL (message->status_code) ||
+      !message->response_body->data)
+    return MAFW_LASTFM_HANDSHAKE_FAILED;
+
+  /* {"code": 200, "message": "Token valid.", "valid": true, ...} */
+  valid = strstr (message->response_body->data, "\"valid\"");
+  if (valid) {
+    valid += strlen ("\"valid\"");
+    valid += strspn (valid, " \t\r\n:");
+  }
+
+  if (!valid || !g_str_has_prefix (valid, "true")) {
+    g_warning ("Couldn't handshake: invalid token");
+    return MAFW_LASTFM_HANDSHAKE_FAILED;
+  }
+
+  /* The token is the session, it doesn't expire either. */
+  g_free (account->session_id);
+  g_free (account->np_url);
+  g_free (account->sub_url);
+  account->session_id = g_strdup (account->md5password);
+  account->np_url = lb_build_url (account->url, SUBMIT_LISTENS);
+  account->sub_url = g_strdup (account->np_url);
+
+  return MAFW_LASTFM_HANDSHAKE_OK;
+}
+
+static void
+lb_begin (MafwLastfmPayload *payload)
+{
+  g_string_append (payload->data,
+                   payload->request == MAFW_LASTFM_REQUEST_NOW_PLAYING ?
+                   "{\"listen_type\":\"playing_now\",\"payload\":[" :
+                   "{\"listen_type\":\"import\",\"payload\":[");
+}
+
+static void
+lb_append (MafwLastfmPayload *payload,
+           MafwLastfmTrack *track,
+           gboolean encoded)
+{
+  GString *json = payload->data;
+
+  if (payload->n_tracks > 0)
+    g_string_append_c (json, ',');
+  g_string_append_c (json, '{');
+
+  /* Tracks being played have no time yet. */
+  if (payload->request == MAFW_LASTFM_REQUEST_SUBMISSION) {
+    append_int_member (json, "listened_at", track->timestamp, TRUE);
+    append_member (json, "track_metadata", FALSE);
+  } else {
+    append_member (json, "track_metadata", TRUE);
+  }
+
+  g_string_append_c (json, '{');
+  append_member (json, "artist_name", TRUE);
+  append_json_string (json, track->artist);
+  append_member (json, "track_name", FALSE);
+  append_json_string (json, track->title);
+  if (track->album && *track->album) {
+    append_member (json, "release_name", FALSE);
+    append_json_string (json, track->album);
+  }
+
+  append_member (json, "additional_info", FALSE);
+  g_string_append_c (json, '{');
+  append_member (json, "submission_client", TRUE);
+  append_json_string (json, CLIENT_NAME);
+  if (track->length > 0)
+    append_int_member (json, "duration_ms", track->length * 1000, FALSE);
+  if (track->number > 0)
+    append_int_member (json, "tracknumber", track->number, FALSE);
+
+  g_string_append_len (json, "}}}", 3);
+}
+
+static void
+lb_end (MafwLastfmPayload *payload)
+{
+  g_string_append_len (payload->data, "]}", 2);
+}
+
+static SoupMessage *
+lb_new_request (const MafwLastfmAccount *account,
+                MafwLastfmPayload *payload)
+{
+  SoupMessage *message;
+
+  /* Nothing of ours in the body, the listens are all of it. */
+  message = mafw_lastfm_protocol_new_post (account->sub_url,
+                                           "application/json",
+                                           NULL, payload);
+  if (message)
+    lb_authorize (message, account->session_id);
+
+  return message;
+}
+
+/**
+ * lb_parse_response:
+ * @message: a finished now-playing or submission request
+ *
+ * Returns: the outcome of @message. A rejected token is handled as a
+ * lost session; a server that is overloaded or throttling us, as an
+ * HTTP error, with the longer backoff. Other client errors mean that
+ * the listens themselves are refused, unless the account or the url
+ * is to blame, which are hard failures until fixed.
+ **/
+static MafwLastfmResponse
+lb_parse_response (SoupMessage *message)
+{
+  MafwLastfmResponse response;
+  const gchar *data;
+
+  response = mafw_lastfm_protocol_check_status (message);
+  if (response != MAFW_LASTFM_RESPONSE_OK)
+    return response;
+
+  if (SOUP_STATUS_IS_SUCCESSFUL (message->status_code))
+    return MAFW_LASTFM_RESPONSE_OK;
+
+  data = message->response_body->data;
+  g_warning ("Request failed: %u %s", message->status_code,
+             data ? data : message->reason_phrase);
+
+  if (message->status_code == SOUP_STATUS_UNAUTHORIZED)
+    return MAFW_LASTFM_RESPONSE_BADSESSION;
+  if (message->status_code == 429 ||
+      message->status_code == SOUP_STATUS_REQUEST_TIMEOUT ||
+      SOUP_STATUS_IS_SERVER_ERROR (message->status_code))
+    return MAFW_LASTFM_RESPONSE_HTTP_ERROR;
+  if (SOUP_STATUS_IS_CLIENT_ERROR (message->status_code) &&
+      message->status_code != SOUP_STATUS_FORBIDDEN &&
+      message->status_code != SOUP_STATUS_NOT_FOUND)
+    return MAFW_LASTFM_RESPONSE_REJECTED;
+
+  return MAFW_LASTFM_RESPONSE_FAILED;
+}
+
+const MafwLastfmProtocol mafw_lastfm_protocol_listenbrainz = {
+  "listenbrainz",
+  API_URL,
+  FALSE,
+  lb_new_handshake,
+  lb_parse_handshake,
+  lb_begin,
+  lb_append,
+  lb_end,
+  lb_new_request,
+  lb_parse_response
+};
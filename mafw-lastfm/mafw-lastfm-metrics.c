@@ -0,0 +1,250 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Always-on counters, gauges and latency histograms of the
+ * scrobbler, read through D-Bus or dumped to a file.
+ *
+ * The values are plain integers in a static registry, updated with
+ * relaxed atomic operations where the compiler provides them, so
+ * that updating one costs about as much as incrementing a variable.
+ * They are only meant to be consistent one by one: a reader may see
+ * a histogram count that doesn't match the sum of its buckets yet.
+ */
+
+#include <glib.h>
+
+#include "mafw-lastfm-metrics.h"
+
+#if defined (__ATOMIC_RELAXED)
+ #define metric_add(p, v) __atomic_fetch_add ((p), (v), __ATOMIC_RELAXED)
+ #define metric_store(p, v) __atomic_store_n ((p), (v), __ATOMIC_RELAXED)
+ #define metric_load(p) ((guint) __atomic_load_n ((p), __ATOMIC_RELAXED))
+#else
+ #define metric_add(p, v) g_atomic_int_add ((p), (v))
+ #define metric_store(p, v) g_atomic_int_set ((p), (v))
+ #define metric_load(p) ((guint) g_atomic_int_get ((p)))
+#endif
+
+/* Upper bounds of the histogram buckets, in milliseconds. The last
+   bucket takes everything above them. */
+static const guint bucket_bounds[] = {
+  50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000
+};
+
+#define N_BUCKETS (G_N_ELEMENTS (bucket_bounds) + 1)
+
+typedef struct {
+  volatile gint buckets[N_BUCKETS];
+  volatile gint count;
+  volatile gint sum;
+} Histogram;
+
+static const gchar *metric_names[MAFW_LASTFM_N_METRICS] = {
+  "handshakes",
+  "handshakes_failed",
+  "now_playing_sent",
+  "now_playing_cancelled",
+  "now_playing_superseded",
+  "tracks_enqueued",
+  "duplicates_dropped",
+  "submissions",
+  "submissions_failed",
+  "scrobbles_rejected",
+  "bytes_sent",
+  "breaker_trips",
+  "metadata_cache_hits",
+  "metadata_cache_misses",
+  "position_cache_hits",
+  "position_cache_misses",
+  "queue_depth",
+  "disk_bytes",
+  "retry_backoff_seconds",
+  "breaker_state"
+};
+
+static const gchar *histogram_names[MAFW_LASTFM_N_HISTOGRAMS] = {
+  "handshake_latency_ms",
+  "submission_latency_ms"
+};
+
+static volatile gint metrics[MAFW_LASTFM_N_METRICS];
+static Histogram histograms[MAFW_LASTFM_N_HISTOGRAMS];
+
+/**
+ * mafw_lastfm_metrics_add:
+ * @metric: a counter
+ * @value: the amount to add
+ *
+ * Adds @value to @metric. mafw_lastfm_metrics_inc() adds 1.
+ **/
+void
+mafw_lastfm_metrics_add (MafwLastfmMetric metric,
+                         gint value)
+{
+  metric_add (&metrics[metric], value);
+}
+
+/**
+ * mafw_lastfm_metrics_set:
+ * @metric: a gauge
+ * @value: the current value of @metric
+ *
+ * Sets the value of a gauge, such as the depth of the queue.
+ **/
+void
+mafw_lastfm_metrics_set (MafwLastfmMetric metric,
+                         gint value)
+{
+  metric_store (&metrics[metric], value);
+}
+
+guint
+mafw_lastfm_metrics_get (MafwLastfmMetric metric)
+{
+  return metric_load (&metrics[metric]);
+}
+
+/**
+ * mafw_lastfm_metrics_observe:
+ * @histogram: a histogram
+ * @milliseconds: the latency to account for
+ *
+ * Adds a sample to @histogram.
+ **/
+void
+mafw_lastfm_metrics_observe (MafwLastfmHistogram histogram,
+                             guint milliseconds)
+{
+  Histogram *h = &histograms[histogram];
+  guint i = 0;
+
+  while (i < G_N_ELEMENTS (bucket_bounds) && milliseconds > bucket_bounds[i])
+    i++;
+
+  metric_add (&h->buckets[i], 1);
+  metric_add (&h->count, 1);
+  metric_add (&h->sum, milliseconds);
+}
+
+/**
+ * mafw_lastfm_metrics_foreach:
+ * @func: the function to call for each value
+ * @user_data: data to pass to @func
+ *
+ * Calls @func with the name and the value of every counter and
+ * gauge, and of every bucket of the histograms. Like in Prometheus,
+ * the buckets are cumulative: "<histogram>_le_<bound>" counts the
+ * samples up to bound milliseconds, and they are followed by
+ * "<histogram>_count" and "<histogram>_sum".
+ **/
+void
+mafw_lastfm_metrics_foreach (MafwLastfmMetricsFunc func,
+                             gpointer user_data)
+{
+  gchar name[64];
+  guint i, j, total;
+
+  for (i = 0; i < MAFW_LASTFM_N_METRICS; i++)
+    func (metric_names[i], metric_load (&metrics[i]), user_data);
+
+  for (i = 0; i < MAFW_LASTFM_N_HISTOGRAMS; i++) {
+    total = 0;
+    for (j = 0; j < N_BUCKETS; j++) {
+      total += metric_load (&histograms[i].buckets[j]);
+      if (j < G_N_ELEMENTS (bucket_bounds))
+        g_snprintf (name, sizeof (name), "%s_le_%u",
+                    histogram_names[i], bucket_bounds[j]);
+      else
+        g_snprintf (name, sizeof (name), "%s_le_inf", histogram_names[i]);
+      func (name, total, user_data);
+    }
+
+    g_snprintf (name, sizeof (name), "%s_count", histogram_names[i]);
+    func (name, metric_load (&histograms[i].count), user_data);
+    g_snprintf (name, sizeof (name), "%s_sum", histogram_names[i]);
+    func (name, metric_load (&histograms[i].sum), user_data);
+  }
+}
+
+static void
+append_line (const gchar *name,
+             guint value,
+             gpointer user_data)
+{
+  g_string_append_printf (user_data, "%s %u\n", name, value);
+}
+
+/**
+ * mafw_lastfm_metrics_to_string:
+ *
+ * Returns: a newly allocated string with a "name value" line per
+ * value, as listed by mafw_lastfm_metrics_foreach().
+ **/
+gchar *
+mafw_lastfm_metrics_to_string (void)
+{
+  GString *string;
+
+  string = g_string_sized_new (1024);
+  mafw_lastfm_metrics_foreach (append_line, string);
+
+  return g_string_free (string, FALSE);
+}
+
+/**
+ * mafw_lastfm_metrics_dump:
+ * @path: the file to write
+ * @error: return location for a #GError, or %NULL
+ *
+ * Replaces the contents of @path with mafw_lastfm_metrics_to_string().
+ * Readers of @path never see a partial dump.
+ *
+ * Returns: %TRUE on success.
+ **/
+gboolean
+mafw_lastfm_metrics_dump (const gchar *path,
+                          GError **error)
+{
+  gchar *contents;
+  gboolean retval;
+
+  contents = mafw_lastfm_metrics_to_string ();
+  retval = g_file_set_contents (path, contents, -1, error);
+  g_free (contents);
+
+  return retval;
+}
+
+void
+mafw_lastfm_metrics_reset (void)
+{
+  guint i, j;
+
+  for (i = 0; i < MAFW_LASTFM_N_METRICS; i++)
+    metric_store (&metrics[i], 0);
+
+  for (i = 0; i < MAFW_LASTFM_N_HISTOGRAMS; i++) {
+    for (j = 0; j < N_BUCKETS; j++)
+      metric_store (&histograms[i].buckets[j], 0);
+    metric_store (&histograms[i].count, 0);
+    metric_store (&histograms[i].sum, 0);
+  }
+}
@@ -0,0 +1,97 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef MAFW_LASTFM_METRICS_H
+#define MAFW_LASTFM_METRICS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+  /* Counters */
+  MAFW_LASTFM_METRIC_HANDSHAKES,
+  MAFW_LASTFM_METRIC_HANDSHAKES_FAILED,
+  MAFW_LASTFM_METRIC_NOW_PLAYING_SENT,
+  MAFW_LASTFM_METRIC_NOW_PLAYING_CANCELLED,
+  MAFW_LASTFM_METRIC_NOW_PLAYING_SUPERSEDED,
+  MAFW_LASTFM_METRIC_TRACKS_ENQUEUED,
+  MAFW_LASTFM_METRIC_DUPLICATES_DROPPED,
+  MAFW_LASTFM_METRIC_SUBMISSIONS,
+  MAFW_LASTFM_METRIC_SUBMISSIONS_FAILED,
+  MAFW_LASTFM_METRIC_SCROBBLES_REJECTED,
+  MAFW_LASTFM_METRIC_BYTES_SENT,
+  MAFW_LASTFM_METRIC_BREAKER_TRIPS,
+  MAFW_LASTFM_METRIC_METADATA_CACHE_HITS,
+  MAFW_LASTFM_METRIC_METADATA_CACHE_MISSES,
+  MAFW_LASTFM_METRIC_POSITION_CACHE_HITS,
+  MAFW_LASTFM_METRIC_POSITION_CACHE_MISSES,
+  /* Gauges */
+  MAFW_LASTFM_METRIC_QUEUE_DEPTH,
+  MAFW_LASTFM_METRIC_DISK_BYTES,
+  MAFW_LASTFM_METRIC_RETRY_BACKOFF,
+  MAFW_LASTFM_METRIC_BREAKER_STATE,
+  MAFW_LASTFM_N_METRICS
+} MafwLastfmMetric;
+
+typedef enum {
+  MAFW_LASTFM_HISTOGRAM_HANDSHAKE_LATENCY,
+  MAFW_LASTFM_HISTOGRAM_SUBMISSION_LATENCY,
+  MAFW_LASTFM_N_HISTOGRAMS
+} MafwLastfmHistogram;
+
+typedef void (*MafwLastfmMetricsFunc) (const gchar *name,
+                                       guint value,
+                                       gpointer user_data);
+
+void
+mafw_lastfm_metrics_add (MafwLastfmMetric metric,
+                         gint value);
+
+#define mafw_lastfm_metrics_inc(metric) mafw_lastfm_metrics_add ((metric), 1)
+
+void
+mafw_lastfm_metrics_set (MafwLastfmMetric metric,
+                         gint value);
+
+guint
+mafw_lastfm_metrics_get (MafwLastfmMetric metric);
+
+void
+mafw_lastfm_metrics_observe (MafwLastfmHistogram histogram,
+                             guint milliseconds);
+
+void
+mafw_lastfm_metrics_foreach (MafwLastfmMetricsFunc func,
+                             gpointer user_data);
+
+gchar *
+mafw_lastfm_metrics_to_string (void);
+
+gboolean
+mafw_lastfm_metrics_dump (const gchar *path,
+                          GError **error);
+
+void
+mafw_lastfm_metrics_reset (void);
+
+G_END_DECLS
+
+#endif /* MAFW_LASTFM_METRICS_H */
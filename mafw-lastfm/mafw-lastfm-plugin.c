@@ -0,0 +1,78 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2009-2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The scrobbler as a MAFW plugin, for the process running the
+ * renderer to load it with mafw_registry_load_plugin(). The signals
+ * of the renderer are then delivered to the tracker by a plain
+ * GObject emission, instead of crossing the session bus to reach
+ * the proxy of the renderer in the daemon, and the requests for the
+ * position and the metadata are answered in-process as well.
+ *
+ * Only one of the plugin and the daemon can be running, since both
+ * would scrobble every track to the same journal: the one started
+ * last fails to initialize.
+ */
+
+#include <glib.h>
+#include <gmodule.h>
+#include <libmafw/mafw.h>
+
+#include "mafw-lastfm-scrobbler.h"
+#include "mafw-lastfm-service.h"
+
+#define MAFW_LASTFM_PLUGIN_NAME "Mafw-Lastfm"
+
+static MafwLastfmService *service = NULL;
+
+static gboolean
+mafw_lastfm_plugin_initialize (MafwRegistry *registry,
+                               GError **error)
+{
+  MafwLastfmScrobbler *scrobbler;
+
+  g_return_val_if_fail (service == NULL, FALSE);
+
+  scrobbler = mafw_lastfm_scrobbler_new (error);
+  if (!scrobbler)
+    return FALSE;
+
+  service = mafw_lastfm_service_new (scrobbler);
+  g_object_unref (scrobbler);
+
+  mafw_lastfm_service_watch_registry (service, registry);
+  mafw_lastfm_service_load_settings (service);
+
+  return TRUE;
+}
+
+static void
+mafw_lastfm_plugin_deinitialize (GError **error)
+{
+  mafw_lastfm_service_free (service);
+  service = NULL;
+}
+
+/* Looked up by the name of the module, mafw-lastfm.so. */
+G_MODULE_EXPORT MafwPluginDescriptor mafw_lastfm_plugin_description = {
+  { .name = MAFW_LASTFM_PLUGIN_NAME },
+  .initialize = mafw_lastfm_plugin_initialize,
+  .deinitialize = mafw_lastfm_plugin_deinitialize,
+};
@@ -0,0 +1,281 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The protocols spoken to the servers. An endpoint handshakes, sends
+ * and parses the responses through the vtable of its protocol, and
+ * handles everything else (sessions, retries, batches) the same way
+ * for all of them.
+ *
+ * A payload holds the tracks of a request encoded for a protocol. It
+ * is built once and shared by all the endpoints speaking it: the
+ * encoded fields as a SoupBuffer appended to each request as is, and,
+ * for the protocols that sign the requests, the fields sorted by name
+ * so that each endpoint only merges its own ones while signing.
+ */
+
+#include <glib.h>
+#include <libsoup/soup.h>
+#include <string.h>
+
+#include "mafw-lastfm-protocol.h"
+
+static const MafwLastfmProtocol *protocols[] = {
+  &mafw_lastfm_protocol_as12,
+  &mafw_lastfm_protocol_as20,
+  &mafw_lastfm_protocol_listenbrainz
+};
+
+/**
+ * mafw_lastfm_protocol_lookup:
+ * @name: the name of a protocol, or %NULL
+ *
+ * Returns: the protocol called @name, the Audioscrobbler 1.2.1 one
+ * for %NULL, or %NULL if there is no such protocol.
+ **/
+const MafwLastfmProtocol *
+mafw_lastfm_protocol_lookup (const gchar *name)
+{
+  guint i;
+
+  if (!name)
+    return &mafw_lastfm_protocol_as12;
+
+  for (i = 0; i < G_N_ELEMENTS (protocols); i++)
+    if (strcmp (protocols[i]->name, name) == 0)
+      return protocols[i];
+
+  return NULL;
+}
+
+/**
+ * mafw_lastfm_protocol_check_status:
+ * @message: a finished request
+ *
+ * Returns: %MAFW_LASTFM_RESPONSE_CANCELLED or
+ * %MAFW_LASTFM_RESPONSE_NETWORK_ERROR if @message got no response,
+ * %MAFW_LASTFM_RESPONSE_OK if it did, whatever its status.
+ **/
+MafwLastfmResponse
+mafw_lastfm_protocol_check_status (SoupMessage *message)
+{
+  if (message->status_code == SOUP_STATUS_CANCELLED)
+    return MAFW_LASTFM_RESPONSE_CANCELLED;
+  if (SOUP_STATUS_IS_TRANSPORT_ERROR (message->status_code))
+    return MAFW_LASTFM_RESPONSE_NETWORK_ERROR;
+
+  return MAFW_LASTFM_RESPONSE_OK;
+}
+
+/**
+ * mafw_lastfm_protocol_new_post:
+ * @url: the url to POST to
+ * @content_type: the type of the body
+ * @prefix: the fields of the endpoint, or %NULL. It is freed.
+ * @payload: a finished #MafwLastfmPayload
+ *
+ * Returns: a new request whose body is @prefix followed by the fields
+ * of @payload, which are not copied.
+ **/
+SoupMessage *
+mafw_lastfm_protocol_new_post (const gchar *url,
+                               const gchar *content_type,
+                               GString *prefix,
+                               MafwLastfmPayload *payload)
+{
+  SoupMessage *message;
+  gsize length;
+
+  g_return_val_if_fail (payload->fields, NULL);
+
+  message = soup_message_new ("POST", url);
+  if (!message) {
+    if (prefix)
+      g_string_free (prefix, TRUE);
+    return NULL;
+  }
+
+  if (prefix) {
+    length = prefix->len;
+    soup_message_set_request (message, content_type, SOUP_MEMORY_TAKE,
+                              g_string_free (prefix, FALSE), length);
+  } else {
+    soup_message_set_request (message, content_type, SOUP_MEMORY_STATIC,
+                              NULL, 0);
+  }
+  soup_message_body_append_buffer (message->request_body, payload->fields);
+
+  return message;
+}
+
+/**
+ * mafw_lastfm_payload_new:
+ * @protocol: the protocol to encode the tracks for
+ * @request: the kind of request the tracks are for
+ * @size_hint: the expected size of the encoded tracks
+ *
+ * Returns: a new #MafwLastfmPayload to append the tracks to, and
+ * finish with mafw_lastfm_payload_finish().
+ **/
+MafwLastfmPayload *
+mafw_lastfm_payload_new (const MafwLastfmProtocol *protocol,
+                         MafwLastfmRequest request,
+                         gsize size_hint)
+{
+  MafwLastfmPayload *payload;
+
+  payload = g_slice_new0 (MafwLastfmPayload);
+  payload->protocol = protocol;
+  payload->request = request;
+  payload->data = g_string_sized_new (size_hint);
+  payload->ref_count = 1;
+
+  if (protocol->begin)
+    protocol->begin (payload);
+
+  return payload;
+}
+
+MafwLastfmPayload *
+mafw_lastfm_payload_ref (MafwLastfmPayload *payload)
+{
+  g_atomic_int_inc (&payload->ref_count);
+
+  return payload;
+}
+
+void
+mafw_lastfm_payload_unref (MafwLastfmPayload *payload)
+{
+  if (!g_atomic_int_dec_and_test (&payload->ref_count))
+    return;
+
+  if (payload->data)
+    g_string_free (payload->data, TRUE);
+  if (payload->fields)
+    soup_buffer_free (payload->fields);
+  if (payload->params) {
+    g_ptr_array_foreach (payload->params, (GFunc) g_free, NULL);
+    g_ptr_array_free (payload->params, TRUE);
+  }
+  g_slice_free (MafwLastfmPayload, payload);
+}
+
+/**
+ * mafw_lastfm_payload_append:
+ * @payload: an unfinished #MafwLastfmPayload
+ * @track: the track to append
+ * @encoded: whether the strings of @track are already encoded, as
+ * imported from the text queue
+ *
+ * Appends @track to @payload, decoding its strings first if the
+ * protocol can't take them encoded.
+ **/
+void
+mafw_lastfm_payload_append (MafwLastfmPayload *payload,
+                            MafwLastfmTrack *track,
+                            gboolean encoded)
+{
+  MafwLastfmTrack decoded;
+  gchar *artist, *title, *album;
+
+  g_return_if_fail (payload->data);
+
+  if (!encoded || payload->protocol->takes_encoded) {
+    payload->protocol->append (payload, track, encoded);
+  } else {
+    artist = track->artist ? soup_uri_decode (track->artist) : NULL;
+    title = track->title ? soup_uri_decode (track->title) : NULL;
+    album = track->album ? soup_uri_decode (track->album) : NULL;
+    decoded = *track;
+    decoded.artist = artist;
+    decoded.title = title;
+    decoded.album = album;
+    payload->protocol->append (payload, &decoded, FALSE);
+    g_free (artist);
+    g_free (title);
+    g_free (album);
+  }
+
+  payload->n_tracks++;
+}
+
+/**
+ * mafw_lastfm_payload_add_param:
+ * @payload: an unfinished #MafwLastfmPayload
+ * @name: the name of a field
+ * @value: its value, unencoded
+ *
+ * Keeps a field of @payload to be signed.
+ **/
+void
+mafw_lastfm_payload_add_param (MafwLastfmPayload *payload,
+                               const gchar *name,
+                               const gchar *value)
+{
+  gsize name_len, value_len;
+  gchar *param;
+
+  if (!payload->params)
+    payload->params = g_ptr_array_new ();
+
+  name_len = strlen (name);
+  value_len = value ? strlen (value) : 0;
+  param = g_malloc (name_len + value_len + 2);
+  memcpy (param, name, name_len + 1);
+  memcpy (param + name_len + 1, value ? value : "", value_len + 1);
+
+  g_ptr_array_add (payload->params, param);
+}
+
+static gint
+compare_params (gconstpointer a,
+                gconstpointer b)
+{
+  /* Only the names are compared, the values are after their nul. */
+  return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+/**
+ * mafw_lastfm_payload_finish:
+ * @payload: a #MafwLastfmPayload
+ *
+ * Ends @payload, which is ready to be sent afterwards and can't be
+ * appended to any longer.
+ **/
+void
+mafw_lastfm_payload_finish (MafwLastfmPayload *payload)
+{
+  gsize length;
+
+  g_return_if_fail (payload->data);
+
+  if (payload->protocol->end)
+    payload->protocol->end (payload);
+
+  if (payload->params)
+    g_ptr_array_sort (payload->params, compare_params);
+
+  length = payload->data->len;
+  payload->fields = soup_buffer_new (SOUP_MEMORY_TAKE,
+                                     g_string_free (payload->data, FALSE),
+                                     length);
+  payload->data = NULL;
+}
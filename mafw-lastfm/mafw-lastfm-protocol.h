@@ -0,0 +1,154 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef MAFW_LASTFM_PROTOCOL_H
+#define MAFW_LASTFM_PROTOCOL_H
+
+#include <glib.h>
+#include <libsoup/soup.h>
+
+#include "mafw-lastfm-track.h"
+
+G_BEGIN_DECLS
+
+typedef enum {
+  MAFW_LASTFM_REQUEST_NOW_PLAYING,
+  MAFW_LASTFM_REQUEST_SUBMISSION
+} MafwLastfmRequest;
+
+/* Outcome of a now-playing or submission request. The failures that
+   are retried with a backoff come first. */
+typedef enum {
+  MAFW_LASTFM_RESPONSE_NETWORK_ERROR,
+  MAFW_LASTFM_RESPONSE_HTTP_ERROR,
+  MAFW_LASTFM_RESPONSE_FAILED,
+  MAFW_LASTFM_RESPONSE_N_BACKOFFS,
+  MAFW_LASTFM_RESPONSE_OK = MAFW_LASTFM_RESPONSE_N_BACKOFFS,
+  MAFW_LASTFM_RESPONSE_BADSESSION,
+  /* The server refuses the tracks themselves, and would every time. */
+  MAFW_LASTFM_RESPONSE_REJECTED,
+  MAFW_LASTFM_RESPONSE_CANCELLED
+} MafwLastfmResponse;
+
+typedef enum {
+  MAFW_LASTFM_HANDSHAKE_OK,
+  /* The clock is off, handshake again right away. */
+  MAFW_LASTFM_HANDSHAKE_BADTIME,
+  MAFW_LASTFM_HANDSHAKE_FAILED
+} MafwLastfmHandshakeResponse;
+
+/* What an endpoint knows about its account on the server. */
+typedef struct {
+  gchar *url;
+  gchar *username;
+  /* The user token for ListenBrainz. */
+  gchar *md5password;
+  /* For the protocols that sign their requests. */
+  gchar *api_key;
+  gchar *api_secret;
+  /* Obtained in the handshake. */
+  gchar *session_id;
+  gchar *np_url;
+  gchar *sub_url;
+} MafwLastfmAccount;
+
+typedef struct MafwLastfmProtocol MafwLastfmProtocol;
+
+/* The tracks of a request, encoded once for all the endpoints that
+   speak the same protocol. */
+typedef struct {
+  const MafwLastfmProtocol *protocol;
+  MafwLastfmRequest request;
+  guint n_tracks;
+  /* The encoded fields, shared by the requests once finished. */
+  GString *data;
+  SoupBuffer *fields;
+  /* The fields unencoded, as "name\0value", for the protocols that
+     sign them. Sorted by name once finished. */
+  GPtrArray *params;
+  gint ref_count;
+} MafwLastfmPayload;
+
+struct MafwLastfmProtocol {
+  const gchar *name;
+  const gchar *default_url;
+  /* Whether the strings of the records imported from the text queue
+     can be sent as they are, already encoded. */
+  gboolean takes_encoded;
+
+  /* Returns NULL if @account lacks what the handshake needs. */
+  SoupMessage *(*new_handshake) (const MafwLastfmAccount *account);
+  MafwLastfmHandshakeResponse (*parse_handshake) (SoupMessage *message,
+                                                  MafwLastfmAccount *account);
+
+  void (*begin) (MafwLastfmPayload *payload);
+  void (*append) (MafwLastfmPayload *payload,
+                  MafwLastfmTrack *track,
+                  gboolean encoded);
+  void (*end) (MafwLastfmPayload *payload);
+
+  SoupMessage *(*new_request) (const MafwLastfmAccount *account,
+                               MafwLastfmPayload *payload);
+  MafwLastfmResponse (*parse_response) (SoupMessage *message);
+};
+
+extern const MafwLastfmProtocol mafw_lastfm_protocol_as12;
+extern const MafwLastfmProtocol mafw_lastfm_protocol_as20;
+extern const MafwLastfmProtocol mafw_lastfm_protocol_listenbrainz;
+
+const MafwLastfmProtocol *
+mafw_lastfm_protocol_lookup (const gchar *name);
+
+MafwLastfmResponse
+mafw_lastfm_protocol_check_status (SoupMessage *message);
+
+SoupMessage *
+mafw_lastfm_protocol_new_post (const gchar *url,
+                               const gchar *content_type,
+                               GString *prefix,
+                               MafwLastfmPayload *payload);
+
+MafwLastfmPayload *
+mafw_lastfm_payload_new (const MafwLastfmProtocol *protocol,
+                         MafwLastfmRequest request,
+                         gsize size_hint);
+
+MafwLastfmPayload *
+mafw_lastfm_payload_ref (MafwLastfmPayload *payload);
+
+void
+mafw_lastfm_payload_unref (MafwLastfmPayload *payload);
+
+void
+mafw_lastfm_payload_append (MafwLastfmPayload *payload,
+                            MafwLastfmTrack *track,
+                            gboolean encoded);
+
+void
+mafw_lastfm_payload_add_param (MafwLastfmPayload *payload,
+                               const gchar *name,
+                               const gchar *value);
+
+void
+mafw_lastfm_payload_finish (MafwLastfmPayload *payload);
+
+G_END_DECLS
+
+#endif /* MAFW_LASTFM_PROTOCOL_H */
@@ -0,0 +1,317 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The queue of tracks waiting to be written to the journal. It is a
+ * ring buffer of track references, kept in a single array whose
+ * capacity is a power of two and doubles when it gets full, so that
+ * pushing and popping at either end doesn't allocate.
+ *
+ * The queue also keeps the number of bytes taken by its tracks, so
+ * that the scrobbler can spill them to disk once an optional limit is
+ * exceeded.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "mafw-lastfm-queue.h"
+
+#define MIN_CAPACITY 4
+
+struct MafwLastfmQueue {
+  MafwLastfmTrack **tracks;
+  /* Always a power of two. */
+  guint capacity;
+  guint head;
+  guint length;
+  guint high_water;
+
+  /* Bytes taken by the tracks in the queue. */
+  gsize memory_size;
+  /* 0 if there is no limit. */
+  gsize memory_limit;
+};
+
+static gsize
+track_size (MafwLastfmTrack *track)
+{
+  return sizeof (MafwLastfmTrack) +
+    (track->artist ? strlen (track->artist) + 1 : 0) +
+    (track->title ? strlen (track->title) + 1 : 0) +
+    (track->album ? strlen (track->album) + 1 : 0);
+}
+
+static void
+queue_grow (MafwLastfmQueue *queue)
+{
+  MafwLastfmTrack **tracks;
+  guint first;
+
+  tracks = g_new (MafwLastfmTrack *, queue->capacity * 2);
+
+  /* Unwrap the contents so that they start at 0 again. */
+  first = MIN (queue->length, queue->capacity - queue->head);
+  memcpy (tracks, queue->tracks + queue->head,
+          first * sizeof (MafwLastfmTrack *));
+  memcpy (tracks + first, queue->tracks,
+          (queue->length - first) * sizeof (MafwLastfmTrack *));
+
+  g_free (queue->tracks);
+  queue->tracks = tracks;
+  queue->capacity *= 2;
+  queue->head = 0;
+}
+
+static void
+queue_added (MafwLastfmQueue *queue,
+             MafwLastfmTrack *track)
+{
+  queue->length++;
+  queue->high_water = MAX (queue->high_water, queue->length);
+  queue->memory_size += track_size (track);
+}
+
+/**
+ * mafw_lastfm_queue_new:
+ * @capacity: the number of tracks to make room for, it will be
+ * rounded up to a power of two
+ *
+ * Returns: a new, empty #MafwLastfmQueue.
+ **/
+MafwLastfmQueue *
+mafw_lastfm_queue_new (guint capacity)
+{
+  MafwLastfmQueue *queue;
+
+  queue = g_new0 (MafwLastfmQueue, 1);
+  queue->capacity = MIN_CAPACITY;
+  while (queue->capacity < capacity)
+    queue->capacity *= 2;
+  queue->tracks = g_new (MafwLastfmTrack *, queue->capacity);
+
+  return queue;
+}
+
+/**
+ * mafw_lastfm_queue_free:
+ * @queue: a #MafwLastfmQueue
+ *
+ * Frees @queue, releasing the tracks in it.
+ **/
+void
+mafw_lastfm_queue_free (MafwLastfmQueue *queue)
+{
+  if (!queue)
+    return;
+
+  mafw_lastfm_queue_clear (queue);
+  g_free (queue->tracks);
+  g_free (queue);
+}
+
+/**
+ * mafw_lastfm_queue_push_head:
+ * @queue: a #MafwLastfmQueue
+ * @track: a #MafwLastfmTrack
+ *
+ * Adds @track at the head of @queue, taking over the caller's
+ * reference.
+ **/
+void
+mafw_lastfm_queue_push_head (MafwLastfmQueue *queue,
+                             MafwLastfmTrack *track)
+{
+  g_return_if_fail (track);
+
+  if (queue->length == queue->capacity)
+    queue_grow (queue);
+
+  queue->head = (queue->head - 1) & (queue->capacity - 1);
+  queue->tracks[queue->head] = track;
+  queue_added (queue, track);
+}
+
+/**
+ * mafw_lastfm_queue_push_tail:
+ * @queue: a #MafwLastfmQueue
+ * @track: a #MafwLastfmTrack
+ *
+ * Adds @track at the tail of @queue, taking over the caller's
+ * reference.
+ **/
+void
+mafw_lastfm_queue_push_tail (MafwLastfmQueue *queue,
+                             MafwLastfmTrack *track)
+{
+  g_return_if_fail (track);
+
+  if (queue->length == queue->capacity)
+    queue_grow (queue);
+
+  queue->tracks[(queue->head + queue->length) & (queue->capacity - 1)] = track;
+  queue_added (queue, track);
+}
+
+/**
+ * mafw_lastfm_queue_pop_head:
+ * @queue: a #MafwLastfmQueue
+ *
+ * Returns: the track at the head of @queue, whose reference is passed
+ * to the caller, or %NULL if @queue is empty.
+ **/
+MafwLastfmTrack *
+mafw_lastfm_queue_pop_head (MafwLastfmQueue *queue)
+{
+  MafwLastfmTrack *track;
+
+  if (queue->length == 0)
+    return NULL;
+
+  track = queue->tracks[queue->head];
+  queue->head = (queue->head + 1) & (queue->capacity - 1);
+  queue->length--;
+  queue->memory_size -= track_size (track);
+
+  return track;
+}
+
+/**
+ * mafw_lastfm_queue_pop_tail:
+ * @queue: a #MafwLastfmQueue
+ *
+ * Returns: the track at the tail of @queue, whose reference is passed
+ * to the caller, or %NULL if @queue is empty.
+ **/
+MafwLastfmTrack *
+mafw_lastfm_queue_pop_tail (MafwLastfmQueue *queue)
+{
+  MafwLastfmTrack *track;
+
+  if (queue->length == 0)
+    return NULL;
+
+  queue->length--;
+  track = queue->tracks[(queue->head + queue->length) & (queue->capacity - 1)];
+  queue->memory_size -= track_size (track);
+
+  return track;
+}
+
+/**
+ * mafw_lastfm_queue_peek_nth:
+ * @queue: a #MafwLastfmQueue
+ * @n: the position of the track, from the head
+ *
+ * Returns: the track at position @n, owned by @queue, or %NULL if
+ * @n is out of range.
+ **/
+MafwLastfmTrack *
+mafw_lastfm_queue_peek_nth (MafwLastfmQueue *queue,
+                            guint n)
+{
+  if (n >= queue->length)
+    return NULL;
+
+  return queue->tracks[(queue->head + n) & (queue->capacity - 1)];
+}
+
+/**
+ * mafw_lastfm_queue_clear:
+ * @queue: a #MafwLastfmQueue
+ *
+ * Removes all the tracks from @queue, keeping its capacity.
+ **/
+void
+mafw_lastfm_queue_clear (MafwLastfmQueue *queue)
+{
+  while (queue->length > 0)
+    mafw_lastfm_track_unref (mafw_lastfm_queue_pop_head (queue));
+
+  queue->head = 0;
+}
+
+guint
+mafw_lastfm_queue_get_length (MafwLastfmQueue *queue)
+{
+  return queue->length;
+}
+
+/**
+ * mafw_lastfm_queue_get_capacity:
+ * @queue: a #MafwLastfmQueue
+ *
+ * Returns: the number of tracks that @queue can hold before it has
+ * to grow.
+ **/
+guint
+mafw_lastfm_queue_get_capacity (MafwLastfmQueue *queue)
+{
+  return queue->capacity;
+}
+
+/**
+ * mafw_lastfm_queue_get_high_water:
+ * @queue: a #MafwLastfmQueue
+ *
+ * Returns: the largest number of tracks that @queue has held.
+ **/
+guint
+mafw_lastfm_queue_get_high_water (MafwLastfmQueue *queue)
+{
+  return queue->high_water;
+}
+
+/**
+ * mafw_lastfm_queue_get_memory_size:
+ * @queue: a #MafwLastfmQueue
+ *
+ * Returns: the number of bytes taken by the tracks in @queue and by
+ * the queue itself.
+ **/
+gsize
+mafw_lastfm_queue_get_memory_size (MafwLastfmQueue *queue)
+{
+  return sizeof (MafwLastfmQueue) +
+    queue->capacity * sizeof (MafwLastfmTrack *) +
+    queue->memory_size;
+}
+
+/**
+ * mafw_lastfm_queue_set_memory_limit:
+ * @queue: a #MafwLastfmQueue
+ * @limit: the maximum number of bytes, or 0 for no limit
+ *
+ * Sets the memory size above which mafw_lastfm_queue_is_over_limit()
+ * returns %TRUE. The queue doesn't enforce it by itself.
+ **/
+void
+mafw_lastfm_queue_set_memory_limit (MafwLastfmQueue *queue,
+                                    gsize limit)
+{
+  queue->memory_limit = limit;
+}
+
+gboolean
+mafw_lastfm_queue_is_over_limit (MafwLastfmQueue *queue)
+{
+  return (queue->memory_limit > 0 &&
+          mafw_lastfm_queue_get_memory_size (queue) > queue->memory_limit);
+}
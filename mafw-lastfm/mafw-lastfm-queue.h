@@ -0,0 +1,80 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef MAFW_LASTFM_QUEUE_H
+#define MAFW_LASTFM_QUEUE_H
+
+#include <glib.h>
+
+#include "mafw-lastfm-track.h"
+
+G_BEGIN_DECLS
+
+typedef struct MafwLastfmQueue MafwLastfmQueue;
+
+MafwLastfmQueue *
+mafw_lastfm_queue_new (guint capacity);
+
+void
+mafw_lastfm_queue_free (MafwLastfmQueue *queue);
+
+void
+mafw_lastfm_queue_push_head (MafwLastfmQueue *queue,
+                             MafwLastfmTrack *track);
+
+void
+mafw_lastfm_queue_push_tail (MafwLastfmQueue *queue,
+                             MafwLastfmTrack *track);
+
+MafwLastfmTrack *
+mafw_lastfm_queue_pop_head (MafwLastfmQueue *queue);
+
+MafwLastfmTrack *
+mafw_lastfm_queue_pop_tail (MafwLastfmQueue *queue);
+
+MafwLastfmTrack *
+mafw_lastfm_queue_peek_nth (MafwLastfmQueue *queue,
+                            guint n);
+
+void
+mafw_lastfm_queue_clear (MafwLastfmQueue *queue);
+
+guint
+mafw_lastfm_queue_get_length (MafwLastfmQueue *queue);
+
+guint
+mafw_lastfm_queue_get_capacity (MafwLastfmQueue *queue);
+
+guint
+mafw_lastfm_queue_get_high_water (MafwLastfmQueue *queue);
+
+gsize
+mafw_lastfm_queue_get_memory_size (MafwLastfmQueue *queue);
+
+void
+mafw_lastfm_queue_set_memory_limit (MafwLastfmQueue *queue,
+                                    gsize limit);
+
+gboolean
+mafw_lastfm_queue_is_over_limit (MafwLastfmQueue *queue);
+
+G_END_DECLS
+
+#endif /* MAFW_LASTFM_QUEUE_H */
@@ -0,0 +1,498 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * All the timeouts of the scrobbler go through a single GSource,
+ * which keeps their deadlines in a binary min-heap and only wakes up
+ * for the earliest one. That wakeup is put off to the last deadline
+ * within the slack window after it, so that the timers in the window
+ * run together instead of waking up for each of them. Timers never
+ * run before their deadline, and at most the slack after it.
+ *
+ * Timers are one-shot unless their function returns %TRUE, as with
+ * g_timeout_add(). Intervals are in milliseconds.
+ *
+ * The clock can be replaced, so that recorded sessions can be
+ * replayed faster than real time.
+ */
+
+#include <glib.h>
+
+#include "mafw-lastfm-scheduler.h"
+
+typedef struct {
+  guint id;
+  gint64 deadline;
+  guint interval;
+  GSourceFunc function;
+  gpointer data;
+  /* Position in the heap, or OFF_HEAP while being dispatched. */
+  guint index;
+  /* Cancelled while off the heap, to be freed by the dispatch. */
+  gboolean removed;
+} Timer;
+
+#define OFF_HEAP G_MAXUINT
+
+typedef struct {
+  GSource source;
+  MafwLastfmScheduler *scheduler;
+} SchedulerSource;
+
+struct MafwLastfmScheduler {
+  GSource *source;
+  GPtrArray *heap;
+  /* Timer ids to timers. */
+  GHashTable *timers;
+  guint next_id;
+  guint slack;
+
+  guint wakeups;
+  guint wakeups_avoided;
+};
+
+static MafwLastfmTimeFunc time_func = NULL;
+
+static gint64
+get_time (void)
+{
+  if (time_func)
+    return time_func ();
+
+  return mafw_lastfm_scheduler_get_real_time ();
+}
+
+/**
+ * mafw_lastfm_scheduler_get_real_time:
+ *
+ * Returns: the time of a monotonic clock if available, in
+ * milliseconds, regardless of mafw_lastfm_scheduler_set_time_func().
+ **/
+gint64
+mafw_lastfm_scheduler_get_real_time (void)
+{
+#if GLIB_CHECK_VERSION (2, 28, 0)
+  return g_get_monotonic_time () / 1000;
+#else
+  GTimeVal now;
+
+  g_get_current_time (&now);
+
+  return (gint64) now.tv_sec * 1000 + now.tv_usec / 1000;
+#endif
+}
+
+#define HEAP_TIMER(heap, i) ((Timer *) g_ptr_array_index ((heap), (i)))
+
+static void
+heap_set (GPtrArray *heap,
+          guint i,
+          Timer *timer)
+{
+  g_ptr_array_index (heap, i) = timer;
+  timer->index = i;
+}
+
+static void
+heap_sift_up (GPtrArray *heap,
+              guint i)
+{
+  Timer *timer = HEAP_TIMER (heap, i);
+  guint parent;
+
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (HEAP_TIMER (heap, parent)->deadline <= timer->deadline)
+      break;
+    heap_set (heap, i, HEAP_TIMER (heap, parent));
+    i = parent;
+  }
+  heap_set (heap, i, timer);
+}
+
+static void
+heap_sift_down (GPtrArray *heap,
+                guint i)
+{
+  Timer *timer = HEAP_TIMER (heap, i);
+  guint child;
+
+  while ((child = 2 * i + 1) < heap->len) {
+    if (child + 1 < heap->len &&
+        HEAP_TIMER (heap, child + 1)->deadline < HEAP_TIMER (heap, child)->deadline)
+      child++;
+    if (timer->deadline <= HEAP_TIMER (heap, child)->deadline)
+      break;
+    heap_set (heap, i, HEAP_TIMER (heap, child));
+    i = child;
+  }
+  heap_set (heap, i, timer);
+}
+
+static void
+heap_insert (GPtrArray *heap,
+             Timer *timer)
+{
+  g_ptr_array_add (heap, timer);
+  timer->index = heap->len - 1;
+  heap_sift_up (heap, timer->index);
+}
+
+static void
+heap_remove (GPtrArray *heap,
+             Timer *timer)
+{
+  guint i = timer->index;
+  Timer *last;
+
+  last = g_ptr_array_index (heap, heap->len - 1);
+  g_ptr_array_set_size (heap, heap->len - 1);
+  timer->index = OFF_HEAP;
+
+  if (last == timer)
+    return;
+
+  heap_set (heap, i, last);
+  if (i > 0 && HEAP_TIMER (heap, (i - 1) / 2)->deadline > last->deadline)
+    heap_sift_up (heap, i);
+  else
+    heap_sift_down (heap, i);
+}
+
+/* The last deadline up to @limit in the subtree at @i, if any. */
+static gint64
+heap_get_last (GPtrArray *heap,
+               guint i,
+               gint64 limit)
+{
+  gint64 last;
+
+  if (i >= heap->len || HEAP_TIMER (heap, i)->deadline > limit)
+    return G_MININT64;
+
+  last = HEAP_TIMER (heap, i)->deadline;
+  last = MAX (last, heap_get_last (heap, 2 * i + 1, limit));
+  last = MAX (last, heap_get_last (heap, 2 * i + 2, limit));
+
+  return last;
+}
+
+static gint64
+get_wakeup (MafwLastfmScheduler *scheduler)
+{
+  return heap_get_last (scheduler->heap, 0,
+                        HEAP_TIMER (scheduler->heap, 0)->deadline +
+                        scheduler->slack);
+}
+
+static gboolean
+scheduler_source_prepare (GSource *source,
+                          gint *timeout)
+{
+  MafwLastfmScheduler *scheduler = ((SchedulerSource *) source)->scheduler;
+  gint64 remaining;
+
+  if (scheduler->heap->len == 0) {
+    *timeout = -1;
+    return FALSE;
+  }
+
+  remaining = get_wakeup (scheduler) - get_time ();
+  if (remaining <= 0) {
+    *timeout = 0;
+    return TRUE;
+  }
+
+  *timeout = MIN (remaining, G_MAXINT);
+
+  return FALSE;
+}
+
+static gboolean
+scheduler_source_check (GSource *source)
+{
+  MafwLastfmScheduler *scheduler = ((SchedulerSource *) source)->scheduler;
+
+  return (scheduler->heap->len > 0 &&
+          get_wakeup (scheduler) <= get_time ());
+}
+
+static gboolean
+scheduler_source_dispatch (GSource *source,
+                           GSourceFunc callback,
+                           gpointer user_data)
+{
+  MafwLastfmScheduler *scheduler = ((SchedulerSource *) source)->scheduler;
+  Timer *timer;
+  GSList *repeating = NULL;
+  gint64 now, last = G_MININT64;
+  gboolean again;
+
+  now = get_time ();
+  scheduler->wakeups++;
+
+  while (scheduler->heap->len > 0) {
+    timer = HEAP_TIMER (scheduler->heap, 0);
+    if (timer->deadline > now)
+      break;
+
+    /* This one would have needed a wakeup of its own. */
+    if (last != G_MININT64 && timer->deadline > last)
+      scheduler->wakeups_avoided++;
+    last = timer->deadline;
+
+    heap_remove (scheduler->heap, timer);
+
+    again = timer->function (timer->data);
+
+    /* Put back once done, or a short interval would keep it due. */
+    if (timer->removed)
+      g_free (timer);
+    else if (again)
+      repeating = g_slist_prepend (repeating, timer);
+    else
+      g_hash_table_remove (scheduler->timers, GUINT_TO_POINTER (timer->id));
+  }
+
+  /* Those removed since they ran, by the timers after them, are only
+     freed now. */
+  now = get_time ();
+  while (repeating) {
+    timer = repeating->data;
+    if (timer->removed) {
+      g_free (timer);
+    } else {
+      timer->deadline = now + timer->interval;
+      heap_insert (scheduler->heap, timer);
+    }
+    repeating = g_slist_delete_link (repeating, repeating);
+  }
+
+  return TRUE;
+}
+
+static GSourceFuncs scheduler_source_funcs = {
+  scheduler_source_prepare,
+  scheduler_source_check,
+  scheduler_source_dispatch,
+  NULL
+};
+
+/**
+ * mafw_lastfm_scheduler_set_time_func:
+ * @func: the function returning the current time in milliseconds, or
+ * %NULL to use the real clock
+ *
+ * Replaces the clock of all the schedulers. The main context has to
+ * be iterated when the time returned by @func moves forward, so that
+ * the timers due get dispatched.
+ **/
+void
+mafw_lastfm_scheduler_set_time_func (MafwLastfmTimeFunc func)
+{
+  time_func = func;
+}
+
+/**
+ * mafw_lastfm_scheduler_new:
+ * @slack: how late a timer may run, in milliseconds, to share a
+ * wakeup with another one
+ *
+ * Creates a scheduler, attached to the default main context.
+ *
+ * Returns: a new #MafwLastfmScheduler.
+ **/
+MafwLastfmScheduler *
+mafw_lastfm_scheduler_new (guint slack)
+{
+  MafwLastfmScheduler *scheduler;
+
+  scheduler = g_new0 (MafwLastfmScheduler, 1);
+  scheduler->heap = g_ptr_array_new ();
+  scheduler->timers = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                             NULL, g_free);
+  scheduler->next_id = 1;
+  scheduler->slack = slack;
+
+  scheduler->source = g_source_new (&scheduler_source_funcs,
+                                    sizeof (SchedulerSource));
+  ((SchedulerSource *) scheduler->source)->scheduler = scheduler;
+  g_source_attach (scheduler->source, NULL);
+
+  return scheduler;
+}
+
+/**
+ * mafw_lastfm_scheduler_free:
+ * @scheduler: a #MafwLastfmScheduler
+ *
+ * Frees @scheduler, cancelling all its timers.
+ **/
+void
+mafw_lastfm_scheduler_free (MafwLastfmScheduler *scheduler)
+{
+  if (!scheduler)
+    return;
+
+  g_source_destroy (scheduler->source);
+  g_source_unref (scheduler->source);
+
+  g_ptr_array_free (scheduler->heap, TRUE);
+  g_hash_table_destroy (scheduler->timers);
+  g_free (scheduler);
+}
+
+/**
+ * mafw_lastfm_scheduler_add:
+ * @scheduler: a #MafwLastfmScheduler
+ * @interval: the time until @function is called, in milliseconds
+ * @function: the function to call, it is called again after
+ * @interval while it returns %TRUE
+ * @data: the data to pass to @function
+ *
+ * Returns: the id of the timer, greater than 0.
+ **/
+guint
+mafw_lastfm_scheduler_add (MafwLastfmScheduler *scheduler,
+                           guint interval,
+                           GSourceFunc function,
+                           gpointer data)
+{
+  Timer *timer;
+
+  g_return_val_if_fail (function, 0);
+
+  /* Skip 0 and the ids still in use once the counter wraps. */
+  while (scheduler->next_id == 0 ||
+         g_hash_table_lookup (scheduler->timers,
+                              GUINT_TO_POINTER (scheduler->next_id)))
+    scheduler->next_id++;
+
+  timer = g_new (Timer, 1);
+  timer->id = scheduler->next_id++;
+  timer->deadline = get_time () + interval;
+  timer->interval = interval;
+  timer->function = function;
+  timer->data = data;
+  timer->removed = FALSE;
+
+  g_hash_table_insert (scheduler->timers, GUINT_TO_POINTER (timer->id), timer);
+  heap_insert (scheduler->heap, timer);
+
+  return timer->id;
+}
+
+guint
+mafw_lastfm_scheduler_add_seconds (MafwLastfmScheduler *scheduler,
+                                   guint interval,
+                                   GSourceFunc function,
+                                   gpointer data)
+{
+  return mafw_lastfm_scheduler_add (scheduler, interval * 1000,
+                                    function, data);
+}
+
+/**
+ * mafw_lastfm_scheduler_remove:
+ * @scheduler: a #MafwLastfmScheduler
+ * @id: the id of a timer
+ *
+ * Cancels the timer @id. It can be called from the function of any
+ * timer, including the one of @id itself.
+ *
+ * Returns: %TRUE if the timer was found.
+ **/
+gboolean
+mafw_lastfm_scheduler_remove (MafwLastfmScheduler *scheduler,
+                              guint id)
+{
+  Timer *timer;
+
+  timer = g_hash_table_lookup (scheduler->timers, GUINT_TO_POINTER (id));
+  if (!timer)
+    return FALSE;
+
+  /* Being dispatched, the dispatch frees it once done with it. */
+  if (timer->index == OFF_HEAP) {
+    timer->removed = TRUE;
+    g_hash_table_steal (scheduler->timers, GUINT_TO_POINTER (id));
+    return TRUE;
+  }
+
+  heap_remove (scheduler->heap, timer);
+  g_hash_table_remove (scheduler->timers, GUINT_TO_POINTER (id));
+
+  return TRUE;
+}
+
+/**
+ * mafw_lastfm_scheduler_set_slack:
+ * @scheduler: a #MafwLastfmScheduler
+ * @slack: how late a timer may run, in milliseconds
+ *
+ * Sets the window after the earliest deadline within which the timers
+ * are run together, once the last of them is due. A slack of 0 runs
+ * every timer on its own deadline.
+ **/
+void
+mafw_lastfm_scheduler_set_slack (MafwLastfmScheduler *scheduler,
+                                 guint slack)
+{
+  scheduler->slack = slack;
+}
+
+/**
+ * mafw_lastfm_scheduler_get_n_timers:
+ * @scheduler: a #MafwLastfmScheduler
+ *
+ * Returns: the number of timers not run or cancelled yet, counting
+ * the repeating ones.
+ **/
+guint
+mafw_lastfm_scheduler_get_n_timers (MafwLastfmScheduler *scheduler)
+{
+  return g_hash_table_size (scheduler->timers);
+}
+
+/**
+ * mafw_lastfm_scheduler_get_wakeups:
+ * @scheduler: a #MafwLastfmScheduler
+ *
+ * Returns: the number of times that the scheduler woke up to run
+ * timers.
+ **/
+guint
+mafw_lastfm_scheduler_get_wakeups (MafwLastfmScheduler *scheduler)
+{
+  return scheduler->wakeups;
+}
+
+/**
+ * mafw_lastfm_scheduler_get_wakeups_avoided:
+ * @scheduler: a #MafwLastfmScheduler
+ *
+ * Returns: the number of timers that were run along with one due
+ * earlier, and so didn't need a wakeup of their own.
+ **/
+guint
+mafw_lastfm_scheduler_get_wakeups_avoided (MafwLastfmScheduler *scheduler)
+{
+  return scheduler->wakeups_avoided;
+}
@@ -0,0 +1,75 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef MAFW_LASTFM_SCHEDULER_H
+#define MAFW_LASTFM_SCHEDULER_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct MafwLastfmScheduler MafwLastfmScheduler;
+
+typedef gint64 (*MafwLastfmTimeFunc) (void);
+
+gint64
+mafw_lastfm_scheduler_get_real_time (void);
+
+void
+mafw_lastfm_scheduler_set_time_func (MafwLastfmTimeFunc func);
+
+MafwLastfmScheduler *
+mafw_lastfm_scheduler_new (guint slack);
+
+void
+mafw_lastfm_scheduler_free (MafwLastfmScheduler *scheduler);
+
+guint
+mafw_lastfm_scheduler_add (MafwLastfmScheduler *scheduler,
+                           guint interval,
+                           GSourceFunc function,
+                           gpointer data);
+
+guint
+mafw_lastfm_scheduler_add_seconds (MafwLastfmScheduler *scheduler,
+                                   guint interval,
+                                   GSourceFunc function,
+                                   gpointer data);
+
+gboolean
+mafw_lastfm_scheduler_remove (MafwLastfmScheduler *scheduler,
+                              guint id);
+
+void
+mafw_lastfm_scheduler_set_slack (MafwLastfmScheduler *scheduler,
+                                 guint slack);
+
+guint
+mafw_lastfm_scheduler_get_n_timers (MafwLastfmScheduler *scheduler);
+
+guint
+mafw_lastfm_scheduler_get_wakeups (MafwLastfmScheduler *scheduler);
+
+guint
+mafw_lastfm_scheduler_get_wakeups_avoided (MafwLastfmScheduler *scheduler);
+
+G_END_DECLS
+
+#endif /* MAFW_LASTFM_SCHEDULER_H */
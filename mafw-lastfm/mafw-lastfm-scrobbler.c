@@ -18,49 +18,89 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <libsoup/soup.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
 
 #include "mafw-lastfm-scrobbler.h"
-
-#define CLIENT_ID "maf"
-#define CLIENT_VERSION "0.0.1"
-#define MAFW_LASTFM_QUEUE_FILE ".osso/mafw-lastfm.queue"
+#include "mafw-lastfm-journal.h"
+#include "mafw-lastfm-history.h"
+#include "mafw-lastfm-dedup.h"
+#include "mafw-lastfm-body.h"
+#include "mafw-lastfm-queue.h"
+#include "mafw-lastfm-scheduler.h"
+#include "mafw-lastfm-metrics.h"
+
+#define MAFW_LASTFM_QUEUE_FILE ".osso/mafw-lastfm.journal"
+/* Text queue used by older versions, imported into the journal. */
+#define MAFW_LASTFM_LEGACY_QUEUE_FILE ".osso/mafw-lastfm.queue"
+/* The last session handed out by the server, reused on startup. */
+#define MAFW_LASTFM_SESSION_FILE ".osso/mafw-lastfm.session"
+/* The plays acknowledged by every server, dropped from the journal. */
+#define MAFW_LASTFM_HISTORY_FILE ".osso/mafw-lastfm.history"
+/* The fingerprints of the last tracks acknowledged by each server. */
+#define MAFW_LASTFM_DEDUP_FILE ".osso/mafw-lastfm.dedup"
+/* Locked by the process using the files above. */
+#define MAFW_LASTFM_LOCK_FILE ".osso/mafw-lastfm.lock"
+
+/* Maximum number of tracks per submission, as mandated by the
+   1.2.1 protocol, and per call to track.scrobble in 2.0. */
+#define MAFW_LASTFM_MAX_BATCH_SIZE 50
+/* Acknowledged bytes in the journal before it gets compacted. */
+#define MAFW_LASTFM_COMPACT_THRESHOLD (32 * 1024)
+/* Tracks wait in memory only until they have been played long
+   enough, so the queue rarely holds more than one. */
+#define MAFW_LASTFM_QUEUE_CAPACITY 4
+/* How late a timeout may run to share a wakeup with another one,
+   in milliseconds. */
+#define MAFW_LASTFM_DEFAULT_TIMER_SLACK 1000
+/* Acknowledged tracks remembered so that none is submitted twice, a
+   few weeks of listening to a couple of servers. */
+#define MAFW_LASTFM_DEDUP_CAPACITY 4096
 
 G_DEFINE_TYPE (MafwLastfmScrobbler, mafw_lastfm_scrobbler, G_TYPE_OBJECT);
 
 #define GET_PRIVATE(o) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((o), MAFW_LASTFM_TYPE_SCROBBLER, MafwLastfmScrobblerPrivate))
 
-typedef enum {
-  MAFW_LASTFM_SCROBBLER_NEED_HANDSHAKE,
-  MAFW_LASTFM_SCROBBLER_HANDSHAKING,
-  MAFW_LASTFM_SCROBBLER_READY,
-  MAFW_LASTFM_SCROBBLER_SUBMITTING
-} MafwLastfmScrobblerStatus;
-
 struct MafwLastfmScrobblerPrivate {
+  /* Shared by the endpoints. */
   SoupSession *session;
-  gchar *session_id;
-  gchar *np_url;
-  gchar *sub_url;
-  GQueue *scrobbling_queue;
-  guint handshake_id;
-  guint retry_id;
+  MafwLastfmQueue *scrobbling_queue;
+  /* Runs all the timeouts below but compact_id, and the ones of the
+     endpoints. */
+  MafwLastfmScheduler *scheduler;
   guint playing_now_id;
   guint cache_id;
+  guint compact_id;
   MafwLastfmTrack *playing_now_track;
 
-  guint retry_interval;
-  SoupMessage *retry_message;
-
-  MafwLastfmScrobblerStatus status;
-
-  gchar *username;
-  gchar *md5password;
+  /* The servers to scrobble to, the default one first. */
+  GSList *endpoints;
+  gboolean online;
 
   MafwLastfmTrack *suspended_track;
+
+  MafwLastfmJournal *journal;
+  MafwLastfmHistory *history;
+  MafwLastfmDedup *dedup;
+  /* The descriptor holding the lock of the files in the home
+     directory, or -1. */
+  gint lock_fd;
+  /* The lists of tracks being written to the journal, in the order
+     they were queued. */
+  GQueue *flushing;
+  guint n_flushing;
+  /* A batch is being read from the journal, for the endpoints whose
+     next batch starts at read_from. */
+  gboolean reading;
+  goffset read_from;
 };
 
 #ifndef MAFW_LASTFM_ENABLE_DEBUG
@@ -68,57 +108,63 @@ struct MafwLastfmScrobblerPrivate {
  #define g_print(...)
 #endif
 
-static MafwLastfmTrack *
-mafw_lastfm_track_encode (MafwLastfmTrack *track);
-static gboolean mafw_lastfm_track_cmp (MafwLastfmTrack *a,
-                                       MafwLastfmTrack *b);
-static  MafwLastfmTrack *
-mafw_lastfm_track_dup (MafwLastfmTrack *track);
 
 static void
-mafw_lastfm_scrobbler_flush_to_disk (MafwLastfmScrobbler *scrobbler);
+mafw_lastfm_scrobbler_flush_to_disk (MafwLastfmScrobbler *scrobbler,
+                                     guint n_tracks);
+static void
+mafw_lastfm_scrobbler_enforce_queue_limit (MafwLastfmScrobbler *scrobbler);
 static void
 mafw_lastfm_scrobbler_scrobble_cached (MafwLastfmScrobbler *scrobbler);
 static void
 mafw_lastfm_scrobbler_drop_pending_track (MafwLastfmScrobbler *scrobbler);
+static void
+mafw_lastfm_scrobbler_update_queue_metrics (MafwLastfmScrobbler *scrobbler);
 
-static void handshake_cb (SoupSession *session,
-                          SoupMessage *message,
-                          gpointer user_data);
+static void
+free_tracks (GSList *tracks)
+{
+  g_slist_foreach (tracks, (GFunc) mafw_lastfm_track_unref, NULL);
+  g_slist_free (tracks);
+}
 
 static void
 mafw_lastfm_scrobbler_finalize (GObject *object)
 {
   MafwLastfmScrobblerPrivate *priv = MAFW_LASTFM_SCROBBLER (object)->priv;
 
-  if (priv->session) {
-    soup_session_abort (priv->session);
-    g_object_unref (priv->session);
-  }
+  /* Aborting the session runs the callbacks, which mustn't send the
+     track waiting to be announced. */
+  g_slist_foreach (priv->endpoints,
+                   (GFunc) mafw_lastfm_endpoint_drop_playing_now, NULL);
 
-  g_free (priv->session_id);
-  g_free (priv->np_url);
-  g_free (priv->sub_url);
+  soup_session_abort (priv->session);
+  g_slist_foreach (priv->endpoints, (GFunc) mafw_lastfm_endpoint_free, NULL);
+  g_slist_free (priv->endpoints);
+  g_object_unref (priv->session);
 
-  if (priv->scrobbling_queue) {
-    g_queue_foreach (priv->scrobbling_queue, (GFunc) mafw_lastfm_track_free, NULL);
-    g_queue_free (priv->scrobbling_queue);
-  }
+  mafw_lastfm_queue_free (priv->scrobbling_queue);
 
-  if (priv->playing_now_id)
-    g_source_remove (priv->playing_now_id);
-  if (priv->cache_id)
-    g_source_remove (priv->cache_id);
-  if (priv->retry_id)
-    g_source_remove (priv->retry_id);
-  if (priv->handshake_id)
-    g_source_remove (priv->handshake_id);
+  mafw_lastfm_scheduler_free (priv->scheduler);
+  if (priv->compact_id)
+    g_source_remove (priv->compact_id);
 
   if (priv->playing_now_track)
-    mafw_lastfm_track_free (priv->playing_now_track);
-
-  g_free (priv->username);
-  g_free (priv->md5password);
+    mafw_lastfm_track_unref (priv->playing_now_track);
+
+  /* Joins the worker of the journal, which appends to the history
+     and saves the fingerprints. */
+  mafw_lastfm_dedup_save_async (priv->dedup, priv->journal);
+  mafw_lastfm_journal_free (priv->journal);
+  if (priv->history)
+    mafw_lastfm_history_free (priv->history);
+  mafw_lastfm_dedup_free (priv->dedup);
+  g_queue_foreach (priv->flushing, (GFunc) free_tracks, NULL);
+  g_queue_free (priv->flushing);
+
+  /* Only once the worker of the journal is done with the files. */
+  if (priv->lock_fd >= 0)
+    close (priv->lock_fd);
 
   G_OBJECT_CLASS (mafw_lastfm_scrobbler_parent_class)->finalize (object);
 }
@@ -139,32 +185,245 @@ mafw_lastfm_scrobbler_init (MafwLastfmScrobbler *scrobbler)
 
   priv->session = soup_session_async_new ();
 
-  priv->session_id = NULL;
-  priv->np_url = NULL;
-  priv->sub_url = NULL;
-  priv->scrobbling_queue = g_queue_new ();
-  priv->handshake_id = 0;
-  priv->retry_id = 0;
+  priv->scrobbling_queue = mafw_lastfm_queue_new (MAFW_LASTFM_QUEUE_CAPACITY);
+  priv->scheduler = mafw_lastfm_scheduler_new (MAFW_LASTFM_DEFAULT_TIMER_SLACK);
 
-  priv->retry_message = NULL;
-  priv->retry_interval = 5;
   priv->suspended_track = NULL;
 
   priv->playing_now_track = NULL;
   priv->playing_now_id = 0;
 
   priv->cache_id = 0;
+  priv->compact_id = 0;
+
+  /* Set by the constructors, along with the default endpoint. */
+  priv->journal = NULL;
+  priv->history = NULL;
+  priv->endpoints = NULL;
+
+  priv->dedup = mafw_lastfm_dedup_new (MAFW_LASTFM_DEDUP_CAPACITY);
+  priv->lock_fd = -1;
+
+  priv->flushing = g_queue_new ();
+  priv->n_flushing = 0;
+  priv->reading = FALSE;
+  priv->read_from = 0;
+
+  priv->online = TRUE;
+}
+
+/**
+ * lock_home:
+ * @path: the lock file
+ * @error: return location for a #GError, or %NULL
+ *
+ * Takes the lock on @path, which is kept until the returned
+ * descriptor is closed, even if the process dies. The journal itself
+ * can't hold it, since it is replaced when compacted. The directory
+ * of @path is created if needed, as on the first run.
+ *
+ * Returns: the descriptor, or -1 if the lock is held by another
+ * process, with %G_FILE_ERROR_AGAIN, or couldn't be taken.
+ **/
+static gint
+lock_home (const gchar *path,
+           GError **error)
+{
+  gchar *dirname;
+  gint fd;
+  gint saved_errno;
+
+  dirname = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (dirname, 0700) < 0) {
+    saved_errno = errno;
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                 "Couldn't create %s: %s", dirname, g_strerror (saved_errno));
+    g_free (dirname);
+    return -1;
+  }
+  g_free (dirname);
+
+  fd = g_open (path, O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    saved_errno = errno;
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                 "Couldn't open %s: %s", path, g_strerror (saved_errno));
+    return -1;
+  }
+
+  if (flock (fd, LOCK_EX | LOCK_NB) < 0) {
+    saved_errno = errno;
+    close (fd);
+    if (saved_errno == EWOULDBLOCK)
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_AGAIN,
+                   "Another mafw-lastfm is running, it holds %s", path);
+    else
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "Couldn't lock %s: %s", path, g_strerror (saved_errno));
+    return -1;
+  }
 
-  priv->username = NULL;
-  priv->md5password = NULL;
+  /* Not for the processes the renderer may spawn. */
+  fcntl (fd, F_SETFD, FD_CLOEXEC);
 
-  priv->status = MAFW_LASTFM_SCROBBLER_NEED_HANDSHAKE;
+  return fd;
 }
 
+/**
+ * mafw_lastfm_scrobbler_new:
+ * @error: return location for a #GError, or %NULL
+ *
+ * Creates a scrobbler keeping its journal, its session, its history
+ * and its fingerprints in the home directory. Only one process can
+ * use them at a time: the daemon and the plugin would otherwise
+ * scrobble every track twice and write over each other's files.
+ *
+ * Returns: a new #MafwLastfmScrobbler, or %NULL if another process
+ * is using the files.
+ **/
 MafwLastfmScrobbler*
-mafw_lastfm_scrobbler_new (void)
+mafw_lastfm_scrobbler_new (GError **error)
 {
-  return g_object_new (MAFW_LASTFM_TYPE_SCROBBLER, NULL);
+  MafwLastfmScrobbler *scrobbler;
+  gchar *filename;
+  gint lock_fd;
+
+  /* Before the journal is even read. */
+  filename = g_build_filename (g_get_home_dir (),
+                               MAFW_LASTFM_LOCK_FILE, NULL);
+  lock_fd = lock_home (filename, error);
+  g_free (filename);
+  if (lock_fd < 0)
+    return NULL;
+
+  filename = g_build_filename (g_get_home_dir (),
+                               MAFW_LASTFM_QUEUE_FILE, NULL);
+  scrobbler = mafw_lastfm_scrobbler_new_with_journal (filename);
+  scrobbler->priv->lock_fd = lock_fd;
+  g_free (filename);
+
+  filename = g_build_filename (g_get_home_dir (),
+                               MAFW_LASTFM_LEGACY_QUEUE_FILE, NULL);
+  mafw_lastfm_journal_import_legacy (scrobbler->priv->journal, filename);
+  g_free (filename);
+
+  filename = g_build_filename (g_get_home_dir (),
+                               MAFW_LASTFM_SESSION_FILE, NULL);
+  mafw_lastfm_scrobbler_set_session_file (scrobbler, filename);
+  g_free (filename);
+
+  filename = g_build_filename (g_get_home_dir (),
+                               MAFW_LASTFM_HISTORY_FILE, NULL);
+  mafw_lastfm_scrobbler_set_history_file (scrobbler, filename);
+  g_free (filename);
+
+  filename = g_build_filename (g_get_home_dir (),
+                               MAFW_LASTFM_DEDUP_FILE, NULL);
+  mafw_lastfm_scrobbler_set_dedup_file (scrobbler, filename);
+  g_free (filename);
+
+  return scrobbler;
+}
+
+/**
+ * mafw_lastfm_scrobbler_new_with_journal:
+ * @path: the path of the journal to cache the tracks in
+ *
+ * Creates a scrobbler that keeps its tracks in @path instead of the
+ * journal in the home directory, for instance to run it against a
+ * test server without touching the real queue.
+ *
+ * Returns: a new #MafwLastfmScrobbler.
+ **/
+MafwLastfmScrobbler*
+mafw_lastfm_scrobbler_new_with_journal (const gchar *path)
+{
+  MafwLastfmScrobbler *scrobbler;
+
+  g_return_val_if_fail (path, NULL);
+
+  scrobbler = g_object_new (MAFW_LASTFM_TYPE_SCROBBLER, NULL);
+  scrobbler->priv->journal = mafw_lastfm_journal_new (path);
+  mafw_lastfm_scrobbler_add_endpoint (scrobbler,
+                                      MAFW_LASTFM_DEFAULT_ENDPOINT, NULL);
+
+  return scrobbler;
+}
+
+static void
+endpoint_changed_cb (MafwLastfmEndpoint *endpoint,
+                     gpointer user_data)
+{
+  MafwLastfmScrobbler *scrobbler = user_data;
+
+  mafw_lastfm_scrobbler_update_queue_metrics (scrobbler);
+  mafw_lastfm_scrobbler_scrobble_cached (scrobbler);
+}
+
+/**
+ * mafw_lastfm_scrobbler_add_endpoint:
+ * @scrobbler: a #MafwLastfmScrobbler
+ * @name: a name for the endpoint, unique to @scrobbler
+ * @handshake_url: the url of the handshake, without the query, or
+ * %NULL for the default of the protocol
+ *
+ * Adds a server to scrobble to, besides the default one. Every
+ * cached track is submitted to all of them, and stays in the journal
+ * until they all have acknowledged it. The endpoint needs credentials
+ * before mafw_lastfm_endpoint_restore_session() or
+ * mafw_lastfm_endpoint_handshake().
+ *
+ * Returns: the new endpoint, owned by @scrobbler.
+ **/
+MafwLastfmEndpoint *
+mafw_lastfm_scrobbler_add_endpoint (MafwLastfmScrobbler *scrobbler,
+                                    const gchar *name,
+                                    const gchar *handshake_url)
+{
+  MafwLastfmScrobblerPrivate *priv;
+  MafwLastfmEndpoint *endpoint;
+
+  g_return_val_if_fail (MAFW_LASTFM_IS_SCROBBLER (scrobbler), NULL);
+  g_return_val_if_fail (name, NULL);
+  g_return_val_if_fail (!mafw_lastfm_scrobbler_get_endpoint (scrobbler, name),
+                        NULL);
+
+  priv = scrobbler->priv;
+  endpoint = mafw_lastfm_endpoint_new (name, handshake_url,
+                                       priv->session, priv->scheduler,
+                                       priv->journal,
+                                       endpoint_changed_cb, scrobbler);
+  mafw_lastfm_endpoint_set_dedup (endpoint, priv->dedup);
+  mafw_lastfm_endpoint_set_online (endpoint, priv->online);
+  priv->endpoints = g_slist_append (priv->endpoints, endpoint);
+
+  return endpoint;
+}
+
+/**
+ * mafw_lastfm_scrobbler_get_endpoint:
+ * @scrobbler: a #MafwLastfmScrobbler
+ * @name: the name of an endpoint, or %NULL for the default one
+ *
+ * Returns: the endpoint called @name, or %NULL if there is none.
+ **/
+MafwLastfmEndpoint *
+mafw_lastfm_scrobbler_get_endpoint (MafwLastfmScrobbler *scrobbler,
+                                    const gchar *name)
+{
+  GSList *l;
+
+  g_return_val_if_fail (MAFW_LASTFM_IS_SCROBBLER (scrobbler), NULL);
+
+  if (!name)
+    return scrobbler->priv->endpoints ? scrobbler->priv->endpoints->data : NULL;
+
+  for (l = scrobbler->priv->endpoints; l; l = l->next) {
+    if (strcmp (mafw_lastfm_endpoint_get_name (l->data), name) == 0)
+      return l->data;
+  }
+
+  return NULL;
 }
 
 void
@@ -172,91 +431,338 @@ mafw_lastfm_scrobbler_set_credentials (MafwLastfmScrobbler *scrobbler,
                                        const gchar *username,
                                        const gchar *md5password)
 {
-  g_free (scrobbler->priv->username);
-  scrobbler->priv->username = g_strdup (username);
+  mafw_lastfm_endpoint_set_credentials (mafw_lastfm_scrobbler_get_endpoint (scrobbler, NULL),
+                                        username, md5password);
+}
 
-  g_free (scrobbler->priv->md5password);
-  scrobbler->priv->md5password = g_strdup (md5password);
+/**
+ * mafw_lastfm_scrobbler_set_handshake_url:
+ * @scrobbler: a #MafwLastfmScrobbler
+ * @url: the url of the handshake, without the query
+ *
+ * Sets the server of the default endpoint. See
+ * mafw_lastfm_endpoint_set_handshake_url().
+ **/
+void
+mafw_lastfm_scrobbler_set_handshake_url (MafwLastfmScrobbler *scrobbler,
+                                         const gchar *url)
+{
+  g_return_if_fail (MAFW_LASTFM_IS_SCROBBLER (scrobbler));
 
-  scrobbler->priv->status = MAFW_LASTFM_SCROBBLER_NEED_HANDSHAKE;
+  mafw_lastfm_endpoint_set_handshake_url (mafw_lastfm_scrobbler_get_endpoint (scrobbler, NULL),
+                                          url);
 }
 
-static gboolean
-on_deferred_handshake_timeout_cb (gpointer user_data)
+/**
+ * mafw_lastfm_scrobbler_set_session_file:
+ * @scrobbler: a #MafwLastfmScrobbler
+ * @path: the file to save the session in, or %NULL
+ *
+ * Sets where the session of the default endpoint is saved, for
+ * mafw_lastfm_scrobbler_restore_session() to reuse it. Scrobblers
+ * created with mafw_lastfm_scrobbler_new() use a file in the home
+ * directory, the others don't save it unless this is called.
+ **/
+void
+mafw_lastfm_scrobbler_set_session_file (MafwLastfmScrobbler *scrobbler,
+                                        const gchar *path)
 {
-  MafwLastfmScrobbler *scrobbler = user_data;
-  scrobbler->priv->handshake_id = 0;
-
-  mafw_lastfm_scrobbler_handshake (scrobbler);
+  g_return_if_fail (MAFW_LASTFM_IS_SCROBBLER (scrobbler));
 
-  return FALSE;
+  mafw_lastfm_endpoint_set_session_file (mafw_lastfm_scrobbler_get_endpoint (scrobbler, NULL),
+                                         path);
 }
 
 static void
-mafw_lastfm_scrobbler_defer_handshake (MafwLastfmScrobbler *scrobbler)
+archive_cb (const gchar *records,
+            gsize length,
+            gpointer user_data)
 {
-  if (scrobbler->priv->handshake_id != 0)
-    return;
+  mafw_lastfm_history_append (user_data, records, length);
+}
 
-  scrobbler->priv->status = MAFW_LASTFM_SCROBBLER_NEED_HANDSHAKE;
-  scrobbler->priv->handshake_id = g_timeout_add_seconds (5,
-                                                         (GSourceFunc) on_deferred_handshake_timeout_cb,
-                                                         scrobbler);
+/**
+ * mafw_lastfm_scrobbler_set_history_file:
+ * @scrobbler: a #MafwLastfmScrobbler
+ * @path: the path of the history
+ *
+ * Keeps the tracks acknowledged by every endpoint in the history at
+ * @path, once they are dropped from the journal. Scrobblers created
+ * with mafw_lastfm_scrobbler_new() use a file in the home directory,
+ * the others keep no history unless this is called. It can only be
+ * set once.
+ **/
+void
+mafw_lastfm_scrobbler_set_history_file (MafwLastfmScrobbler *scrobbler,
+                                        const gchar *path)
+{
+  MafwLastfmScrobblerPrivate *priv;
+
+  g_return_if_fail (MAFW_LASTFM_IS_SCROBBLER (scrobbler));
+  g_return_if_fail (path != NULL);
+
+  priv = scrobbler->priv;
+  g_return_if_fail (priv->history == NULL);
+
+  priv->history = mafw_lastfm_history_new (path);
+  if (priv->history)
+    mafw_lastfm_journal_set_archive_func (priv->journal, archive_cb,
+                                          priv->history);
 }
 
-static void
-scrobbler_send_message (MafwLastfmScrobbler *scrobbler,
-                         const char *url,
-                         const char *body,
-                         SoupSessionCallback callback)
-{
-  SoupMessage *message;
-  message = soup_message_new ("POST", url);
-  soup_message_set_request (message,
-                            "application/x-www-form-urlencoded",
-                            SOUP_MEMORY_TAKE,
-                            body,
-                            strlen (body));
-  soup_session_queue_message (scrobbler->priv->session,
-                              message,
-                              callback,
-                              scrobbler);
+/**
+ * mafw_lastfm_scrobbler_get_history:
+ * @scrobbler: a #MafwLastfmScrobbler
+ *
+ * Returns: the #MafwLastfmHistory of @scrobbler, owned by it, or
+ * %NULL if it keeps none.
+ **/
+MafwLastfmHistory *
+mafw_lastfm_scrobbler_get_history (MafwLastfmScrobbler *scrobbler)
+{
+  g_return_val_if_fail (MAFW_LASTFM_IS_SCROBBLER (scrobbler), NULL);
+
+  return scrobbler->priv->history;
 }
 
-static void
-set_playing_now_cb (SoupSession *session,
-                    SoupMessage *message,
-                    gpointer user_data)
+/**
+ * mafw_lastfm_scrobbler_set_dedup_file:
+ * @scrobbler: a #MafwLastfmScrobbler
+ * @path: the file to keep the fingerprints of the tracks in
+ *
+ * Tracks already acknowledged by an endpoint, with the same artist,
+ * title and timestamp, are never submitted to it again, however they
+ * made it back into a batch. This keeps the fingerprints of the last
+ * ones in @path, so that they are still recognized after a restart.
+ * Scrobblers created with mafw_lastfm_scrobbler_new() use a file in
+ * the home directory. It must be set before any track is submitted.
+ **/
+void
+mafw_lastfm_scrobbler_set_dedup_file (MafwLastfmScrobbler *scrobbler,
+                                      const gchar *path)
 {
-  MafwLastfmScrobbler *scrobbler = MAFW_LASTFM_SCROBBLER (user_data);
+  GError *error = NULL;
 
-  if (SOUP_STATUS_IS_SUCCESSFUL (message->status_code)) {
-    g_print ("Playing-now: %s", message->response_body->data);
-    if (strcmp (message->response_body->data, "BADSESSION\n") == 0)
-      mafw_lastfm_scrobbler_defer_handshake (scrobbler);
+  g_return_if_fail (MAFW_LASTFM_IS_SCROBBLER (scrobbler));
+  g_return_if_fail (path != NULL);
+
+  if (!mafw_lastfm_dedup_load (scrobbler->priv->dedup, path, &error)) {
+    g_warning ("Couldn't load the fingerprints of the tracks: %s",
+               error->message);
+    g_error_free (error);
   }
 }
 
+/**
+ * mafw_lastfm_scrobbler_set_max_batches_in_flight:
+ * @scrobbler: a #MafwLastfmScrobbler
+ * @max_batches: the maximum number of submissions to have in flight
+ *
+ * Sets how many batches of cached tracks can be submitted at the
+ * same time to each of the endpoints while draining the queue.
+ **/
+void
+mafw_lastfm_scrobbler_set_max_batches_in_flight (MafwLastfmScrobbler *scrobbler,
+                                                 guint max_batches)
+{
+  GSList *l;
+
+  g_return_if_fail (MAFW_LASTFM_IS_SCROBBLER (scrobbler));
+  g_return_if_fail (max_batches > 0);
+
+  for (l = scrobbler->priv->endpoints; l; l = l->next)
+    mafw_lastfm_endpoint_set_max_batches_in_flight (l->data, max_batches);
+}
+
+/**
+ * mafw_lastfm_scrobbler_set_queue_memory_limit:
+ * @scrobbler: a #MafwLastfmScrobbler
+ * @limit: the maximum number of bytes, or 0 for no limit
+ *
+ * Sets how much memory the tracks waiting to be cached can take.
+ * Once exceeded, the tracks that have been played long enough are
+ * written to disk right away and, if that fails, the oldest ones are
+ * dropped.
+ **/
 void
-mafw_lastfm_scrobbler_set_playing_now (MafwLastfmScrobbler *scrobbler,
-                                       MafwLastfmTrack *encoded)
+mafw_lastfm_scrobbler_set_queue_memory_limit (MafwLastfmScrobbler *scrobbler,
+                                              gsize limit)
 {
-  gchar *post_data;
+  g_return_if_fail (MAFW_LASTFM_IS_SCROBBLER (scrobbler));
+
+  mafw_lastfm_queue_set_memory_limit (scrobbler->priv->scrobbling_queue, limit);
+}
 
+/**
+ * mafw_lastfm_scrobbler_set_timer_slack:
+ * @scrobbler: a #MafwLastfmScrobbler
+ * @slack: how late a timeout may run, in milliseconds
+ *
+ * Sets the window within which the timeouts of @scrobbler are run
+ * together, on a single wakeup. A slack of 0 disables coalescing.
+ **/
+void
+mafw_lastfm_scrobbler_set_timer_slack (MafwLastfmScrobbler *scrobbler,
+                                       guint slack)
+{
   g_return_if_fail (MAFW_LASTFM_IS_SCROBBLER (scrobbler));
-  g_return_if_fail (encoded);
-  g_return_if_fail (scrobbler->priv->status == MAFW_LASTFM_SCROBBLER_READY);
 
-  post_data = g_strdup_printf ("s=%s&a=%s&t=%s&b=%s&l=%lli&n=%i&m=",
-                               scrobbler->priv->session_id,
-                               encoded->artist,
-                               encoded->title,
-                               encoded->album ? encoded->album : "",
-                               encoded->length,
-                               encoded->number);
+  mafw_lastfm_scheduler_set_slack (scrobbler->priv->scheduler, slack);
+}
 
-  scrobbler_send_message (scrobbler, scrobbler->priv->np_url,
-                          post_data, set_playing_now_cb);
+/**
+ * mafw_lastfm_scrobbler_get_wakeups:
+ * @scrobbler: a #MafwLastfmScrobbler
+ *
+ * Returns: how many times the timeouts of @scrobbler woke it up.
+ **/
+guint
+mafw_lastfm_scrobbler_get_wakeups (MafwLastfmScrobbler *scrobbler)
+{
+  g_return_val_if_fail (MAFW_LASTFM_IS_SCROBBLER (scrobbler), 0);
+
+  return mafw_lastfm_scheduler_get_wakeups (scrobbler->priv->scheduler);
+}
+
+/**
+ * mafw_lastfm_scrobbler_get_wakeups_avoided:
+ * @scrobbler: a #MafwLastfmScrobbler
+ *
+ * Returns: how many timeouts of @scrobbler were run along with an
+ * earlier one instead of on a wakeup of their own.
+ **/
+guint
+mafw_lastfm_scrobbler_get_wakeups_avoided (MafwLastfmScrobbler *scrobbler)
+{
+  g_return_val_if_fail (MAFW_LASTFM_IS_SCROBBLER (scrobbler), 0);
+
+  return mafw_lastfm_scheduler_get_wakeups_avoided (scrobbler->priv->scheduler);
+}
+
+void
+mafw_lastfm_scrobbler_handshake (MafwLastfmScrobbler *scrobbler)
+{
+  mafw_lastfm_endpoint_handshake (mafw_lastfm_scrobbler_get_endpoint (scrobbler, NULL));
+}
+
+/**
+ * mafw_lastfm_scrobbler_restore_session:
+ * @scrobbler: a #MafwLastfmScrobbler
+ *
+ * Restores the session of the default endpoint. See
+ * mafw_lastfm_endpoint_restore_session().
+ *
+ * Returns: %TRUE if a session was restored, %FALSE if
+ * mafw_lastfm_scrobbler_handshake() is needed.
+ **/
+gboolean
+mafw_lastfm_scrobbler_restore_session (MafwLastfmScrobbler *scrobbler)
+{
+  g_return_val_if_fail (MAFW_LASTFM_IS_SCROBBLER (scrobbler), FALSE);
+
+  return mafw_lastfm_endpoint_restore_session (mafw_lastfm_scrobbler_get_endpoint (scrobbler, NULL));
+}
+
+/**
+ * mafw_lastfm_scrobbler_set_online:
+ * @scrobbler: a #MafwLastfmScrobbler
+ * @online: whether the network is available
+ *
+ * Tells @scrobbler whether the network is available, for instance
+ * from a #GNetworkMonitor. While offline, the handshake retries and
+ * the submissions are parked instead of waking up to fail, and the
+ * tracks are only cached. Once back online, the endpoints handshake
+ * right away if needed and drain the cached tracks.
+ **/
+void
+mafw_lastfm_scrobbler_set_online (MafwLastfmScrobbler *scrobbler,
+                                  gboolean online)
+{
+  GSList *l;
+
+  g_return_if_fail (MAFW_LASTFM_IS_SCROBBLER (scrobbler));
+
+  online = online != FALSE;
+  if (scrobbler->priv->online == online)
+    return;
+
+  scrobbler->priv->online = online;
+  g_print ("Network is %s\n", online ? "up" : "down");
+
+  for (l = scrobbler->priv->endpoints; l; l = l->next)
+    mafw_lastfm_endpoint_set_online (l->data, online);
+}
+
+static gboolean
+mafw_lastfm_scrobbler_is_ready (MafwLastfmScrobbler *scrobbler)
+{
+  GSList *l;
+
+  for (l = scrobbler->priv->endpoints; l; l = l->next) {
+    if (mafw_lastfm_endpoint_is_ready (l->data))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Returns the payload of @payloads encoded for @protocol, or NULL. */
+static MafwLastfmPayload *
+find_payload (GSList *payloads,
+              const MafwLastfmProtocol *protocol)
+{
+  for (; payloads; payloads = payloads->next) {
+    MafwLastfmPayload *payload = payloads->data;
+    if (payload->protocol == protocol)
+      return payload;
+  }
+
+  return NULL;
+}
+
+static void
+free_payloads (GSList *payloads)
+{
+  g_slist_foreach (payloads, (GFunc) mafw_lastfm_payload_unref, NULL);
+  g_slist_free (payloads);
+}
+
+/**
+ * mafw_lastfm_scrobbler_set_playing_now:
+ * @scrobbler: a #MafwLastfmScrobbler
+ * @track: the track being played
+ *
+ * Announces @track as the one being played to the endpoints that have
+ * a session. Its fields are encoded once per protocol, for all the
+ * endpoints speaking it.
+ **/
+void
+mafw_lastfm_scrobbler_set_playing_now (MafwLastfmScrobbler *scrobbler,
+                                       MafwLastfmTrack *track)
+{
+  const MafwLastfmProtocol *protocol;
+  MafwLastfmPayload *payload;
+  GSList *payloads = NULL;
+  GSList *l;
+
+  g_return_if_fail (MAFW_LASTFM_IS_SCROBBLER (scrobbler));
+  g_return_if_fail (track);
+
+  for (l = scrobbler->priv->endpoints; l; l = l->next) {
+    protocol = mafw_lastfm_endpoint_get_protocol (l->data);
+    payload = find_payload (payloads, protocol);
+    if (!payload) {
+      payload = mafw_lastfm_payload_new (protocol,
+                                         MAFW_LASTFM_REQUEST_NOW_PLAYING,
+                                         mafw_lastfm_body_estimate_size (track));
+      mafw_lastfm_payload_append (payload, track, FALSE);
+      mafw_lastfm_payload_finish (payload);
+      payloads = g_slist_prepend (payloads, payload);
+    }
+    mafw_lastfm_endpoint_set_playing_now (l->data, payload);
+  }
+
+  free_payloads (payloads);
 }
 
 /**
@@ -271,7 +777,7 @@ void
 mafw_lastfm_scrobbler_flush_queue (MafwLastfmScrobbler *scrobbler)
 {
   if (scrobbler->priv->suspended_track) {
-    mafw_lastfm_track_free (scrobbler->priv->suspended_track);
+    mafw_lastfm_track_unref (scrobbler->priv->suspended_track);
     scrobbler->priv->suspended_track = NULL;
   }
   mafw_lastfm_scrobbler_drop_pending_track (scrobbler);
@@ -286,10 +792,10 @@ mafw_lastfm_scrobbler_suspend (MafwLastfmScrobbler *scrobbler)
     return;
 
   /* Remove the last track from the queue, since it is suspended. */
-  scrobbler->priv->suspended_track = g_queue_pop_tail (scrobbler->priv->scrobbling_queue);
+  scrobbler->priv->suspended_track = mafw_lastfm_queue_pop_tail (scrobbler->priv->scrobbling_queue);
   /* Nothing to cache */
   if (scrobbler->priv->cache_id) {
-    g_source_remove (scrobbler->priv->cache_id);
+    mafw_lastfm_scheduler_remove (scrobbler->priv->scheduler, scrobbler->priv->cache_id);
     scrobbler->priv->cache_id = 0;
   }
 }
@@ -299,7 +805,7 @@ defer_set_playing_now_cb (MafwLastfmScrobbler *scrobbler)
 {
   mafw_lastfm_scrobbler_set_playing_now (scrobbler,
                                          scrobbler->priv->playing_now_track);
-  mafw_lastfm_track_free (scrobbler->priv->playing_now_track);
+  mafw_lastfm_track_unref (scrobbler->priv->playing_now_track);
   scrobbler->priv->playing_now_track = NULL;
   scrobbler->priv->playing_now_id = 0;
 
@@ -311,7 +817,8 @@ cache_scrobble_queue (MafwLastfmScrobbler *scrobbler)
 {
   scrobbler->priv->cache_id = 0;
 
-  mafw_lastfm_scrobbler_flush_to_disk (scrobbler);
+  mafw_lastfm_scrobbler_flush_to_disk (scrobbler,
+                                       mafw_lastfm_queue_get_length (scrobbler->priv->scrobbling_queue));
 
   return FALSE;
 }
@@ -322,9 +829,10 @@ mafw_lastfm_scrobbler_drop_pending_track (MafwLastfmScrobbler *scrobbler)
   /* If this is != 0, there is a track awaiting to be cached but it shouldn't.
      Drop it. */
   if (scrobbler->priv->cache_id) {
-    g_source_remove (scrobbler->priv->cache_id);
+    mafw_lastfm_scheduler_remove (scrobbler->priv->scheduler, scrobbler->priv->cache_id);
     scrobbler->priv->cache_id = 0;
-    mafw_lastfm_track_free ((MafwLastfmTrack *)g_queue_pop_tail (scrobbler->priv->scrobbling_queue));
+    mafw_lastfm_track_unref (mafw_lastfm_queue_pop_tail (scrobbler->priv->scrobbling_queue));
+    mafw_lastfm_scrobbler_update_queue_metrics (scrobbler);
   }
 }
 
@@ -333,446 +841,447 @@ mafw_lastfm_scrobbler_enqueue_scrobble (MafwLastfmScrobbler *scrobbler,
                                         MafwLastfmTrack *track,
                                         gint position)
 {
-  MafwLastfmTrack *encoded;
   gint t;
 
   mafw_lastfm_scrobbler_scrobble_cached (scrobbler);
 
-  encoded = mafw_lastfm_track_encode (track);
+  track = mafw_lastfm_track_ref (track);
+  mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_TRACKS_ENQUEUED);
 
   if (scrobbler->priv->playing_now_id) {
-    g_source_remove (scrobbler->priv->playing_now_id);
+    /* The previous track didn't play long enough to announce it. */
+    mafw_lastfm_scheduler_remove (scrobbler->priv->scheduler, scrobbler->priv->playing_now_id);
     scrobbler->priv->playing_now_id = 0;
+    mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_NOW_PLAYING_CANCELLED);
   }
+  /* Nor is the one waiting for the requests in flight. */
+  g_slist_foreach (scrobbler->priv->endpoints,
+                   (GFunc) mafw_lastfm_endpoint_drop_playing_now, NULL);
   if (scrobbler->priv->playing_now_track) {
-    mafw_lastfm_track_free (scrobbler->priv->playing_now_track);
-    scrobbler->priv->playing_now_track = 0;
+    mafw_lastfm_track_unref (scrobbler->priv->playing_now_track);
+    scrobbler->priv->playing_now_track = NULL;
   }
 
   mafw_lastfm_scrobbler_drop_pending_track (scrobbler);
 
   if (scrobbler->priv->suspended_track) {
-    if (mafw_lastfm_track_cmp (scrobbler->priv->suspended_track, encoded) &&
+    if (mafw_lastfm_track_equal (scrobbler->priv->suspended_track, track) &&
         position > 0) {
-      mafw_lastfm_track_free (encoded);
-      encoded = scrobbler->priv->suspended_track;
+      mafw_lastfm_track_unref (track);
+      track = scrobbler->priv->suspended_track;
     } else {
-      mafw_lastfm_track_free (scrobbler->priv->suspended_track);
+      mafw_lastfm_track_unref (scrobbler->priv->suspended_track);
     }
     scrobbler->priv->suspended_track = NULL;
   }
 
   /* calculate how much to play before it should be considered worth scrobbling. */
-  t = MIN (240, encoded->length/2) - position;
+  t = MIN (240, track->length/2) - position;
   if (t >= 0) {
     /* Track has not been played enough (or at all). */
-    if (scrobbler->priv->status == MAFW_LASTFM_SCROBBLER_READY) {
+    if (mafw_lastfm_scrobbler_is_ready (scrobbler)) {
       /* Set its playing now status. */
-      scrobbler->priv->playing_now_track = mafw_lastfm_track_dup (encoded);
-      scrobbler->priv->playing_now_id = g_timeout_add_seconds (3,
-                                                               (GSourceFunc) defer_set_playing_now_cb,
-                                                               scrobbler);
+      scrobbler->priv->playing_now_track = mafw_lastfm_track_ref (track);
+      scrobbler->priv->playing_now_id =
+        mafw_lastfm_scheduler_add_seconds (scrobbler->priv->scheduler, 3,
+                                           (GSourceFunc) defer_set_playing_now_cb,
+                                           scrobbler);
     }
     /* Schedule its caching once it has played enough. */
-    g_queue_push_tail (scrobbler->priv->scrobbling_queue, encoded);
-    scrobbler->priv->cache_id = g_timeout_add_seconds (t, (GSourceFunc)cache_scrobble_queue, scrobbler);
+    mafw_lastfm_queue_push_tail (scrobbler->priv->scrobbling_queue, track);
+    scrobbler->priv->cache_id =
+      mafw_lastfm_scheduler_add_seconds (scrobbler->priv->scheduler, t,
+                                         (GSourceFunc) cache_scrobble_queue,
+                                         scrobbler);
+
+    if (mafw_lastfm_queue_is_over_limit (scrobbler->priv->scrobbling_queue)) {
+      /* Spill the tracks that have already been played long
+         enough, all but the one just added. */
+      mafw_lastfm_scrobbler_flush_to_disk (scrobbler,
+                                           mafw_lastfm_queue_get_length (scrobbler->priv->scrobbling_queue) - 1);
+    }
+    mafw_lastfm_scrobbler_update_queue_metrics (scrobbler);
+  } else {
+    mafw_lastfm_track_unref (track);
   }
 }
 
 /**
- * get_auth_string:
- * @md5password: the md5sum of the password to build the authorization string from
- * @timestamp: a pointer to store the used timestamp.
- *
- * Builds an authorization string based on the password
- * and the current epoch time. The Last.fm authorization string
- * is of the form md5 (md5 (password) + @timestamp).
+ * mafw_lastfm_scrobbler_update_queue_metrics:
+ * @scrobbler: a #MafwLastfmScrobbler
  *
- * Returns: a newly allocated string with the authorization md5sum,
- * to be used together with @timestamp.
+ * Updates the gauges of the tracks waiting to be submitted, in
+ * memory, on their way to the journal and in it, and of the size of
+ * the journal.
  **/
-static gchar *
-get_auth_string (const gchar *md5passwd,
-                 glong *timestamp)
+static void
+mafw_lastfm_scrobbler_update_queue_metrics (MafwLastfmScrobbler *scrobbler)
 {
-  GTimeVal time_val;
-  gchar *auth;
-  gchar *md5;
-
-  g_return_val_if_fail (timestamp, NULL);
-
-  g_get_current_time (&time_val);
-
-  auth = g_strdup_printf ("%s%li", md5passwd, time_val.tv_sec);
-
-  *timestamp = time_val.tv_sec;
-
-  md5 = g_compute_checksum_for_string (G_CHECKSUM_MD5, auth, -1);
-  g_free (auth);
-
-  return md5;
+  MafwLastfmScrobblerPrivate *priv = scrobbler->priv;
+
+  mafw_lastfm_metrics_set (MAFW_LASTFM_METRIC_QUEUE_DEPTH,
+                           mafw_lastfm_queue_get_length (priv->scrobbling_queue) +
+                           priv->n_flushing +
+                           mafw_lastfm_journal_get_n_pending (priv->journal));
+  mafw_lastfm_metrics_set (MAFW_LASTFM_METRIC_DISK_BYTES,
+                           mafw_lastfm_journal_get_size (priv->journal));
 }
 
-typedef enum {
-  AS_RESPONSE_OK,
-  /* AS_RESPONSE_BANNED, */
-  /* AS_RESPONSE_BADAUTH, */
-  AS_RESPONSE_BADTIME,
-  /* AS_RESPONSE_FAILED, */
-  AS_RESPONSE_OTHER
-} AsHandshakeResponse;
-
-static AsHandshakeResponse
-parse_handshake_response (MafwLastfmScrobbler *scrobbler,
-                          const gchar *response_data)
+static void
+flush_to_disk_cb (MafwLastfmJournal *journal,
+                  const GError *error,
+                  gpointer user_data)
 {
-  gchar **response;
-  AsHandshakeResponse retval;
-  response = g_strsplit (response_data, "\n", 5);
-
-  if (g_str_has_prefix (response [0], "OK")) {
-    g_free (scrobbler->priv->session_id);
-    g_free (scrobbler->priv->np_url);
-    g_free (scrobbler->priv->sub_url);
-
-    scrobbler->priv->session_id = response[1];
-    scrobbler->priv->np_url = response[2];
-    scrobbler->priv->sub_url = response[3];
+  MafwLastfmScrobbler *scrobbler = user_data;
+  MafwLastfmScrobblerPrivate *priv = scrobbler->priv;
+  MafwLastfmQueue *queue = priv->scrobbling_queue;
+  GSList *tracks, *l;
+  guint n_tracks;
 
-    /* We take ownership on the relevant parsed data, free the
-       array and response code. */
-    g_free (response[0]);
-    g_free (response[4]);
-    g_free (response);
+  tracks = g_queue_pop_head (priv->flushing);
+  n_tracks = g_slist_length (tracks);
+  priv->n_flushing -= n_tracks;
 
-    retval = AS_RESPONSE_OK;
-  } else if (g_str_has_prefix (response [0], "BADTIME")) {
-    retval = AS_RESPONSE_BADTIME;
-  } else {
-    retval = AS_RESPONSE_OTHER;
+  if (error) {
+    g_warning ("Error appending tracks: %s\n", error->message);
+    /* Back in front of the queue, newest first, to be written
+       again with the next ones. */
+    for (l = tracks; l; l = l->next)
+      mafw_lastfm_queue_push_head (queue, l->data);
+    g_slist_free (tracks);
+    mafw_lastfm_scrobbler_enforce_queue_limit (scrobbler);
+    return;
   }
 
-  if (retval != AS_RESPONSE_OK) {
-    g_warning ("Couldn't handshake: %s", response[0]);
-    g_strfreev (response);
-  }
+  g_print ("Cached %u track(s) on disk (queue capacity %u, high water %u)\n",
+           n_tracks, mafw_lastfm_queue_get_capacity (queue),
+           mafw_lastfm_queue_get_high_water (queue));
+  free_tracks (tracks);
 
-  return retval;
+  mafw_lastfm_scrobbler_update_queue_metrics (scrobbler);
+  mafw_lastfm_scrobbler_scrobble_cached (scrobbler);
 }
 
-static gboolean
-retry_queue_message (gpointer userdata)
+/**
+ * mafw_lastfm_scrobbler_flush_to_disk:
+ * @scrobbler: a #MafwLastfmScrobbler
+ * @n_tracks: the number of tracks to write, from the head of the queue
+ *
+ * Moves the first @n_tracks tracks of the scrobbling queue to the
+ * journal. They leave the queue right away, so that they aren't
+ * written twice, and go back to it if they couldn't be written.
+ **/
+static void
+mafw_lastfm_scrobbler_flush_to_disk (MafwLastfmScrobbler *scrobbler,
+                                     guint n_tracks)
 {
-  MafwLastfmScrobblerPrivate *priv = MAFW_LASTFM_SCROBBLER (userdata)->priv;
+  MafwLastfmScrobblerPrivate *priv = scrobbler->priv;
+  MafwLastfmTrack *track;
+  GString *records;
+  GSList *tracks = NULL;
+  guint i;
 
-  priv->retry_id = 0;
-  g_print ("retrying to queue message\n");
-  soup_session_queue_message (priv->session,
-                              priv->retry_message,
-                              handshake_cb,
-                              MAFW_LASTFM_SCROBBLER (userdata));
-  priv->retry_message = NULL;
+  if (n_tracks == 0)
+    return;
 
-  return FALSE;
-}
+  records = g_string_new (NULL);
 
-static void
-handshake_cb (SoupSession *session,
-              SoupMessage *message,
-              gpointer user_data)
-{
-  MafwLastfmScrobbler *scrobbler = MAFW_LASTFM_SCROBBLER (user_data);
-
-  if (SOUP_STATUS_IS_SUCCESSFUL (message->status_code)) {
-    g_print ("%s", message->response_body->data);
-    switch (parse_handshake_response (scrobbler, message->response_body->data)) {
-    case AS_RESPONSE_OK:
-      scrobbler->priv->status = MAFW_LASTFM_SCROBBLER_READY;
-      scrobbler->priv->retry_interval = 5;
-      mafw_lastfm_scrobbler_scrobble_cached (scrobbler);
-      return;
-    case AS_RESPONSE_BADTIME:
-      scrobbler->priv->status = MAFW_LASTFM_SCROBBLER_NEED_HANDSHAKE;
-      scrobbler->priv->retry_interval = 5;
-      mafw_lastfm_scrobbler_handshake (scrobbler);
-      return;
-    case AS_RESPONSE_OTHER:
-      break;
-    }
+  for (i = 0; i < n_tracks; i++) {
+    track = mafw_lastfm_queue_pop_head (priv->scrobbling_queue);
+    mafw_lastfm_journal_encode_record (records, track, 0);
+    tracks = g_slist_prepend (tracks, track);
   }
 
-  /* If something went wrong, try to recover. */
-  g_print ("message failed, trying to send in %d seconds.\n", scrobbler->priv->retry_interval);
-  scrobbler->priv->status = MAFW_LASTFM_SCROBBLER_NEED_HANDSHAKE;
-  scrobbler->priv->retry_message = g_object_ref (message);
-  scrobbler->priv->retry_id = g_timeout_add_seconds (scrobbler->priv->retry_interval,
-                                                     retry_queue_message,
-                                                     scrobbler);
-  if (scrobbler->priv->retry_interval < 320)
-    scrobbler->priv->retry_interval *= 2;
+  g_queue_push_tail (priv->flushing, tracks);
+  priv->n_flushing += n_tracks;
+  mafw_lastfm_journal_append_async (priv->journal, records,
+                                    flush_to_disk_cb, scrobbler);
+  mafw_lastfm_scrobbler_update_queue_metrics (scrobbler);
 }
 
-void
-mafw_lastfm_scrobbler_handshake (MafwLastfmScrobbler *scrobbler)
+/**
+ * mafw_lastfm_scrobbler_enforce_queue_limit:
+ * @scrobbler: a #MafwLastfmScrobbler
+ *
+ * Drops the oldest tracks of the scrobbling queue while it takes
+ * more memory than allowed, which only happens when they couldn't be
+ * written to disk. The last track is always kept.
+ **/
+static void
+mafw_lastfm_scrobbler_enforce_queue_limit (MafwLastfmScrobbler *scrobbler)
 {
-  gchar *auth;
-  glong timestamp;
-  gchar *handshake_url;
-  SoupMessage *message;
-
-  g_return_if_fail (scrobbler->priv->status != MAFW_LASTFM_SCROBBLER_HANDSHAKING);
-  g_return_if_fail (scrobbler->priv->username || scrobbler->priv->md5password);
-  if (scrobbler->priv->retry_id) {
-    g_source_remove (scrobbler->priv->retry_id);
-    scrobbler->priv->retry_id = 0;
-    if (scrobbler->priv->retry_message) {
-      g_object_unref (scrobbler->priv->retry_message);
-      scrobbler->priv->retry_message = NULL;
-    }
-  }
-  if (scrobbler->priv->handshake_id) {
-    g_source_remove (scrobbler->priv->handshake_id);
-    scrobbler->priv->handshake_id = 0;
-  }
-  scrobbler->priv->status = MAFW_LASTFM_SCROBBLER_HANDSHAKING;
-
-  auth = get_auth_string (scrobbler->priv->md5password, &timestamp);
+  MafwLastfmQueue *queue = scrobbler->priv->scrobbling_queue;
 
-  handshake_url = g_strdup_printf ("http://post.audioscrobbler.com/?hs=true&p=1.2.1&c=%s&v=%s&u=%s&t=%li&a=%s",
-                                   CLIENT_ID, CLIENT_VERSION,
-                                   scrobbler->priv->username,
-                                   timestamp,
-                                   auth);
-
-  message = soup_message_new ("GET", handshake_url);
-  soup_session_queue_message (scrobbler->priv->session,
-                              message,
-                              handshake_cb,
-                              scrobbler);
-  g_free (handshake_url);
-  g_free (auth);
+  while (mafw_lastfm_queue_is_over_limit (queue) &&
+         mafw_lastfm_queue_get_length (queue) > 1) {
+    g_warning ("Scrobbling queue over its memory limit, dropping a track");
+    mafw_lastfm_track_unref (mafw_lastfm_queue_pop_head (queue));
+  }
+  mafw_lastfm_scrobbler_update_queue_metrics (scrobbler);
 }
 
 static void
-mafw_lastfm_scrobbler_flush_to_disk (MafwLastfmScrobbler *scrobbler)
+compact_done_cb (MafwLastfmJournal *journal,
+                 const GError *error,
+                 gpointer user_data)
 {
-  MafwLastfmTrack *track;
-  GFileOutputStream *outstream;
-  gchar *buffer = NULL, **tracks;
-  gint length, i;
-  GList *iter;
-  GError *error = NULL;
-  gboolean success = TRUE;
-  GFile *file;
-  gchar *filename;
-
-  filename = g_build_filename (g_get_home_dir(),
-                               MAFW_LASTFM_QUEUE_FILE, NULL);
-  file = g_file_new_for_path (filename);
-  g_free (filename);
-
-  outstream = g_file_append_to (file, G_FILE_CREATE_PRIVATE, NULL, &error);
-
-  if (error) {
-    g_warning ("Couldn't open output file: %s\n", error->message);
-    g_error_free (error);
-    goto out;
-  }
+  MafwLastfmScrobbler *scrobbler = user_data;
 
-  length = g_queue_get_length (scrobbler->priv->scrobbling_queue);
-  tracks = g_new0 (gchar *, length + 1);
-
-  for (i = 0, iter = scrobbler->priv->scrobbling_queue->head;
-       iter != NULL;
-       i++, iter = g_list_next (iter)) {
-    track = (MafwLastfmTrack *) iter->data;
-    tracks[i] = g_strdup_printf ("%s&%s&%li&%c&%lld&%s&%i\n",
-                                 track->artist,
-                                 track->title,
-                                 track->timestamp,
-                                 track->source,
-                                 /* ratio skipped */
-                                 track->length,
-                                 track->album ? track->album : "",
-                                 track->number
-                                 /* musicbrainz id skipped */);
-  }
+  mafw_lastfm_scrobbler_update_queue_metrics (scrobbler);
+  /* Batches are held while compacting. */
+  mafw_lastfm_scrobbler_scrobble_cached (scrobbler);
+}
 
-  buffer = g_strjoinv (NULL, tracks);
-  g_strfreev (tracks);
-  g_output_stream_write (G_OUTPUT_STREAM (outstream), buffer, strlen (buffer), NULL, &error);
+static gboolean
+compact_journal_cb (MafwLastfmScrobbler *scrobbler)
+{
+  GSList *l;
 
-  if (error) {
-    g_warning ("Error appending tracks: %s\n", error->message);
-    g_error_free (error);
-    success = FALSE;
-    error = NULL;
-  }
+  scrobbler->priv->compact_id = 0;
 
-  g_output_stream_close (G_OUTPUT_STREAM (outstream), NULL, &error);
-  if (error) {
-    g_warning ("Error closing file: %s\n", error->message);
-    success = FALSE;
-    g_error_free (error);
+  /* Offsets of the records being read or submitted would change.
+     The endpoint still busy asks again once done. */
+  if (scrobbler->priv->reading)
+    return FALSE;
+  for (l = scrobbler->priv->endpoints; l; l = l->next) {
+    if (!mafw_lastfm_endpoint_is_idle (l->data))
+      return FALSE;
   }
 
-  if (success) {
-    g_print ("Cached %i track(s) on disk\n", length);
-    g_queue_foreach (scrobbler->priv->scrobbling_queue, (GFunc)mafw_lastfm_track_free, NULL);
-    g_queue_clear (scrobbler->priv->scrobbling_queue);
-  }
+  mafw_lastfm_journal_compact_async (scrobbler->priv->journal,
+                                     compact_done_cb, scrobbler);
 
-out:
-  g_free (buffer);
-  g_object_unref (outstream);
-  g_object_unref (file);
+  return FALSE;
 }
 
+/* Compacts the journal once enough of it has been acknowledged, or,
+   while offline, to compress the records piling up. */
 static void
-cached_scrobble_cb (SoupSession *session,
-                    SoupMessage *message,
-                    gpointer user_data)
+mafw_lastfm_scrobbler_maybe_compact (MafwLastfmScrobbler *scrobbler)
 {
-  GFile *file;
-  gchar *filename;
-
-  if (SOUP_STATUS_IS_SUCCESSFUL (message->status_code)) {
-    g_print ("Scrobble: %s", message->response_body->data);
-    if (g_str_has_prefix (message->response_body->data, "OK")) {
-      filename = g_build_filename (g_get_home_dir (), MAFW_LASTFM_QUEUE_FILE, NULL);
-      file = g_file_new_for_path (filename);
-      g_file_delete (file, NULL, NULL);
-      g_object_unref (file);
-      g_free (filename);
-      return;
-    }
-  }
-  /* If we are here, we failed to submit. */
-  mafw_lastfm_scrobbler_defer_handshake (MAFW_LASTFM_SCROBBLER  (user_data));
+  MafwLastfmJournal *journal = scrobbler->priv->journal;
+
+  if (scrobbler->priv->compact_id == 0 &&
+      !mafw_lastfm_journal_is_compacting (journal) &&
+      (mafw_lastfm_journal_get_acked_offset (journal) >
+       MAFW_LASTFM_COMPACT_THRESHOLD ||
+       mafw_lastfm_journal_get_unsealed_size (journal) >
+       MAFW_LASTFM_JOURNAL_SEGMENT_SIZE))
+    scrobbler->priv->compact_id = g_idle_add_full (G_PRIORITY_LOW,
+                                                   (GSourceFunc) compact_journal_cb,
+                                                   scrobbler, NULL);
 }
 
-static void
-mafw_lastfm_scrobbler_scrobble_cached (MafwLastfmScrobbler *scrobbler)
+/* The fingerprint of a record for @scope, from its decoded
+   strings. */
+static guint64
+record_fingerprint (MafwLastfmTrack *track,
+                    guint flags,
+                    const gchar *scope)
 {
-  gchar *filename;
-  gchar *buffer;
-  gchar **tracks = NULL;
-  gchar **new_tracks;
-  gchar **track;
-  gchar *post_data;
-  gint i, n;
-
-  filename = g_build_filename (g_get_home_dir(),
-                               MAFW_LASTFM_QUEUE_FILE, NULL);
-
-  if (g_file_get_contents (filename, &buffer, NULL, NULL) && buffer) {
-    tracks = g_strsplit (buffer, "\n", 0);
-    g_free (buffer);
-    buffer = NULL;
-  }
-  g_free (filename);
+  MafwLastfmTrack decoded;
+  gchar *artist, *title;
+  guint64 fingerprint;
+
+  if (!(flags & MAFW_LASTFM_JOURNAL_RECORD_ENCODED))
+    return mafw_lastfm_dedup_fingerprint (track, scope);
+
+  artist = track->artist ? soup_uri_decode (track->artist) : NULL;
+  title = track->title ? soup_uri_decode (track->title) : NULL;
+  decoded = *track;
+  decoded.artist = artist;
+  decoded.title = title;
+  fingerprint = mafw_lastfm_dedup_fingerprint (&decoded, scope);
+  g_free (artist);
+  g_free (title);
+
+  return fingerprint;
+}
 
-  if (tracks) {
-    n = g_strv_length (tracks);
-    new_tracks = g_new0 (gchar *, n);
-    for (i = 0; i < n - 1; i++) {
-      track = g_strsplit (tracks[i], "&", 0);
-      new_tracks[i] = g_strdup_printf ("a[%i]=%s&t[%i]=%s&i[%i]=%s&o[%i]=%s&r[%i]=&l[%i]=%s&b[%i]=%s&n[%i]=%s&m[%i]=",
-                                       i, track [0],
-                                       i, track [1],
-                                       i, track [2],
-                                       i, track [3],
-                                       i, /* ratio skipped */
-                                       i, track [4],
-                                       i, track [5] ? track [5] : "",
-                                       i, track [6],
-                                       i, track [7],
-                                       i /* musicbrainz id skipped */);
-      g_strfreev (track);
+/**
+ * filter_batch:
+ * @endpoint: the #MafwLastfmEndpoint to submit the batch to
+ * @records: the records of the batch
+ * @length: the length of @records
+ * @dropped: a #GString to set, one byte per record, to whether it is
+ * dropped
+ *
+ * Drops the records that @endpoint has already been sent, or that
+ * come twice in the batch.
+ *
+ * Returns: the fingerprints of the records left, in a new #GArray.
+ **/
+static GArray *
+filter_batch (MafwLastfmEndpoint *endpoint,
+              const gchar *records,
+              gsize length,
+              GString *dropped)
+{
+  MafwLastfmJournalIter iter;
+  MafwLastfmTrack track;
+  GArray *fingerprints;
+  guint64 fingerprint;
+  gboolean duplicate;
+  guint flags;
+  guint i;
+
+  fingerprints = g_array_new (FALSE, FALSE, sizeof (guint64));
+  g_string_truncate (dropped, 0);
+
+  mafw_lastfm_journal_iter_init (&iter, records, length);
+  while (mafw_lastfm_journal_iter_next (&iter, &track, &flags)) {
+    fingerprint = record_fingerprint (&track, flags,
+                                      mafw_lastfm_endpoint_get_name (endpoint));
+    duplicate = mafw_lastfm_endpoint_has_sent (endpoint, fingerprint);
+    for (i = 0; i < fingerprints->len && !duplicate; i++)
+      duplicate = g_array_index (fingerprints, guint64, i) == fingerprint;
+
+    if (duplicate) {
+      g_print ("Dropping duplicate scrobble of %s - %s to %s\n",
+               track.artist, track.title,
+               mafw_lastfm_endpoint_get_name (endpoint));
+      mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_DUPLICATES_DROPPED);
+    } else {
+      g_array_append_val (fingerprints, fingerprint);
     }
-    buffer = g_strjoinv ("&", new_tracks);
-    g_strfreev (tracks);
-    g_strfreev (new_tracks);
+    g_string_append_c (dropped, duplicate);
   }
 
-  if (buffer) {
-    post_data = g_strdup_printf ("s=%s&%s",
-                                 scrobbler->priv->session_id,
-                                 buffer);
-    g_free (buffer);
-    scrobbler_send_message (scrobbler, scrobbler->priv->sub_url,
-                            post_data, cached_scrobble_cb);
-  }
+  return fingerprints;
 }
 
-MafwLastfmTrack *
-mafw_lastfm_track_new (void)
+/**
+ * batch_read_cb:
+ * @journal: the #MafwLastfmJournal of the scrobbler
+ * @records: the records read, or %NULL
+ * @length: the length of @records
+ * @offset: the offset of @records in the journal
+ * @error: the error reading them, if any
+ * @user_data: the #MafwLastfmScrobbler
+ *
+ * Encodes the batch once per protocol, for all the endpoints that can
+ * submit it: usually all of them, unless some are lagging behind
+ * after a failure. An endpoint that has already been sent some of the
+ * records gets a batch of its own without them. Then reads the next
+ * batch, if any.
+ **/
+static void
+batch_read_cb (MafwLastfmJournal *journal,
+               const gchar *records,
+               gsize length,
+               goffset offset,
+               const GError *error,
+               gpointer user_data)
 {
-  return g_new0 (MafwLastfmTrack, 1);
-}
+  MafwLastfmScrobbler *scrobbler = user_data;
+  MafwLastfmScrobblerPrivate *priv = scrobbler->priv;
+  MafwLastfmJournalIter iter;
+  MafwLastfmTrack track;
+  const MafwLastfmProtocol *protocol;
+  MafwLastfmPayload *payload;
+  GSList *payloads = NULL;
+  GSList *l;
+  GArray *fingerprints;
+  GString *dropped;
+  gboolean shared;
+  goffset end;
+  guint flags;
+  guint i;
+
+  priv->reading = FALSE;
 
-void
-mafw_lastfm_track_free (MafwLastfmTrack *track)
-{
-  if (!track)
+  if (error) {
+    g_warning ("Couldn't read cached tracks: %s\n", error->message);
     return;
+  }
 
-  g_free (track->artist);
-  g_free (track->title);
-  g_free (track->album);
-
-  g_free (track);
-}
-
-#define EXTRA_URI_ENCODE_CHARS "&+"
-
-static MafwLastfmTrack *
-mafw_lastfm_track_encode (MafwLastfmTrack *track)
-{
-  MafwLastfmTrack *encoded;
-
-  encoded = mafw_lastfm_track_new ();
-
-  if (track->artist)
-    encoded->artist = soup_uri_encode (track->artist, EXTRA_URI_ENCODE_CHARS);
-
-  if (track->title)
-    encoded->title = soup_uri_encode (track->title, EXTRA_URI_ENCODE_CHARS);
+  if (!records) {
+    mafw_lastfm_scrobbler_maybe_compact (scrobbler);
+    return;
+  }
 
-  if (track->album)
-    encoded->album = soup_uri_encode (track->album, EXTRA_URI_ENCODE_CHARS);
+  end = offset + length;
+  dropped = g_string_new (NULL);
+
+  for (l = priv->endpoints; l; l = l->next) {
+    if (!mafw_lastfm_endpoint_can_submit (l->data) ||
+        mafw_lastfm_endpoint_get_submitted_end (l->data) != priv->read_from)
+      continue;
+
+    fingerprints = filter_batch (l->data, records, length, dropped);
+    shared = fingerprints->len == dropped->len;
+
+    protocol = mafw_lastfm_endpoint_get_protocol (l->data);
+    payload = shared ? find_payload (payloads, protocol) : NULL;
+    if (!payload) {
+      /* The records hold the strings of the tracks, which take at
+         most three times as much once encoded, plus the keys and the
+         numeric values. */
+      payload = mafw_lastfm_payload_new (protocol,
+                                         MAFW_LASTFM_REQUEST_SUBMISSION,
+                                         3 * length +
+                                         MAFW_LASTFM_MAX_BATCH_SIZE * 64);
+      mafw_lastfm_journal_iter_init (&iter, records, length);
+      for (i = 0; mafw_lastfm_journal_iter_next (&iter, &track, &flags); i++) {
+        if (!dropped->str[i])
+          mafw_lastfm_payload_append (payload, &track,
+                                      flags & MAFW_LASTFM_JOURNAL_RECORD_ENCODED);
+      }
+      mafw_lastfm_payload_finish (payload);
+      payloads = g_slist_prepend (payloads, payload);
+    }
+    mafw_lastfm_endpoint_submit (l->data, payload, end, fingerprints);
+    /* Only for this endpoint. */
+    if (!shared) {
+      payloads = g_slist_remove (payloads, payload);
+      mafw_lastfm_payload_unref (payload);
+    }
+  }
 
-  encoded->length = track->length;
-  encoded->number = track->number;
-  encoded->timestamp = track->timestamp;
-  encoded->source = track->source;
+  g_string_free (dropped, TRUE);
+  /* Nobody took it if the endpoints changed meanwhile, and then the
+     next read starts from scratch. */
+  free_payloads (payloads);
 
-  return encoded;
+  mafw_lastfm_scrobbler_scrobble_cached (scrobbler);
 }
 
-static gboolean
-mafw_lastfm_track_cmp (MafwLastfmTrack *a,
-                       MafwLastfmTrack *b)
+/**
+ * mafw_lastfm_scrobbler_scrobble_cached:
+ * @scrobbler: a #MafwLastfmScrobbler
+ *
+ * Sends as many batches of cached tracks to the endpoints as allowed
+ * by their maximum number of batches in flight, reading them one at a
+ * time from the journal. This doesn't touch the disk unless there
+ * are records in the journal that haven't been sent to some endpoint
+ * yet.
+ **/
+static void
+mafw_lastfm_scrobbler_scrobble_cached (MafwLastfmScrobbler *scrobbler)
 {
-  return (strcmp (a->artist, b->artist) == 0 &&
-          strcmp (a->title, b->title) == 0 &&
-          a->length == b->length &&
-          (!(a->album || b->album) ||
-           ((a->album && b->album) && strcmp (a->album, b->album) == 0)));
-}
+  MafwLastfmScrobblerPrivate *priv = scrobbler->priv;
+  MafwLastfmEndpoint *endpoint = NULL;
+  GSList *l;
 
-static MafwLastfmTrack *
-mafw_lastfm_track_dup (MafwLastfmTrack *track)
-{
-  MafwLastfmTrack *track2 = mafw_lastfm_track_new ();
+  /* The batch being read goes on with the next one once done, and so
+     does the compaction. */
+  if (priv->reading || mafw_lastfm_journal_is_compacting (priv->journal))
+    return;
+
+  for (l = priv->endpoints; l && !endpoint; l = l->next) {
+    if (mafw_lastfm_endpoint_can_submit (l->data))
+      endpoint = l->data;
+  }
 
-  track2->artist = g_strdup (track->artist);
-  track2->title = g_strdup (track->title);
-  track2->album = g_strdup (track->album);
-  track2->timestamp = track->timestamp;
-  track2->source = track->source;
-  track2->length = track->length;
-  track2->number = track->number;
+  if (!endpoint) {
+    mafw_lastfm_scrobbler_maybe_compact (scrobbler);
+    return;
+  }
 
-  return track2;
+  priv->reading = TRUE;
+  priv->read_from = mafw_lastfm_endpoint_get_submitted_end (endpoint);
+  mafw_lastfm_journal_read_batch_async (priv->journal, priv->read_from,
+                                        MIN (MAFW_LASTFM_MAX_BATCH_SIZE,
+                                             mafw_lastfm_endpoint_get_batch_limit (endpoint)),
+                                        batch_read_cb, scrobbler);
 }
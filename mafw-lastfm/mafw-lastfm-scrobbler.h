@@ -23,6 +23,10 @@
 
 #include <glib-object.h>
 
+#include "mafw-lastfm-track.h"
+#include "mafw-lastfm-endpoint.h"
+#include "mafw-lastfm-history.h"
+
 G_BEGIN_DECLS
 
 #define MAFW_LASTFM_TYPE_SCROBBLER mafw_lastfm_scrobbler_get_type ()
@@ -53,30 +57,79 @@ typedef struct {
   GObjectClass parent_class;
 } MafwLastfmScrobblerClass;
 
-typedef struct {
-  gchar *artist;
-  gchar *title;
-  gchar *album;
-  glong timestamp;
-  gchar source;
-  gint64 length;
-  gint number;
-} MafwLastfmTrack;
+/* The name of the endpoint the scrobbler is created with. */
+#define MAFW_LASTFM_DEFAULT_ENDPOINT "lastfm"
 
 GType
 mafw_lastfm_scrobbler_get_type (void);
 
 MafwLastfmScrobbler *
-mafw_lastfm_scrobbler_new (void);
+mafw_lastfm_scrobbler_new (GError **error);
+
+MafwLastfmScrobbler *
+mafw_lastfm_scrobbler_new_with_journal (const gchar *path);
+
+MafwLastfmEndpoint *
+mafw_lastfm_scrobbler_add_endpoint (MafwLastfmScrobbler *scrobbler,
+                                    const gchar *name,
+                                    const gchar *handshake_url);
+
+MafwLastfmEndpoint *
+mafw_lastfm_scrobbler_get_endpoint (MafwLastfmScrobbler *scrobbler,
+                                    const gchar *name);
 
 void
 mafw_lastfm_scrobbler_set_credentials (MafwLastfmScrobbler *scrobbler,
                                        const gchar *username,
                                        const gchar *passwd);
 
+void
+mafw_lastfm_scrobbler_set_handshake_url (MafwLastfmScrobbler *scrobbler,
+                                         const gchar *url);
+
+void
+mafw_lastfm_scrobbler_set_session_file (MafwLastfmScrobbler *scrobbler,
+                                        const gchar *path);
+
+void
+mafw_lastfm_scrobbler_set_history_file (MafwLastfmScrobbler *scrobbler,
+                                        const gchar *path);
+
+MafwLastfmHistory *
+mafw_lastfm_scrobbler_get_history (MafwLastfmScrobbler *scrobbler);
+
+void
+mafw_lastfm_scrobbler_set_dedup_file (MafwLastfmScrobbler *scrobbler,
+                                      const gchar *path);
+
+void
+mafw_lastfm_scrobbler_set_max_batches_in_flight (MafwLastfmScrobbler *scrobbler,
+                                                 guint max_batches);
+
+void
+mafw_lastfm_scrobbler_set_queue_memory_limit (MafwLastfmScrobbler *scrobbler,
+                                              gsize limit);
+
+void
+mafw_lastfm_scrobbler_set_timer_slack (MafwLastfmScrobbler *scrobbler,
+                                       guint slack);
+
+guint
+mafw_lastfm_scrobbler_get_wakeups (MafwLastfmScrobbler *scrobbler);
+
+guint
+mafw_lastfm_scrobbler_get_wakeups_avoided (MafwLastfmScrobbler *scrobbler);
+
 void
 mafw_lastfm_scrobbler_handshake (MafwLastfmScrobbler *scrobbler);
 
+gboolean
+mafw_lastfm_scrobbler_restore_session (MafwLastfmScrobbler *scrobbler);
+
+void
+mafw_lastfm_scrobbler_set_online (MafwLastfmScrobbler *scrobbler,
+                                  gboolean online);
+
 void
 mafw_lastfm_scrobbler_set_playing_now (MafwLastfmScrobbler *scrobbler,
                                        MafwLastfmTrack *track);
@@ -92,12 +145,6 @@ mafw_lastfm_scrobbler_flush_queue (MafwLastfmScrobbler *scrobbler);
 void
 mafw_lastfm_scrobbler_suspend (MafwLastfmScrobbler *scrobbler);
 
-MafwLastfmTrack *
-mafw_lastfm_track_new (void);
-
-void
-mafw_lastfm_track_free (MafwLastfmTrack *track);
-
 G_END_DECLS
 
 #endif /* MAFW_LASTFM_SCROBBLER_H */
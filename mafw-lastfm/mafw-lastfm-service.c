@@ -0,0 +1,648 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2009-2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Attaches a scrobbler to the renderers of a MAFW registry, forwarding
+ * their signals to a #MafwLastfmTracker, and configures it from the
+ * credentials file and the environment. The registry is the one of
+ * the daemon, where the renderers are proxies of the ones living in
+ * other processes, or the one of the process loading the plugin,
+ * where the renderer is the GObject emitting the signals itself.
+ */
+
+#include <glib.h>
+#include <libmafw/mafw.h>
+#include <gio/gio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mafw-lastfm-service.h"
+#include "mafw-lastfm-tracker.h"
+#include "mafw-lastfm-metrics.h"
+#include "mafw-lastfm-dbus.h"
+
+#define WANTED_RENDERER "Mafw-Gst-Renderer"
+#define MAFW_LASTFM_CREDENTIALS_FILE ".osso/mafw-lastfm"
+/* Prefix of the groups of the other endpoints in the credentials
+   file, and where their sessions are saved. */
+#define MAFW_LASTFM_ENDPOINT_GROUP "Endpoint "
+#define MAFW_LASTFM_ENDPOINT_SESSION_FILE ".osso/mafw-lastfm-%s.session"
+/* Seconds between the dumps of the metrics, if enabled. */
+#define MAFW_LASTFM_DEFAULT_STATS_INTERVAL 60
+
+struct MafwLastfmService {
+  MafwLastfmScrobbler *scrobbler;
+  MafwLastfmTracker *tracker;
+
+  MafwRegistry *registry;
+  /* The renderers the tracker is connected to. */
+  GSList *renderers;
+
+  GFileMonitor *credentials_monitor;
+  gpointer network_monitor;
+  guint stats_id;
+  gboolean exported;
+};
+
+static const gchar *
+mafw_metadata_lookup_string (GHashTable *table,
+                             const gchar *key)
+{
+  GValue *value;
+  value = mafw_metadata_first (table, key);
+  return value ?  g_value_get_string (value) : NULL;
+}
+
+static int
+mafw_metadata_lookup_int (GHashTable *table,
+                          const gchar *key)
+{
+  GValue *value;
+  value = mafw_metadata_first (table, key);
+  return value ? g_value_get_int (value) : 0;
+}
+
+static void
+metadata_callback (MafwRenderer *self,
+                   const gchar *object_id,
+                   GHashTable *metadata,
+                   gpointer user_data,
+                   const GError *error)
+{
+  mafw_lastfm_tracker_metadata (user_data,
+                                mafw_metadata_lookup_string (metadata, MAFW_METADATA_KEY_ARTIST),
+                                mafw_metadata_lookup_string (metadata, MAFW_METADATA_KEY_TITLE),
+                                mafw_metadata_lookup_string (metadata, MAFW_METADATA_KEY_ALBUM),
+                                mafw_metadata_lookup_int (metadata, MAFW_METADATA_KEY_TRACK));
+}
+
+static void
+position_callback (MafwRenderer *renderer,
+                   gint current_position,
+                   gpointer user_data,
+                   const GError *error)
+{
+  mafw_lastfm_tracker_position (user_data, current_position);
+}
+
+/* The tracker doesn't depend on mafw, so it has its own states. */
+static MafwLastfmTrackerState
+tracker_state (MafwPlayState state)
+{
+  switch (state) {
+  case Playing:
+    return MAFW_LASTFM_TRACKER_PLAYING;
+  case Paused:
+    return MAFW_LASTFM_TRACKER_PAUSED;
+  case Transitioning:
+    return MAFW_LASTFM_TRACKER_TRANSITIONING;
+  case Stopped:
+  default:
+    return MAFW_LASTFM_TRACKER_STOPPED;
+  }
+}
+
+static void
+state_changed_cb (MafwRenderer *renderer,
+                  MafwPlayState state,
+                  gpointer user_data)
+{
+  GTimeVal time_val;
+  guint needs;
+
+  g_get_current_time (&time_val);
+  needs = mafw_lastfm_tracker_state_changed (user_data,
+                                             tracker_state (state),
+                                             time_val.tv_sec);
+
+  /* Only what the tracker missed from the signals, in parallel. */
+  if (needs & MAFW_LASTFM_TRACKER_NEED_POSITION)
+    mafw_renderer_get_position (renderer, position_callback,
+                                user_data);
+  if (needs & MAFW_LASTFM_TRACKER_NEED_METADATA)
+    mafw_renderer_get_current_metadata (renderer,
+                                        metadata_callback,
+                                        user_data);
+}
+
+static void
+media_changed_cb (MafwRenderer *renderer,
+                  gint index,
+                  gchar *object_id,
+                  gpointer user_data)
+{
+  mafw_lastfm_tracker_media_changed (user_data);
+}
+
+static void
+metadata_changed_cb (MafwRenderer *renderer,
+                     gchar *name,
+                     GValueArray *varray,
+                     gpointer user_data)
+{
+  GValue *value;
+
+  if (varray->n_values == 0)
+    return;
+  value = g_value_array_get_nth (varray, 0);
+
+  if (strcmp (name, MAFW_METADATA_KEY_DURATION) == 0)
+    mafw_lastfm_tracker_duration_changed (user_data,
+                                          g_value_get_int64 (value));
+  else if (strcmp (name, MAFW_METADATA_KEY_TRACK) == 0 &&
+           G_VALUE_HOLDS_INT (value))
+    mafw_lastfm_tracker_metadata_changed (user_data,
+                                          MAFW_LASTFM_TRACKER_NUMBER,
+                                          NULL, g_value_get_int (value));
+  else if (!G_VALUE_HOLDS_STRING (value))
+    return;
+  else if (strcmp (name, MAFW_METADATA_KEY_ARTIST) == 0)
+    mafw_lastfm_tracker_metadata_changed (user_data,
+                                          MAFW_LASTFM_TRACKER_ARTIST,
+                                          g_value_get_string (value), 0);
+  else if (strcmp (name, MAFW_METADATA_KEY_TITLE) == 0)
+    mafw_lastfm_tracker_metadata_changed (user_data,
+                                          MAFW_LASTFM_TRACKER_TITLE,
+                                          g_value_get_string (value), 0);
+  else if (strcmp (name, MAFW_METADATA_KEY_ALBUM) == 0)
+    mafw_lastfm_tracker_metadata_changed (user_data,
+                                          MAFW_LASTFM_TRACKER_ALBUM,
+                                          g_value_get_string (value), 0);
+}
+
+static void
+renderer_added_cb (MafwRegistry *registry,
+                   GObject *renderer,
+                   MafwLastfmService *service)
+{
+  const gchar *name;
+
+  if (!MAFW_IS_RENDERER (renderer))
+    return;
+
+  name = mafw_extension_get_name (MAFW_EXTENSION (renderer));
+
+  if (strcmp (name, WANTED_RENDERER) != 0)
+    return;
+
+  mafw_lastfm_service_attach_renderer (service, renderer);
+}
+
+static void
+renderer_removed_cb (MafwRegistry *registry,
+                     GObject *renderer,
+                     MafwLastfmService *service)
+{
+  GSList *link;
+
+  link = g_slist_find (service->renderers, renderer);
+  if (!link)
+    return;
+
+  g_signal_handlers_disconnect_matched (renderer, G_SIGNAL_MATCH_DATA,
+                                        0, 0, NULL, NULL,
+                                        service->tracker);
+  service->renderers = g_slist_delete_link (service->renderers, link);
+  g_object_unref (renderer);
+}
+
+static gboolean
+dump_stats_cb (gpointer user_data)
+{
+  GError *error = NULL;
+
+  if (!mafw_lastfm_metrics_dump (user_data, &error)) {
+    g_warning ("Couldn't dump the metrics: %s", error->message);
+    g_error_free (error);
+  }
+
+  return TRUE;
+}
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+static void
+network_changed_cb (GNetworkMonitor *monitor,
+                    gboolean available,
+                    MafwLastfmScrobbler *scrobbler)
+{
+  mafw_lastfm_scrobbler_set_online (scrobbler, available);
+}
+
+static void
+monitor_network (MafwLastfmService *service)
+{
+  GNetworkMonitor *monitor;
+
+  monitor = g_network_monitor_get_default ();
+  mafw_lastfm_scrobbler_set_online (service->scrobbler,
+                                    g_network_monitor_get_network_available (monitor));
+  g_signal_connect (monitor, "network-changed",
+                    G_CALLBACK (network_changed_cb), service->scrobbler);
+  service->network_monitor = g_object_ref (monitor);
+}
+#endif
+
+static gboolean
+get_credentials (GKeyFile *keyfile,
+                 const gchar *group,
+                 gchar **username,
+                 gchar **pw_md5)
+{
+  *username = g_key_file_get_string (keyfile,
+                                     group, "username", NULL);
+  *pw_md5 = g_key_file_get_string (keyfile,
+                                   group, "password", NULL);
+
+  if (!*username || !*pw_md5) {
+    g_warning ("Error loading username or password md5 of %s", group);
+
+    g_free (*username);
+    g_free (*pw_md5);
+
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Endpoints speak Audioscrobbler 1.2.1 unless told otherwise:
+
+     protocol=2.0
+     api_key=...
+     api_secret=...
+
+   The api key and its secret are only needed by 2.0. With
+   protocol=listenbrainz, the password is the user token. */
+static gboolean
+set_protocol (MafwLastfmEndpoint *endpoint,
+              GKeyFile *keyfile,
+              const gchar *group)
+{
+  const MafwLastfmProtocol *protocol;
+  gchar *name;
+  gchar *api_key, *api_secret;
+
+  name = g_key_file_get_string (keyfile, group, "protocol", NULL);
+  protocol = mafw_lastfm_protocol_lookup (name);
+  if (!protocol) {
+    g_warning ("Unknown protocol %s in %s", name, group);
+    g_free (name);
+    return FALSE;
+  }
+
+  api_key = g_key_file_get_string (keyfile, group, "api_key", NULL);
+  api_secret = g_key_file_get_string (keyfile, group, "api_secret", NULL);
+  mafw_lastfm_endpoint_set_protocol (endpoint, protocol, api_key, api_secret);
+
+  g_free (api_secret);
+  g_free (api_key);
+  g_free (name);
+
+  return TRUE;
+}
+
+static void
+authenticate_endpoint (MafwLastfmEndpoint *endpoint,
+                       GKeyFile *keyfile,
+                       const gchar *group)
+{
+  gchar *username, *md5passwd;
+
+  if (!set_protocol (endpoint, keyfile, group) ||
+      !get_credentials (keyfile, group, &username, &md5passwd))
+    return;
+
+  mafw_lastfm_endpoint_set_credentials (endpoint, username, md5passwd);
+  if (!mafw_lastfm_endpoint_restore_session (endpoint))
+    mafw_lastfm_endpoint_handshake (endpoint);
+  g_free (username);
+  g_free (md5passwd);
+}
+
+/* Other servers to scrobble to, such as Libre.fm, have a group of
+   their own in the credentials file:
+
+     [Endpoint libre.fm]
+     url=http://turtle.libre.fm/
+     username=...
+     password=...
+
+   The url defaults to the one of Last.fm for the protocol. Endpoints
+   removed from the file are only dropped on restart. */
+static void
+add_endpoints (MafwLastfmScrobbler *scrobbler,
+               GKeyFile *keyfile)
+{
+  MafwLastfmEndpoint *endpoint;
+  gchar **groups;
+  const gchar *name;
+  gchar *url;
+  gchar *file, *path;
+  gint i;
+
+  groups = g_key_file_get_groups (keyfile, NULL);
+  for (i = 0; groups[i] != NULL; i++) {
+    if (!g_str_has_prefix (groups[i], MAFW_LASTFM_ENDPOINT_GROUP))
+      continue;
+
+    name = groups[i] + strlen (MAFW_LASTFM_ENDPOINT_GROUP);
+    if (!*name) {
+      g_warning ("Ignoring %s, without a name", groups[i]);
+      continue;
+    }
+    url = g_key_file_get_string (keyfile, groups[i], "url", NULL);
+
+    endpoint = mafw_lastfm_scrobbler_get_endpoint (scrobbler, name);
+    if (endpoint) {
+      mafw_lastfm_endpoint_set_handshake_url (endpoint, url);
+    } else {
+      endpoint = mafw_lastfm_scrobbler_add_endpoint (scrobbler, name, url);
+      file = g_strdup_printf (MAFW_LASTFM_ENDPOINT_SESSION_FILE, name);
+      path = g_build_filename (g_get_home_dir (), file, NULL);
+      mafw_lastfm_endpoint_set_session_file (endpoint, path);
+      g_free (path);
+      g_free (file);
+    }
+
+    authenticate_endpoint (endpoint, keyfile, groups[i]);
+    g_free (url);
+  }
+  g_strfreev (groups);
+}
+
+static void
+authenticate_from_file (MafwLastfmScrobbler *scrobbler,
+                        gchar *path)
+{
+  GKeyFile *keyfile;
+  GError *error = NULL;
+
+  keyfile = g_key_file_new ();
+
+  if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, &error)) {
+    if (error) {
+      g_warning ("Error loading credentials file: %s",
+                 error->message);
+      g_error_free (error);
+    }
+
+    g_key_file_free (keyfile);
+
+    return;
+  }
+
+  authenticate_endpoint (mafw_lastfm_scrobbler_get_endpoint (scrobbler, NULL),
+                         keyfile, "Credentials");
+  add_endpoints (scrobbler, keyfile);
+
+  g_key_file_free (keyfile);
+}
+
+static void
+on_credentials_file_changed (GFileMonitor *monitor,
+                             GFile *file,
+                             GFile *other_file,
+                             GFileMonitorEvent event_type,
+                             MafwLastfmScrobbler *scrobbler)
+{
+  gchar *path;
+
+  path = g_file_get_path (file);
+  authenticate_from_file (scrobbler, path);
+  g_free (path);
+}
+
+static GFileMonitor *
+monitor_credentials_file (const gchar *path,
+                          MafwLastfmScrobbler *scrobbler)
+{
+  GFile * file;
+  GFileMonitor *monitor;
+
+  file = g_file_new_for_path (path);
+  monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE,
+                                 NULL, NULL);
+  if (monitor)
+    g_signal_connect (monitor, "changed",
+                      G_CALLBACK (on_credentials_file_changed),
+                      scrobbler);
+  g_object_unref (file);
+
+  return monitor;
+}
+
+/**
+ * mafw_lastfm_service_new:
+ * @scrobbler: the #MafwLastfmScrobbler to feed
+ *
+ * Creates a service feeding @scrobbler with the events of the
+ * renderers attached to it, which are recorded to the log given by
+ * MAFW_LASTFM_RECORD, if set.
+ *
+ * Returns: a new #MafwLastfmService.
+ **/
+MafwLastfmService *
+mafw_lastfm_service_new (MafwLastfmScrobbler *scrobbler)
+{
+  MafwLastfmService *service;
+  MafwLastfmEventLog *log;
+  const gchar *record_path;
+  GError *error = NULL;
+
+  service = g_new0 (MafwLastfmService, 1);
+  service->scrobbler = g_object_ref (scrobbler);
+  service->tracker = mafw_lastfm_tracker_new (scrobbler);
+
+  /* Records the renderer events, to be replayed without MAFW. */
+  record_path = g_getenv ("MAFW_LASTFM_RECORD");
+  if (record_path) {
+    log = mafw_lastfm_event_log_new (record_path, &error);
+    if (log) {
+      mafw_lastfm_tracker_set_event_log (service->tracker, log);
+    } else {
+      g_warning ("Couldn't record to %s: %s", record_path, error->message);
+      g_clear_error (&error);
+    }
+  }
+
+  return service;
+}
+
+/**
+ * mafw_lastfm_service_free:
+ * @service: a #MafwLastfmService
+ *
+ * Detaches @service from its registry and renderers, and stops
+ * monitoring the credentials and the network.
+ **/
+void
+mafw_lastfm_service_free (MafwLastfmService *service)
+{
+  if (!service)
+    return;
+
+  if (service->registry) {
+    g_signal_handlers_disconnect_matched (service->registry,
+                                          G_SIGNAL_MATCH_DATA,
+                                          0, 0, NULL, NULL, service);
+    g_object_unref (service->registry);
+  }
+  while (service->renderers)
+    renderer_removed_cb (NULL, service->renderers->data, service);
+
+  if (service->credentials_monitor) {
+    g_file_monitor_cancel (service->credentials_monitor);
+    g_object_unref (service->credentials_monitor);
+  }
+  if (service->network_monitor) {
+    g_signal_handlers_disconnect_matched (service->network_monitor,
+                                          G_SIGNAL_MATCH_DATA,
+                                          0, 0, NULL, NULL,
+                                          service->scrobbler);
+    g_object_unref (service->network_monitor);
+  }
+  if (service->stats_id)
+    g_source_remove (service->stats_id);
+  if (service->exported)
+    mafw_lastfm_dbus_unexport_stats ();
+
+  mafw_lastfm_tracker_free (service->tracker);
+  g_object_unref (service->scrobbler);
+  g_free (service);
+}
+
+/**
+ * mafw_lastfm_service_load_settings:
+ * @service: a #MafwLastfmService
+ *
+ * Authenticates the endpoints of the scrobbler with the credentials
+ * file, reloading it whenever it changes, exports the metrics on
+ * D-Bus and applies the settings given in the environment.
+ **/
+void
+mafw_lastfm_service_load_settings (MafwLastfmService *service)
+{
+  MafwLastfmScrobbler *scrobbler = service->scrobbler;
+  const gchar *handshake_url;
+  const gchar *stats_path;
+  const gchar *stats_interval;
+  guint interval;
+  gchar *file;
+  GError *error = NULL;
+
+  /* Allows running against another server, such as a local one. */
+  handshake_url = g_getenv ("MAFW_LASTFM_HANDSHAKE_URL");
+  if (handshake_url)
+    mafw_lastfm_scrobbler_set_handshake_url (scrobbler, handshake_url);
+
+  /* Otherwise the scrobbler assumes it is always online. */
+#if GLIB_CHECK_VERSION (2, 32, 0)
+  monitor_network (service);
+#endif
+
+  service->exported = mafw_lastfm_dbus_export_stats (&error);
+  if (!service->exported) {
+    g_warning ("Couldn't export the metrics on D-Bus: %s", error->message);
+    g_clear_error (&error);
+  }
+
+  /* Dumps the metrics periodically, for when D-Bus isn't handy. */
+  stats_path = g_getenv ("MAFW_LASTFM_STATS_FILE");
+  if (stats_path) {
+    stats_interval = g_getenv ("MAFW_LASTFM_STATS_INTERVAL");
+    interval = stats_interval ? atoi (stats_interval) : 0;
+    if (interval == 0)
+      interval = MAFW_LASTFM_DEFAULT_STATS_INTERVAL;
+    service->stats_id = g_timeout_add_seconds (interval, dump_stats_cb,
+                                               (gpointer) stats_path);
+  }
+
+  file = g_build_filename (g_get_home_dir (),
+                           MAFW_LASTFM_CREDENTIALS_FILE, NULL);
+  service->credentials_monitor = monitor_credentials_file (file, scrobbler);
+  authenticate_from_file (scrobbler, file);
+  g_free (file);
+}
+
+/**
+ * mafw_lastfm_service_watch_registry:
+ * @service: a #MafwLastfmService
+ * @registry: a #MafwRegistry
+ *
+ * Attaches @service to the renderer to scrobble from, if it is
+ * already in @registry, or otherwise once it is added.
+ **/
+void
+mafw_lastfm_service_watch_registry (MafwLastfmService *service,
+                                    MafwRegistry *registry)
+{
+  GList *renderers;
+
+  g_return_if_fail (service->registry == NULL);
+
+  service->registry = g_object_ref (registry);
+  g_signal_connect (registry,
+                    "renderer-added",
+                    G_CALLBACK (renderer_added_cb), service);
+  g_signal_connect (registry,
+                    "renderer-removed",
+                    G_CALLBACK (renderer_removed_cb), service);
+
+  /* The renderer is already there when the plugin is loaded after
+     the one providing it. */
+  for (renderers = mafw_registry_get_renderers (registry);
+       renderers != NULL; renderers = renderers->next)
+    renderer_added_cb (registry, renderers->data, service);
+}
+
+/**
+ * mafw_lastfm_service_attach_renderer:
+ * @service: a #MafwLastfmService
+ * @renderer: a #MafwRenderer
+ *
+ * Forwards the signals of @renderer to the tracker. Only the
+ * state-changed, media-changed and metadata-changed signals are
+ * needed as long as they carry the metadata of the track, so that
+ * @renderer doesn't need to be a #MafwRenderer then, as in the
+ * benchmarks.
+ **/
+void
+mafw_lastfm_service_attach_renderer (MafwLastfmService *service,
+                                     GObject *renderer)
+{
+  if (g_slist_find (service->renderers, renderer))
+    return;
+
+  service->renderers = g_slist_prepend (service->renderers,
+                                        g_object_ref (renderer));
+
+  g_signal_connect (renderer,
+                    "state-changed",
+                    G_CALLBACK (state_changed_cb),
+                    service->tracker);
+  g_signal_connect (renderer,
+                    "media-changed",
+                    G_CALLBACK (media_changed_cb),
+                    service->tracker);
+  g_signal_connect (renderer,
+                    "metadata-changed",
+                    G_CALLBACK (metadata_changed_cb),
+                    service->tracker);
+}
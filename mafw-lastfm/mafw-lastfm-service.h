@@ -0,0 +1,52 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2009-2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef MAFW_LASTFM_SERVICE_H
+#define MAFW_LASTFM_SERVICE_H
+
+#include <glib-object.h>
+#include <libmafw/mafw.h>
+
+#include "mafw-lastfm-scrobbler.h"
+
+G_BEGIN_DECLS
+
+typedef struct MafwLastfmService MafwLastfmService;
+
+MafwLastfmService *
+mafw_lastfm_service_new (MafwLastfmScrobbler *scrobbler);
+
+void
+mafw_lastfm_service_free (MafwLastfmService *service);
+
+void
+mafw_lastfm_service_load_settings (MafwLastfmService *service);
+
+void
+mafw_lastfm_service_watch_registry (MafwLastfmService *service,
+                                    MafwRegistry *registry);
+
+void
+mafw_lastfm_service_attach_renderer (MafwLastfmService *service,
+                                     GObject *renderer);
+
+G_END_DECLS
+
+#endif /* MAFW_LASTFM_SERVICE_H */
@@ -0,0 +1,201 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Tracks are immutable and shared by reference: the queue, the
+ * playing-now slot and the suspended slot of the scrobbler all hold
+ * the same instance. A track and its strings live in a single block,
+ * the strings right after the structure.
+ *
+ * Tracks with a reference count of 0 are not owned by anyone that
+ * refcounts them: the ones created with mafw_lastfm_track_new() for
+ * compatibility, which are mutable and freed field by field, and the
+ * ones filled by the journal iterator, whose strings point into the
+ * journal. Taking a reference to them makes an immutable copy.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "mafw-lastfm-track.h"
+
+/**
+ * mafw_lastfm_track_new_full:
+ * @artist: the artist
+ * @title: the title
+ * @album: the album, or %NULL
+ * @timestamp: when the track started playing, in seconds since the epoch
+ * @source: the source of the track, as in the submission protocol
+ * @length: the length of the track, in seconds
+ * @number: the track number, or 0
+ *
+ * Creates an immutable track, copying the strings.
+ *
+ * Returns: a new #MafwLastfmTrack, to be released with
+ * mafw_lastfm_track_unref().
+ **/
+MafwLastfmTrack *
+mafw_lastfm_track_new_full (const gchar *artist,
+                            const gchar *title,
+                            const gchar *album,
+                            glong timestamp,
+                            gchar source,
+                            gint64 length,
+                            gint number)
+{
+  MafwLastfmTrack *track;
+  gsize artist_len, title_len, album_len;
+  gchar *strings;
+
+  artist_len = artist ? strlen (artist) + 1 : 0;
+  title_len = title ? strlen (title) + 1 : 0;
+  album_len = album ? strlen (album) + 1 : 0;
+
+  track = g_malloc (sizeof (MafwLastfmTrack) +
+                    artist_len + title_len + album_len);
+  strings = (gchar *) (track + 1);
+
+  track->artist = artist ? memcpy (strings, artist, artist_len) : NULL;
+  strings += artist_len;
+  track->title = title ? memcpy (strings, title, title_len) : NULL;
+  strings += title_len;
+  track->album = album ? memcpy (strings, album, album_len) : NULL;
+
+  track->timestamp = timestamp;
+  track->source = source;
+  track->length = length;
+  track->number = number;
+  track->ref_count = 1;
+
+  return track;
+}
+
+/**
+ * mafw_lastfm_track_ref:
+ * @track: a #MafwLastfmTrack
+ *
+ * Takes a reference to @track. If @track is not refcounted, because it
+ * was created with mafw_lastfm_track_new() or filled by the journal, an
+ * immutable copy is made instead.
+ *
+ * Returns: @track or its copy, to be released with
+ * mafw_lastfm_track_unref().
+ **/
+MafwLastfmTrack *
+mafw_lastfm_track_ref (MafwLastfmTrack *track)
+{
+  g_return_val_if_fail (track, NULL);
+
+  if (g_atomic_int_get (&track->ref_count) == 0)
+    return mafw_lastfm_track_new_full (track->artist, track->title,
+                                       track->album, track->timestamp,
+                                       track->source, track->length,
+                                       track->number);
+
+  g_atomic_int_inc (&track->ref_count);
+
+  return track;
+}
+
+/**
+ * mafw_lastfm_track_unref:
+ * @track: a #MafwLastfmTrack, or %NULL
+ *
+ * Releases a reference to @track, and frees it when it was the last
+ * one.
+ **/
+void
+mafw_lastfm_track_unref (MafwLastfmTrack *track)
+{
+  if (!track)
+    return;
+
+  g_return_if_fail (track->ref_count > 0);
+
+  if (g_atomic_int_dec_and_test (&track->ref_count))
+    g_free (track);
+}
+
+static gboolean
+str_equal (const gchar *a,
+           const gchar *b)
+{
+  return a == b || (a && b && strcmp (a, b) == 0);
+}
+
+/**
+ * mafw_lastfm_track_equal:
+ * @a: a #MafwLastfmTrack
+ * @b: another #MafwLastfmTrack
+ *
+ * Returns: %TRUE if @a and @b are the same song, regardless of when
+ * they were played.
+ **/
+gboolean
+mafw_lastfm_track_equal (const MafwLastfmTrack *a,
+                         const MafwLastfmTrack *b)
+{
+  return (a == b ||
+          (str_equal (a->artist, b->artist) &&
+           str_equal (a->title, b->title) &&
+           a->length == b->length &&
+           str_equal (a->album, b->album)));
+}
+
+/**
+ * mafw_lastfm_track_new:
+ *
+ * Creates an empty, mutable track whose strings are owned by it and
+ * freed by mafw_lastfm_track_free(). This is kept for compatibility,
+ * mafw_lastfm_track_new_full() should be used instead.
+ *
+ * Returns: a new #MafwLastfmTrack.
+ **/
+MafwLastfmTrack *
+mafw_lastfm_track_new (void)
+{
+  return g_new0 (MafwLastfmTrack, 1);
+}
+
+/**
+ * mafw_lastfm_track_free:
+ * @track: a #MafwLastfmTrack, or %NULL
+ *
+ * Frees a track created with mafw_lastfm_track_new(). For refcounted
+ * tracks, this is the same as mafw_lastfm_track_unref().
+ **/
+void
+mafw_lastfm_track_free (MafwLastfmTrack *track)
+{
+  if (!track)
+    return;
+
+  if (track->ref_count > 0) {
+    mafw_lastfm_track_unref (track);
+    return;
+  }
+
+  /* Only the strings of these tracks are owned by them. */
+  g_free ((gchar *) track->artist);
+  g_free ((gchar *) track->title);
+  g_free ((gchar *) track->album);
+
+  g_free (track);
+}
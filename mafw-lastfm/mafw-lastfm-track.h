@@ -0,0 +1,67 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef MAFW_LASTFM_TRACK_H
+#define MAFW_LASTFM_TRACK_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct {
+  const gchar *artist;
+  const gchar *title;
+  const gchar *album;
+  glong timestamp;
+  gchar source;
+  gint64 length;
+  gint number;
+  /*< private >*/
+  gint ref_count;
+} MafwLastfmTrack;
+
+MafwLastfmTrack *
+mafw_lastfm_track_new_full (const gchar *artist,
+                            const gchar *title,
+                            const gchar *album,
+                            glong timestamp,
+                            gchar source,
+                            gint64 length,
+                            gint number);
+
+MafwLastfmTrack *
+mafw_lastfm_track_ref (MafwLastfmTrack *track);
+
+void
+mafw_lastfm_track_unref (MafwLastfmTrack *track);
+
+gboolean
+mafw_lastfm_track_equal (const MafwLastfmTrack *a,
+                         const MafwLastfmTrack *b);
+
+MafwLastfmTrack *
+mafw_lastfm_track_new (void);
+
+void
+mafw_lastfm_track_free (MafwLastfmTrack *track);
+
+G_END_DECLS
+
+#endif /* MAFW_LASTFM_TRACK_H */
@@ -0,0 +1,416 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2009-2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Turns the events of the renderer into scrobbler calls. This knows
+ * nothing about MAFW, mafw-lastfm-service.c forwards the signals and
+ * the replies to its requests, so that the same events can also come
+ * from a recorded log.
+ *
+ * The metadata of the current track is kept as the renderer signals
+ * it, and so is its position, which starts at 0 with each track and
+ * only moves while playing. When playback starts, the track is
+ * enqueued right away if both are known, and otherwise once the
+ * replies to the requests for the missing ones arrive. The position
+ * misses the seeks, which the renderer doesn't signal, so it may be
+ * off on resume after one.
+ */
+
+#include <glib.h>
+
+#include "mafw-lastfm-tracker.h"
+#include "mafw-lastfm-metrics.h"
+
+struct MafwLastfmTracker {
+  MafwLastfmScrobbler *scrobbler;
+  MafwLastfmEventLog *log;
+
+  gint64 length;
+  glong current_time;
+
+  /* The metadata of the current track. */
+  gchar *artist;
+  gchar *title;
+  gchar *album;
+  gint number;
+
+  /* The position at position_time, if known. */
+  gint position;
+  glong position_time;
+  gboolean position_known;
+  gboolean playing;
+  /* Nothing is known until the renderer signals a track change,
+     which older event logs don't have. */
+  gboolean media_known;
+
+  /* MafwLastfmTrackerNeeds still awaited to enqueue the track. */
+  guint pending;
+};
+
+static void
+tracker_record (MafwLastfmTracker *tracker,
+                MafwLastfmEvent *event)
+{
+  GError *error = NULL;
+
+  if (!tracker->log)
+    return;
+
+  if (!mafw_lastfm_event_log_write (tracker->log, event, &error)) {
+    g_warning ("Couldn't record event, recording stopped: %s",
+               error->message);
+    g_error_free (error);
+    mafw_lastfm_event_log_free (tracker->log);
+    tracker->log = NULL;
+  }
+}
+
+/**
+ * mafw_lastfm_tracker_new:
+ * @scrobbler: the #MafwLastfmScrobbler to feed
+ *
+ * Returns: a new #MafwLastfmTracker.
+ **/
+MafwLastfmTracker *
+mafw_lastfm_tracker_new (MafwLastfmScrobbler *scrobbler)
+{
+  MafwLastfmTracker *tracker;
+
+  tracker = g_new0 (MafwLastfmTracker, 1);
+  tracker->scrobbler = g_object_ref (scrobbler);
+
+  return tracker;
+}
+
+void
+mafw_lastfm_tracker_free (MafwLastfmTracker *tracker)
+{
+  if (!tracker)
+    return;
+
+  mafw_lastfm_event_log_free (tracker->log);
+  g_object_unref (tracker->scrobbler);
+  g_free (tracker->artist);
+  g_free (tracker->title);
+  g_free (tracker->album);
+  g_free (tracker);
+}
+
+/**
+ * mafw_lastfm_tracker_set_event_log:
+ * @tracker: a #MafwLastfmTracker
+ * @log: a #MafwLastfmEventLog, or %NULL
+ *
+ * Records all the events received by @tracker from now on to @log,
+ * which is owned by @tracker afterwards.
+ **/
+void
+mafw_lastfm_tracker_set_event_log (MafwLastfmTracker *tracker,
+                                   MafwLastfmEventLog *log)
+{
+  if (tracker->log)
+    mafw_lastfm_event_log_free (tracker->log);
+
+  tracker->log = log;
+}
+
+static void
+tracker_enqueue (MafwLastfmTracker *tracker)
+{
+  MafwLastfmTrack *track;
+
+  if (!tracker->artist || !tracker->title)
+    return;
+
+  /* The strings are copied once, into the track, which is then
+     shared by the scrobbler. */
+  track = mafw_lastfm_track_new_full (tracker->artist, tracker->title,
+                                      tracker->album,
+                                      tracker->current_time, 'P',
+                                      tracker->length, tracker->number);
+
+  mafw_lastfm_scrobbler_enqueue_scrobble (tracker->scrobbler, track,
+                                          tracker->position);
+
+  mafw_lastfm_track_unref (track);
+}
+
+/* Moves the known position to @wall_time. */
+static void
+tracker_update_position (MafwLastfmTracker *tracker,
+                         glong wall_time)
+{
+  if (tracker->playing)
+    tracker->position += MAX (wall_time - tracker->position_time, 0);
+  tracker->position_time = wall_time;
+}
+
+static void
+tracker_set_string (gchar **field,
+                    const gchar *value)
+{
+  g_free (*field);
+  *field = g_strdup (value);
+}
+
+/**
+ * mafw_lastfm_tracker_state_changed:
+ * @tracker: a #MafwLastfmTracker
+ * @state: the new state of the renderer
+ * @wall_time: the current time, in seconds since the epoch
+ *
+ * When @state is %MAFW_LASTFM_TRACKER_PLAYING, the track is enqueued
+ * if its position and metadata are known. Otherwise the caller has to
+ * request the missing ones from the renderer, both at once, and pass
+ * the replies to mafw_lastfm_tracker_position() and
+ * mafw_lastfm_tracker_metadata().
+ *
+ * Returns: the #MafwLastfmTrackerNeeds to request.
+ **/
+guint
+mafw_lastfm_tracker_state_changed (MafwLastfmTracker *tracker,
+                                   MafwLastfmTrackerState state,
+                                   glong wall_time)
+{
+  MafwLastfmEvent event = { MAFW_LASTFM_EVENT_STATE_CHANGED };
+
+  event.state = state;
+  event.wall_time = wall_time;
+  tracker_record (tracker, &event);
+
+  tracker_update_position (tracker, wall_time);
+  tracker->playing = state == MAFW_LASTFM_TRACKER_PLAYING;
+
+  switch (state) {
+  case MAFW_LASTFM_TRACKER_PLAYING:
+    tracker->current_time = wall_time;
+    tracker->pending = 0;
+
+    if (tracker->media_known && tracker->position_known) {
+      mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_POSITION_CACHE_HITS);
+    } else {
+      mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_POSITION_CACHE_MISSES);
+      tracker->pending |= MAFW_LASTFM_TRACKER_NEED_POSITION;
+    }
+
+    if (tracker->media_known && tracker->artist && tracker->title) {
+      mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_METADATA_CACHE_HITS);
+    } else {
+      mafw_lastfm_metrics_inc (MAFW_LASTFM_METRIC_METADATA_CACHE_MISSES);
+      tracker->pending |= MAFW_LASTFM_TRACKER_NEED_METADATA;
+    }
+
+    if (!tracker->pending)
+      tracker_enqueue (tracker);
+    return tracker->pending;
+  case MAFW_LASTFM_TRACKER_PAUSED:
+    mafw_lastfm_scrobbler_suspend (tracker->scrobbler);
+    break;
+  case MAFW_LASTFM_TRACKER_STOPPED:
+    /* Playing again starts over. */
+    tracker->position = 0;
+    tracker->position_known = TRUE;
+    mafw_lastfm_scrobbler_flush_queue (tracker->scrobbler);
+    break;
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+/**
+ * mafw_lastfm_tracker_media_changed:
+ * @tracker: a #MafwLastfmTracker
+ *
+ * Forgets about the metadata of the previous track. The new one
+ * starts at position 0.
+ **/
+void
+mafw_lastfm_tracker_media_changed (MafwLastfmTracker *tracker)
+{
+  MafwLastfmEvent event = { MAFW_LASTFM_EVENT_MEDIA_CHANGED };
+
+  tracker_record (tracker, &event);
+
+  tracker_set_string (&tracker->artist, NULL);
+  tracker_set_string (&tracker->title, NULL);
+  tracker_set_string (&tracker->album, NULL);
+  tracker->number = 0;
+
+  tracker->position = 0;
+  tracker->position_known = TRUE;
+  tracker->playing = FALSE;
+  tracker->media_known = TRUE;
+}
+
+/**
+ * mafw_lastfm_tracker_metadata_changed:
+ * @tracker: a #MafwLastfmTracker
+ * @key: the #MafwLastfmTrackerKey that changed
+ * @value: its value, for the strings
+ * @number: its value, for %MAFW_LASTFM_TRACKER_NUMBER
+ *
+ * Updates the metadata of the current track, as signalled by the
+ * renderer.
+ **/
+void
+mafw_lastfm_tracker_metadata_changed (MafwLastfmTracker *tracker,
+                                      MafwLastfmTrackerKey key,
+                                      const gchar *value,
+                                      gint number)
+{
+  MafwLastfmEvent event = { MAFW_LASTFM_EVENT_METADATA_CHANGED };
+
+  event.key = key;
+  event.value = value;
+  event.number = number;
+  tracker_record (tracker, &event);
+
+  switch (key) {
+  case MAFW_LASTFM_TRACKER_ARTIST:
+    tracker_set_string (&tracker->artist, value);
+    break;
+  case MAFW_LASTFM_TRACKER_TITLE:
+    tracker_set_string (&tracker->title, value);
+    break;
+  case MAFW_LASTFM_TRACKER_ALBUM:
+    tracker_set_string (&tracker->album, value);
+    break;
+  case MAFW_LASTFM_TRACKER_NUMBER:
+    tracker->number = number;
+    break;
+  }
+}
+
+void
+mafw_lastfm_tracker_duration_changed (MafwLastfmTracker *tracker,
+                                      gint64 duration)
+{
+  MafwLastfmEvent event = { MAFW_LASTFM_EVENT_DURATION_CHANGED };
+
+  event.duration = duration;
+  tracker_record (tracker, &event);
+
+  tracker->length = duration;
+}
+
+/**
+ * mafw_lastfm_tracker_position:
+ * @tracker: a #MafwLastfmTracker
+ * @position: the position of the renderer, in seconds
+ *
+ * Called with the reply to the position request.
+ **/
+void
+mafw_lastfm_tracker_position (MafwLastfmTracker *tracker,
+                              gint position)
+{
+  MafwLastfmEvent event = { MAFW_LASTFM_EVENT_POSITION };
+
+  event.position = position;
+  tracker_record (tracker, &event);
+
+  /* The renderer was there when it started playing. */
+  tracker->position = position;
+  tracker->position_time = tracker->current_time;
+  tracker->position_known = TRUE;
+
+  if (tracker->pending & MAFW_LASTFM_TRACKER_NEED_POSITION) {
+    tracker->pending &= ~MAFW_LASTFM_TRACKER_NEED_POSITION;
+    if (!tracker->pending)
+      tracker_enqueue (tracker);
+  }
+}
+
+/**
+ * mafw_lastfm_tracker_metadata:
+ * @tracker: a #MafwLastfmTracker
+ * @artist: the artist of the current track, or %NULL
+ * @title: the title of the current track, or %NULL
+ * @album: the album of the current track, or %NULL
+ * @number: the track number, or 0
+ *
+ * Called with the reply to the metadata request. The track is
+ * enqueued for scrobbling if it has an artist and a title, once the
+ * position is known too.
+ **/
+void
+mafw_lastfm_tracker_metadata (MafwLastfmTracker *tracker,
+                              const gchar *artist,
+                              const gchar *title,
+                              const gchar *album,
+                              gint number)
+{
+  MafwLastfmEvent event = { MAFW_LASTFM_EVENT_METADATA };
+
+  event.artist = artist;
+  event.title = title;
+  event.album = album;
+  event.number = number;
+  tracker_record (tracker, &event);
+
+  tracker_set_string (&tracker->artist, artist);
+  tracker_set_string (&tracker->title, title);
+  tracker_set_string (&tracker->album, album);
+  tracker->number = number;
+
+  if (tracker->pending & MAFW_LASTFM_TRACKER_NEED_METADATA) {
+    tracker->pending &= ~MAFW_LASTFM_TRACKER_NEED_METADATA;
+    if (!tracker->pending)
+      tracker_enqueue (tracker);
+  }
+}
+
+/**
+ * mafw_lastfm_tracker_feed:
+ * @tracker: a #MafwLastfmTracker
+ * @event: a recorded #MafwLastfmEvent
+ *
+ * Handles @event as if it came from the renderer.
+ **/
+void
+mafw_lastfm_tracker_feed (MafwLastfmTracker *tracker,
+                          MafwLastfmEvent *event)
+{
+  switch (event->type) {
+  case MAFW_LASTFM_EVENT_STATE_CHANGED:
+    mafw_lastfm_tracker_state_changed (tracker, event->state,
+                                       event->wall_time);
+    break;
+  case MAFW_LASTFM_EVENT_DURATION_CHANGED:
+    mafw_lastfm_tracker_duration_changed (tracker, event->duration);
+    break;
+  case MAFW_LASTFM_EVENT_POSITION:
+    mafw_lastfm_tracker_position (tracker, event->position);
+    break;
+  case MAFW_LASTFM_EVENT_METADATA:
+    mafw_lastfm_tracker_metadata (tracker, event->artist, event->title,
+                                  event->album, event->number);
+    break;
+  case MAFW_LASTFM_EVENT_MEDIA_CHANGED:
+    mafw_lastfm_tracker_media_changed (tracker);
+    break;
+  case MAFW_LASTFM_EVENT_METADATA_CHANGED:
+    mafw_lastfm_tracker_metadata_changed (tracker, event->key, event->value,
+                                          event->number);
+    break;
+  }
+}
@@ -0,0 +1,100 @@
+/**
+ * mafw-lastfm: a last.fm scrobbler for mafw
+ *
+ * Copyright (C) 2009-2010  Claudio Saavedra <csaavedra@igalia.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef MAFW_LASTFM_TRACKER_H
+#define MAFW_LASTFM_TRACKER_H
+
+#include <glib.h>
+
+#include "mafw-lastfm-scrobbler.h"
+#include "mafw-lastfm-event-log.h"
+
+G_BEGIN_DECLS
+
+/* The states of MafwPlayState, mapped by the service. */
+typedef enum {
+  MAFW_LASTFM_TRACKER_STOPPED,
+  MAFW_LASTFM_TRACKER_PLAYING,
+  MAFW_LASTFM_TRACKER_PAUSED,
+  MAFW_LASTFM_TRACKER_TRANSITIONING
+} MafwLastfmTrackerState;
+
+/* The metadata of the current track kept by the tracker. */
+typedef enum {
+  MAFW_LASTFM_TRACKER_ARTIST,
+  MAFW_LASTFM_TRACKER_TITLE,
+  MAFW_LASTFM_TRACKER_ALBUM,
+  MAFW_LASTFM_TRACKER_NUMBER
+} MafwLastfmTrackerKey;
+
+/* What the caller has to request from the renderer. */
+typedef enum {
+  MAFW_LASTFM_TRACKER_NEED_POSITION = 1 << 0,
+  MAFW_LASTFM_TRACKER_NEED_METADATA = 1 << 1
+} MafwLastfmTrackerNeeds;
+
+typedef struct MafwLastfmTracker MafwLastfmTracker;
+
+MafwLastfmTracker *
+mafw_lastfm_tracker_new (MafwLastfmScrobbler *scrobbler);
+
+void
+mafw_lastfm_tracker_free (MafwLastfmTracker *tracker);
+
+void
+mafw_lastfm_tracker_set_event_log (MafwLastfmTracker *tracker,
+                                   MafwLastfmEventLog *log);
+
+guint
+mafw_lastfm_tracker_state_changed (MafwLastfmTracker *tracker,
+                                   MafwLastfmTrackerState state,
+                                   glong wall_time);
+
+void
+mafw_lastfm_tracker_media_changed (MafwLastfmTracker *tracker);
+
+void
+mafw_lastfm_tracker_metadata_changed (MafwLastfmTracker *tracker,
+                                      MafwLastfmTrackerKey key,
+                                      const gchar *value,
+                                      gint number);
+
+void
+mafw_lastfm_tracker_duration_changed (MafwLastfmTracker *tracker,
+                                      gint64 duration);
+
+void
+mafw_lastfm_tracker_position (MafwLastfmTracker *tracker,
+                              gint position);
+
+void
+mafw_lastfm_tracker_metadata (MafwLastfmTracker *tracker,
+                              const gchar *artist,
+                              const gchar *title,
+                              const gchar *album,
+                              gint number);
+
+void
+mafw_lastfm_tracker_feed (MafwLastfmTracker *tracker,
+                          MafwLastfmEvent *event);
+
+G_END_DECLS
+
+#endif /* MAFW_LASTFM_TRACKER_H */